@@ -0,0 +1,116 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "arena_map.h"
+
+#include <functional>
+
+namespace {
+
+constexpr size_t kInitialSlots = 16;
+constexpr size_t kBlockSize = 64 * 1024;
+// Entries larger than this get a block of their own, so that they don't
+// waste the rest of a shared block.
+constexpr size_t kMaxSharedEntrySize = kBlockSize / 4;
+
+uint64_t Hash(std::string_view key) {
+  // ShardedKeyValueMap picks shards with the low bits of std::hash, so mix
+  // them into the high bits that select the slot.
+  return std::hash<std::string_view>()(key) * 0x9e3779b97f4a7c15ull;
+}
+
+}  // namespace
+
+ArenaHashMap::ArenaHashMap() : slots_(kInitialSlots, Slot{0, nullptr}) {}
+
+size_t ArenaHashMap::FindSlot(std::string_view key, uint64_t hash) const {
+  size_t mask = slots_.size() - 1;
+  // Fibonacci hashing: the high bits are the best mixed.
+  size_t index = (hash >> 32) & mask;
+  while (true) {
+    const Slot& slot = slots_[index];
+    if (slot.entry == nullptr ||
+        (slot.hash == hash && EntryKey(slot.entry) == key)) {
+      return index;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+bool ArenaHashMap::Insert(std::string_view key, std::string_view value,
+                          std::string_view* stored_key) {
+  uint64_t hash = Hash(key);
+  size_t index = FindSlot(key, hash);
+  if (slots_[index].entry != nullptr) {
+    return false;
+  }
+
+  EntryHeader header = {static_cast<uint32_t>(key.size()),
+                        static_cast<uint32_t>(value.size())};
+  char* entry = Allocate(sizeof(header) + key.size() + value.size());
+  memcpy(entry, &header, sizeof(header));
+  memcpy(entry + sizeof(header), key.data(), key.size());
+  memcpy(entry + sizeof(header) + key.size(), value.data(), value.size());
+  slots_[index] = Slot{hash, entry};
+  if (stored_key != nullptr) {
+    *stored_key = EntryKey(entry);
+  }
+  entries_.push_back(entry);
+  data_bytes_ += key.size() + value.size();
+
+  // Keep the load factor under 3/4 so that probe sequences stay short.
+  if (entries_.size() * 4 > slots_.size() * 3) {
+    Grow();
+  }
+  return true;
+}
+
+bool ArenaHashMap::Find(std::string_view key, std::string_view* value) const {
+  const Slot& slot = slots_[FindSlot(key, Hash(key))];
+  if (slot.entry == nullptr) {
+    return false;
+  }
+  *value = EntryValue(slot.entry);
+  return true;
+}
+
+char* ArenaHashMap::Allocate(size_t size) {
+  if (size > kMaxSharedEntrySize) {
+    blocks_.emplace_back(new char[size]);
+    arena_bytes_ += size;
+    return blocks_.back().get();
+  }
+  if (size > block_left_) {
+    // The rest of the current block is wasted, which is less than the
+    // largest shared entry.
+    blocks_.emplace_back(new char[kBlockSize]);
+    arena_bytes_ += kBlockSize;
+    block_next_ = blocks_.back().get();
+    block_left_ = kBlockSize;
+  }
+  char* entry = block_next_;
+  block_next_ += size;
+  block_left_ -= size;
+  return entry;
+}
+
+void ArenaHashMap::Grow() {
+  std::vector<Slot> old_slots(slots_.size() * 2, Slot{0, nullptr});
+  old_slots.swap(slots_);
+  size_t mask = slots_.size() - 1;
+  // Entries are never removed and keys are unique, so each one just goes to
+  // the first free slot of its probe sequence, without comparing keys.
+  for (const Slot& slot : old_slots) {
+    if (slot.entry == nullptr) {
+      continue;
+    }
+    size_t index = (slot.hash >> 32) & mask;
+    while (slots_[index].entry != nullptr) {
+      index = (index + 1) & mask;
+    }
+    slots_[index] = slot;
+  }
+}
@@ -0,0 +1,117 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_ARENA_MAP_H
+#define KVS_ARENA_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// A write-once hash map that keeps the key and value bytes of its entries
+// back to back in append-only arenas, indexed by an open-addressing table of
+// (hash, entry) slots.
+//
+// An insert costs no heap allocation of its own; it bumps a pointer in the
+// current arena block and, now and then, allocates a new block or doubles the
+// table. A lookup compares the full hash stored in the slot before touching
+// the entry, so probing past other keys rarely leaves the table.
+//
+// Not thread-safe; ShardedKeyValueMap locks each shard's map.
+class ArenaHashMap {
+ public:
+  ArenaHashMap();
+  ArenaHashMap(const ArenaHashMap&) = delete;
+  ArenaHashMap(ArenaHashMap&&) = delete;
+  ArenaHashMap& operator=(const ArenaHashMap&) = delete;
+  ArenaHashMap&& operator=(ArenaHashMap&&) = delete;
+
+  // Inserts a copy of the key/value pair. Returns false without modifying the
+  // map if the key already exists. If `stored_key` is not null, it is pointed
+  // to the copy of the key, which stays valid as long as the map.
+  bool Insert(std::string_view key, std::string_view value,
+              std::string_view* stored_key = nullptr);
+
+  // Points `value` to the value for the key and returns true if the key
+  // exists. The value stays valid as long as the map.
+  bool Find(std::string_view key, std::string_view* value) const;
+
+  // Calls `callback(key, value)` for every entry, in insertion order.
+  template <typename Callback>
+  void ForEach(const Callback& callback) const {
+    ForEachInRange(0, entries_.size(), callback);
+  }
+
+  // Like ForEach(), from the entry inserted `begin`th up to the one inserted
+  // `end`th, so that a caller can visit the entries a few at a time and leave
+  // out the ones inserted since it started.
+  template <typename Callback>
+  void ForEachInRange(size_t begin, size_t end,
+                      const Callback& callback) const {
+    end = std::min(end, entries_.size());
+    for (size_t i = begin; i < end; ++i) {
+      callback(EntryKey(entries_[i]), EntryValue(entries_[i]));
+    }
+  }
+
+  size_t size() const { return entries_.size(); }
+
+  // Returns the size of the keys and values.
+  size_t data_bytes() const { return data_bytes_; }
+
+  // Returns the bytes held by the arenas and the table.
+  size_t memory_usage() const {
+    return arena_bytes_ + slots_.capacity() * sizeof(Slot) +
+           entries_.capacity() * sizeof(const char*);
+  }
+
+ private:
+  // An empty slot has no entry.
+  struct Slot {
+    uint64_t hash;
+    const char* entry;
+  };
+
+  // Every entry is a header followed by the key and the value.
+  struct EntryHeader {
+    uint32_t key_size;
+    uint32_t value_size;
+  };
+
+  static std::string_view EntryKey(const char* entry) {
+    EntryHeader header;
+    memcpy(&header, entry, sizeof(header));
+    return std::string_view(entry + sizeof(header), header.key_size);
+  }
+
+  static std::string_view EntryValue(const char* entry) {
+    EntryHeader header;
+    memcpy(&header, entry, sizeof(header));
+    return std::string_view(entry + sizeof(header) + header.key_size,
+                            header.value_size);
+  }
+
+  // Returns the slot for the key, which is empty if the key doesn't exist.
+  size_t FindSlot(std::string_view key, uint64_t hash) const;
+  char* Allocate(size_t size);
+  void Grow();
+
+  std::vector<Slot> slots_;
+  // The entries in insertion order.
+  std::vector<const char*> entries_;
+  size_t data_bytes_ = 0;
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* block_next_ = nullptr;
+  size_t block_left_ = 0;
+  size_t arena_bytes_ = 0;
+};
+
+#endif  // KVS_ARENA_MAP_H
@@ -0,0 +1,73 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "arena_map.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+TEST(ArenaHashMapTest, InsertOnce) {
+  ArenaHashMap map;
+  std::string_view value;
+  EXPECT_FALSE(map.Find("key1", &value));
+  EXPECT_TRUE(map.Insert("key1", "value1"));
+  EXPECT_FALSE(map.Insert("key1", "value2"));
+  EXPECT_TRUE(map.Find("key1", &value));
+  EXPECT_EQ(value, "value1");
+  EXPECT_TRUE(map.Insert("", ""));
+  EXPECT_TRUE(map.Find("", &value));
+  EXPECT_EQ(value, "");
+  EXPECT_EQ(map.size(), 2);
+}
+
+TEST(ArenaHashMapTest, GrowsAndKeepsEveryEntry) {
+  ArenaHashMap map;
+  std::map<std::string, std::string> expected;
+  for (int i = 0; i < 100000; ++i) {
+    std::string key = "key" + std::to_string(i);
+    // Some values are too large to share an arena block.
+    std::string value(i % 1000 == 0 ? 20000 : i % 50, 'a' + i % 26);
+    ASSERT_TRUE(map.Insert(key, value));
+    expected.emplace(std::move(key), std::move(value));
+  }
+  EXPECT_EQ(map.size(), expected.size());
+  for (const auto& key_value : expected) {
+    std::string_view value;
+    ASSERT_TRUE(map.Find(key_value.first, &value));
+    EXPECT_EQ(value, key_value.second);
+  }
+
+  std::map<std::string, std::string> visited;
+  map.ForEach([&](std::string_view key, std::string_view value) {
+    EXPECT_TRUE(visited.emplace(key, value).second);
+  });
+  EXPECT_EQ(visited, expected);
+}
+
+TEST(ArenaHashMapTest, VisitsRangesInInsertionOrder) {
+  ArenaHashMap map;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(map.Insert("key" + std::to_string(i), std::to_string(i)));
+  }
+  std::vector<std::string> visited;
+  auto visit = [&](std::string_view key, std::string_view value) {
+    EXPECT_EQ(key.substr(3), value);
+    visited.emplace_back(value);
+  };
+  map.ForEachInRange(10, 13, visit);
+  // The end is clamped to the size of the map.
+  map.ForEachInRange(98, 1000, visit);
+  EXPECT_EQ(visited, std::vector<std::string>({"10", "11", "12", "98", "99"}));
+}
+
+}  // namespace
+}  // namespace kvs
@@ -0,0 +1,92 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "cache.h"
+
+#include <iterator>
+
+namespace {
+
+size_t EntryBytes(const std::string& key, const std::string& value) {
+  return key.size() + value.size();
+}
+
+}  // namespace
+
+ValueCache::ValueCache(size_t max_entries, size_t max_bytes)
+    : max_entries_(max_entries), max_bytes_(max_bytes) {}
+
+bool ValueCache::Get(const std::string& key, std::string* value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    ++stats_.misses;
+    return false;
+  }
+  ++stats_.hits;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  *value = it->second->second;
+  return true;
+}
+
+uint64_t ValueCache::epoch() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return epoch_;
+}
+
+void ValueCache::Put(const std::string& key, const std::string& value,
+                     uint64_t epoch) {
+  size_t bytes = EntryBytes(key, value);
+  if (max_entries_ == 0 || bytes > max_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (epoch != epoch_) {
+    return;
+  }
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    EraseEntry(it->second);
+  }
+  while (!entries_.empty() && (stats_.entries + 1 > max_entries_ ||
+                               stats_.bytes + bytes > max_bytes_)) {
+    EraseEntry(std::prev(entries_.end()));
+    ++stats_.evictions;
+  }
+  entries_.emplace_front(key, value);
+  index_.emplace(key, entries_.begin());
+  ++stats_.entries;
+  stats_.bytes += bytes;
+}
+
+void ValueCache::Erase(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    EraseEntry(it->second);
+  }
+}
+
+void ValueCache::Invalidate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  stats_.entries = 0;
+  stats_.bytes = 0;
+  ++epoch_;
+}
+
+ValueCache::Stats ValueCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void ValueCache::EraseEntry(std::list<Entry>::iterator it) {
+  --stats_.entries;
+  stats_.bytes -= EntryBytes(it->first, it->second);
+  index_.erase(it->first);
+  entries_.erase(it);
+}
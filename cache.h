@@ -0,0 +1,78 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_CACHE_H
+#define KVS_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// A thread-safe LRU cache of key/value pairs bounded by both a number of
+// entries and a number of bytes.
+//
+// Since values are write-once, cached entries never go stale on their own.
+// Erase() and Invalidate() are there for when that changes; the latter bumps
+// an epoch so that values fetched before it are not cached after it.
+class ValueCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  // A budget of zero entries or bytes disables the cache.
+  ValueCache(size_t max_entries, size_t max_bytes);
+  ValueCache(const ValueCache&) = delete;
+  ValueCache(ValueCache&&) = delete;
+  ValueCache& operator=(const ValueCache&) = delete;
+  ValueCache&& operator=(ValueCache&&) = delete;
+
+  // Copies the cached value for the key to `value` and returns true, making it
+  // the most recently used entry. Counts a hit or a miss.
+  bool Get(const std::string& key, std::string* value);
+
+  // Returns the current epoch, to be passed to Put() for a value that is about
+  // to be fetched.
+  uint64_t epoch() const;
+
+  // Caches a value fetched in `epoch`, evicting the least recently used
+  // entries to stay within budget. Does nothing if the cache has been
+  // invalidated since, or if the entry alone exceeds the byte budget.
+  void Put(const std::string& key, const std::string& value, uint64_t epoch);
+
+  // Drops the cached value for the key.
+  void Erase(const std::string& key);
+
+  // Drops every cached value and starts a new epoch.
+  void Invalidate();
+
+  Stats stats() const;
+
+ private:
+  using Entry = std::pair<std::string, std::string>;
+
+  void EraseEntry(std::list<Entry>::iterator it);
+
+  const size_t max_entries_;
+  const size_t max_bytes_;
+
+  mutable std::mutex mutex_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  uint64_t epoch_ = 0;
+  Stats stats_;
+};
+
+#endif  // KVS_CACHE_H
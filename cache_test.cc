@@ -0,0 +1,90 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "cache.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace kvs {
+namespace {
+
+TEST(ValueCacheTest, CountsHitsAndMisses) {
+  ValueCache cache(/*max_entries=*/4, /*max_bytes=*/1024);
+  std::string value;
+  EXPECT_FALSE(cache.Get("key1", &value));
+  cache.Put("key1", "value1", cache.epoch());
+  EXPECT_TRUE(cache.Get("key1", &value));
+  EXPECT_EQ(value, "value1");
+
+  ValueCache::Stats stats = cache.stats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(stats.bytes, 10);
+}
+
+TEST(ValueCacheTest, EvictsLeastRecentlyUsedEntry) {
+  ValueCache cache(/*max_entries=*/2, /*max_bytes=*/1024);
+  std::string value;
+  cache.Put("key1", "value1", cache.epoch());
+  cache.Put("key2", "value2", cache.epoch());
+  // key1 becomes the most recently used entry.
+  EXPECT_TRUE(cache.Get("key1", &value));
+  cache.Put("key3", "value3", cache.epoch());
+  EXPECT_TRUE(cache.Get("key1", &value));
+  EXPECT_FALSE(cache.Get("key2", &value));
+  EXPECT_TRUE(cache.Get("key3", &value));
+  EXPECT_EQ(cache.stats().evictions, 1);
+}
+
+TEST(ValueCacheTest, StaysWithinByteBudget) {
+  ValueCache cache(/*max_entries=*/100, /*max_bytes=*/20);
+  std::string value;
+  cache.Put("a", std::string(9, 'x'), cache.epoch());
+  cache.Put("b", std::string(9, 'x'), cache.epoch());
+  cache.Put("c", std::string(9, 'x'), cache.epoch());
+  EXPECT_FALSE(cache.Get("a", &value));
+  EXPECT_TRUE(cache.Get("c", &value));
+  EXPECT_LE(cache.stats().bytes, 20);
+
+  // An entry larger than the whole budget is not cached.
+  cache.Put("d", std::string(20, 'x'), cache.epoch());
+  EXPECT_FALSE(cache.Get("d", &value));
+  EXPECT_TRUE(cache.Get("c", &value));
+}
+
+TEST(ValueCacheTest, ZeroBudgetDisablesCache) {
+  ValueCache cache(/*max_entries=*/0, /*max_bytes=*/1024);
+  std::string value;
+  cache.Put("key1", "value1", cache.epoch());
+  EXPECT_FALSE(cache.Get("key1", &value));
+  EXPECT_EQ(cache.stats().entries, 0);
+}
+
+TEST(ValueCacheTest, EraseAndInvalidate) {
+  ValueCache cache(/*max_entries=*/4, /*max_bytes=*/1024);
+  std::string value;
+  cache.Put("key1", "value1", cache.epoch());
+  cache.Put("key2", "value2", cache.epoch());
+  cache.Erase("key1");
+  EXPECT_FALSE(cache.Get("key1", &value));
+  EXPECT_TRUE(cache.Get("key2", &value));
+
+  // A value fetched before the invalidation is not cached after it.
+  uint64_t epoch = cache.epoch();
+  cache.Invalidate();
+  EXPECT_FALSE(cache.Get("key2", &value));
+  cache.Put("key3", "value3", epoch);
+  EXPECT_FALSE(cache.Get("key3", &value));
+  cache.Put("key3", "value3", cache.epoch());
+  EXPECT_TRUE(cache.Get("key3", &value));
+  EXPECT_EQ(cache.stats().entries, 1);
+}
+
+}  // namespace
+}  // namespace kvs
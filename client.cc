@@ -6,78 +6,1170 @@
 
 #include "client.h"
 
-#include <iostream>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <grpcpp/alarm.h>
+
+#include <algorithm>
+#include <future>
+#include <thread>
+
+#include "log.h"
+
+namespace {
+
+constexpr char kGetValueMethod[] = "/keyvaluestore.KeyValueStore/GetValue";
+
+// Finds the value field of a serialized GetValueResponse and points `value`
+// into `slice` instead of copying it into a message.
+bool ParseGetValueResponse(const grpc::Slice& slice, std::string_view* value) {
+  using google::protobuf::internal::WireFormatLite;
+  constexpr uint32_t kValueTag = WireFormatLite::MakeTag(
+      keyvaluestore::GetValueResponse::kValueFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+  google::protobuf::io::CodedInputStream input(slice.begin(), slice.size());
+  *value = std::string_view();
+  while (uint32_t tag = input.ReadTag()) {
+    if (tag != kValueTag) {
+      if (!WireFormatLite::SkipField(&input, tag)) {
+        return false;
+      }
+      continue;
+    }
+    uint32_t size = 0;
+    if (!input.ReadVarint32(&size)) {
+      return false;
+    }
+    const void* data = nullptr;
+    int available = 0;
+    if (size > 0 && (!input.GetDirectBufferPointer(&data, &available) ||
+                     static_cast<uint32_t>(available) < size)) {
+      return false;
+    }
+    // The last occurrence of a field wins, as with a regular parse.
+    *value = std::string_view(static_cast<const char*>(data), size);
+    input.Skip(size);
+  }
+  return input.ConsumedEntireMessage();
+}
+
+// Failed RPCs are reported to the caller, so they are only logged for
+// debugging.
+void LogFailedRpc(const char* method, const grpc::Status& status) {
+  KVS_LOG(kInfo) << method << "() failed: " << status.error_code() << ": "
+                 << status.error_message();
+}
+
+// Makes a pool of each channel.
+std::vector<std::vector<std::shared_ptr<grpc::Channel>>> PoolsOfOne(
+    const std::vector<std::shared_ptr<grpc::Channel>>& channels) {
+  std::vector<std::vector<std::shared_ptr<grpc::Channel>>> pools;
+  for (const std::shared_ptr<grpc::Channel>& channel : channels) {
+    pools.push_back({channel});
+  }
+  return pools;
+}
+
+// How long Failover waits between rounds of attempts on every replica.
+constexpr auto kMinFailoverBackoff = std::chrono::milliseconds(10);
+constexpr auto kMaxFailoverBackoff = std::chrono::milliseconds(500);
+
+}  // namespace
+
+std::vector<std::shared_ptr<grpc::Channel>> CreateChannelPool(
+    const std::string& address, const KeyValueStoreClientOptions& options) {
+  if (IsInProcessAddress(address)) {
+    // gRPC's in-process transport has no connections to pool.
+    if (std::shared_ptr<InProcessServer> server = FindInProcessServer(
+            address.substr(kInProcessScheme.size()))) {
+      return {server->channel()};
+    }
+  }
+  grpc::ChannelArguments args;
+  // Channels with the same arguments would otherwise share a connection.
+  args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  if (options.keepalive_time.count() > 0) {
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS,
+                std::max<std::chrono::milliseconds>(options.keepalive_time,
+                                                    kMinKeepaliveTime)
+                    .count());
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                options.keepalive_timeout.count());
+    args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+  }
+  if (options.max_message_size > 0) {
+    args.SetMaxReceiveMessageSize(options.max_message_size);
+    args.SetMaxSendMessageSize(options.max_message_size);
+  }
+  std::vector<std::shared_ptr<grpc::Channel>> channels;
+  for (size_t i = 0; i < std::max<size_t>(options.channels_per_replica, 1);
+       ++i) {
+    channels.push_back(grpc::CreateCustomChannel(
+        address, grpc::InsecureChannelCredentials(), args));
+  }
+  return channels;
+}
+
+size_t WarmUpChannels(
+    const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+    std::chrono::system_clock::time_point deadline) {
+  // Connect all of them at once, so that waiting is bounded by the slowest.
+  for (const std::shared_ptr<grpc::Channel>& channel : channels) {
+    channel->GetState(/*try_to_connect=*/true);
+  }
+  size_t not_connected = 0;
+  for (const std::shared_ptr<grpc::Channel>& channel : channels) {
+    if (!channel->WaitForConnected(deadline)) {
+      ++not_connected;
+    }
+  }
+  return not_connected;
+}
+
+KeyValueStoreClient::KeyValueStoreClient(
+    const std::vector<std::shared_ptr<grpc::Channel>>& replicas,
+    const KeyValueStoreClientOptions& options)
+    : KeyValueStoreClient(PoolsOfOne(replicas), options) {}
+
+KeyValueStoreClient::KeyValueStoreClient(
+    const std::vector<std::vector<std::shared_ptr<grpc::Channel>>>& replicas,
+    const KeyValueStoreClientOptions& options)
+    : failover_timeout_(options.failover_timeout),
+      connection_timeout_(options.connection_timeout),
+      compression_(options.compression),
+      compression_threshold_(options.compression_threshold),
+      raw_values_(options.raw_values),
+      cache_(options.cache_max_entries, options.cache_max_bytes),
+      shared_memory_(options.shared_memory),
+      in_process_(options.in_process),
+      direct_(in_process_ && options.direct_in_process) {
+  if (options.log_level) {
+    SetLogLevel(*options.log_level);
+  }
+  for (const std::vector<std::shared_ptr<grpc::Channel>>& pool : replicas) {
+    Replica& replica = replicas_.emplace_back();
+    for (const std::shared_ptr<grpc::Channel>& channel : pool) {
+      Channel& pooled = replica.emplace_back();
+      pooled.stub = keyvaluestore::KeyValueStore::NewStub(channel);
+      pooled.generic_stub = std::make_unique<grpc::GenericStub>(channel);
+    }
+  }
+  if (in_process_) {
+    std::shared_ptr<grpc::Channel> closed = CreateClosedChannel();
+    closed_channel_.stub = keyvaluestore::KeyValueStore::NewStub(closed);
+    closed_channel_.generic_stub = std::make_unique<grpc::GenericStub>(closed);
+  }
+}
+
+KeyValueStoreClient::Failover::Failover(KeyValueStoreClient* client,
+                                        Kind kind)
+    : client_(client),
+      kind_(kind),
+      deadline_(std::chrono::steady_clock::now() + client->failover_timeout_),
+      backoff_(kMinFailoverBackoff) {
+  if (kind == kRead) {
+    replica_ = client->next_reader_.fetch_add(1, std::memory_order_relaxed) %
+               client->replicas_.size();
+  } else {
+    replica_ = client->leader_.load(std::memory_order_relaxed);
+  }
+}
+
+bool KeyValueStoreClient::Failover::CanRetry(
+    const grpc::Status& status) const {
+  // Followers reject writes with FAILED_PRECONDITION.
+  return client_->replicas_.size() > 1 &&
+         ((status.error_code() == grpc::StatusCode::UNAVAILABLE &&
+           kind_ != kNonIdempotentWrite) ||
+          status.error_code() == grpc::StatusCode::FAILED_PRECONDITION);
+}
+
+bool KeyValueStoreClient::Failover::Retry(const grpc::Status& status) {
+  std::chrono::milliseconds backoff;
+  if (!Next(status, &backoff)) {
+    return false;
+  }
+  if (backoff.count() > 0) {
+    std::this_thread::sleep_for(backoff);
+  }
+  return true;
+}
+
+bool KeyValueStoreClient::Failover::Next(const grpc::Status& status,
+                                         std::chrono::milliseconds* backoff) {
+  if (!CanRetry(status)) {
+    if (kind_ == kNonIdempotentWrite && client_->replicas_.size() > 1 &&
+        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
+      // The caller decides whether to call again, which then starts at the
+      // next replica.
+      MoveOn();
+    }
+    return false;
+  }
+  *backoff = std::chrono::milliseconds(0);
+  if (++attempts_ % client_->replicas_.size() == 0) {
+    // No replica could take the call. Give a follower time to be promoted.
+    if (std::chrono::steady_clock::now() + backoff_ > deadline_) {
+      return false;
+    }
+    *backoff = backoff_;
+    backoff_ = std::min<std::chrono::milliseconds>(backoff_ * 2,
+                                                   kMaxFailoverBackoff);
+  }
+  MoveOn();
+  KVS_LOG(kInfo) << "Retrying on replica " << replica_ << " after: "
+                 << status.error_message();
+  return true;
+}
+
+void KeyValueStoreClient::Failover::MoveOn() {
+  size_t next = (replica_ + 1) % client_->replicas_.size();
+  if (kind_ != kRead) {
+    // Another call may have found the leader already.
+    size_t leader = replica_;
+    if (!client_->leader_.compare_exchange_strong(leader, next)) {
+      next = leader;
+    }
+  }
+  replica_ = next;
+}
+
+void KeyValueStoreClient::FailoverAsync(
+    Failover::Kind kind, AsyncAttempt attempt,
+    std::function<void(grpc::Status)> done) {
+  struct State {
+    Failover failover;
+    AsyncAttempt attempt;
+    std::function<void(grpc::Status)> done;
+    // A new alarm for every backoff, since the last one may still be calling
+    // back.
+    std::unique_ptr<grpc::Alarm> alarm;
+
+    static void Start(std::shared_ptr<State> state) {
+      auto attempt_done = [state](grpc::Status status) {
+        std::chrono::milliseconds backoff;
+        if (status.ok() || !state->failover.Next(status, &backoff)) {
+          state->done(std::move(status));
+        } else if (backoff.count() == 0) {
+          Start(state);
+        } else {
+          state->alarm = std::make_unique<grpc::Alarm>();
+          state->alarm->Set(std::chrono::system_clock::now() + backoff,
+                            [state](bool) { Start(state); });
+        }
+      };
+      state->attempt(state->failover.replica(), state->failover.retried(),
+                     std::move(attempt_done));
+    }
+  };
+  State::Start(std::make_shared<State>(
+      State{Failover(this, kind), std::move(attempt), std::move(done)}));
+}
+
+std::optional<std::chrono::system_clock::time_point>
+KeyValueStoreClient::CallDeadline(std::chrono::milliseconds timeout) const {
+  if (timeout.count() <= 0) {
+    return std::nullopt;
+  }
+  return std::chrono::system_clock::now() + timeout + connection_timeout_;
+}
+
+grpc::Status KeyValueStoreClient::Decode(std::string* value) const {
+  if (raw_values_ || DecodeValueInPlace(value)) {
+    return grpc::Status::OK;
+  }
+  return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                      "failed to decompress the value");
+}
+
+grpc::Status KeyValueStoreClient::Decode(ValueView& value) const {
+  if (raw_values_ || !IsFramed(value.value_)) {
+    return grpc::Status::OK;
+  }
+  auto decoded = std::make_shared<std::string>();
+  if (!DecodeValue(value.value_, decoded.get())) {
+    return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                        "failed to decompress the value");
+  }
+  value.value_ = *decoded;
+  value.decoded_ = std::move(decoded);
+  return grpc::Status::OK;
+}
 
 // GetValue gets a value for the requested key.
 grpc::Status KeyValueStoreClient::GetValue(
     std::string key, std::string& value, std::chrono::milliseconds timeout_ms) {
-  std::cout << "GetValue(\"" << key << "\") -> ";
-
   grpc::Status status = grpc::Status::OK;
   value = "";
 
-  // Check the cache first.
-  if (kv_map.count(key)) {
-    value = kv_map[key];
-    std::cout << "\"" << value << "\" (cached)\n";
-    return status;
+  // Published values are read without a syscall, so they come first.
+  if (shared_memory_) {
+    std::string_view shared_value;
+    SharedMemoryReader::WaitResult result =
+        shared_memory_->Find(key, &shared_value)
+            ? SharedMemoryReader::WaitResult::kFound
+            : shared_memory_->WaitFor(
+                  key,
+                  std::chrono::steady_clock::now() +
+                      (timeout_ms.count() > 0 ? timeout_ms
+                                              : shared_memory_->timeout()),
+                  &shared_value);
+    switch (result) {
+      case SharedMemoryReader::WaitResult::kFound:
+        value.assign(shared_value);
+        status = Decode(&value);
+        if (!status.ok()) {
+          return status;
+        }
+        KVS_LOG(kDebug) << "GetValue(" << LogString(key) << ") -> "
+                        << LogString(value) << " (shared memory)";
+        return status;
+      case SharedMemoryReader::WaitResult::kTimedOut:
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            "GetValue() exceeded time limit.");
+      case SharedMemoryReader::WaitResult::kUnpublished:
+        // Ask the server.
+        break;
+    }
   }
 
-  // Context for the client. It could be used to convey extra information to
-  // the server and/or tweak certain RPC behaviors.
-  grpc::ClientContext context;
-
-  context.set_fail_fast(false);
-  // std::chrono::system_clock::time_point deadline =
-  //     std::chrono::system_clock::now() + timeout_ms;
-  // context.set_deadline(deadline);
+  // Check the cache before asking the server.
+  if (cache_.Get(key, &value)) {
+    KVS_LOG(kDebug) << "GetValue(" << LogString(key) << ") -> "
+                    << LogString(value) << " (cached)";
+    return status;
+  }
+  uint64_t cache_epoch = cache_.epoch();
 
-  // Key we are sending to the server.
+  // Key we are sending to the server, and how long it waits for the key to
+  // be set by another client.
   keyvaluestore::GetValueRequest request;
   request.set_key(std::move(key));
-  // timeout_ms = std::min(timeout_ms,
-  //                       std::chrono::duration_cast<std::chrono::milliseconds>(
-  //                           std::chrono::minutes(10)));
-  // FIXME: add timeout_ms field to the message and use it to wait for the key
-  // to be set by another client.
+  request.set_timeout_ms(timeout_ms.count());
+  // Failover attempts share the deadline, so the call as a whole gives up
+  // once it passes.
+  auto deadline = CallDeadline(timeout_ms);
 
   keyvaluestore::GetValueResponse response;
-  status = stub_->GetValue(&context, request, &response);
-  if (!status.ok()) {
-    std::cout << status.error_code() << ": " << status.error_message()
-              << std::endl;
-    std::cout << "RPC failed";
+  if (direct_) {
+    status = in_process_->GetValue(request, &response);
+  } else {
+    Failover failover(this, Failover::kRead);
+    do {
+      // Context for the client. It could be used to convey extra information
+      // to the server and/or tweak certain RPC behaviors.
+      grpc::ClientContext context;
+      context.set_fail_fast(!wait_for_ready());
+      if (deadline) {
+        context.set_deadline(*deadline);
+      }
+      status =
+          stub(failover.replica())->GetValue(&context, request, &response);
+    } while (!status.ok() && failover.Retry(status));
+  }
+  if (status.ok()) {
+    status = Decode(response.mutable_value());
+  }
+  if (status.ok()) {
+    // Keys are write-once, so the value can be cached for good.
+    cache_.Put(request.key(), response.value(), cache_epoch);
+  } else {
+    LogFailedRpc("GetValue", status);
   }
 
   value = response.value();
-  std::cout << "\"" << value << "\"\n";
+  KVS_LOG(kDebug) << "GetValue(" << LogString(request.key()) << ") -> "
+                  << LogString(value);
 
   return status;
 }
 
-// SetValue sets a value for the key. Updating (Setting a value for an
-// existing key) is not supported by the server.
-grpc::Status KeyValueStoreClient::SetValue(std::string key, std::string value) {
-  // Context for the client. It could be used to convey extra information to
-  // the server and/or tweak certain RPC behaviors.
-  grpc::ClientContext context;
+// GetValueView gets a value for the requested key without copying it.
+grpc::Status KeyValueStoreClient::GetValueView(std::string key,
+                                               ValueView& value) {
+  if (shared_memory_ && shared_memory_->Find(key, &value.value_)) {
+    value.shared_memory_ = shared_memory_;
+    return Decode(value);
+  }
+  keyvaluestore::GetValueRequest request;
+  request.set_key(std::move(key));
+  grpc::ByteBuffer request_buffer;
+  bool own_buffer = false;
+  grpc::Status status =
+      grpc::SerializationTraits<keyvaluestore::GetValueRequest>::Serialize(
+          request, &request_buffer, &own_buffer);
+  if (!status.ok()) {
+    return status;
+  }
 
-  std::cout << "SetValue(\"" << key << "\", \"" << value << "\")\n";
+  grpc::ByteBuffer response_buffer;
+  Failover failover(this, Failover::kRead);
+  do {
+    grpc::ClientContext context;
+    context.set_fail_fast(!wait_for_ready());
+    std::promise<grpc::Status> done;
+    channel(failover.replica()).generic_stub->UnaryCall(
+        &context, kGetValueMethod, grpc::StubOptions(), &request_buffer,
+        &response_buffer, [&done](grpc::Status status) {
+          done.set_value(std::move(status));
+        });
+    status = done.get_future().get();
+  } while (!status.ok() && failover.Retry(status));
+  if (!status.ok()) {
+    LogFailedRpc("GetValueView", status);
+    return status;
+  }
 
-  // Put the key and value in the cache.
-  kv_map[key] = value;
+  // Small messages arrive in a single slice, which is borrowed as is.
+  if (!response_buffer.TrySingleSlice(&value.slice_).ok()) {
+    status = response_buffer.DumpToSingleSlice(&value.slice_);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  if (!ParseGetValueResponse(value.slice_, &value.value_)) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "failed to parse GetValueResponse");
+  }
+  return Decode(value);
+}
 
+// SetValue sets a value for the key. Updating (Setting a value for an
+// existing key) is not supported by the server.
+grpc::Status KeyValueStoreClient::SetValue(std::string key, std::string value,
+                                           std::chrono::milliseconds timeout) {
+  KVS_LOG(kDebug) << "SetValue(" << LogString(key) << ", "
+                  << LogString(value) << ")";
+
+  uint64_t cache_epoch = cache_.epoch();
   keyvaluestore::SetValueRequest request;
   request.set_key(std::move(key));
-  request.set_value(std::move(value));
+  std::string encoded;
+  bool framed = Encode(value, &encoded);
+  request.set_value(framed ? std::move(encoded) : std::move(value));
 
   keyvaluestore::SetValueResponse response;
-  grpc::Status status = stub_->SetValue(&context, request, &response);
+  grpc::Status status;
+  auto deadline = CallDeadline(timeout);
+  if (direct_) {
+    // The server takes the value on this thread, so there is no deadline to
+    // miss.
+    status = in_process_->SetValue(request, &response);
+  } else {
+    Failover failover(this, Failover::kWrite);
+    do {
+      // Context for the client. It could be used to convey extra information
+      // to the server and/or tweak certain RPC behaviors.
+      grpc::ClientContext context;
+      if (deadline) {
+        context.set_deadline(*deadline);
+      }
+      request.set_retried(failover.retried());
+      status =
+          stub(failover.replica())->SetValue(&context, request, &response);
+    } while (!status.ok() && failover.Retry(status));
+  }
+
+  if (status.ok()) {
+    // Only cache the value once the server has taken it; a rejected value
+    // is not the one other clients see.
+    cache_.Put(request.key(), framed ? value : request.value(), cache_epoch);
+  } else {
+    LogFailedRpc("SetValue", status);
+  }
+  return status;
+}
+
+// MultiGetValue gets the values for several keys in one round trip.
+grpc::Status KeyValueStoreClient::MultiGetValue(
+    const std::vector<std::string>& keys,
+    std::vector<std::optional<std::string>>& values, bool wait_for_any,
+    std::chrono::milliseconds timeout) {
+  grpc::Status status;
+  // Like GetValue, failover attempts share the deadline.
+  auto deadline = CallDeadline(timeout);
+  Failover failover(this, Failover::kRead);
+  do {
+    grpc::ClientContext context;
+    if (deadline) {
+      context.set_deadline(*deadline);
+    }
+    std::promise<grpc::Status> done;
+    MultiGetValueAsync(
+        &context, failover.replica(), keys, wait_for_any, timeout,
+        [&](grpc::Status status,
+            std::vector<std::optional<std::string>> found_values) {
+          values = std::move(found_values);
+          done.set_value(std::move(status));
+        });
+    status = done.get_future().get();
+  } while (!status.ok() && failover.Retry(status));
+  return status;
+}
+
+// MultiSetValue sets the values for several keys in one round trip.
+grpc::Status KeyValueStoreClient::MultiSetValue(
+    const std::vector<std::pair<std::string, std::string>>& key_values) {
+  grpc::Status status;
+  Failover failover(this, Failover::kWrite);
+  do {
+    grpc::ClientContext context;
+    std::promise<grpc::Status> done;
+    MultiSetValueAsync(&context, failover.replica(), failover.retried(),
+                       key_values, [&](grpc::Status status) {
+                         done.set_value(std::move(status));
+                       });
+    status = done.get_future().get();
+  } while (!status.ok() && failover.Retry(status));
+  return status;
+}
+
+// MultiGetValueAsync starts getting the values for several keys.
+void KeyValueStoreClient::MultiGetValueAsync(
+    grpc::ClientContext* context, size_t replica,
+    const std::vector<std::string>& keys, bool wait_for_any,
+    std::chrono::milliseconds timeout, MultiGetValueDone done) {
+  // The messages have to outlive the RPC.
+  struct Call {
+    keyvaluestore::MultiGetValueRequest request;
+    keyvaluestore::MultiGetValueResponse response;
+    uint64_t cache_epoch;
+  };
+  Call* call = new Call;
+  for (const std::string& key : keys) {
+    call->request.add_keys(key);
+  }
+  if (wait_for_any) {
+    call->request.set_wait_mode(
+        keyvaluestore::MultiGetValueRequest::WAIT_ANY);
+  }
+  call->request.set_timeout_ms(timeout.count());
+  call->cache_epoch = cache_.epoch();
+  auto on_done = [this, call, done = std::move(done)](grpc::Status status) {
+    std::vector<std::optional<std::string>> values(call->request.keys_size());
+    if (status.ok()) {
+      auto& response_values = *call->response.mutable_values();
+      for (int i = 0;
+           i < response_values.size() && i < call->request.keys_size();
+           ++i) {
+        if (response_values[i].found()) {
+          status = Decode(response_values[i].mutable_value());
+          if (!status.ok()) {
+            break;
+          }
+          cache_.Put(call->request.keys(i), response_values[i].value(),
+                     call->cache_epoch);
+          values[i] = std::move(*response_values[i].mutable_value());
+        }
+      }
+    } else {
+      LogFailedRpc("MultiGetValue", status);
+    }
+    done(std::move(status), std::move(values));
+    delete call;
+  };
+  if (direct_) {
+    // Completes inline, which callers are ready for.
+    on_done(in_process_->MultiGetValue(call->request, &call->response));
+    return;
+  }
+  context->set_fail_fast(!wait_for_ready());
+  stub(replica)->async()->MultiGetValue(context, &call->request,
+                                        &call->response, std::move(on_done));
+}
+
+// MultiSetValueAsync starts setting the values for several keys.
+void KeyValueStoreClient::MultiSetValueAsync(
+    grpc::ClientContext* context, size_t replica, bool retried,
+    const std::vector<std::pair<std::string, std::string>>& key_values,
+    std::function<void(grpc::Status)> done) {
+  struct Call {
+    keyvaluestore::MultiSetValueRequest request;
+    keyvaluestore::MultiSetValueResponse response;
+  };
+  Call* call = new Call;
+  call->request.set_retried(retried);
+  for (const auto& key_value : key_values) {
+    keyvaluestore::KeyValue* entry = call->request.add_key_values();
+    entry->set_key(key_value.first);
+    std::string encoded;
+    if (Encode(key_value.second, &encoded)) {
+      entry->set_value(std::move(encoded));
+    } else {
+      entry->set_value(key_value.second);
+    }
+  }
+  auto on_done = [call, done = std::move(done)](grpc::Status status) {
+    if (!status.ok()) {
+      LogFailedRpc("MultiSetValue", status);
+    }
+    done(std::move(status));
+    delete call;
+  };
+  if (direct_) {
+    on_done(in_process_->MultiSetValue(call->request, &call->response));
+    return;
+  }
+  stub(replica)->async()->MultiSetValue(context, &call->request,
+                                        &call->response, std::move(on_done));
+}
+
+// Barrier blocks until `world_size` callers have arrived at the barrier.
+grpc::Status KeyValueStoreClient::Barrier(std::string name, int64_t world_size,
+                                          std::chrono::milliseconds timeout) {
+  keyvaluestore::BarrierRequest request;
+  request.set_name(std::move(name));
+  request.set_world_size(world_size);
+  request.set_timeout_ms(timeout.count());
 
+  keyvaluestore::BarrierResponse response;
+  grpc::Status status;
+  auto deadline = CallDeadline(timeout);
+  if (direct_) {
+    status = in_process_->Barrier(request, &response);
+  } else {
+    Failover failover(this, Failover::kNonIdempotentWrite);
+    do {
+      grpc::ClientContext context;
+      if (deadline) {
+        context.set_deadline(*deadline);
+      }
+      status =
+          stub(failover.replica())->Barrier(&context, request, &response);
+    } while (!status.ok() && failover.Retry(status));
+  }
   if (!status.ok()) {
-    std::cout << status.error_code() << ": " << status.error_message()
-              << std::endl;
-    std::cout << "RPC failed";
+    LogFailedRpc("Barrier", status);
+  }
+  return status;
+}
+
+// OpenNamespace opens a namespace or renews its lease.
+grpc::Status KeyValueStoreClient::OpenNamespace(std::string name,
+                                                std::chrono::milliseconds ttl,
+                                                bool& opened) {
+  keyvaluestore::OpenNamespaceRequest request;
+  request.set_name(std::move(name));
+  request.set_ttl_ms(ttl.count());
+
+  keyvaluestore::OpenNamespaceResponse response;
+  grpc::Status status;
+  Failover failover(this, Failover::kWrite);
+  do {
+    grpc::ClientContext context;
+    status =
+        stub(failover.replica())->OpenNamespace(&context, request, &response);
+  } while (!status.ok() && failover.Retry(status));
+  if (status.ok()) {
+    opened = response.opened();
+  } else {
+    LogFailedRpc("OpenNamespace", status);
+  }
+  return status;
+}
+
+// DropNamespace drops the keys of a namespace.
+grpc::Status KeyValueStoreClient::DropNamespace(std::string name,
+                                                bool& dropped) {
+  keyvaluestore::DropNamespaceRequest request;
+  request.set_name(std::move(name));
+
+  keyvaluestore::DropNamespaceResponse response;
+  grpc::Status status;
+  Failover failover(this, Failover::kWrite);
+  do {
+    grpc::ClientContext context;
+    status =
+        stub(failover.replica())->DropNamespace(&context, request, &response);
+  } while (!status.ok() && failover.Retry(status));
+  if (status.ok()) {
+    dropped = response.dropped();
+  } else {
+    LogFailedRpc("DropNamespace", status);
   }
+  // The cache doesn't know which keys were in the namespace, and they may
+  // be set again with other values.
+  cache_.Invalidate();
   return status;
 }
+
+// Add atomically adds `delta` to the counter `key`.
+grpc::Status KeyValueStoreClient::Add(std::string key, int64_t delta,
+                                      int64_t& value) {
+  keyvaluestore::AddRequest request;
+  request.set_key(std::move(key));
+  request.set_delta(delta);
+
+  keyvaluestore::AddResponse response;
+  grpc::Status status;
+  if (direct_) {
+    status = in_process_->Add(request, &response);
+  } else {
+    Failover failover(this, Failover::kNonIdempotentWrite);
+    do {
+      grpc::ClientContext context;
+      status = stub(failover.replica())->Add(&context, request, &response);
+    } while (!status.ok() && failover.Retry(status));
+  }
+  if (status.ok()) {
+    value = response.value();
+  } else {
+    LogFailedRpc("Add", status);
+  }
+  return status;
+}
+
+grpc::Status KeyValueStoreClient::GetStats(
+    keyvaluestore::GetStatsResponse& stats) {
+  grpc::Status status;
+  Failover failover(this, Failover::kWrite);
+  do {
+    grpc::ClientContext context;
+    stats.Clear();
+    status = stub(failover.replica())
+                 ->GetStats(&context, keyvaluestore::GetStatsRequest(), &stats);
+  } while (!status.ok() && failover.Retry(status));
+  return status;
+}
+
+// GetValueAsync starts getting a value for the requested key without blocking.
+void KeyValueStoreClient::GetValueAsync(
+    std::string key, std::function<void(grpc::Status, std::string)> done) {
+  // The messages have to outlive the RPC, and each attempt has a context of
+  // its own.
+  struct Call {
+    std::unique_ptr<grpc::ClientContext> context;
+    keyvaluestore::GetValueRequest request;
+    keyvaluestore::GetValueResponse response;
+  };
+  std::string value;
+  if (cache_.Get(key, &value)) {
+    done(grpc::Status::OK, std::move(value));
+    return;
+  }
+  uint64_t cache_epoch = cache_.epoch();
+  auto call = std::make_shared<Call>();
+  call->request.set_key(std::move(key));
+  FailoverAsync(
+      Failover::kRead,
+      [this, call](size_t replica, bool retried,
+                   std::function<void(grpc::Status)> attempt_done) {
+        call->context = std::make_unique<grpc::ClientContext>();
+        call->context->set_fail_fast(!wait_for_ready());
+        stub(replica)->async()->GetValue(call->context.get(), &call->request,
+                                         &call->response,
+                                         std::move(attempt_done));
+      },
+      [this, call, cache_epoch, done = std::move(done)](grpc::Status status) {
+        if (status.ok()) {
+          status = Decode(call->response.mutable_value());
+        } else {
+          LogFailedRpc("GetValue", status);
+        }
+        if (status.ok()) {
+          cache_.Put(call->request.key(), call->response.value(), cache_epoch);
+        }
+        done(std::move(status), std::move(*call->response.mutable_value()));
+      });
+}
+
+std::future<KeyValueStoreClient::GetValueResult>
+KeyValueStoreClient::GetValueAsync(std::string key) {
+  auto promise = std::make_shared<std::promise<GetValueResult>>();
+  std::future<GetValueResult> future = promise->get_future();
+  GetValueAsync(std::move(key),
+                [promise](grpc::Status status, std::string value) {
+                  promise->set_value({std::move(status), std::move(value)});
+                });
+  return future;
+}
+
+// SetValueAsync starts setting a value for the key without blocking.
+void KeyValueStoreClient::SetValueAsync(
+    std::string key, std::string value,
+    std::function<void(grpc::Status)> done) {
+  struct Call {
+    std::unique_ptr<grpc::ClientContext> context;
+    keyvaluestore::SetValueRequest request;
+    keyvaluestore::SetValueResponse response;
+  };
+  uint64_t cache_epoch = cache_.epoch();
+  auto call = std::make_shared<Call>();
+  call->request.set_key(std::move(key));
+  std::string encoded;
+  bool framed = Encode(value, &encoded);
+  // The value as callers see it is kept for the cache if it is sent framed.
+  std::string unframed;
+  if (framed) {
+    call->request.set_value(std::move(encoded));
+    unframed = std::move(value);
+  } else {
+    call->request.set_value(std::move(value));
+  }
+  auto on_done = [this, call, cache_epoch, framed,
+                  unframed = std::move(unframed),
+                  done = std::move(done)](grpc::Status status) {
+    if (status.ok()) {
+      // Like SetValue, only cache the value the server has taken.
+      cache_.Put(call->request.key(),
+                 framed ? unframed : call->request.value(), cache_epoch);
+    } else {
+      LogFailedRpc("SetValue", status);
+    }
+    done(std::move(status));
+  };
+  if (direct_) {
+    // The server takes the value on this thread without waiting for anything.
+    on_done(in_process_->SetValue(call->request, &call->response));
+    return;
+  }
+  FailoverAsync(
+      Failover::kWrite,
+      [this, call](size_t replica, bool retried,
+                   std::function<void(grpc::Status)> attempt_done) {
+        call->context = std::make_unique<grpc::ClientContext>();
+        call->request.set_retried(retried);
+        stub(replica)->async()->SetValue(call->context.get(), &call->request,
+                                         &call->response,
+                                         std::move(attempt_done));
+      },
+      std::move(on_done));
+}
+
+std::future<grpc::Status> KeyValueStoreClient::SetValueAsync(
+    std::string key, std::string value) {
+  auto promise = std::make_shared<std::promise<grpc::Status>>();
+  std::future<grpc::Status> future = promise->get_future();
+  SetValueAsync(std::move(key), std::move(value),
+                [promise](grpc::Status status) {
+                  promise->set_value(std::move(status));
+                });
+  return future;
+}
+
+void KeyValueStoreClient::MultiSetValueAsync(
+    std::vector<std::pair<std::string, std::string>> key_values,
+    std::function<void(grpc::Status)> done) {
+  struct Call {
+    std::unique_ptr<grpc::ClientContext> context;
+    std::vector<std::pair<std::string, std::string>> key_values;
+  };
+  auto call = std::make_shared<Call>();
+  call->key_values = std::move(key_values);
+  if (direct_) {
+    MultiSetValueAsync(/*context=*/nullptr, /*replica=*/0, /*retried=*/false,
+                       call->key_values, std::move(done));
+    return;
+  }
+  FailoverAsync(
+      Failover::kWrite,
+      [this, call](size_t replica, bool retried,
+                   std::function<void(grpc::Status)> attempt_done) {
+        call->context = std::make_unique<grpc::ClientContext>();
+        MultiSetValueAsync(call->context.get(), replica, retried,
+                           call->key_values, std::move(attempt_done));
+      },
+      // Keeps the context until the last attempt is done.
+      [call, done = std::move(done)](grpc::Status status) {
+        done(std::move(status));
+      });
+}
+
+void KeyValueStoreClient::BarrierAsync(
+    std::string name, int64_t world_size, std::chrono::milliseconds timeout,
+    std::function<void(grpc::Status)> done) {
+  struct Call {
+    std::unique_ptr<grpc::ClientContext> context;
+    keyvaluestore::BarrierRequest request;
+    keyvaluestore::BarrierResponse response;
+  };
+  auto call = std::make_shared<Call>();
+  call->request.set_name(std::move(name));
+  call->request.set_world_size(world_size);
+  call->request.set_timeout_ms(timeout.count());
+  // Failover attempts share the deadline, like Barrier.
+  auto deadline = CallDeadline(timeout);
+  FailoverAsync(
+      Failover::kNonIdempotentWrite,
+      [this, call, deadline](size_t replica, bool retried,
+                             std::function<void(grpc::Status)> attempt_done) {
+        call->context = std::make_unique<grpc::ClientContext>();
+        if (deadline) {
+          call->context->set_deadline(*deadline);
+        }
+        stub(replica)->async()->Barrier(call->context.get(), &call->request,
+                                        &call->response,
+                                        std::move(attempt_done));
+      },
+      [call, done = std::move(done)](grpc::Status status) {
+        if (!status.ok()) {
+          LogFailedRpc("Barrier", status);
+        }
+        done(std::move(status));
+      });
+}
+
+void KeyValueStoreClient::AddAsync(
+    std::string key, int64_t delta,
+    std::function<void(grpc::Status, int64_t value)> done) {
+  struct Call {
+    std::unique_ptr<grpc::ClientContext> context;
+    keyvaluestore::AddRequest request;
+    keyvaluestore::AddResponse response;
+  };
+  auto call = std::make_shared<Call>();
+  call->request.set_key(std::move(key));
+  call->request.set_delta(delta);
+  auto on_done = [call, done = std::move(done)](grpc::Status status) {
+    if (!status.ok()) {
+      LogFailedRpc("Add", status);
+    }
+    done(std::move(status), call->response.value());
+  };
+  if (direct_) {
+    on_done(in_process_->Add(call->request, &call->response));
+    return;
+  }
+  FailoverAsync(
+      Failover::kNonIdempotentWrite,
+      [this, call](size_t replica, bool retried,
+                   std::function<void(grpc::Status)> attempt_done) {
+        call->context = std::make_unique<grpc::ClientContext>();
+        stub(replica)->async()->Add(call->context.get(), &call->request,
+                                    &call->response, std::move(attempt_done));
+      },
+      std::move(on_done));
+}
+
+KeyValueStoreClient::PrefixWatch::PrefixWatch(
+    keyvaluestore::KeyValueStore::Stub* stub,
+    const keyvaluestore::WatchPrefixRequest& request, bool decode_values)
+    : decode_values_(decode_values) {
+  context_.set_fail_fast(false);
+  reader_ = stub->WatchPrefix(&context_, request);
+}
+
+KeyValueStoreClient::PrefixWatch::~PrefixWatch() {
+  if (!finished_) {
+    context_.TryCancel();
+    Finish();
+  }
+}
+
+bool KeyValueStoreClient::PrefixWatch::Next(std::string& key,
+                                            std::string& value) {
+  if (finished_ || !reader_->Read(&key_value_)) {
+    return false;
+  }
+  if (decode_values_ && !DecodeValueInPlace(key_value_.mutable_value())) {
+    // End the stream with the error.
+    context_.TryCancel();
+    Finish();
+    status_ = grpc::Status(grpc::StatusCode::DATA_LOSS,
+                           "failed to decompress the value");
+    return false;
+  }
+  key = std::move(*key_value_.mutable_key());
+  value = std::move(*key_value_.mutable_value());
+  return true;
+}
+
+grpc::Status KeyValueStoreClient::PrefixWatch::Finish() {
+  if (!finished_) {
+    // The reader must be drained before it can be finished.
+    while (reader_->Read(&key_value_)) {
+    }
+    status_ = reader_->Finish();
+    finished_ = true;
+  }
+  return status_;
+}
+
+// WatchPrefix streams every key/value pair under `prefix`.
+std::unique_ptr<KeyValueStoreClient::PrefixWatch>
+KeyValueStoreClient::WatchPrefix(std::string prefix, int64_t max_keys) {
+  keyvaluestore::WatchPrefixRequest request;
+  request.set_prefix(std::move(prefix));
+  request.set_max_keys(max_keys);
+  size_t replica = next_reader_.fetch_add(1, std::memory_order_relaxed) %
+                   replicas_.size();
+  return std::make_unique<PrefixWatch>(stub(replica), request,
+                                       /*decode_values=*/!raw_values_);
+}
+
+KeyValueStoreClient::KeyList::KeyList(
+    keyvaluestore::KeyValueStore::Stub* stub,
+    const keyvaluestore::ListKeysRequest& request, bool decode_values)
+    : decode_values_(decode_values) {
+  context_.set_fail_fast(false);
+  reader_ = stub->ListKeys(&context_, request);
+}
+
+KeyValueStoreClient::KeyList::~KeyList() {
+  if (!finished_) {
+    context_.TryCancel();
+    Finish();
+  }
+}
+
+bool KeyValueStoreClient::KeyList::Next(std::string& key,
+                                        std::string& value) {
+  if (finished_) {
+    return false;
+  }
+  while (next_ == page_.keys_size()) {
+    next_ = 0;
+    if (!reader_->Read(&page_)) {
+      page_.Clear();
+      return false;
+    }
+  }
+  value.clear();
+  if (next_ < page_.values_size()) {
+    std::string* page_value = page_.mutable_values(next_);
+    if (decode_values_ && !DecodeValueInPlace(page_value)) {
+      // End the stream with the error.
+      context_.TryCancel();
+      Finish();
+      status_ = grpc::Status(grpc::StatusCode::DATA_LOSS,
+                             "failed to decompress the value");
+      return false;
+    }
+    value = std::move(*page_value);
+  }
+  key = std::move(*page_.mutable_keys(next_));
+  ++next_;
+  return true;
+}
+
+grpc::Status KeyValueStoreClient::KeyList::Finish() {
+  if (!finished_) {
+    // The reader must be drained before it can be finished.
+    while (reader_->Read(&page_)) {
+    }
+    page_.Clear();
+    next_ = 0;
+    status_ = reader_->Finish();
+    finished_ = true;
+  }
+  return status_;
+}
+
+// ListKeys lists the keys under `prefix` after `start_after`.
+std::unique_ptr<KeyValueStoreClient::KeyList> KeyValueStoreClient::ListKeys(
+    std::string prefix, std::string start_after, int64_t limit,
+    bool with_values) {
+  keyvaluestore::ListKeysRequest request;
+  request.set_prefix(std::move(prefix));
+  request.set_start_after(std::move(start_after));
+  request.set_limit(limit);
+  request.set_with_values(with_values);
+  size_t replica = next_reader_.fetch_add(1, std::memory_order_relaxed) %
+                   replicas_.size();
+  return std::make_unique<KeyList>(stub(replica), request,
+                                   /*decode_values=*/!raw_values_);
+}
+
+KeyValueStoreClient::ValueWriter::ValueWriter(
+    keyvaluestore::KeyValueStore::Stub* stub, std::string key)
+    : key_(std::move(key)) {
+  context_.set_fail_fast(false);
+  writer_ = stub->SetValueStream(&context_, &response_);
+}
+
+KeyValueStoreClient::ValueWriter::~ValueWriter() {
+  if (!finished_) {
+    context_.TryCancel();
+    writer_->Finish();
+  }
+}
+
+bool KeyValueStoreClient::ValueWriter::Write(const char* data, size_t size) {
+  if (finished_) {
+    return false;
+  }
+  keyvaluestore::ValueChunk chunk;
+  while (size > 0) {
+    size_t chunk_size = std::min(size, kMaxChunkSize);
+    if (!sent_key_) {
+      chunk.set_key(key_);
+    } else {
+      chunk.clear_key();
+    }
+    chunk.set_data(data, chunk_size);
+    if (!writer_->Write(chunk)) {
+      return false;
+    }
+    sent_key_ = true;
+    data += chunk_size;
+    size -= chunk_size;
+  }
+  return true;
+}
+
+grpc::Status KeyValueStoreClient::ValueWriter::Finish() {
+  if (!finished_) {
+    if (!sent_key_) {
+      // An empty value still needs a chunk to carry the key.
+      keyvaluestore::ValueChunk chunk;
+      chunk.set_key(key_);
+      writer_->Write(chunk);
+    }
+    writer_->WritesDone();
+    status_ = writer_->Finish();
+    finished_ = true;
+  }
+  return status_;
+}
+
+KeyValueStoreClient::ValueReader::ValueReader(
+    keyvaluestore::KeyValueStore::Stub* stub,
+    const keyvaluestore::GetValueRequest& request) {
+  context_.set_fail_fast(false);
+  reader_ = stub->GetValueStream(&context_, request);
+}
+
+KeyValueStoreClient::ValueReader::~ValueReader() {
+  if (!finished_) {
+    context_.TryCancel();
+    Finish();
+  }
+}
+
+bool KeyValueStoreClient::ValueReader::Read(std::string& chunk) {
+  if (finished_ || !reader_->Read(&chunk_)) {
+    return false;
+  }
+  chunk = std::move(*chunk_.mutable_data());
+  return true;
+}
+
+grpc::Status KeyValueStoreClient::ValueReader::Finish() {
+  if (!finished_) {
+    // The reader must be drained before it can be finished.
+    while (reader_->Read(&chunk_)) {
+    }
+    status_ = reader_->Finish();
+    finished_ = true;
+  }
+  return status_;
+}
+
+// SetValueStream starts setting a value for the key in chunks.
+std::unique_ptr<KeyValueStoreClient::ValueWriter>
+KeyValueStoreClient::SetValueStream(std::string key) {
+  return std::make_unique<ValueWriter>(
+      stub(leader_.load(std::memory_order_relaxed)), std::move(key));
+}
+
+// GetValueStream starts reading a value for the key in chunks.
+std::unique_ptr<KeyValueStoreClient::ValueReader>
+KeyValueStoreClient::GetValueStream(std::string key) {
+  keyvaluestore::GetValueRequest request;
+  request.set_key(std::move(key));
+  // Values set in chunks are not replicated.
+  return std::make_unique<ValueReader>(
+      stub(leader_.load(std::memory_order_relaxed)), request);
+}
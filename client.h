@@ -4,39 +4,546 @@
 // See https://llvm.org/LICENSE.txt for license information.
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 
+#ifndef KVS_CLIENT_H
+#define KVS_CLIENT_H
+
+#include <grpcpp/generic/generic_stub.h>
 #include <grpcpp/grpcpp.h>
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "cache.h"
+#include "codec.h"
+#include "inproc.h"
 #include "keyvaluestore.grpc.pb.h"
+#include "log.h"
+#include "shm.h"
 
 //------------------------------------------------------------------------------
 // Client Class
 //------------------------------------------------------------------------------
 
+struct KeyValueStoreClientOptions {
+  // Budget of the cache of the values this client has read or set. Zero
+  // disables the cache.
+  size_t cache_max_entries = 4096;
+  size_t cache_max_bytes = 64 << 20;
+  // How long calls keep trying the other replicas of a server that is down
+  // or is no longer the leader.
+  std::chrono::milliseconds failover_timeout = std::chrono::seconds(10);
+  // How much longer than its timeout a call that has one waits for the
+  // server, to cover connecting and the round trip. The call's deadline
+  // passes after that, and the server stops waiting for it as well.
+  std::chrono::milliseconds connection_timeout = std::chrono::seconds(1);
+  // Sets the process-wide log level if present.
+  std::optional<LogLevel> log_level;
+  // Connections to each replica, which calls are spread over round-robin so
+  // that a busy client is not held to the concurrent stream limit of a single
+  // HTTP/2 connection.
+  size_t channels_per_replica = 1;
+  // How often an idle connection is pinged to detect a dead server or a
+  // dropped connection, or never if it is zero, and how long a ping may go
+  // unanswered before the connection is closed. Servers refuse pings more
+  // often than every kMinKeepaliveTime.
+  std::chrono::milliseconds keepalive_time = std::chrono::milliseconds(0);
+  std::chrono::milliseconds keepalive_timeout = std::chrono::seconds(20);
+  // Largest message the client sends or receives, or gRPC's default if zero.
+  int max_message_size = 0;
+  // Values of at least `compression_threshold` bytes are compressed with
+  // `compression` before they are sent, see codec.h. Values that other
+  // clients compressed are decompressed whatever the codec of this one.
+  Codec compression = Codec::kNone;
+  size_t compression_threshold = 4096;
+  // Sends and returns the values as the server stores them, framed or not,
+  // as a proxy does to pass on the values of its clients.
+  bool raw_values = false;
+  // The shared memory segment of a server on the same host, which GetValue
+  // and GetValueView read the published values from without a round trip.
+  // Only for a client of that one server.
+  std::shared_ptr<SharedMemoryReader> shared_memory;
+  // A server in the same process, which GetValue, SetValue, MultiGetValue,
+  // MultiSetValue, Barrier and Add call into directly unless
+  // direct_in_process is false. The other calls go through the channel, see
+  // InProcessServer. Only for a client of that one server.
+  std::shared_ptr<InProcessServer> in_process;
+  bool direct_in_process = true;
+};
+
+// The shortest keepalive interval that servers accept from clients.
+constexpr auto kMinKeepaliveTime = std::chrono::seconds(1);
+
+// Creates `options.channels_per_replica` channels to `address` with the
+// connection settings of `options`. Each channel has a connection of its own
+// instead of sharing one with the channels of the same settings. For an
+// in-process server, see InProcessServer, returns its one channel instead.
+std::vector<std::shared_ptr<grpc::Channel>> CreateChannelPool(
+    const std::string& address, const KeyValueStoreClientOptions& options);
+
+// Starts connecting every channel and waits until all of them are connected
+// or `deadline` passes, so that the first calls don't pay for connecting.
+// Returns the number of channels that are not connected.
+size_t WarmUpChannels(
+    const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+    std::chrono::system_clock::time_point deadline);
+
 class KeyValueStoreClient {
  public:
-  explicit KeyValueStoreClient(std::shared_ptr<grpc::Channel> channel)
-      : stub_(keyvaluestore::KeyValueStore::NewStub(channel)) {}
+  explicit KeyValueStoreClient(
+      std::shared_ptr<grpc::Channel> channel,
+      const KeyValueStoreClientOptions& options = KeyValueStoreClientOptions())
+      : KeyValueStoreClient(
+            std::vector<std::shared_ptr<grpc::Channel>>{std::move(channel)},
+            options) {}
+  // A client of the replicas of a server, one channel each. Writes go to
+  // the leader and reads to any replica, and calls that find a replica down
+  // or no longer the leader are retried on the others; see Failover for the
+  // writes that are not.
+  explicit KeyValueStoreClient(
+      const std::vector<std::shared_ptr<grpc::Channel>>& replicas,
+      const KeyValueStoreClientOptions& options = KeyValueStoreClientOptions());
+  // Like above, with a pool of channels per replica, see CreateChannelPool.
+  explicit KeyValueStoreClient(
+      const std::vector<std::vector<std::shared_ptr<grpc::Channel>>>& replicas,
+      const KeyValueStoreClientOptions& options = KeyValueStoreClientOptions());
   KeyValueStoreClient(const KeyValueStoreClient&) = delete;
   KeyValueStoreClient(KeyValueStoreClient&&) = delete;
   KeyValueStoreClient& operator=(const KeyValueStoreClient&) = delete;
   KeyValueStoreClient&& operator=(KeyValueStoreClient&&) = delete;
 
-  // GetValue gets a value for the requested key.
+  // GetValue gets a value for the requested key, from the cache if this
+  // client has read or set it before. The server waits for the key to be set
+  // for up to `timeout_ms`, or for its own timeout if it is zero. With shared
+  // memory, it waits for the key there instead, as long as the server keeps
+  // publishing.
   grpc::Status GetValue(
       std::string key, std::string& value,
-      std::chrono::milliseconds timeout_ms = std::chrono::milliseconds(3000));
+      std::chrono::milliseconds timeout_ms = std::chrono::milliseconds(0));
+
+  // A value that borrows the buffer gRPC received it into, see GetValueView.
+  class ValueView {
+   public:
+    const char* data() const { return value_.data(); }
+    size_t size() const { return value_.size(); }
+
+   private:
+    friend class KeyValueStoreClient;
+    grpc::Slice slice_;
+    // Keeps the segment mapped if the value was read from shared memory.
+    std::shared_ptr<SharedMemoryReader> shared_memory_;
+    // Holds the value if it was compressed.
+    std::shared_ptr<const std::string> decoded_;
+    std::string_view value_;
+  };
+
+  // GetValueView gets a value for the requested key without copying it out of
+  // the receive buffer, except to join a value that arrived in several slices.
+  // Unlike GetValue, it bypasses the cache. A value found in shared memory
+  // is not copied at all, and a compressed value is decompressed into a
+  // buffer of its own.
+  grpc::Status GetValueView(std::string key, ValueView& value);
 
   // SetValue sets a value for the key. Updating (Setting a value for an
-  // existing key) is not supported by the server.
-  grpc::Status SetValue(std::string key, std::string value);
+  // existing key) is not supported by the server. When the call is retried
+  // on the next leader, a key that holds the same value already counts as
+  // set, since the failed leader may have taken it. Unless `timeout` is zero,
+  // it fails with DEADLINE_EXCEEDED if the server has not taken the value by
+  // then.
+  grpc::Status SetValue(
+      std::string key, std::string value,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+  // MultiGetValue gets the values for `keys` in one round trip. It waits until
+  // every key is set, or with `wait_for_any` until at least one of them is.
+  // `values` gets one entry per key, which is std::nullopt if the key is not
+  // set yet. Like GetValue, the server waits up to `timeout`, or its own
+  // timeout if it is zero.
+  grpc::Status MultiGetValue(
+      const std::vector<std::string>& keys,
+      std::vector<std::optional<std::string>>& values,
+      bool wait_for_any = false,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+  // MultiSetValue sets the values for several keys in one round trip. Keys
+  // that don't exist yet are set even if others already exist.
+  grpc::Status MultiSetValue(
+      const std::vector<std::pair<std::string, std::string>>& key_values);
+
+  // Barrier blocks until `world_size` callers have arrived at the barrier
+  // `name`, or until `timeout` runs out; the server's timeout is used if it is
+  // zero. The same name can be reused for consecutive rounds.
+  grpc::Status Barrier(std::string name, int64_t world_size,
+                       std::chrono::milliseconds timeout =
+                           std::chrono::milliseconds(0));
+
+  // Add atomically adds `delta` to the counter `key`, which starts at zero,
+  // and stores the new value to `value`. Counters are separate from the keys
+  // set with SetValue.
+  grpc::Status Add(std::string key, int64_t delta, int64_t& value);
+
+  // OpenNamespace opens the namespace `name` on the server, under which the
+  // keys named "<name>/..." and set from now on can be dropped together, or
+  // renews its lease if it is open. The server drops the namespace `ttl`
+  // after the last call, unless `ttl` is zero. `opened` tells whether the
+  // namespace was not open yet.
+  grpc::Status OpenNamespace(std::string name, std::chrono::milliseconds ttl,
+                             bool& opened);
+
+  // DropNamespace drops the keys of a namespace from the server and closes it.
+  // The values this client has cached are dropped as well. `dropped` tells
+  // whether the namespace was open.
+  grpc::Status DropNamespace(std::string name, bool& dropped);
+
+  // GetStats fetches the server's counters and latency histograms.
+  grpc::Status GetStats(keyvaluestore::GetStatsResponse& stats);
+
+  // A stream of the key/value pairs under a prefix, see WatchPrefix.
+  class PrefixWatch {
+   public:
+    PrefixWatch(keyvaluestore::KeyValueStore::Stub* stub,
+                const keyvaluestore::WatchPrefixRequest& request,
+                bool decode_values);
+    PrefixWatch(const PrefixWatch&) = delete;
+    PrefixWatch& operator=(const PrefixWatch&) = delete;
+    // Cancels the stream if it has not ended yet.
+    ~PrefixWatch();
+
+    // Next blocks until the next key/value pair arrives. It returns false once
+    // the stream has ended, and Finish then tells why.
+    bool Next(std::string& key, std::string& value);
+
+    // Finish waits for the stream to end, dropping the pairs that have not
+    // been read, and returns the status the stream ended with.
+    grpc::Status Finish();
+
+    // Cancel ends the stream. Unlike the other methods, it may be called
+    // while another thread is blocked in Next.
+    void Cancel() { context_.TryCancel(); }
+
+   private:
+    grpc::ClientContext context_;
+    std::unique_ptr<grpc::ClientReader<keyvaluestore::KeyValue>> reader_;
+    keyvaluestore::KeyValue key_value_;
+    bool decode_values_;
+    bool finished_ = false;
+    grpc::Status status_;
+  };
+
+  // The keys under a prefix in ascending order, see ListKeys.
+  class KeyList {
+   public:
+    KeyList(keyvaluestore::KeyValueStore::Stub* stub,
+            const keyvaluestore::ListKeysRequest& request, bool decode_values);
+    KeyList(const KeyList&) = delete;
+    KeyList& operator=(const KeyList&) = delete;
+    // Cancels the stream if it has not ended yet.
+    ~KeyList();
+
+    // Next blocks until the next key arrives, and its value if the list was
+    // asked for values. It returns false once the stream has ended, and
+    // Finish then tells why.
+    bool Next(std::string& key, std::string& value);
+
+    // Finish waits for the stream to end, dropping the keys that have not
+    // been read, and returns the status the stream ended with.
+    grpc::Status Finish();
+
+    // Cancel ends the stream. Unlike the other methods, it may be called
+    // while another thread is blocked in Next.
+    void Cancel() { context_.TryCancel(); }
+
+   private:
+    grpc::ClientContext context_;
+    std::unique_ptr<grpc::ClientReader<keyvaluestore::ListKeysResponse>>
+        reader_;
+    // The page being read, and the position of the next key in it.
+    keyvaluestore::ListKeysResponse page_;
+    int next_ = 0;
+    bool decode_values_;
+    bool finished_ = false;
+    grpc::Status status_;
+  };
+
+  // A value being set in chunks, see SetValueStream.
+  class ValueWriter {
+   public:
+    ValueWriter(keyvaluestore::KeyValueStore::Stub* stub, std::string key);
+    ValueWriter(const ValueWriter&) = delete;
+    ValueWriter& operator=(const ValueWriter&) = delete;
+    // Cancels the stream if it has not been finished, so no value is set.
+    ~ValueWriter();
+
+    // Write sends `size` bytes of the value, split into chunks of at most
+    // kMaxChunkSize bytes. It blocks while the server is behind, so at most a
+    // chunk is buffered. Returns false if the stream is broken, and Finish
+    // then tells why.
+    bool Write(const char* data, size_t size);
+
+    // Finish ends the value and returns whether it was set.
+    grpc::Status Finish();
+
+   private:
+    grpc::ClientContext context_;
+    keyvaluestore::SetValueResponse response_;
+    std::unique_ptr<grpc::ClientWriter<keyvaluestore::ValueChunk>> writer_;
+    std::string key_;
+    bool sent_key_ = false;
+    bool finished_ = false;
+    grpc::Status status_;
+  };
+
+  // A value being read in chunks, see GetValueStream.
+  class ValueReader {
+   public:
+    ValueReader(keyvaluestore::KeyValueStore::Stub* stub,
+                const keyvaluestore::GetValueRequest& request);
+    ValueReader(const ValueReader&) = delete;
+    ValueReader& operator=(const ValueReader&) = delete;
+    // Cancels the stream if it has not ended yet.
+    ~ValueReader();
+
+    // Read blocks until the next chunk of the value arrives. It returns false
+    // once the stream has ended, and Finish then tells why.
+    bool Read(std::string& chunk);
+
+    // Finish waits for the stream to end, dropping the chunks that have not
+    // been read, and returns the status the stream ended with.
+    grpc::Status Finish();
+
+   private:
+    grpc::ClientContext context_;
+    std::unique_ptr<grpc::ClientReader<keyvaluestore::ValueChunk>> reader_;
+    keyvaluestore::ValueChunk chunk_;
+    bool finished_ = false;
+    grpc::Status status_;
+  };
+
+  // The largest chunk a ValueWriter sends, well below gRPC's default message
+  // size limit.
+  static constexpr size_t kMaxChunkSize = 1 << 20;
+
+  // SetValueStream starts setting a value for the key in chunks, so that
+  // values beyond the message size limit can be set with bounded memory. The
+  // value is set once the writer is finished. Values set this way are kept
+  // apart from the ones set with SetValue and are read with GetValueStream.
+  std::unique_ptr<ValueWriter> SetValueStream(std::string key);
+
+  // GetValueStream starts reading the value set by SetValueStream for the
+  // key in chunks. The first Read blocks until the value is set.
+  std::unique_ptr<ValueReader> GetValueStream(std::string key);
+
+  // WatchPrefix streams every key/value pair under `prefix` over a single
+  // RPC: the keys that are already set first, then each key as it is set. The
+  // stream ends after `max_keys` keys if it is positive.
+  std::unique_ptr<PrefixWatch> WatchPrefix(std::string prefix,
+                                           int64_t max_keys = 0);
+
+  // ListKeys lists the keys set with SetValue or MultiSetValue that start with
+  // `prefix` and sort after `start_after`, in ascending order, so that a
+  // listing can go on from the last key it got. The stream ends after `limit`
+  // keys if it is positive. The server sends the keys in pages, and reads
+  // each page from its map once the previous one has been sent, so listing
+  // any number of keys takes bounded memory on both ends. The values come
+  // with the keys if `with_values` is set.
+  std::unique_ptr<KeyList> ListKeys(std::string prefix,
+                                    std::string start_after = "",
+                                    int64_t limit = 0,
+                                    bool with_values = false);
+
+  // Tracks which replica a call is sent to, and whether to retry it on
+  // another one after it failed.
+  class Failover {
+   public:
+    // Writes are sent to the leader. Those that are not idempotent, such as
+    // Add and Barrier, are only retried when a follower refused them, since a
+    // replica that went down may have applied them already. Write-once values
+    // are retried, as a repeated set of the same value succeeds.
+    enum Kind { kRead, kWrite, kNonIdempotentWrite };
+
+    // Starts at the leader for writes, or at the next replica in turn for
+    // reads.
+    Failover(KeyValueStoreClient* client, Kind kind);
+
+    // The replica to send the next attempt to.
+    size_t replica() const { return replica_; }
+
+    // Whether the next attempt repeats one sent to another replica.
+    bool retried() const { return attempts_ > 0; }
+
+    // Returns whether `status` says that the replica is down or is not the
+    // leader, so that the call can be retried on another replica.
+    bool CanRetry(const grpc::Status& status) const;
+
+    // Returns whether to retry after an attempt failed with `status`, and
+    // moves on to the next replica if so. Backs off once every replica has
+    // been tried, until the failover timeout runs out.
+    bool Retry(const grpc::Status& status);
+
+    // Like Retry(), but leaves the backing off to the caller: `backoff` is set
+    // to how long to wait before the next attempt, zero if it can start now.
+    bool Next(const grpc::Status& status, std::chrono::milliseconds* backoff);
+
+   private:
+    // Moves on to the next replica, and to the next leader for writes.
+    void MoveOn();
+
+    KeyValueStoreClient* client_;
+    const Kind kind_;
+    size_t replica_;
+    size_t attempts_ = 0;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::milliseconds backoff_;
+  };
+
+  // The outcome of a GetValueAsync call.
+  struct GetValueResult {
+    grpc::Status status;
+    std::string value;
+  };
+
+  // GetValueAsync starts getting a value for the requested key without
+  // blocking. Any number of calls can be in flight on the channel at the same
+  // time. `done` is called on a gRPC thread when the RPC completes, or before
+  // it returns if the value is cached. Like GetValue, it checks and fills the
+  // cache and fails over to another replica, backing off on an alarm
+  // instead of a sleep. With an in-process server it always goes through the
+  // channel, since calling into the server directly would block.
+  void GetValueAsync(std::string key,
+                     std::function<void(grpc::Status, std::string)> done);
+  std::future<GetValueResult> GetValueAsync(std::string key);
+
+  // SetValueAsync starts setting a value for the key without blocking. It
+  // fails over like GetValueAsync, and calls into an in-process server
+  // directly like SetValue, in which case `done` is called before it returns.
+  void SetValueAsync(std::string key, std::string value,
+                     std::function<void(grpc::Status)> done);
+  std::future<grpc::Status> SetValueAsync(std::string key, std::string value);
+
+  // MultiGetValueAsync starts a MultiGetValue call on `replica` without
+  // blocking. `context` must outlive the call and can cancel it, and its
+  // deadline is up to the caller, see CallDeadline. `done` is called on a
+  // gRPC thread when the RPC completes, after the values found are cached.
+  // Retrying is up to the caller, see Failover.
+  using MultiGetValueDone = std::function<void(
+      grpc::Status, std::vector<std::optional<std::string>>)>;
+  void MultiGetValueAsync(grpc::ClientContext* context, size_t replica,
+                          const std::vector<std::string>& keys,
+                          bool wait_for_any, std::chrono::milliseconds timeout,
+                          MultiGetValueDone done);
+
+  // MultiSetValueAsync starts a MultiSetValue call without blocking, like
+  // MultiGetValueAsync. `retried` is Failover::retried() for the attempt.
+  void MultiSetValueAsync(
+      grpc::ClientContext* context, size_t replica, bool retried,
+      const std::vector<std::pair<std::string, std::string>>& key_values,
+      std::function<void(grpc::Status)> done);
+  // Like above, failing over like MultiSetValue.
+  void MultiSetValueAsync(
+      std::vector<std::pair<std::string, std::string>> key_values,
+      std::function<void(grpc::Status)> done);
+
+  // BarrierAsync and AddAsync start a Barrier or Add call without blocking,
+  // failing over like the blocking calls. A barrier always goes through the
+  // channel, like GetValueAsync, while an in-process Add is done before it
+  // returns.
+  void BarrierAsync(std::string name, int64_t world_size,
+                    std::chrono::milliseconds timeout,
+                    std::function<void(grpc::Status)> done);
+  void AddAsync(std::string key, int64_t delta,
+                std::function<void(grpc::Status, int64_t value)> done);
+
+  // The cache of the values read by GetValue and MultiGetValue, and set by
+  // SetValue.
+  ValueCache* cache() { return &cache_; }
+
+  // The deadline of a call that may wait up to `timeout` on the server, or
+  // none if `timeout` is zero.
+  std::optional<std::chrono::system_clock::time_point> CallDeadline(
+      std::chrono::milliseconds timeout) const;
 
  private:
-  std::unique_ptr<keyvaluestore::KeyValueStore::Stub> stub_;
+  // A channel of the pool of a replica.
+  struct Channel {
+    std::unique_ptr<keyvaluestore::KeyValueStore::Stub> stub;
+    // Sends requests whose responses are parsed in place.
+    std::unique_ptr<grpc::GenericStub> generic_stub;
+  };
+  using Replica = std::vector<Channel>;
+
+  // Runs `attempt` on the replica that a Failover picks, then on the next
+  // ones while it fails in a way that Failover retries, and calls `done` with
+  // the last status.
+  using AsyncAttempt =
+      std::function<void(size_t replica, bool retried,
+                         std::function<void(grpc::Status)> attempt_done)>;
+  void FailoverAsync(Failover::Kind kind, AsyncAttempt attempt,
+                     std::function<void(grpc::Status)> done);
+
+  // Returns the next channel of the replica's pool.
+  Channel& channel(size_t replica) {
+    if (in_process_ && in_process_->closed()) {
+      return closed_channel_;
+    }
+    Replica& channels = replicas_[replica];
+    if (channels.size() == 1) {
+      return channels[0];
+    }
+    return channels[next_channel_.fetch_add(1, std::memory_order_relaxed) %
+                    channels.size()];
+  }
+
+  keyvaluestore::KeyValueStore::Stub* stub(size_t replica) {
+    return channel(replica).stub.get();
+  }
+
+  // A single server is waited for while it is unreachable, as it may still be
+  // starting up. Replicas fail fast instead, so the others can be tried.
+  bool wait_for_ready() const { return replicas_.size() == 1; }
+
+  // Stores the frame of `value` to `encoded` and returns true if it has to be
+  // sent framed, see EncodeValue.
+  bool Encode(std::string_view value, std::string* encoded) const {
+    return !raw_values_ &&
+           EncodeValue(value, compression_, compression_threshold_, encoded);
+  }
+
+  // Unpacks a value received from the server. Returns DATA_LOSS if it is a
+  // damaged frame.
+  grpc::Status Decode(std::string* value) const;
+
+  // Points `value` to the value of the view, decoded into `value.decoded_`
+  // if it is framed.
+  grpc::Status Decode(ValueView& value) const;
+
+  std::vector<Replica> replicas_;
+  const std::chrono::milliseconds failover_timeout_;
+  const std::chrono::milliseconds connection_timeout_;
+  const Codec compression_;
+  const size_t compression_threshold_;
+  const bool raw_values_;
+  // The replica that writes are sent to, as far as this client knows.
+  std::atomic<size_t> leader_{0};
+  // Spreads reads across the replicas.
+  std::atomic<size_t> next_reader_{0};
+  // Spreads calls across the channels of each replica.
+  std::atomic<size_t> next_channel_{0};
   // cache for key/value
-  std::unordered_map<std::string, std::string> kv_map;
+  ValueCache cache_;
+  std::shared_ptr<SharedMemoryReader> shared_memory_;
+  std::shared_ptr<InProcessServer> in_process_;
+  // Whether the calls that in_process_ serves skip its channel.
+  const bool direct_;
+  // Stands in for the channel of in_process_ once it shut down.
+  Channel closed_channel_;
 };
+
+#endif  // KVS_CLIENT_H
@@ -4,7 +4,24 @@
 // See https://llvm.org/LICENSE.txt for license information.
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 
+// Ahead of gtest, which brings in the WAIT_ANY macro of <sys/wait.h>.
+#include "keyvaluestore.grpc.pb.h"
+
 #include <gtest/gtest.h>
+#include <grpcpp/grpcpp.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "kvs.h"
 
@@ -13,13 +30,19 @@ namespace {
 
 class ClientServerTest : public ::testing::Test {
  public:
-  void StartServer(const std::string& server_addr) {
-    kvs_server_ = nullptr;
-    kvs_server_config_t config = {.timeout_ms = 100};
+  void StartServer(const std::string& server_addr,
+                   long long timeout_ms = 100) {
+    kvs_server_config_t config = {.timeout_ms = timeout_ms};
+    StartServer(server_addr, config);
+  }
 
+  void StartServer(const std::string& server_addr,
+                   kvs_server_config_t config) {
+    kvs_server_ = nullptr;
     kvs_status_t status =
         kvs_server_create(&kvs_server_, "localhost:50051", &config);
     EXPECT_EQ(status, KVS_STATUS_OK);
+    stop_is_already_called_ = false;
   }
 
   void Stop() {
@@ -32,8 +55,10 @@ class ClientServerTest : public ::testing::Test {
 
   void TearDown() override { Stop(); }
 
+  kvs_server_t* server() { return kvs_server_; }
+
  private:
-  kvs_server_t* kvs_server_;
+  kvs_server_t* kvs_server_ = nullptr;
   bool stop_is_already_called_ = false;
 };
 
@@ -137,5 +162,2120 @@ TEST_F(ClientServerTest, GetValueTimeOut) {
   kvs_client_destroy(&kvs_client);
 }
 
+// Checks that a get waits as long as it asks for rather than for the server's
+// timeout, and that the server stops waiting for calls that are cancelled or
+// past their deadline.
+void RunRequestTimeouts(kvs_server_t* server) {
+  kvs_client_t* client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 100};
+  ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  char value[128];
+  const char key[] = "key";
+  const char value1[] = "value1";
+
+  // The server's timeout is 3 s.
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(kvs_client_get_with_timeout(client, key, sizeof(key), value,
+                                        sizeof(value), /*timeout_ms=*/50),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(50));
+  EXPECT_LT(elapsed, std::chrono::seconds(1));
+  EXPECT_EQ(kvs_client_get_with_timeout(client, key, sizeof(key), value,
+                                        sizeof(value), /*timeout_ms=*/-1),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  // So does a batched get.
+  const char* keys[] = {key};
+  const int key_lens[] = {sizeof(key)};
+  char* values[] = {value};
+  const int value_lens[] = {sizeof(value)};
+  int found[1] = {};
+  start = std::chrono::steady_clock::now();
+  EXPECT_EQ(kvs_client_multi_get_with_timeout(
+                client, 1, keys, key_lens, values, value_lens, found,
+                /*value_sizes=*/nullptr, KVS_WAIT_ALL, /*timeout_ms=*/50),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(50));
+  EXPECT_LT(elapsed, std::chrono::seconds(1));
+  EXPECT_EQ(kvs_client_get_with_timeout(client, key, sizeof(key), value,
+                                        /*value_len=*/-1, /*timeout_ms=*/0),
+            KVS_STATUS_INVALID_ARGUMENT);
+  EXPECT_EQ(kvs_client_set_with_timeout(client, key, sizeof(key), nullptr, 1,
+                                        /*timeout_ms=*/0),
+            KVS_STATUS_INVALID_ARGUMENT);
+  EXPECT_EQ(kvs_client_set_with_timeout(nullptr, key, sizeof(key), value1,
+                                        sizeof(value1), /*timeout_ms=*/0),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  // A waiting call is dropped as soon as its client cancels it.
+  auto stub = keyvaluestore::KeyValueStore::NewStub(grpc::CreateChannel(
+      "localhost:50051", grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  std::thread waiter([&]() {
+    keyvaluestore::GetValueRequest request;
+    request.set_key(key, sizeof(key));
+    keyvaluestore::GetValueResponse response;
+    EXPECT_EQ(stub->GetValue(&context, request, &response).error_code(),
+              grpc::StatusCode::CANCELLED);
+  });
+  kvs_server_stats_t stats;
+  do {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+  } while (stats.blocked_waiters == 0);
+  start = std::chrono::steady_clock::now();
+  context.TryCancel();
+  waiter.join();
+  do {
+    ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+  } while (stats.blocked_waiters > 0 &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  EXPECT_EQ(stats.blocked_waiters, 0);
+  EXPECT_EQ(stats.cancelled, 1);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(500));
+
+  // The server waits no longer than the deadline of the call.
+  grpc::ClientContext short_context;
+  short_context.set_deadline(std::chrono::system_clock::now() +
+                             std::chrono::milliseconds(50));
+  keyvaluestore::MultiGetValueRequest request;
+  request.add_keys(key, sizeof(key));
+  keyvaluestore::MultiGetValueResponse response;
+  EXPECT_EQ(
+      stub->MultiGetValue(&short_context, request, &response).error_code(),
+      grpc::StatusCode::DEADLINE_EXCEEDED);
+  start = std::chrono::steady_clock::now();
+  do {
+    ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+  } while (stats.blocked_waiters > 0 &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  EXPECT_EQ(stats.blocked_waiters, 0);
+
+  // A set with a timeout succeeds as usual.
+  EXPECT_EQ(kvs_client_set_with_timeout(client, key, sizeof(key), value1,
+                                        sizeof(value1), /*timeout_ms=*/1000),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get_with_timeout(client, key, sizeof(key), value,
+                                        sizeof(value), /*timeout_ms=*/50),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(value, value1);
+
+  kvs_client_destroy(&client);
+}
+
+TEST_F(ClientServerTest, RequestTimeouts) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  RunRequestTimeouts(server());
+}
+
+TEST_F(ClientServerTest, AsyncModeRequestTimeouts) {
+  kvs_server_config_t server_config = {.timeout_ms = 3000, .async_mode = 1};
+  StartServer("127.0.0.1:50051", server_config);
+  RunRequestTimeouts(server());
+}
+
+// Measures the time from SetValue() of a key until every GetValue() blocked on
+// that key returns.
+TEST_F(ClientServerTest, PublishToWakeupLatency) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+
+  constexpr int kNumWaiters = 32;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  std::vector<kvs_client_t*> clients(kNumWaiters + 1, nullptr);
+  for (kvs_client_t*& client : clients) {
+    ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+              KVS_STATUS_OK);
+  }
+
+  const char key[] = "rendezvous";
+  const char value[] = "published";
+  std::atomic<int> num_ok(0);
+  std::vector<std::chrono::steady_clock::time_point> wakeup_times(kNumWaiters);
+  std::vector<std::thread> waiters;
+  for (int i = 0; i < kNumWaiters; ++i) {
+    waiters.emplace_back([&, i]() {
+      char received[128] = {0};
+      if (kvs_client_get(clients[i], key, sizeof(key), received,
+                         sizeof(received)) == KVS_STATUS_OK &&
+          std::string(received) == value) {
+        ++num_ok;
+      }
+      wakeup_times[i] = std::chrono::steady_clock::now();
+    });
+  }
+
+  // Give the waiters time to block on the server before publishing.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  auto publish_time = std::chrono::steady_clock::now();
+  EXPECT_EQ(kvs_client_set(clients[kNumWaiters], key, sizeof(key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  for (std::thread& waiter : waiters) {
+    waiter.join();
+  }
+  EXPECT_EQ(num_ok, kNumWaiters);
+
+  std::vector<double> latencies_us;
+  for (const auto& wakeup_time : wakeup_times) {
+    latencies_us.push_back(
+        std::chrono::duration<double, std::micro>(wakeup_time - publish_time)
+            .count());
+  }
+  std::sort(latencies_us.begin(), latencies_us.end());
+  std::cout << "publish-to-wakeup latency with " << kNumWaiters
+            << " waiters: p50 = " << latencies_us[kNumWaiters / 2]
+            << " us, max = " << latencies_us.back() << " us\n";
+  RecordProperty("p50_latency_us",
+                 static_cast<int>(latencies_us[kNumWaiters / 2]));
+  RecordProperty("max_latency_us", static_cast<int>(latencies_us.back()));
+
+  for (kvs_client_t*& client : clients) {
+    kvs_client_destroy(&client);
+  }
+}
+
+TEST_F(ClientServerTest, AsyncModeSingleClient) {
+  kvs_server_config_t server_config = {.timeout_ms = 100, .async_mode = 1};
+  StartServer("127.0.0.1:50051", server_config);
+
+  kvs_client_t* kvs_client;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  char value[128];
+  const char key1[] = "key1";
+  const char value1[] = "value1";
+  const char key2[] = "key2";
+
+  EXPECT_EQ(
+      kvs_client_set(kvs_client, key1, sizeof(key1), value1, sizeof(value1)),
+      KVS_STATUS_OK);
+  EXPECT_EQ(
+      kvs_client_get(kvs_client, key1, sizeof(key1), value, sizeof(value)),
+      KVS_STATUS_OK);
+  EXPECT_STREQ(value, value1);
+  EXPECT_EQ(
+      kvs_client_set(kvs_client, key1, sizeof(key1), value1, sizeof(value1)),
+      KVS_STATUS_INVALID_USAGE);
+  EXPECT_EQ(
+      kvs_client_get(kvs_client, key2, sizeof(key2), value, sizeof(value)),
+      KVS_STATUS_DEADLINE_EXCEEDED);
+
+  kvs_client_destroy(&kvs_client);
+}
+
+// Blocked GetValue() calls in async mode must not occupy the polling thread,
+// so SetValue() calls for unrelated keys keep going through.
+TEST_F(ClientServerTest, AsyncModeManyBlockedWaiters) {
+  kvs_server_config_t server_config = {
+      .timeout_ms = 3000, .async_mode = 1, .num_polling_threads = 1};
+  StartServer("127.0.0.1:50051", server_config);
+
+  constexpr int kNumWaiters = 64;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  std::vector<kvs_client_t*> clients(kNumWaiters + 1, nullptr);
+  for (kvs_client_t*& client : clients) {
+    ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+              KVS_STATUS_OK);
+  }
+
+  const char key[] = "rendezvous";
+  const char value[] = "published";
+  std::atomic<int> num_ok(0);
+  std::vector<std::thread> waiters;
+  for (int i = 0; i < kNumWaiters; ++i) {
+    waiters.emplace_back([&, i]() {
+      char received[128] = {0};
+      if (kvs_client_get(clients[i], key, sizeof(key), received,
+                         sizeof(received)) == KVS_STATUS_OK &&
+          std::string(received) == value) {
+        ++num_ok;
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  kvs_client_t* setter = clients[kNumWaiters];
+  for (int i = 0; i < 10; ++i) {
+    std::string unrelated_key = "unrelated" + std::to_string(i);
+    EXPECT_EQ(kvs_client_set(setter, unrelated_key.data(),
+                             unrelated_key.size(), value, sizeof(value)),
+              KVS_STATUS_OK);
+  }
+  EXPECT_EQ(num_ok, 0);
+  EXPECT_EQ(kvs_client_set(setter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  for (std::thread& waiter : waiters) {
+    waiter.join();
+  }
+  EXPECT_EQ(num_ok, kNumWaiters);
+
+  for (kvs_client_t*& client : clients) {
+    kvs_client_destroy(&client);
+  }
+}
+
+// Sets and gets several keys in one round trip each, with a second client
+// that is blocked until every key it asks for is set.
+void RunMultiGetMultiSet() {
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&getter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  const char* keys[] = {"key1", "key2", "key3"};
+  const int key_lens[] = {4, 4, 4};
+  const char* set_values[] = {"value1", "value2", "value3"};
+  const int set_value_lens[] = {7, 7, 7};
+  char buffers[3][128];
+  char* values[] = {buffers[0], buffers[1], buffers[2]};
+  const int value_lens[] = {128, 128, 128};
+  int found[3] = {0};
+
+  // Nothing is set yet, so waiting for any of the keys times out.
+  EXPECT_EQ(kvs_client_multi_get(getter, 3, keys, key_lens, values, value_lens,
+                                 found, /*value_sizes=*/nullptr, KVS_WAIT_ANY),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+
+  kvs_status_t get_status = KVS_STATUS_INTERNAL_ERROR;
+  std::thread waiter([&]() {
+    get_status = kvs_client_multi_get(getter, 3, keys, key_lens, values,
+                                      value_lens, found,
+                                      /*value_sizes=*/nullptr, KVS_WAIT_ALL);
+  });
+  EXPECT_EQ(kvs_client_multi_set(setter, 1, keys, key_lens, set_values,
+                                 set_value_lens),
+            KVS_STATUS_OK);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(kvs_client_multi_set(setter, 2, keys + 1, key_lens + 1,
+                                 set_values + 1, set_value_lens + 1),
+            KVS_STATUS_OK);
+  waiter.join();
+  EXPECT_EQ(get_status, KVS_STATUS_OK);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(found[i], 1);
+    EXPECT_STREQ(values[i], set_values[i]);
+  }
+
+  // Setting an existing key fails, but the new key is still set.
+  const char* more_keys[] = {"key1", "key4"};
+  EXPECT_EQ(kvs_client_multi_set(setter, 2, more_keys, key_lens, set_values,
+                                 set_value_lens),
+            KVS_STATUS_INVALID_USAGE);
+  const char* any_keys[] = {"key5", "key4"};
+  found[0] = found[1] = -1;
+  EXPECT_EQ(kvs_client_multi_get(getter, 2, any_keys, key_lens, values,
+                                 value_lens, found, /*value_sizes=*/nullptr,
+                                 KVS_WAIT_ANY),
+            KVS_STATUS_OK);
+  EXPECT_EQ(found[0], 0);
+  EXPECT_EQ(found[1], 1);
+  EXPECT_STREQ(values[1], set_values[1]);
+
+  // Values are cut to the buffers, which tell the size that was not copied.
+  char short_value[4] = {'x', 'x', 'x', 'x'};
+  char* short_values[] = {short_value};
+  const int short_value_lens[] = {sizeof(short_value)};
+  long long value_sizes[1] = {};
+  EXPECT_EQ(kvs_client_multi_get(getter, 1, keys, key_lens, short_values,
+                                 short_value_lens, found, value_sizes,
+                                 KVS_WAIT_ALL),
+            KVS_STATUS_OK);
+  EXPECT_EQ(std::string(short_value, sizeof(short_value)), "valu");
+  EXPECT_EQ(value_sizes[0], set_value_lens[0]);
+  const int negative_value_lens[] = {-1};
+  EXPECT_EQ(kvs_client_multi_get(getter, 1, keys, key_lens, short_values,
+                                 negative_value_lens, found, value_sizes,
+                                 KVS_WAIT_ALL),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+TEST_F(ClientServerTest, MultiGetMultiSet) {
+  kvs_server_config_t server_config = {.timeout_ms = 1000};
+  StartServer("127.0.0.1:50051", server_config);
+  RunMultiGetMultiSet();
+}
+
+TEST_F(ClientServerTest, AsyncModeMultiGetMultiSet) {
+  kvs_server_config_t server_config = {.timeout_ms = 1000, .async_mode = 1};
+  StartServer("127.0.0.1:50051", server_config);
+  RunMultiGetMultiSet();
+}
+
+// Publishes its own keys while prefetching the peers' keys, with every request
+// in flight on a single client at the same time.
+TEST_F(ClientServerTest, AsyncRequests) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+
+  kvs_client_t* kvs_client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  constexpr int kNumKeys = 32;
+  std::vector<std::string> keys, values;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    values.push_back("value" + std::to_string(i));
+  }
+  std::vector<std::vector<char>> received(kNumKeys, std::vector<char>(128, 0));
+  std::vector<kvs_request_t*> gets(kNumKeys, nullptr);
+  for (int i = 0; i < kNumKeys; ++i) {
+    ASSERT_EQ(kvs_client_get_async(kvs_client, keys[i].data(), keys[i].size(),
+                                   received[i].data(), received[i].size(),
+                                   &gets[i]),
+              KVS_STATUS_OK);
+  }
+  // None of the keys is set yet.
+  EXPECT_EQ(kvs_request_test(&gets[0]), KVS_STATUS_IN_PROGRESS);
+  EXPECT_NE(gets[0], nullptr);
+
+  std::vector<kvs_request_t*> sets(kNumKeys, nullptr);
+  for (int i = 0; i < kNumKeys; ++i) {
+    ASSERT_EQ(kvs_client_set_async(kvs_client, keys[i].data(), keys[i].size(),
+                                   values[i].data(), values[i].size(),
+                                   &sets[i]),
+              KVS_STATUS_OK);
+  }
+  for (int i = 0; i < kNumKeys; ++i) {
+    EXPECT_EQ(kvs_request_wait(&sets[i]), KVS_STATUS_OK);
+    EXPECT_EQ(sets[i], nullptr);
+  }
+  for (int i = 0; i < kNumKeys; ++i) {
+    EXPECT_EQ(kvs_request_wait(&gets[i]), KVS_STATUS_OK);
+    EXPECT_EQ(std::string(received[i].data()), values[i]);
+  }
+
+  kvs_request_t* request = nullptr;
+  ASSERT_EQ(kvs_client_set_async(kvs_client, keys[0].data(), keys[0].size(),
+                                 values[0].data(), values[0].size(), &request),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_request_wait(&request), KVS_STATUS_INVALID_USAGE);
+
+  kvs_client_destroy(&kvs_client);
+}
+
+TEST_F(ClientServerTest, WatchPrefix) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* watcher = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&watcher, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  auto set = [&](const std::string& key, const std::string& value) {
+    EXPECT_EQ(kvs_client_set(setter, key.data(), key.size(), value.data(),
+                             value.size()),
+              KVS_STATUS_OK);
+  };
+  set("job/rank0", "addr0");
+  set("job/rank1", "addr1");
+  set("other/rank0", "other");
+
+  const char prefix[] = "job/";
+  kvs_watch_t* watch = nullptr;
+  ASSERT_EQ(kvs_client_watch_prefix(watcher, prefix, sizeof(prefix) - 1,
+                                    /*max_keys=*/4, &watch),
+            KVS_STATUS_OK);
+  // An unlimited watch that is destroyed before it ends.
+  kvs_watch_t* cancelled_watch = nullptr;
+  ASSERT_EQ(kvs_client_watch_prefix(watcher, prefix, sizeof(prefix) - 1,
+                                    /*max_keys=*/0, &cancelled_watch),
+            KVS_STATUS_OK);
+
+  std::thread publisher([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    set("other/rank1", "other");
+    set("job/rank2", "addr2");
+    set("job/rank3", "addr3");
+  });
+
+  std::map<std::string, std::string> received;
+  char key[128], value[128];
+  for (int i = 0; i < 4; ++i) {
+    int key_len = sizeof(key), value_len = sizeof(value);
+    ASSERT_EQ(kvs_watch_next(watch, key, &key_len, value, &value_len),
+              KVS_STATUS_OK);
+    received[std::string(key, key_len)] = std::string(value, value_len);
+  }
+  int key_len = sizeof(key), value_len = sizeof(value);
+  EXPECT_EQ(kvs_watch_next(watch, key, &key_len, value, &value_len),
+            KVS_STATUS_END_OF_STREAM);
+  publisher.join();
+
+  std::map<std::string, std::string> expected = {{"job/rank0", "addr0"},
+                                                 {"job/rank1", "addr1"},
+                                                 {"job/rank2", "addr2"},
+                                                 {"job/rank3", "addr3"}};
+  EXPECT_EQ(received, expected);
+
+  EXPECT_EQ(kvs_watch_destroy(&watch), KVS_STATUS_OK);
+  EXPECT_EQ(kvs_watch_destroy(&cancelled_watch), KVS_STATUS_OK);
+  EXPECT_EQ(cancelled_watch, nullptr);
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&watcher);
+}
+
+TEST_F(ClientServerTest, ListKeys) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  kvs_server_config_t server_config = {.timeout_ms = 3000};
+  kvs_server_t* server2 = nullptr;
+  kvs_server_t* server3 = nullptr;
+  ASSERT_EQ(kvs_server_create(&server2, "localhost:50052", &server_config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_create(&server3, "localhost:50053", &server_config),
+            KVS_STATUS_OK);
+  kvs_client_t* client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(
+                &client, "localhost:50051,localhost:50052,localhost:50053",
+                &config),
+            KVS_STATUS_OK);
+
+  // Enough keys for several pages per server, in no particular order.
+  std::map<std::string, std::string> expected;
+  for (int i = 0; i < 3000; ++i) {
+    int n = (i * 7919) % 3000;
+    std::string key = "job/key" + std::to_string(n);
+    std::string value = "value" + std::to_string(n);
+    ASSERT_EQ(kvs_client_set(client, key.data(), key.size(), value.data(),
+                             value.size()),
+              KVS_STATUS_OK);
+    expected[key] = value;
+  }
+  // Values that take a page each.
+  std::string large(600 << 10, 'x');
+  for (int i = 0; i < 6; ++i) {
+    std::string key = "large/" + std::to_string(i);
+    ASSERT_EQ(kvs_client_set(client, key.data(), key.size(), large.data(),
+                             large.size()),
+              KVS_STATUS_OK);
+  }
+  const char other[] = "jobs";
+  ASSERT_EQ(kvs_client_set(client, other, sizeof(other) - 1, "x", 1),
+            KVS_STATUS_OK);
+  long long count = 0;
+  ASSERT_EQ(kvs_client_add(client, "job/counter", 11, 1, &count),
+            KVS_STATUS_OK);
+
+  std::vector<char> value_buffer(1 << 20);
+  auto list = [&](const std::string& prefix, const std::string& start_after,
+                  long long limit, bool with_values) {
+    std::vector<std::pair<std::string, std::string>> keys;
+    kvs_list_t* list = nullptr;
+    EXPECT_EQ(kvs_client_list_keys(client, prefix.data(), prefix.size(),
+                                   start_after.data(), start_after.size(),
+                                   limit, with_values, &list),
+              KVS_STATUS_OK);
+    char key[128];
+    int key_len = sizeof(key), value_len = value_buffer.size();
+    kvs_status_t status;
+    while ((status = kvs_list_next(list, key, &key_len, value_buffer.data(),
+                                   &value_len)) == KVS_STATUS_OK) {
+      keys.emplace_back(std::string(key, key_len),
+                        std::string(value_buffer.data(), value_len));
+      key_len = sizeof(key);
+      value_len = value_buffer.size();
+    }
+    EXPECT_EQ(status, KVS_STATUS_END_OF_STREAM);
+    EXPECT_EQ(kvs_list_destroy(&list), KVS_STATUS_OK);
+    return keys;
+  };
+
+  // The keys of every server come merged in order, and counters are not
+  // listed.
+  using KeyValues = std::vector<std::pair<std::string, std::string>>;
+  EXPECT_EQ(list("job/", "", 0, true),
+            KeyValues(expected.begin(), expected.end()));
+
+  // Pages of keys only, each going on from the last key of the previous one.
+  std::vector<std::string> paged;
+  std::string start_after;
+  for (;;) {
+    auto page = list("job/", start_after, 500, false);
+    ASSERT_LE(page.size(), 500);
+    for (const auto& [key, value] : page) {
+      EXPECT_EQ(value, "");
+      paged.push_back(key);
+    }
+    if (page.size() < 500) {
+      break;
+    }
+    start_after = page.back().first;
+  }
+  ASSERT_EQ(paged.size(), expected.size());
+  EXPECT_TRUE(std::equal(paged.begin(), paged.end(), expected.begin(),
+                         [](const std::string& key, const auto& pair) {
+                           return key == pair.first;
+                         }));
+
+  // Large values are cut into pages by size.
+  auto large_values = list("large/", "large/0", 0, true);
+  ASSERT_EQ(large_values.size(), 5);
+  EXPECT_EQ(large_values[0].first, "large/1");
+  EXPECT_EQ(large_values[4].second, large);
+
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_GT(stats.rpcs[KVS_RPC_LIST_KEYS].count, 0);
+  int key_len = 0, value_len = 0;
+  EXPECT_EQ(kvs_list_next(nullptr, nullptr, &key_len, nullptr, &value_len),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  kvs_client_destroy(&client);
+  kvs_server_destroy(&server2);
+  kvs_server_destroy(&server3);
+}
+
+// Runs two rounds of a barrier with the same name, where every client counts
+// its arrival, so that no client can pass a round before all have arrived.
+void RunBarrier(const char* addr = "localhost:50051") {
+  constexpr int kNumClients = 8;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  std::vector<kvs_client_t*> clients(kNumClients, nullptr);
+  for (kvs_client_t*& client : clients) {
+    ASSERT_EQ(kvs_client_create(&client, addr, &config), KVS_STATUS_OK);
+  }
+
+  const char name[] = "barrier";
+  const char counter[] = "arrivals";
+  std::vector<kvs_status_t> statuses(kNumClients, KVS_STATUS_INTERNAL_ERROR);
+  std::vector<long long> arrivals_after_barrier(kNumClients, 0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumClients; ++i) {
+    threads.emplace_back([&, i]() {
+      kvs_status_t status = KVS_STATUS_OK;
+      for (int round = 1; round <= 2 && status == KVS_STATUS_OK; ++round) {
+        if (i == 0) {
+          // Arrive late so that the others have to wait.
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        status = kvs_client_add(clients[i], counter, sizeof(counter) - 1,
+                                /*delta=*/1, nullptr);
+        if (status == KVS_STATUS_OK) {
+          status = kvs_client_barrier(clients[i], name, sizeof(name) - 1,
+                                      kNumClients, /*timeout_ms=*/0);
+        }
+        if (status == KVS_STATUS_OK && round == 1) {
+          status = kvs_client_add(clients[i], counter, sizeof(counter) - 1,
+                                  /*delta=*/0, &arrivals_after_barrier[i]);
+        }
+      }
+      statuses[i] = status;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < kNumClients; ++i) {
+    EXPECT_EQ(statuses[i], KVS_STATUS_OK);
+    EXPECT_GE(arrivals_after_barrier[i], kNumClients);
+  }
+
+  // A barrier that nobody else arrives at times out.
+  EXPECT_EQ(kvs_client_barrier(clients[0], name, sizeof(name) - 1,
+                               /*world_size=*/2, /*timeout_ms=*/50),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_EQ(kvs_client_barrier(clients[0], name, sizeof(name) - 1,
+                               /*world_size=*/0, /*timeout_ms=*/0),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  // A client that timed out is counted out, so that when it retries it still
+  // waits for the other one.
+  const char retried[] = "retried";
+  EXPECT_EQ(kvs_client_barrier(clients[0], retried, sizeof(retried) - 1,
+                               /*world_size=*/2, /*timeout_ms=*/50),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  std::atomic<bool> passed = false;
+  std::thread retry([&]() {
+    EXPECT_EQ(kvs_client_barrier(clients[0], retried, sizeof(retried) - 1,
+                                 /*world_size=*/2, /*timeout_ms=*/3000),
+              KVS_STATUS_OK);
+    passed = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(passed);
+  EXPECT_EQ(kvs_client_barrier(clients[1], retried, sizeof(retried) - 1,
+                               /*world_size=*/2, /*timeout_ms=*/3000),
+            KVS_STATUS_OK);
+  retry.join();
+  EXPECT_TRUE(passed);
+
+  for (kvs_client_t*& client : clients) {
+    kvs_client_destroy(&client);
+  }
+}
+
+TEST_F(ClientServerTest, Barrier) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  RunBarrier();
+}
+
+TEST_F(ClientServerTest, AsyncModeBarrier) {
+  kvs_server_config_t server_config = {.timeout_ms = 3000, .async_mode = 1};
+  StartServer("127.0.0.1:50051", server_config);
+  RunBarrier();
+}
+
+TEST_F(ClientServerTest, AddDoesNotTouchValues) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+
+  kvs_client_t* kvs_client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  const char key[] = "counter";
+  long long value = 0;
+  EXPECT_EQ(kvs_client_add(kvs_client, key, sizeof(key) - 1, 5, &value),
+            KVS_STATUS_OK);
+  EXPECT_EQ(value, 5);
+  EXPECT_EQ(kvs_client_add(kvs_client, key, sizeof(key) - 1, -7, &value),
+            KVS_STATUS_OK);
+  EXPECT_EQ(value, -2);
+
+  // The counter has no value, so the key can still be set once.
+  char buffer[16];
+  EXPECT_EQ(kvs_client_get(kvs_client, key, sizeof(key) - 1, buffer,
+                           sizeof(buffer)),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_EQ(kvs_client_set(kvs_client, key, sizeof(key) - 1, "v", 1),
+            KVS_STATUS_OK);
+
+  kvs_client_destroy(&kvs_client);
+}
+
+TEST_F(ClientServerTest, GetValueView) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+
+  kvs_client_t* kvs_client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  // Large enough to arrive in several slices.
+  std::string blob(1 << 20, '\0');
+  for (size_t i = 0; i < blob.size(); ++i) {
+    blob[i] = static_cast<char>(i * 7);
+  }
+  const char blob_key[] = "blob";
+  const char* keys[] = {blob_key};
+  const int key_lens[] = {sizeof(blob_key) - 1};
+  const char* values[] = {blob.data()};
+  const int value_lens[] = {static_cast<int>(blob.size())};
+  ASSERT_EQ(kvs_client_multi_set(kvs_client, 1, keys, key_lens, values,
+                                 value_lens),
+            KVS_STATUS_OK);
+  const char empty_key[] = "empty";
+  ASSERT_EQ(kvs_client_set(kvs_client, empty_key, sizeof(empty_key) - 1, "", 0),
+            KVS_STATUS_OK);
+
+  kvs_value_t* value = nullptr;
+  const char* data = nullptr;
+  long long size = -1;
+  ASSERT_EQ(kvs_client_get_view(kvs_client, blob_key, sizeof(blob_key) - 1,
+                                &value, &data, &size),
+            KVS_STATUS_OK);
+  EXPECT_EQ(std::string(data, size), blob);
+  EXPECT_EQ(kvs_value_release(&value), KVS_STATUS_OK);
+  EXPECT_EQ(value, nullptr);
+
+  ASSERT_EQ(kvs_client_get_view(kvs_client, empty_key, sizeof(empty_key) - 1,
+                                &value, &data, &size),
+            KVS_STATUS_OK);
+  EXPECT_EQ(size, 0);
+  EXPECT_EQ(kvs_value_release(&value), KVS_STATUS_OK);
+
+  const char missing_key[] = "missing";
+  EXPECT_EQ(kvs_client_get_view(kvs_client, missing_key,
+                                sizeof(missing_key) - 1, &value, &data, &size),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_EQ(value, nullptr);
+
+  // A short value doesn't fill the buffer past its end.
+  const char key[] = "short";
+  ASSERT_EQ(kvs_client_set(kvs_client, key, sizeof(key) - 1, "abc", 3),
+            KVS_STATUS_OK);
+  char buffer[8];
+  memset(buffer, 'x', sizeof(buffer));
+  ASSERT_EQ(kvs_client_get(kvs_client, key, sizeof(key) - 1, buffer,
+                           sizeof(buffer)),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(buffer, "abc");
+  EXPECT_EQ(buffer[4], 'x');
+
+  kvs_client_destroy(&kvs_client);
+}
+
+TEST_F(ClientServerTest, ValueStream) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/1000);
+
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&getter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  // Larger than the default 4 MB message size limit.
+  std::string blob(5 << 20, '\0');
+  for (size_t i = 0; i < blob.size(); ++i) {
+    blob[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  const char key[] = "blob";
+
+  // The reader starts before the value is set and waits for it.
+  std::string received;
+  kvs_status_t read_status = KVS_STATUS_INTERNAL_ERROR;
+  std::thread reader_thread([&]() {
+    kvs_reader_t* reader = nullptr;
+    read_status = kvs_client_get_stream(getter, key, sizeof(key) - 1, &reader);
+    char buffer[100000];
+    while (read_status == KVS_STATUS_OK) {
+      long long size = sizeof(buffer);
+      read_status = kvs_reader_read(reader, buffer, &size);
+      received.append(buffer, size);
+    }
+    kvs_reader_destroy(&reader);
+  });
+
+  kvs_writer_t* writer = nullptr;
+  ASSERT_EQ(kvs_client_set_stream(setter, key, sizeof(key) - 1, &writer),
+            KVS_STATUS_OK);
+  // Writes that don't line up with the chunks.
+  size_t offset = 0;
+  for (size_t size : {size_t{1}, size_t{3 << 20}, blob.size()}) {
+    size = std::min(size, blob.size() - offset);
+    ASSERT_EQ(kvs_writer_write(writer, blob.data() + offset, size),
+              KVS_STATUS_OK);
+    offset += size;
+  }
+  EXPECT_EQ(kvs_writer_close(&writer), KVS_STATUS_OK);
+  EXPECT_EQ(writer, nullptr);
+  reader_thread.join();
+  EXPECT_EQ(read_status, KVS_STATUS_END_OF_STREAM);
+  EXPECT_TRUE(received == blob);
+
+  // A value can only be set once.
+  ASSERT_EQ(kvs_client_set_stream(setter, key, sizeof(key) - 1, &writer),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_writer_write(writer, "x", 1), KVS_STATUS_OK);
+  EXPECT_EQ(kvs_writer_close(&writer), KVS_STATUS_INVALID_USAGE);
+
+  // An empty value is set, but an aborted one is not.
+  const char empty_key[] = "empty";
+  ASSERT_EQ(kvs_client_set_stream(setter, empty_key, sizeof(empty_key) - 1,
+                                  &writer),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_writer_close(&writer), KVS_STATUS_OK);
+  const char aborted_key[] = "aborted";
+  ASSERT_EQ(kvs_client_set_stream(setter, aborted_key,
+                                  sizeof(aborted_key) - 1, &writer),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_writer_write(writer, "x", 1), KVS_STATUS_OK);
+  EXPECT_EQ(kvs_writer_abort(&writer), KVS_STATUS_OK);
+
+  kvs_reader_t* reader = nullptr;
+  char buffer[16];
+  long long size = sizeof(buffer);
+  ASSERT_EQ(kvs_client_get_stream(getter, empty_key, sizeof(empty_key) - 1,
+                                  &reader),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_reader_read(reader, buffer, &size), KVS_STATUS_END_OF_STREAM);
+  EXPECT_EQ(size, 0);
+  kvs_reader_destroy(&reader);
+  ASSERT_EQ(kvs_client_get_stream(getter, aborted_key, sizeof(aborted_key) - 1,
+                                  &reader),
+            KVS_STATUS_OK);
+  size = sizeof(buffer);
+  EXPECT_EQ(kvs_reader_read(reader, buffer, &size),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  kvs_reader_destroy(&reader);
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+// Creates an empty directory for a write-ahead log and removes it when done.
+class ScopedWalDir {
+ public:
+  ScopedWalDir() {
+    char dir[] = "/tmp/clientserver_test.XXXXXX";
+    EXPECT_NE(mkdtemp(dir), nullptr);
+    path_ = dir;
+  }
+  ~ScopedWalDir() {
+    std::string command = "rm -rf " + path_;
+    EXPECT_EQ(system(command.c_str()), 0);
+  }
+
+  const char* path() const { return path_.c_str(); }
+
+ private:
+  std::string path_;
+};
+
+TEST_F(ClientServerTest, ValuesSurviveRestart) {
+  ScopedWalDir wal_dir;
+  kvs_server_config_t server_config = {.timeout_ms = 100,
+                                       .wal_dir = wal_dir.path()};
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  const char key[] = "key";
+  const char value[] = "value";
+  for (int restart = 0; restart < 2; ++restart) {
+    StartServer("127.0.0.1:50051", server_config);
+    kvs_client_t* kvs_client = nullptr;
+    ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+              KVS_STATUS_OK);
+    if (restart == 0) {
+      EXPECT_EQ(kvs_client_set(kvs_client, key, sizeof(key), value,
+                               sizeof(value)),
+                KVS_STATUS_OK);
+    } else {
+      char received[16] = {0};
+      EXPECT_EQ(kvs_client_get(kvs_client, key, sizeof(key), received,
+                               sizeof(received)),
+                KVS_STATUS_OK);
+      EXPECT_STREQ(received, value);
+      // Still write-once after the restart.
+      EXPECT_EQ(kvs_client_set(kvs_client, key, sizeof(key), value,
+                               sizeof(value)),
+                KVS_STATUS_INVALID_USAGE);
+    }
+    kvs_client_destroy(&kvs_client);
+    Stop();
+  }
+}
+
+TEST_F(ClientServerTest, ChunkedValuesSurviveRestart) {
+  ScopedWalDir wal_dir;
+  kvs_server_config_t server_config = {.timeout_ms = 100,
+                                       .wal_dir = wal_dir.path()};
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  const char key[] = "blob";
+  std::string blob(3 << 20, '\0');
+  for (size_t i = 0; i < blob.size(); ++i) {
+    blob[i] = static_cast<char>(i * 31);
+  }
+  // The first restart replays the segments, the second one a snapshot.
+  for (int restart = 0; restart < 3; ++restart) {
+    StartServer("127.0.0.1:50051", server_config);
+    kvs_client_t* kvs_client = nullptr;
+    ASSERT_EQ(kvs_client_create(&kvs_client, "localhost:50051", &config),
+              KVS_STATUS_OK);
+    if (restart == 0) {
+      kvs_writer_t* writer = nullptr;
+      ASSERT_EQ(kvs_client_set_stream(kvs_client, key, sizeof(key) - 1,
+                                      &writer),
+                KVS_STATUS_OK);
+      ASSERT_EQ(kvs_writer_write(writer, blob.data(), blob.size()),
+                KVS_STATUS_OK);
+      EXPECT_EQ(kvs_writer_close(&writer), KVS_STATUS_OK);
+    } else {
+      kvs_reader_t* reader = nullptr;
+      ASSERT_EQ(kvs_client_get_stream(kvs_client, key, sizeof(key) - 1,
+                                      &reader),
+                KVS_STATUS_OK);
+      std::string received;
+      std::vector<char> buffer(1 << 20);
+      kvs_status_t status;
+      do {
+        long long size = buffer.size();
+        status = kvs_reader_read(reader, buffer.data(), &size);
+        received.append(buffer.data(), size);
+      } while (status == KVS_STATUS_OK);
+      EXPECT_EQ(status, KVS_STATUS_END_OF_STREAM);
+      EXPECT_TRUE(received == blob);
+      kvs_reader_destroy(&reader);
+    }
+    if (restart == 1) {
+      // Let a snapshot replace the segments for the next restart.
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    kvs_client_destroy(&kvs_client);
+    Stop();
+    server_config.snapshot_interval_ms = 10;
+  }
+}
+
+// A set that repeats one that may have reached a failed leader succeeds if the
+// key holds the same value, with and without a log.
+TEST_F(ClientServerTest, RetriedSets) {
+  ScopedWalDir wal_dir;
+  for (const char* dir : {static_cast<const char*>(nullptr), wal_dir.path()}) {
+    kvs_server_config_t server_config = {.timeout_ms = 100, .wal_dir = dir};
+    StartServer("127.0.0.1:50051", server_config);
+    auto stub = keyvaluestore::KeyValueStore::NewStub(grpc::CreateChannel(
+        "localhost:50051", grpc::InsecureChannelCredentials()));
+    auto set = [&](const std::string& value, bool retried) {
+      grpc::ClientContext context;
+      keyvaluestore::SetValueRequest request;
+      request.set_key("key");
+      request.set_value(value);
+      request.set_retried(retried);
+      keyvaluestore::SetValueResponse response;
+      return stub->SetValue(&context, request, &response).error_code();
+    };
+    EXPECT_EQ(set("value", /*retried=*/true), grpc::StatusCode::OK);
+    EXPECT_EQ(set("value", /*retried=*/true), grpc::StatusCode::OK);
+    EXPECT_EQ(set("value", /*retried=*/false),
+              grpc::StatusCode::ALREADY_EXISTS);
+    EXPECT_EQ(set("other", /*retried=*/true),
+              grpc::StatusCode::ALREADY_EXISTS);
+
+    grpc::ClientContext context;
+    keyvaluestore::MultiSetValueRequest request;
+    for (const char* key : {"key", "new"}) {
+      keyvaluestore::KeyValue* key_value = request.add_key_values();
+      key_value->set_key(key);
+      key_value->set_value("value");
+    }
+    request.set_retried(true);
+    keyvaluestore::MultiSetValueResponse response;
+    EXPECT_TRUE(stub->MultiSetValue(&context, request, &response).ok());
+    Stop();
+  }
+}
+
+// Measures SetValue() latency from concurrent clients with and without the
+// write-ahead log, whose group commit shares each fsync among the clients.
+TEST_F(ClientServerTest, SetLatencyWithDurability) {
+  constexpr int kNumClients = 8;
+  constexpr int kNumSets = 50;
+  ScopedWalDir wal_dir;
+  for (bool durable : {false, true}) {
+    kvs_server_config_t server_config = {.timeout_ms = 3000};
+    if (durable) {
+      server_config.wal_dir = wal_dir.path();
+    }
+    StartServer("127.0.0.1:50051", server_config);
+
+    kvs_client_config_t config = {.connection_timeout_ms = 3000};
+    std::vector<kvs_client_t*> clients(kNumClients, nullptr);
+    for (kvs_client_t*& client : clients) {
+      ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+                KVS_STATUS_OK);
+    }
+    std::vector<std::vector<double>> latencies_us(kNumClients);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kNumClients; ++i) {
+      threads.emplace_back([&, i]() {
+        for (int j = 0; j < kNumSets; ++j) {
+          std::string key = std::to_string(i) + "/" + std::to_string(j);
+          auto start = std::chrono::steady_clock::now();
+          EXPECT_EQ(kvs_client_set(clients[i], key.data(), key.size(), "v", 1),
+                    KVS_STATUS_OK);
+          latencies_us[i].push_back(std::chrono::duration<double, std::micro>(
+                                        std::chrono::steady_clock::now() -
+                                        start)
+                                        .count());
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    std::vector<double> all_latencies_us;
+    for (const auto& client_latencies_us : latencies_us) {
+      all_latencies_us.insert(all_latencies_us.end(),
+                              client_latencies_us.begin(),
+                              client_latencies_us.end());
+    }
+    std::sort(all_latencies_us.begin(), all_latencies_us.end());
+    double p50 = all_latencies_us[all_latencies_us.size() / 2];
+    double p99 = all_latencies_us[all_latencies_us.size() * 99 / 100];
+    std::cout << "set latency with durability " << (durable ? "on" : "off")
+              << ": p50 = " << p50 << " us, p99 = " << p99 << " us\n";
+    std::string prefix = durable ? "durable_" : "volatile_";
+    RecordProperty(prefix + "p50_latency_us", static_cast<int>(p50));
+    RecordProperty(prefix + "p99_latency_us", static_cast<int>(p99));
+
+    for (kvs_client_t*& client : clients) {
+      kvs_client_destroy(&client);
+    }
+    Stop();
+  }
+}
+
+TEST_F(ClientServerTest, ClientCache) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = 2};
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&getter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  const char key[] = "key";
+  char value[16];
+  EXPECT_EQ(kvs_client_set(setter, key, sizeof(key), "value1", 7),
+            KVS_STATUS_OK);
+  // A rejected value is not cached.
+  EXPECT_EQ(kvs_client_set(getter, key, sizeof(key), "value2", 7),
+            KVS_STATUS_INVALID_USAGE);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(kvs_client_get(getter, key, sizeof(key), value, sizeof(value)),
+              KVS_STATUS_OK);
+    EXPECT_STREQ(value, "value1");
+  }
+  kvs_cache_stats_t stats;
+  ASSERT_EQ(kvs_client_get_cache_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.entries, 1);
+
+  // The setter caches its own value.
+  EXPECT_EQ(kvs_client_get(setter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_get_cache_stats(setter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 0);
+
+  // Misses don't cache anything, and erased keys are fetched again.
+  const char missing_key[] = "missing";
+  EXPECT_EQ(kvs_client_get(getter, missing_key, sizeof(missing_key), value,
+                           sizeof(value)),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_EQ(kvs_client_cache_erase(getter, key, sizeof(key)), KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get(getter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_get_cache_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.misses, 3);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(kvs_client_cache_invalidate(getter), KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_get_cache_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.entries, 0);
+
+  // Gets started without blocking use the cache too.
+  for (int i = 0; i < 2; ++i) {
+    kvs_request_t* request = nullptr;
+    ASSERT_EQ(kvs_client_get_async(getter, key, sizeof(key), value,
+                                   sizeof(value), &request),
+              KVS_STATUS_OK);
+    EXPECT_EQ(kvs_request_wait(&request), KVS_STATUS_OK);
+    EXPECT_STREQ(value, "value1");
+  }
+  ASSERT_EQ(kvs_client_get_cache_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.misses, 4);
+  EXPECT_EQ(stats.hits, 3);
+  EXPECT_EQ(stats.entries, 1);
+  kvs_request_t* request = nullptr;
+  EXPECT_EQ(kvs_client_get_async(getter, key, sizeof(key), value,
+                                 /*value_len=*/-1, &request),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  // Values are terminated like those of blocking gets.
+  const char unterminated_key[] = "unterminated";
+  ASSERT_EQ(kvs_client_set(setter, unterminated_key, sizeof(unterminated_key),
+                           "abc", 3),
+            KVS_STATUS_OK);
+  memset(value, 'x', sizeof(value));
+  ASSERT_EQ(kvs_client_get_async(getter, unterminated_key,
+                                 sizeof(unterminated_key), value,
+                                 sizeof(value), &request),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_request_wait(&request), KVS_STATUS_OK);
+  EXPECT_STREQ(value, "abc");
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+// Checks the stats of a server after a blocked get, a timeout and a rejected
+// set.
+void CheckServerStats(kvs_server_t* server) {
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1};
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&getter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  const char key[] = "key";
+  const char value[] = "value";
+  std::thread waiter([&]() {
+    char received[16];
+    EXPECT_EQ(kvs_client_get(getter, key, sizeof(key), received,
+                             sizeof(received)),
+              KVS_STATUS_OK);
+  });
+  kvs_server_stats_t stats;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+    if (stats.blocked_waiters == 1) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(stats.blocked_waiters, 1);
+  EXPECT_EQ(kvs_client_set(setter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  waiter.join();
+
+  char received[16];
+  const char missing_key[] = "missing";
+  EXPECT_EQ(kvs_client_get(getter, missing_key, sizeof(missing_key),
+                           received, sizeof(received)),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_EQ(kvs_client_set(getter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_INVALID_USAGE);
+
+  // The RPC reports the same stats as the server, and counts itself.
+  ASSERT_EQ(kvs_client_get_server_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_GET_VALUE].count, 2);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_SET_VALUE].count, 2);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_MULTI_GET_VALUE].count, 0);
+  EXPECT_GT(stats.rpcs[KVS_RPC_GET_VALUE].max_us, 0);
+  EXPECT_EQ(stats.blocked_waiters, 0);
+  EXPECT_EQ(stats.wait_time.count, 1);
+  EXPECT_EQ(stats.timeouts, 1);
+  EXPECT_EQ(stats.already_exists, 1);
+  EXPECT_EQ(stats.num_keys, 1);
+  EXPECT_EQ(stats.bytes_stored, sizeof(key) + sizeof(value));
+  ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_GET_STATS].count, 1);
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+TEST_F(ClientServerTest, ServerStats) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+  CheckServerStats(server());
+}
+
+TEST_F(ClientServerTest, AsyncModeServerStats) {
+  kvs_server_config_t server_config = {.timeout_ms = 100, .async_mode = 1};
+  StartServer("127.0.0.1:50051", server_config);
+  CheckServerStats(server());
+}
+
+TEST_F(ClientServerTest, Namespaces) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+  kvs_client_t* client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  const char outside_key[] = "config";
+  const char value[] = "value";
+  ASSERT_EQ(kvs_client_set(client, outside_key, sizeof(outside_key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_open_namespace(client, "a/b", 3, 0),
+            KVS_STATUS_INVALID_ARGUMENT);
+  EXPECT_EQ(kvs_client_open_namespace(client, "", 0, 0),
+            KVS_STATUS_INVALID_ARGUMENT);
+  EXPECT_EQ(kvs_client_open_namespace(client, "job", 3, -1),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  // Jobs come and go without the server growing.
+  for (int job = 0; job < 20; ++job) {
+    std::string name = "job" + std::to_string(job);
+    ASSERT_EQ(kvs_client_open_namespace(client, name.data(), name.size(), 0),
+              KVS_STATUS_OK);
+    for (int i = 0; i < 10; ++i) {
+      std::string key = name + "/" + std::to_string(i);
+      ASSERT_EQ(kvs_client_set(client, key.data(), key.size(), value,
+                               sizeof(value)),
+                KVS_STATUS_OK);
+    }
+    std::string key = name + "/0";
+    char received[16];
+    EXPECT_EQ(kvs_client_get(client, key.data(), key.size(), received,
+                             sizeof(received)),
+              KVS_STATUS_OK);
+    ASSERT_EQ(kvs_client_drop_namespace(client, name.data(), name.size()),
+              KVS_STATUS_OK);
+    EXPECT_EQ(kvs_client_get(client, key.data(), key.size(), received,
+                             sizeof(received)),
+              KVS_STATUS_DEADLINE_EXCEEDED);
+  }
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.num_keys, 1);
+  EXPECT_EQ(stats.num_namespaces, 0);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_OPEN_NAMESPACE].count, 22);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_DROP_NAMESPACE].count, 20);
+
+  // A namespace whose lease runs out is dropped by the server.
+  ASSERT_EQ(kvs_client_open_namespace(client, "leased", 6, 50),
+            KVS_STATUS_OK);
+  const char leased_key[] = "leased/key";
+  ASSERT_EQ(kvs_client_set(client, leased_key, sizeof(leased_key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.num_namespaces, 1);
+  EXPECT_EQ(stats.num_keys, 2);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+    if (stats.expired_namespaces == 1) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(stats.expired_namespaces, 1);
+  EXPECT_EQ(stats.num_namespaces, 0);
+  EXPECT_EQ(stats.num_keys, 1);
+
+  kvs_client_destroy(&client);
+}
+
+TEST_F(ClientServerTest, ChannelPool) {
+  kvs_server_config_t server_config = {.timeout_ms = 100,
+                                       .max_message_size = 8 << 20};
+  StartServer("127.0.0.1:50051", server_config);
+  kvs_client_t* client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1,
+                                .channels_per_server = 4,
+                                .keepalive_time_ms = 1000,
+                                .max_message_size = 8 << 20};
+  ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  // Larger than gRPC's default limit.
+  std::string large(6 << 20, 'x');
+  const char large_key[] = "large";
+  ASSERT_EQ(kvs_client_set(client, large_key, sizeof(large_key), large.data(),
+                           large.size()),
+            KVS_STATUS_OK);
+  std::string received(large.size() + 1, '\0');
+  ASSERT_EQ(kvs_client_get(client, large_key, sizeof(large_key),
+                           received.data(), received.size()),
+            KVS_STATUS_OK);
+  EXPECT_EQ(received.substr(0, large.size()), large);
+
+  // Calls from many threads are spread over the channels.
+  constexpr int kNumThreads = 16;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([client, t]() {
+      for (int i = 0; i < 20; ++i) {
+        std::string key = std::to_string(t) + "/" + std::to_string(i);
+        ASSERT_EQ(kvs_client_set(client, key.data(), key.size(), key.data(),
+                                 key.size()),
+                  KVS_STATUS_OK);
+        char value[16];
+        ASSERT_EQ(kvs_client_get(client, key.data(), key.size(), value,
+                                 sizeof(value)),
+                  KVS_STATUS_OK);
+        EXPECT_EQ(std::string(value, key.size()), key);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  kvs_client_destroy(&client);
+
+  // A client of gRPC's default limit can't receive the large value.
+  config.max_message_size = 0;
+  ASSERT_EQ(kvs_client_create(&client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  EXPECT_NE(kvs_client_get(client, large_key, sizeof(large_key),
+                           received.data(), received.size()),
+            KVS_STATUS_OK);
+  kvs_client_destroy(&client);
+}
+
+TEST_F(ClientServerTest, ConnectWarmUpIsBounded) {
+  // Nothing listens on this port.
+  kvs_client_t* client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 200};
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_EQ(kvs_client_create(&client, "localhost:50099", &config),
+            KVS_STATUS_OK);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+  kvs_client_destroy(&client);
+}
+
+TEST_F(ClientServerTest, Compression) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/100);
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1,
+                                .compression = KVS_CODEC_ZLIB};
+  ASSERT_EQ(kvs_client_create(&setter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  // The getter does not compress, but reads compressed values all the same.
+  config.compression = KVS_CODEC_NONE;
+  ASSERT_EQ(kvs_client_create(&getter, "localhost:50051", &config),
+            KVS_STATUS_OK);
+
+  std::string large;
+  for (int i = 0; large.size() < (1 << 20); ++i) {
+    large += "rank " + std::to_string(i) + " on node" +
+             std::to_string(i % 16) + "\n";
+  }
+  const char large_key[] = "large";
+  ASSERT_EQ(kvs_client_set(setter, large_key, sizeof(large_key), large.data(),
+                           large.size()),
+            KVS_STATUS_OK);
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_LT(stats.bytes_stored, large.size() / 4);
+
+  std::string received(large.size() + 1, '\0');
+  ASSERT_EQ(kvs_client_get(getter, large_key, sizeof(large_key),
+                           received.data(), received.size()),
+            KVS_STATUS_OK);
+  EXPECT_EQ(received.substr(0, large.size()), large);
+  kvs_value_t* view = nullptr;
+  const char* data = nullptr;
+  long long size = 0;
+  ASSERT_EQ(kvs_client_get_view(getter, large_key, sizeof(large_key), &view,
+                                &data, &size),
+            KVS_STATUS_OK);
+  EXPECT_EQ(std::string(data, size), large);
+  kvs_value_release(&view);
+
+  // Small values and values that look like compressed ones come back as is.
+  const char small_key[] = "small";
+  const char small[] = "small value";
+  const char tricky_key[] = "tricky";
+  const char tricky[] = "\0KVC\1not a frame";
+  ASSERT_EQ(kvs_client_set(setter, small_key, sizeof(small_key), small,
+                           sizeof(small)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_set(getter, tricky_key, sizeof(tricky_key), tricky,
+                           sizeof(tricky)),
+            KVS_STATUS_OK);
+  const char* keys[] = {large_key, small_key, tricky_key};
+  int key_lens[] = {sizeof(large_key), sizeof(small_key), sizeof(tricky_key)};
+  char small_value[32];
+  char tricky_value[32];
+  char* values[] = {received.data(), small_value, tricky_value};
+  int value_lens[] = {static_cast<int>(received.size()), sizeof(small_value),
+                      sizeof(tricky_value)};
+  int found[3] = {};
+  long long value_sizes[3] = {};
+  ASSERT_EQ(kvs_client_multi_get(setter, 3, keys, key_lens, values,
+                                 value_lens, found, value_sizes, KVS_WAIT_ALL),
+            KVS_STATUS_OK);
+  EXPECT_EQ(value_sizes[0], large.size());
+  EXPECT_EQ(value_sizes[1], sizeof(small));
+  EXPECT_EQ(received.substr(0, large.size()), large);
+  EXPECT_STREQ(small_value, small);
+  EXPECT_EQ(std::string(tricky_value, sizeof(tricky)),
+            std::string(tricky, sizeof(tricky)));
+
+  config.compression = 42;
+  kvs_client_t* invalid = nullptr;
+  EXPECT_EQ(kvs_client_create(&invalid, "localhost:50051", &config),
+            KVS_STATUS_INVALID_ARGUMENT);
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+// Runs the core calls against an in-process server, whose clients call
+// into it directly unless `inproc_grpc` is set.
+void RunInProcess(int async_mode, int inproc_grpc) {
+  kvs_server_t* server = nullptr;
+  kvs_server_config_t server_config = {.timeout_ms = 100,
+                                       .async_mode = async_mode};
+  ASSERT_EQ(kvs_server_create(&server, "inproc://test", &server_config),
+            KVS_STATUS_OK);
+  // The name is taken until the server is destroyed.
+  kvs_server_t* duplicate = nullptr;
+  EXPECT_NE(kvs_server_create(&duplicate, "inproc://test", &server_config),
+            KVS_STATUS_OK);
+
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.cache_max_entries = -1,
+                                .inproc_grpc = inproc_grpc};
+  EXPECT_EQ(kvs_client_create(&setter, "inproc://missing", &config),
+            KVS_STATUS_CONNECTION_ERROR);
+  ASSERT_EQ(kvs_client_create(&setter, "inproc://test", &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&getter, "inproc://test", &config),
+            KVS_STATUS_OK);
+
+  const char key[] = "key";
+  const char value[] = "value";
+  char received[16] = {};
+  std::thread waiter([&]() {
+    char waited[16] = {};
+    EXPECT_EQ(kvs_client_get_with_timeout(getter, key, sizeof(key), waited,
+                                          sizeof(waited), 3000),
+              KVS_STATUS_OK);
+    EXPECT_STREQ(waited, value);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(kvs_client_set(setter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  waiter.join();
+  EXPECT_EQ(kvs_client_set(getter, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_INVALID_USAGE);
+  const char missing[] = "missing";
+  EXPECT_EQ(kvs_client_get(getter, missing, sizeof(missing), received,
+                           sizeof(received)),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+
+  long long counter = 0;
+  ASSERT_EQ(kvs_client_add(setter, "counter", 7, 5, &counter), KVS_STATUS_OK);
+  EXPECT_EQ(counter, 5);
+  std::thread other([&]() {
+    EXPECT_EQ(kvs_client_barrier(getter, "barrier", 7, 2, 3000),
+              KVS_STATUS_OK);
+  });
+  EXPECT_EQ(kvs_client_barrier(setter, "barrier", 7, 2, 3000), KVS_STATUS_OK);
+  other.join();
+
+  const char* keys[] = {key, missing};
+  int key_lens[] = {sizeof(key), sizeof(missing)};
+  char missing_value[16];
+  char* values[] = {received, missing_value};
+  int value_lens[] = {sizeof(received), sizeof(missing_value)};
+  int found[2] = {};
+  EXPECT_EQ(kvs_client_multi_get(getter, 2, keys, key_lens, values,
+                                 value_lens, found, /*value_sizes=*/nullptr,
+                                 KVS_WAIT_ANY),
+            KVS_STATUS_OK);
+  EXPECT_EQ(found[0], 1);
+  EXPECT_EQ(found[1], 0);
+  EXPECT_STREQ(received, value);
+
+  // Calls that are not direct go through the in-process channel.
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_client_get_server_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_SET_VALUE].count, 2);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_BARRIER].count, 2);
+  EXPECT_EQ(stats.already_exists, 1);
+  EXPECT_EQ(stats.num_keys, 1);
+
+  // Destroying the server ends the calls still waiting on it.
+  std::thread blocked([&]() {
+    EXPECT_NE(kvs_client_get_with_timeout(getter, missing, sizeof(missing),
+                                          received, sizeof(received), 10000),
+              KVS_STATUS_OK);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  auto start = std::chrono::steady_clock::now();
+  kvs_server_destroy(&server);
+  blocked.join();
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(5));
+  EXPECT_NE(kvs_client_set(setter, missing, sizeof(missing), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  EXPECT_NE(kvs_client_get_server_stats(setter, &stats), KVS_STATUS_OK);
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+}
+
+TEST_F(ClientServerTest, InProcess) { RunInProcess(0, 0); }
+
+TEST_F(ClientServerTest, AsyncModeInProcess) { RunInProcess(1, 0); }
+
+TEST_F(ClientServerTest, InProcessOverGrpc) { RunInProcess(0, 1); }
+
+TEST_F(ClientServerTest, ShardedClient) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  kvs_server_config_t server_config = {.timeout_ms = 3000};
+  kvs_server_t* server2 = nullptr;
+  kvs_server_t* server3 = nullptr;
+  ASSERT_EQ(kvs_server_create(&server2, "localhost:50052", &server_config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_create(&server3, "localhost:50053", &server_config),
+            KVS_STATUS_OK);
+  const char addrs[] = "localhost:50051, localhost:50052,localhost:50053";
+
+  kvs_client_t* setter = nullptr;
+  kvs_client_t* getter = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  EXPECT_EQ(kvs_client_create(&setter, "localhost:50051,localhost:50051",
+                              &config),
+            KVS_STATUS_INVALID_ARGUMENT);
+  EXPECT_EQ(kvs_client_create(&setter, "localhost:50051,", &config),
+            KVS_STATUS_INVALID_ARGUMENT);
+  ASSERT_EQ(kvs_client_create(&setter, addrs, &config), KVS_STATUS_OK);
+  // The order of the addresses does not change where the keys are.
+  ASSERT_EQ(kvs_client_create(
+                &getter, "localhost:50053,localhost:50051,localhost:50052",
+                &config),
+            KVS_STATUS_OK);
+
+  constexpr int kNumKeys = 300;
+  std::vector<std::string> keys, values;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("job/key" + std::to_string(i));
+    values.push_back("value" + std::to_string(i));
+  }
+  // Half of the keys one at a time and half in a batch across servers.
+  for (int i = 0; i < kNumKeys / 2; ++i) {
+    ASSERT_EQ(kvs_client_set(setter, keys[i].data(), keys[i].size(),
+                             values[i].data(), values[i].size()),
+              KVS_STATUS_OK);
+  }
+  std::vector<const char*> key_ptrs, value_ptrs;
+  std::vector<int> key_lens, value_lens;
+  for (int i = kNumKeys / 2; i < kNumKeys; ++i) {
+    key_ptrs.push_back(keys[i].data());
+    key_lens.push_back(keys[i].size());
+    value_ptrs.push_back(values[i].data());
+    value_lens.push_back(values[i].size());
+  }
+  ASSERT_EQ(kvs_client_multi_set(setter, key_ptrs.size(), key_ptrs.data(),
+                                 key_lens.data(), value_ptrs.data(),
+                                 value_lens.data()),
+            KVS_STATUS_OK);
+
+  // Every server has a share of the keys.
+  long long total_keys = 0;
+  for (kvs_server_t* server : {server(), server2, server3}) {
+    kvs_server_stats_t stats;
+    ASSERT_EQ(kvs_server_get_stats(server, &stats), KVS_STATUS_OK);
+    EXPECT_GT(stats.num_keys, kNumKeys / 10);
+    total_keys += stats.num_keys;
+  }
+  EXPECT_EQ(total_keys, kNumKeys);
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_client_get_server_stats(getter, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.num_keys, kNumKeys);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_SET_VALUE].count, kNumKeys / 2);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_MULTI_SET_VALUE].count, 3);
+
+  // Every key is found on its server by the other client.
+  for (int i = 0; i < kNumKeys; i += 7) {
+    char value[32] = {};
+    ASSERT_EQ(kvs_client_get(getter, keys[i].data(), keys[i].size(), value,
+                             sizeof(value)),
+              KVS_STATUS_OK);
+    EXPECT_EQ(std::string(value), values[i]);
+  }
+  key_ptrs.clear();
+  key_lens.clear();
+  for (const std::string& key : keys) {
+    key_ptrs.push_back(key.data());
+    key_lens.push_back(key.size());
+  }
+  std::vector<std::string> buffers(kNumKeys, std::string(32, '\0'));
+  std::vector<char*> buffer_ptrs;
+  std::vector<int> buffer_lens;
+  for (std::string& buffer : buffers) {
+    buffer_ptrs.push_back(buffer.data());
+    buffer_lens.push_back(buffer.size());
+  }
+  std::vector<int> found(kNumKeys, 0);
+  ASSERT_EQ(kvs_client_multi_get(getter, kNumKeys, key_ptrs.data(),
+                                 key_lens.data(), buffer_ptrs.data(),
+                                 buffer_lens.data(), found.data(),
+                                 /*value_sizes=*/nullptr, KVS_WAIT_ALL),
+            KVS_STATUS_OK);
+  for (int i = 0; i < kNumKeys; ++i) {
+    EXPECT_TRUE(found[i]);
+    EXPECT_EQ(std::string(buffers[i].c_str()), values[i]);
+  }
+
+  // Waiting for any key returns on the server of the key that is set,
+  // without waiting for the ones that are not.
+  const char* any_keys[] = {"missing0", "missing1", "missing2", "missing3",
+                            keys[0].data()};
+  int any_key_lens[] = {8, 8, 8, 8, static_cast<int>(keys[0].size())};
+  char any_buffers[5][32] = {};
+  char* any_buffer_ptrs[] = {any_buffers[0], any_buffers[1], any_buffers[2],
+                             any_buffers[3], any_buffers[4]};
+  int any_buffer_lens[] = {32, 32, 32, 32, 32};
+  int any_found[5] = {};
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_EQ(kvs_client_multi_get(getter, 5, any_keys, any_key_lens,
+                                 any_buffer_ptrs, any_buffer_lens, any_found,
+                                 /*value_sizes=*/nullptr, KVS_WAIT_ANY),
+            KVS_STATUS_OK);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(1000));
+  EXPECT_EQ(std::vector<int>(any_found, any_found + 5),
+            std::vector<int>({0, 0, 0, 0, 1}));
+  EXPECT_EQ(std::string(any_buffers[4]), values[0]);
+
+  // A watch gets the keys of every server, and ends after max_keys in total.
+  const char prefix[] = "job/";
+  kvs_watch_t* watch = nullptr;
+  ASSERT_EQ(kvs_client_watch_prefix(getter, prefix, sizeof(prefix) - 1,
+                                    /*max_keys=*/kNumKeys, &watch),
+            KVS_STATUS_OK);
+  std::map<std::string, std::string> received;
+  char key[64], value[64];
+  int key_len = sizeof(key), value_len = sizeof(value);
+  while (kvs_watch_next(watch, key, &key_len, value, &value_len) ==
+         KVS_STATUS_OK) {
+    received[std::string(key, key_len)] = std::string(value, value_len);
+    key_len = sizeof(key);
+    value_len = sizeof(value);
+  }
+  EXPECT_EQ(received.size(), kNumKeys);
+  EXPECT_EQ(received[keys[kNumKeys - 1]], values[kNumKeys - 1]);
+  EXPECT_EQ(kvs_watch_destroy(&watch), KVS_STATUS_OK);
+
+  RunBarrier(addrs);
+
+  kvs_client_destroy(&setter);
+  kvs_client_destroy(&getter);
+  kvs_server_destroy(&server2);
+  kvs_server_destroy(&server3);
+}
+
+// Runs `num_threads` threads that each get `num_gets` keys out of `keys`
+// without the cache, and returns the number of gets per second.
+double MeasureGetThroughput(const char* addr,
+                            const std::vector<std::string>& keys,
+                            int num_threads, int num_gets) {
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1};
+  std::vector<kvs_client_t*> clients(num_threads, nullptr);
+  for (kvs_client_t*& client : clients) {
+    EXPECT_EQ(kvs_client_create(&client, addr, &config), KVS_STATUS_OK);
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&, i]() {
+      char value[32];
+      for (int j = 0; j < num_gets; ++j) {
+        const std::string& key = keys[(i * num_gets + j) % keys.size()];
+        EXPECT_EQ(kvs_client_get(clients[i], key.data(), key.size(), value,
+                                 sizeof(value)),
+                  KVS_STATUS_OK);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (kvs_client_t*& client : clients) {
+    kvs_client_destroy(&client);
+  }
+  return num_threads * num_gets / seconds;
+}
+
+// A leader and two followers, where clients read from every replica and fail
+// over to a follower once it is promoted. The replicas run in this process,
+// each with its own port, as separate processes would.
+TEST_F(ClientServerTest, Replication) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  const char replicas[] = "localhost:50051|localhost:50052|localhost:50053";
+  kvs_server_config_t follower_config = {.timeout_ms = 3000,
+                                         .replicas = replicas};
+  kvs_server_t* follower1 = nullptr;
+  kvs_server_t* follower2 = nullptr;
+  ASSERT_EQ(kvs_server_create(&follower1, "localhost:50052", &follower_config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_create(&follower2, "localhost:50053", &follower_config),
+            KVS_STATUS_OK);
+
+  kvs_client_t* client = nullptr;
+  kvs_client_t* async_client = nullptr;
+  kvs_client_t* follower_client = nullptr;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000};
+  ASSERT_EQ(kvs_client_create(&client, replicas, &config), KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&async_client, replicas, &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&follower_client, "localhost:50053", &config),
+            KVS_STATUS_OK);
+
+  // A follower serves a get that waits for a value set on the leader.
+  const char waited_key[] = "waited";
+  char received[32] = {};
+  kvs_status_t waited_status = KVS_STATUS_INTERNAL_ERROR;
+  std::thread waiter([&]() {
+    waited_status = kvs_client_get(follower_client, waited_key,
+                                   sizeof(waited_key), received,
+                                   sizeof(received));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_EQ(kvs_client_set(client, waited_key, sizeof(waited_key), "value",
+                           sizeof("value")),
+            KVS_STATUS_OK);
+  waiter.join();
+  EXPECT_EQ(waited_status, KVS_STATUS_OK);
+  EXPECT_STREQ(received, "value");
+
+  // Followers reject writes from clients that only know them.
+  EXPECT_EQ(kvs_client_set(follower_client, "k", 1, "v", 1),
+            KVS_STATUS_INVALID_USAGE);
+  EXPECT_EQ(kvs_client_add(follower_client, "k", 1, 1, nullptr),
+            KVS_STATUS_INVALID_USAGE);
+
+  constexpr int kNumKeys = 100;
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    ASSERT_EQ(kvs_client_set(client, keys[i].data(), keys[i].size(), "v", 1),
+              KVS_STATUS_OK);
+  }
+  for (kvs_server_t* follower : {follower1, follower2}) {
+    kvs_server_stats_t stats = {};
+    for (int i = 0; i < 100 && stats.num_keys < kNumKeys + 1; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      ASSERT_EQ(kvs_server_get_stats(follower, &stats), KVS_STATUS_OK);
+    }
+    EXPECT_EQ(stats.num_keys, kNumKeys + 1);
+    EXPECT_FALSE(stats.leader);
+  }
+
+  // Reads are spread across the replicas.
+  constexpr int kNumThreads = 8;
+  constexpr int kNumGets = 500;
+  double leader_gets_per_s =
+      MeasureGetThroughput("localhost:50051", keys, kNumThreads, kNumGets);
+  double replicated_gets_per_s =
+      MeasureGetThroughput(replicas, keys, kNumThreads, kNumGets);
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_server_get_stats(follower1, &stats), KVS_STATUS_OK);
+  EXPECT_GT(stats.rpcs[KVS_RPC_GET_VALUE].count, kNumThreads * kNumGets / 10);
+  std::cout << "gets per second from the leader: " << leader_gets_per_s
+            << ", from 3 replicas: " << replicated_gets_per_s << "\n";
+  RecordProperty("leader_gets_per_s", static_cast<int>(leader_gets_per_s));
+  RecordProperty("replicated_gets_per_s",
+                 static_cast<int>(replicated_gets_per_s));
+
+  // Followers drop a namespace with the leader, so a key set again after the
+  // name is reused is read with its new value.
+  kvs_client_config_t uncached_config = {.connection_timeout_ms = 3000,
+                                         .cache_max_entries = -1};
+  kvs_client_t* follower1_client = nullptr;
+  ASSERT_EQ(kvs_client_create(&follower1_client, "localhost:50052",
+                              &uncached_config),
+            KVS_STATUS_OK);
+  const char job_key[] = "job/key";
+  const char* job_values[] = {"old", "new"};
+  for (const char* job_value : job_values) {
+    if (job_value == job_values[1]) {
+      ASSERT_EQ(kvs_client_drop_namespace(client, "job", 3), KVS_STATUS_OK);
+    }
+    ASSERT_EQ(kvs_client_open_namespace(client, "job", 3, /*ttl_ms=*/60000),
+              KVS_STATUS_OK);
+    ASSERT_EQ(kvs_client_set(client, job_key, sizeof(job_key), job_value,
+                             strlen(job_value) + 1),
+              KVS_STATUS_OK);
+    char job_received[8] = {};
+    for (int i = 0; i < 100 && strcmp(job_received, job_value) != 0; ++i) {
+      ASSERT_EQ(kvs_client_get(follower1_client, job_key, sizeof(job_key),
+                               job_received, sizeof(job_received)),
+                KVS_STATUS_OK);
+      if (strcmp(job_received, job_value) != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    EXPECT_STREQ(job_received, job_value);
+  }
+  kvs_client_destroy(&follower1_client);
+
+  // The leader fails and a follower takes over.
+  auto failure_time = std::chrono::steady_clock::now();
+  Stop();
+  ASSERT_EQ(kvs_server_promote(follower1), KVS_STATUS_OK);
+  const char new_key[] = "after_failover";
+  ASSERT_EQ(kvs_client_set(client, new_key, sizeof(new_key), "v", 1),
+            KVS_STATUS_OK);
+  double failover_ms = std::chrono::duration<double, std::milli>(
+                           std::chrono::steady_clock::now() - failure_time)
+                           .count();
+  std::cout << "failover time: " << failover_ms << " ms\n";
+  RecordProperty("failover_ms", static_cast<int>(failover_ms));
+
+  // The other follower now copies from the new leader.
+  char value[8] = {};
+  EXPECT_EQ(kvs_client_get(follower_client, new_key, sizeof(new_key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get(client, keys[0].data(), keys[0].size(), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_get_stats(follower1, &stats), KVS_STATUS_OK);
+  EXPECT_TRUE(stats.leader);
+  // The new leader has the namespace copied from the old one.
+  EXPECT_EQ(stats.num_namespaces, 1);
+  EXPECT_EQ(kvs_client_get(client, job_key, sizeof(job_key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(value, "new");
+
+  // Requests started without blocking fail over too, from a client that
+  // still takes the old leader for the leader.
+  const char async_key[] = "async";
+  kvs_request_t* request = nullptr;
+  ASSERT_EQ(kvs_client_set_async(async_client, async_key, sizeof(async_key),
+                                 "v", 1, &request),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_request_wait(&request), KVS_STATUS_OK);
+  // Reads take turns, so one of them starts at the old leader.
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(kvs_client_get_async(async_client, keys[i].data(),
+                                   keys[i].size(), value, sizeof(value),
+                                   &request),
+              KVS_STATUS_OK);
+    EXPECT_EQ(kvs_request_wait(&request), KVS_STATUS_OK);
+  }
+
+  kvs_client_destroy(&client);
+  kvs_client_destroy(&async_client);
+  kvs_client_destroy(&follower_client);
+  kvs_server_destroy(&follower1);
+  kvs_server_destroy(&follower2);
+}
+
+// Many clients of a proxy wait for the same key, which the proxy fetches from
+// the upstream server once and then serves from its cache.
+TEST_F(ClientServerTest, Proxy) {
+  StartServer("127.0.0.1:50051", /*timeout_ms=*/3000);
+  kvs_server_t* proxy = nullptr;
+  kvs_server_config_t proxy_config = {.timeout_ms = 3000,
+                                      .upstream = "localhost:50051",
+                                      .proxy_cache_max_entries = 1};
+  ASSERT_EQ(kvs_server_create(&proxy, "localhost:50052", &proxy_config),
+            KVS_STATUS_OK);
+
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1};
+  kvs_client_t* upstream_client = nullptr;
+  ASSERT_EQ(kvs_client_create(&upstream_client, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  constexpr int kNumClients = 16;
+  std::vector<kvs_client_t*> clients(kNumClients, nullptr);
+  for (kvs_client_t*& client : clients) {
+    ASSERT_EQ(kvs_client_create(&client, "localhost:50052", &config),
+              KVS_STATUS_OK);
+  }
+
+  const char key[] = "hot";
+  const char value[] = "value";
+  std::vector<std::thread> threads;
+  for (kvs_client_t* client : clients) {
+    threads.emplace_back([client, &key, &value]() {
+      char received[32] = {};
+      EXPECT_EQ(
+          kvs_client_get(client, key, sizeof(key), received, sizeof(received)),
+          KVS_STATUS_OK);
+      EXPECT_STREQ(received, value);
+    });
+  }
+  kvs_server_stats_t stats = {};
+  for (int i = 0; i < 100 && stats.blocked_waiters < kNumClients; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  }
+  EXPECT_EQ(stats.blocked_waiters, kNumClients);
+  ASSERT_EQ(kvs_client_set(upstream_client, key, sizeof(key), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  // Later gets are served by the proxy's cache.
+  char received[32] = {};
+  EXPECT_EQ(kvs_client_get(clients[0], key, sizeof(key), received,
+                           sizeof(received)),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_GET_VALUE].count +
+                stats.rpcs[KVS_RPC_MULTI_GET_VALUE].count,
+            1);
+  ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_GET_VALUE].count, kNumClients + 1);
+  EXPECT_EQ(stats.num_keys, 1);
+
+  // Writes are forwarded upstream.
+  const char key2[] = "key2";
+  EXPECT_EQ(kvs_client_set(clients[1], key2, sizeof(key2), value,
+                           sizeof(value)),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_set(clients[2], key2, sizeof(key2), value,
+                           sizeof(value)),
+            KVS_STATUS_INVALID_USAGE);
+  EXPECT_EQ(kvs_client_get(upstream_client, key2, sizeof(key2), received,
+                           sizeof(received)),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(received, value);
+  // The cache stays within its budget.
+  ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.num_keys, 1);
+  long long counter = 0;
+  EXPECT_EQ(kvs_client_add(clients[3], "counter", 7, 2, &counter),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_add(upstream_client, "counter", 7, 3, &counter),
+            KVS_STATUS_OK);
+  EXPECT_EQ(counter, 5);
+
+  // Ranks meet at a barrier and set their keys in batches through the proxy,
+  // which forwards them without blocking a thread each.
+  std::vector<std::thread> ranks;
+  for (int i = 0; i < 8; ++i) {
+    ranks.emplace_back([client = clients[i], i]() {
+      std::string rank_key = "rank" + std::to_string(i);
+      const char* keys[] = {rank_key.data()};
+      const int key_lens[] = {static_cast<int>(rank_key.size())};
+      const char* values[] = {"v"};
+      const int value_lens[] = {1};
+      EXPECT_EQ(kvs_client_multi_set(client, 1, keys, key_lens, values,
+                                     value_lens),
+                KVS_STATUS_OK);
+      EXPECT_EQ(kvs_client_barrier(client, "ranks", 5, 8, 3000),
+                KVS_STATUS_OK);
+    });
+  }
+  for (std::thread& rank : ranks) {
+    rank.join();
+  }
+  EXPECT_EQ(kvs_client_get(upstream_client, "rank7", 5, received,
+                           sizeof(received)),
+            KVS_STATUS_OK);
+
+  // A get gives up after its own timeout rather than the proxy's.
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(kvs_client_get_with_timeout(clients[4], "late", 4, received,
+                                        sizeof(received), /*timeout_ms=*/100),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.timeouts, 1);
+
+  // A proxy shuts down while clients still wait for a key. The timed out get
+  // may not have left the proxy's waiters yet.
+  for (int i = 0; i < 100 && stats.blocked_waiters > 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  }
+  ASSERT_EQ(stats.blocked_waiters, 0);
+  std::thread waiter([&]() {
+    char unused[8];
+    EXPECT_NE(kvs_client_get(clients[4], "missing", 7, unused, sizeof(unused)),
+              KVS_STATUS_OK);
+  });
+  for (int i = 0; i < 100 && stats.blocked_waiters < 1; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(kvs_server_get_stats(proxy, &stats), KVS_STATUS_OK);
+  }
+  kvs_server_destroy(&proxy);
+  waiter.join();
+  // Releases the upstream call the proxy cancelled.
+  EXPECT_EQ(kvs_client_set(upstream_client, "missing", 7, "v", 1),
+            KVS_STATUS_OK);
+
+  for (kvs_client_t*& client : clients) {
+    kvs_client_destroy(&client);
+  }
+  kvs_client_destroy(&upstream_client);
+}
+
+// Clients on the server's host read the published values from shared memory,
+// and send everything else to the server.
+TEST_F(ClientServerTest, SharedMemory) {
+  std::string shm_name = "kvs_clientserver_test." + std::to_string(getpid());
+  kvs_server_config_t server_config = {.timeout_ms = 3000,
+                                       .shm_name = shm_name.c_str()};
+  StartServer("127.0.0.1:50051", server_config);
+  std::string shm_addr = "shm://" + shm_name;
+  kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                .cache_max_entries = -1};
+  kvs_client_t* client = nullptr;
+  kvs_client_t* writer = nullptr;
+  ASSERT_EQ(kvs_client_create(&client, shm_addr.c_str(), &config),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_create(&writer, "localhost:50051", &config),
+            KVS_STATUS_OK);
+  kvs_client_t* missing = nullptr;
+  EXPECT_EQ(kvs_client_create(&missing, "shm://kvs_no_such_segment", &config),
+            KVS_STATUS_CONNECTION_ERROR);
+
+  // Sets go to the server, which publishes them.
+  const char key[] = "key";
+  const char value[] = "value";
+  ASSERT_EQ(kvs_client_set(client, key, sizeof(key), value, sizeof(value)),
+            KVS_STATUS_OK);
+  char received[32] = {};
+  EXPECT_EQ(
+      kvs_client_get(client, key, sizeof(key), received, sizeof(received)),
+      KVS_STATUS_OK);
+  EXPECT_STREQ(received, value);
+  kvs_value_t* view = nullptr;
+  const char* data = nullptr;
+  long long size = 0;
+  ASSERT_EQ(kvs_client_get_view(client, key, sizeof(key), &view, &data, &size),
+            KVS_STATUS_OK);
+  EXPECT_EQ(std::string(data, size), std::string(value, sizeof(value)));
+  kvs_value_release(&view);
+
+  // A get waits in shared memory for a key that another client sets.
+  const char waited_key[] = "waited";
+  std::thread waiter([&]() {
+    char waited_value[32] = {};
+    EXPECT_EQ(kvs_client_get(client, waited_key, sizeof(waited_key),
+                             waited_value, sizeof(waited_value)),
+              KVS_STATUS_OK);
+    EXPECT_STREQ(waited_value, value);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_EQ(
+      kvs_client_set(writer, waited_key, sizeof(waited_key), value,
+                     sizeof(value)),
+      KVS_STATUS_OK);
+  waiter.join();
+
+  // Only the values set over RPC are read from shared memory.
+  kvs_server_stats_t stats;
+  ASSERT_EQ(kvs_server_get_stats(server(), &stats), KVS_STATUS_OK);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_GET_VALUE].count, 0);
+  EXPECT_EQ(stats.rpcs[KVS_RPC_SET_VALUE].count, 2);
+
+  // The keys of a dropped namespace are asked from the server, until they are
+  // set again once the name is reused.
+  const char job_key[] = "job/key";
+  ASSERT_EQ(kvs_client_open_namespace(writer, "job", 3, /*ttl_ms=*/0),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_set(writer, job_key, sizeof(job_key), "old", 4),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get(client, job_key, sizeof(job_key), received,
+                           sizeof(received)),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(received, "old");
+  ASSERT_EQ(kvs_client_drop_namespace(writer, "job", 3), KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get_with_timeout(client, job_key, sizeof(job_key),
+                                        received, sizeof(received),
+                                        /*timeout_ms=*/100),
+            KVS_STATUS_DEADLINE_EXCEEDED);
+  ASSERT_EQ(kvs_client_open_namespace(writer, "job", 3, /*ttl_ms=*/0),
+            KVS_STATUS_OK);
+  ASSERT_EQ(kvs_client_set(writer, job_key, sizeof(job_key), "new", 4),
+            KVS_STATUS_OK);
+  EXPECT_EQ(kvs_client_get(client, job_key, sizeof(job_key), received,
+                           sizeof(received)),
+            KVS_STATUS_OK);
+  EXPECT_STREQ(received, "new");
+
+  kvs_client_destroy(&client);
+  kvs_client_destroy(&writer);
+}
+
 }  // namespace
 }  // namespace kvs
@@ -0,0 +1,108 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "codec.h"
+
+#include <zlib.h>
+
+#include <utility>
+
+namespace {
+
+constexpr std::string_view kMagic("\0KVC", 4);
+// The magic number, the codec and the size of the value.
+constexpr size_t kHeaderSize = kMagic.size() + 1 + 8;
+// Deflate does not compress by more than this, so a frame that claims more
+// is damaged.
+constexpr size_t kMaxZlibRatio = 1032;
+
+void AppendHeader(Codec codec, uint64_t size, std::string* frame) {
+  frame->append(kMagic);
+  frame->push_back(static_cast<char>(codec));
+  for (int i = 0; i < 8; ++i) {
+    frame->push_back(static_cast<char>(size >> (8 * i)));
+  }
+}
+
+}  // namespace
+
+bool EncodeValue(std::string_view value, Codec codec, size_t threshold,
+                 std::string* encoded) {
+  if (codec == Codec::kZlib && value.size() >= threshold) {
+    uLongf compressed_size = compressBound(value.size());
+    encoded->resize(kHeaderSize + compressed_size);
+    // The fastest level: values are compressed on the critical path of the
+    // publisher, and the values worth compressing are highly compressible.
+    if (compress2(reinterpret_cast<Bytef*>(encoded->data() + kHeaderSize),
+                  &compressed_size,
+                  reinterpret_cast<const Bytef*>(value.data()), value.size(),
+                  Z_BEST_SPEED) == Z_OK &&
+        kHeaderSize + compressed_size < value.size()) {
+      encoded->resize(kHeaderSize + compressed_size);
+      std::string header;
+      AppendHeader(Codec::kZlib, value.size(), &header);
+      encoded->replace(0, kHeaderSize, header);
+      return true;
+    }
+  }
+  if (!IsFramed(value)) {
+    return false;
+  }
+  encoded->clear();
+  encoded->reserve(kHeaderSize + value.size());
+  AppendHeader(Codec::kNone, value.size(), encoded);
+  encoded->append(value);
+  return true;
+}
+
+bool IsFramed(std::string_view stored) {
+  return stored.substr(0, kMagic.size()) == kMagic;
+}
+
+bool DecodeValue(std::string_view stored, std::string* value) {
+  if (stored.size() < kHeaderSize || !IsFramed(stored)) {
+    return false;
+  }
+  Codec codec = static_cast<Codec>(stored[kMagic.size()]);
+  uint64_t size = 0;
+  for (int i = 0; i < 8; ++i) {
+    size |= uint64_t{static_cast<uint8_t>(stored[kMagic.size() + 1 + i])}
+            << (8 * i);
+  }
+  std::string_view payload = stored.substr(kHeaderSize);
+  switch (codec) {
+    case Codec::kNone:
+      if (payload.size() != size) {
+        return false;
+      }
+      value->assign(payload);
+      return true;
+    case Codec::kZlib: {
+      if (size > payload.size() * kMaxZlibRatio) {
+        return false;
+      }
+      value->resize(size);
+      uLongf value_size = size;
+      return uncompress(reinterpret_cast<Bytef*>(value->data()), &value_size,
+                        reinterpret_cast<const Bytef*>(payload.data()),
+                        payload.size()) == Z_OK &&
+             value_size == size;
+    }
+  }
+  return false;
+}
+
+bool DecodeValueInPlace(std::string* value) {
+  if (!IsFramed(*value)) {
+    return true;
+  }
+  std::string decoded;
+  if (!DecodeValue(*value, &decoded)) {
+    return false;
+  }
+  *value = std::move(decoded);
+  return true;
+}
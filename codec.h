@@ -0,0 +1,46 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_CODEC_H
+#define KVS_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// How clients compress the values they set. The server stores and serves the
+// bytes it is given, so a value is compressed once by the client that sets it
+// and decompressed once by each client that gets it.
+//
+// A compressed value is stored as a frame: a magic number, the codec, the
+// size of the value and the compressed bytes. Values that are not compressed
+// are stored as is, unless they start with the magic number themselves, in
+// which case they are framed with Codec::kNone so that readers can tell.
+enum class Codec : uint8_t {
+  kNone = 0,
+  kZlib = 1,
+};
+
+// Returns true and stores the frame of `value` to `encoded` if `value` has to
+// be framed: if it has at least `threshold` bytes and compressing it with
+// `codec` makes it smaller, or if it looks like a frame. Returns false if
+// `value` is to be stored as is.
+bool EncodeValue(std::string_view value, Codec codec, size_t threshold,
+                 std::string* encoded);
+
+// Returns true if `stored` is a frame, which DecodeValue() has to unpack.
+bool IsFramed(std::string_view stored);
+
+// Stores the value of the frame `stored` to `value`. Returns false if the
+// frame is damaged or has an unknown codec.
+bool DecodeValue(std::string_view stored, std::string* value);
+
+// Replaces `value` with the value of its frame, if it is one. Returns false
+// if the frame is damaged or has an unknown codec.
+bool DecodeValueInPlace(std::string* value);
+
+#endif  // KVS_CODEC_H
@@ -0,0 +1,103 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Microbenchmarks of value compression, run in-process by kvs_bench. They
+// measure the codec alone, and a value set by one client and got by another
+// through a server, compressed and raw. The "wire_bytes" counter is the size
+// of the value as sent each way and as the server stores it.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "client.h"
+#include "codec.h"
+#include "server.h"
+
+namespace {
+
+// A value that compresses like our serialized configs and topology tables.
+std::string ConfigLikeValue(size_t size) {
+  std::string value;
+  for (int i = 0; value.size() < size; ++i) {
+    value += "{\"rank\": " + std::to_string(i) + ", \"host\": \"node" +
+             std::to_string(i % 64) + ".cluster\", \"port\": " +
+             std::to_string(50000 + i % 8) + ", \"devices\": [0, 1, 2, 3]},\n";
+  }
+  value.resize(size);
+  return value;
+}
+
+void BM_EncodeValue(benchmark::State& state) {
+  std::string value = ConfigLikeValue(state.range(0));
+  std::string encoded;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(EncodeValue(value, Codec::kZlib, 0, &encoded));
+  }
+  state.SetBytesProcessed(state.iterations() * value.size());
+  state.counters["ratio"] =
+      static_cast<double>(value.size()) / encoded.size();
+}
+
+void BM_DecodeValue(benchmark::State& state) {
+  std::string value = ConfigLikeValue(state.range(0));
+  std::string encoded;
+  EncodeValue(value, Codec::kZlib, 0, &encoded);
+  std::string decoded;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DecodeValue(encoded, &decoded));
+  }
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+
+// Sets a new key with one client and gets it with another, so that every
+// iteration moves the value to the server and back. The clients' caches are
+// disabled.
+template <Codec codec>
+void BM_SetThenGet(benchmark::State& state) {
+  KeyValueStoreServer server("localhost:50062", KeyValueStoreServerOptions());
+  KeyValueStoreClientOptions options;
+  options.cache_max_entries = 0;
+  options.compression = codec;
+  options.max_message_size = 64 << 20;
+  KeyValueStoreClient setter(
+      CreateChannelPool("localhost:50062", options), options);
+  KeyValueStoreClient getter(
+      CreateChannelPool("localhost:50062", options), options);
+  std::string value = ConfigLikeValue(state.range(0));
+  std::string received;
+  int64_t i = 0;
+  for (auto _ : state) {
+    std::string key = "key" + std::to_string(i++);
+    if (!setter.SetValue(key, value).ok() ||
+        !getter.GetValue(key, received).ok()) {
+      state.SkipWithError("call failed");
+      break;
+    }
+  }
+  std::string encoded;
+  size_t wire_bytes = EncodeValue(value, codec, options.compression_threshold,
+                                  &encoded)
+                          ? encoded.size()
+                          : value.size();
+  state.SetBytesProcessed(state.iterations() * value.size());
+  state.counters["wire_bytes"] = wire_bytes;
+}
+
+BENCHMARK(BM_EncodeValue)->Arg(16 << 10)->Arg(1 << 20);
+BENCHMARK(BM_DecodeValue)->Arg(16 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_SetThenGet, Codec::kNone)
+    ->Arg(16 << 10)
+    ->Arg(256 << 10)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SetThenGet, Codec::kZlib)
+    ->Arg(16 << 10)
+    ->Arg(256 << 10)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,96 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "codec.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+
+namespace kvs {
+namespace {
+
+// A value that compresses well, like a serialized config.
+std::string Compressible(size_t size) {
+  std::string value;
+  for (int i = 0; value.size() < size; ++i) {
+    value += "{\"rank\": " + std::to_string(i) + ", \"host\": \"node" +
+             std::to_string(i % 16) + "\"},\n";
+  }
+  value.resize(size);
+  return value;
+}
+
+std::string Random(size_t size) {
+  std::mt19937 rng(42);
+  std::string value(size, '\0');
+  for (char& c : value) {
+    c = static_cast<char>(rng());
+  }
+  return value;
+}
+
+TEST(CodecTest, CompressesAboveThreshold) {
+  std::string value = Compressible(64 << 10);
+  std::string encoded;
+  ASSERT_TRUE(EncodeValue(value, Codec::kZlib, 4096, &encoded));
+  EXPECT_TRUE(IsFramed(encoded));
+  EXPECT_LT(encoded.size(), value.size() / 4);
+  std::string decoded;
+  ASSERT_TRUE(DecodeValue(encoded, &decoded));
+  EXPECT_EQ(decoded, value);
+  ASSERT_TRUE(DecodeValueInPlace(&encoded));
+  EXPECT_EQ(encoded, value);
+
+  // Below the threshold or without a codec, values are stored as is.
+  EXPECT_FALSE(EncodeValue(value.substr(0, 4095), Codec::kZlib, 4096,
+                           &encoded));
+  EXPECT_FALSE(EncodeValue(value, Codec::kNone, 4096, &encoded));
+  EXPECT_FALSE(IsFramed(value));
+}
+
+TEST(CodecTest, KeepsIncompressibleValuesAsIs) {
+  std::string value = Random(64 << 10);
+  std::string encoded;
+  EXPECT_FALSE(EncodeValue(value, Codec::kZlib, 4096, &encoded));
+  EXPECT_FALSE(EncodeValue("", Codec::kZlib, 0, &encoded));
+  std::string unchanged = value;
+  ASSERT_TRUE(DecodeValueInPlace(&unchanged));
+  EXPECT_EQ(unchanged, value);
+}
+
+TEST(CodecTest, FramesValuesThatLookLikeFrames) {
+  std::string value = Compressible(64 << 10);
+  std::string frame;
+  ASSERT_TRUE(EncodeValue(value, Codec::kZlib, 0, &frame));
+  // A frame set as a value, or just its magic number, comes back as is.
+  for (const std::string& tricky : {frame, frame.substr(0, 4)}) {
+    std::string encoded;
+    ASSERT_TRUE(EncodeValue(tricky, Codec::kNone, 0, &encoded));
+    std::string decoded;
+    ASSERT_TRUE(DecodeValue(encoded, &decoded));
+    EXPECT_EQ(decoded, tricky);
+  }
+}
+
+TEST(CodecTest, RejectsDamagedFrames) {
+  std::string encoded;
+  ASSERT_TRUE(
+      EncodeValue(Compressible(64 << 10), Codec::kZlib, 0, &encoded));
+  std::string decoded;
+  EXPECT_FALSE(DecodeValue(encoded.substr(0, encoded.size() / 2), &decoded));
+  EXPECT_FALSE(DecodeValue(encoded.substr(0, 8), &decoded));
+  std::string unknown_codec = encoded;
+  unknown_codec[4] = 7;
+  EXPECT_FALSE(DecodeValue(unknown_codec, &decoded));
+  std::string huge_size = encoded;
+  huge_size[12] = 1;
+  EXPECT_FALSE(DecodeValueInPlace(&huge_size));
+}
+
+}  // namespace
+}  // namespace kvs
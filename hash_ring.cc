@@ -0,0 +1,51 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "hash_ring.h"
+
+#include <algorithm>
+
+HashRing::HashRing(size_t num_virtual_nodes)
+    : num_virtual_nodes_(std::max<size_t>(num_virtual_nodes, 1)) {}
+
+size_t HashRing::AddNode(std::string_view name) {
+  size_t node = num_nodes_++;
+  std::string point_name(name);
+  point_name += '#';
+  for (size_t i = 0; i < num_virtual_nodes_; ++i) {
+    point_name.resize(name.size() + 1);
+    point_name += std::to_string(i);
+    points_.emplace_back(Hash(point_name), node);
+  }
+  std::sort(points_.begin(), points_.end());
+  return node;
+}
+
+size_t HashRing::NodeFor(std::string_view key) const {
+  uint64_t hash = Hash(key);
+  auto it = std::lower_bound(points_.begin(), points_.end(),
+                             std::make_pair(hash, size_t{0}));
+  if (it == points_.end()) {
+    it = points_.begin();
+  }
+  return it->second;
+}
+
+uint64_t HashRing::Hash(std::string_view data) {
+  // FNV-1a, whose low bits are then mixed by the finalizer of MurmurHash3 so
+  // that similar keys spread over the whole ring.
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (char c : data) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9a3fe1a85ecULL;
+  hash ^= hash >> 33;
+  return hash;
+}
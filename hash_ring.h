@@ -0,0 +1,49 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_HASH_RING_H
+#define KVS_HASH_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Assigns keys to nodes by consistent hashing. Each node is hashed to
+// `num_virtual_nodes` points on a ring of 64-bit hashes, and a key belongs to
+// the node of the first point at or after its hash. Adding a node only moves
+// the keys that land on its points, about 1/n of them, and the virtual nodes
+// keep the share of each node within a few percent of the others.
+//
+// Nodes are placed by name alone, so rings built from the same names agree on
+// every key whatever order the names are added in.
+class HashRing {
+ public:
+  explicit HashRing(size_t num_virtual_nodes = 160);
+
+  // Adds a node and returns its index, which counts the nodes in the order
+  // they are added.
+  size_t AddNode(std::string_view name);
+
+  // Returns the index of the node the key belongs to. There must be a node.
+  size_t NodeFor(std::string_view key) const;
+
+  size_t num_nodes() const { return num_nodes_; }
+
+  // A 64-bit hash that is stable across processes and platforms, unlike
+  // std::hash.
+  static uint64_t Hash(std::string_view data);
+
+ private:
+  const size_t num_virtual_nodes_;
+  size_t num_nodes_ = 0;
+  // The points of the nodes sorted by hash, each with its node index.
+  std::vector<std::pair<uint64_t, size_t>> points_;
+};
+
+#endif  // KVS_HASH_RING_H
@@ -0,0 +1,89 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "hash_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+constexpr int kNumKeys = 100000;
+
+std::string Key(int i) { return "key" + std::to_string(i); }
+
+TEST(HashRingTest, SingleNodeOwnsEveryKey) {
+  HashRing ring;
+  EXPECT_EQ(ring.AddNode("localhost:50051"), 0);
+  EXPECT_EQ(ring.num_nodes(), 1);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(ring.NodeFor(Key(i)), 0);
+  }
+}
+
+TEST(HashRingTest, SpreadsKeysEvenly) {
+  constexpr int kNumNodes = 4;
+  HashRing ring;
+  for (int i = 0; i < kNumNodes; ++i) {
+    ring.AddNode("localhost:" + std::to_string(50051 + i));
+  }
+  std::vector<int> counts(kNumNodes);
+  for (int i = 0; i < kNumKeys; ++i) {
+    ++counts[ring.NodeFor(Key(i))];
+  }
+  for (int count : counts) {
+    EXPECT_GT(count, kNumKeys / kNumNodes * 8 / 10);
+    EXPECT_LT(count, kNumKeys / kNumNodes * 12 / 10);
+  }
+}
+
+TEST(HashRingTest, AddingANodeMovesFewKeys) {
+  HashRing ring;
+  ring.AddNode("a");
+  ring.AddNode("b");
+  ring.AddNode("c");
+  std::vector<size_t> before(kNumKeys);
+  for (int i = 0; i < kNumKeys; ++i) {
+    before[i] = ring.NodeFor(Key(i));
+  }
+
+  size_t d = ring.AddNode("d");
+  int moved = 0;
+  for (int i = 0; i < kNumKeys; ++i) {
+    size_t node = ring.NodeFor(Key(i));
+    if (node != before[i]) {
+      // Keys only move to the new node.
+      EXPECT_EQ(node, d);
+      ++moved;
+    }
+  }
+  // About a quarter of the keys move.
+  EXPECT_GT(moved, kNumKeys / 4 * 8 / 10);
+  EXPECT_LT(moved, kNumKeys / 4 * 12 / 10);
+}
+
+TEST(HashRingTest, OrderOfNodesDoesNotMatter) {
+  HashRing ring1;
+  ring1.AddNode("a");
+  ring1.AddNode("b");
+  ring1.AddNode("c");
+  HashRing ring2;
+  ring2.AddNode("c");
+  ring2.AddNode("a");
+  ring2.AddNode("b");
+  const char* names1[] = {"a", "b", "c"};
+  const char* names2[] = {"c", "a", "b"};
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_STREQ(names1[ring1.NodeFor(Key(i))],
+                 names2[ring2.NodeFor(Key(i))]);
+  }
+}
+
+}  // namespace
+}  // namespace kvs
@@ -0,0 +1,100 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "inproc.h"
+
+#include <grpcpp/support/client_interceptor.h>
+
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Fails every call before it is sent.
+class ClosedServerInterceptor : public grpc::experimental::Interceptor {
+ public:
+  void Intercept(
+      grpc::experimental::InterceptorBatchMethods* methods) override {
+    using grpc::experimental::InterceptionHookPoints;
+    // The first batch of a call sends its metadata; taking it over means
+    // that the channel never sees the call.
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_INITIAL_METADATA)) {
+      methods->Hijack();
+      return;
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+      methods->FailHijackedSendMessage();
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_RECV_MESSAGE)) {
+      methods->FailHijackedRecvMessage();
+    }
+    if (methods->QueryInterceptionHookPoint(
+            InterceptionHookPoints::PRE_RECV_STATUS)) {
+      *methods->GetRecvStatus() =
+          grpc::Status(grpc::StatusCode::UNAVAILABLE, "server shut down");
+    }
+    methods->Proceed();
+  }
+};
+
+class ClosedServerInterceptorFactory
+    : public grpc::experimental::ClientInterceptorFactoryInterface {
+ public:
+  grpc::experimental::Interceptor* CreateClientInterceptor(
+      grpc::experimental::ClientRpcInfo* info) override {
+    return new ClosedServerInterceptor;
+  }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<InProcessServer>> servers;
+};
+
+Registry& GetRegistry() {
+  // Never destroyed, so that servers can unregister during static
+  // destruction.
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+}  // namespace
+
+bool RegisterInProcessServer(const std::string& name,
+                             std::shared_ptr<InProcessServer> server) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  return registry.servers.emplace(name, std::move(server)).second;
+}
+
+void UnregisterInProcessServer(const std::string& name) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.servers.erase(name);
+}
+
+std::shared_ptr<InProcessServer> FindInProcessServer(const std::string& name) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  auto it = registry.servers.find(name);
+  return it == registry.servers.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<grpc::Channel> CreateClosedChannel() {
+  std::vector<
+      std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+      interceptors;
+  interceptors.push_back(std::make_unique<ClosedServerInterceptorFactory>());
+  // The calls never get to the target.
+  return grpc::experimental::CreateCustomChannelWithInterceptors(
+      "unix:/dev/null", grpc::InsecureChannelCredentials(),
+      grpc::ChannelArguments(), std::move(interceptors));
+}
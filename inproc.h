@@ -0,0 +1,74 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_INPROC_H
+#define KVS_INPROC_H
+
+#include <grpcpp/grpcpp.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "keyvaluestore.pb.h"
+
+// Addresses of the form "inproc://name" name a server in the same process.
+constexpr std::string_view kInProcessScheme = "inproc://";
+
+inline bool IsInProcessAddress(std::string_view address) {
+  return address.substr(0, kInProcessScheme.size()) == kInProcessScheme;
+}
+
+// A server in the same process as its clients. The calls below run the
+// server's own handlers on the calling thread, with the same semantics as
+// over gRPC but without serializing the messages or going through a
+// transport. Every other call goes through channel(), gRPC's in-process
+// transport to the server.
+//
+// Once the server shuts down, the calls fail with UNAVAILABLE, and calls
+// blocked waiting for keys give up with CANCELLED. The channel must not be
+// used from then on, see CreateClosedChannel().
+class InProcessServer {
+ public:
+  virtual ~InProcessServer() = default;
+
+  virtual grpc::Status GetValue(const keyvaluestore::GetValueRequest& request,
+                                keyvaluestore::GetValueResponse* response) = 0;
+  virtual grpc::Status SetValue(const keyvaluestore::SetValueRequest& request,
+                                keyvaluestore::SetValueResponse* response) = 0;
+  virtual grpc::Status MultiGetValue(
+      const keyvaluestore::MultiGetValueRequest& request,
+      keyvaluestore::MultiGetValueResponse* response) = 0;
+  virtual grpc::Status MultiSetValue(
+      const keyvaluestore::MultiSetValueRequest& request,
+      keyvaluestore::MultiSetValueResponse* response) = 0;
+  virtual grpc::Status Barrier(const keyvaluestore::BarrierRequest& request,
+                               keyvaluestore::BarrierResponse* response) = 0;
+  virtual grpc::Status Add(const keyvaluestore::AddRequest& request,
+                           keyvaluestore::AddResponse* response) = 0;
+
+  virtual std::shared_ptr<grpc::Channel> channel() = 0;
+  // Whether the server shut down.
+  virtual bool closed() const = 0;
+};
+
+// Returns a channel whose calls fail with UNAVAILABLE without going
+// anywhere, to stand in for the channel of a server that shut down. gRPC's
+// in-process transport crashes on calls to a server that is gone.
+std::shared_ptr<grpc::Channel> CreateClosedChannel();
+
+// Makes `server` reachable at "inproc://<name>". Returns false if the name
+// is taken.
+bool RegisterInProcessServer(const std::string& name,
+                             std::shared_ptr<InProcessServer> server);
+
+// Makes the name available again. Clients that found the server keep it.
+void UnregisterInProcessServer(const std::string& name);
+
+// Returns the server registered as `name`, or nullptr if there is none.
+std::shared_ptr<InProcessServer> FindInProcessServer(const std::string& name);
+
+#endif  // KVS_INPROC_H
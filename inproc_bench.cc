@@ -0,0 +1,86 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Microbenchmarks of a client in the same process as its server, run by
+// kvs_bench. They compare GetValue() and SetValue() called into the server
+// directly with the same calls through gRPC's in-process transport and over
+// TCP.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "client.h"
+#include "inproc.h"
+#include "server.h"
+
+namespace {
+
+constexpr int kNumKeys = 1 << 12;
+
+enum class Transport { kDirect, kInProcessGrpc, kTcp };
+
+KeyValueStoreClient CreateClient(Transport transport,
+                                 KeyValueStoreClientOptions options) {
+  options.cache_max_entries = 0;
+  if (transport == Transport::kTcp) {
+    return KeyValueStoreClient(CreateChannelPool("localhost:50063", options),
+                               options);
+  }
+  options.in_process = FindInProcessServer("bench");
+  options.direct_in_process = transport == Transport::kDirect;
+  return KeyValueStoreClient(CreateChannelPool("inproc://bench", options),
+                             options);
+}
+
+// Gets set keys. The client's cache is disabled.
+template <Transport transport>
+void BM_InProcessGetValue(benchmark::State& state) {
+  KeyValueStoreServer server(
+      transport == Transport::kTcp ? "localhost:50063" : "inproc://bench",
+      KeyValueStoreServerOptions());
+  KeyValueStoreClient client =
+      CreateClient(transport, KeyValueStoreClientOptions());
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    client.SetValue(keys.back(), std::string(32, 'v'));
+  }
+  size_t i = 0;
+  std::string value;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(client.GetValue(keys[i], value));
+    i = (i + 7919) % kNumKeys;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Sets a new key per iteration.
+template <Transport transport>
+void BM_InProcessSetValue(benchmark::State& state) {
+  KeyValueStoreServer server(
+      transport == Transport::kTcp ? "localhost:50063" : "inproc://bench",
+      KeyValueStoreServerOptions());
+  KeyValueStoreClient client =
+      CreateClient(transport, KeyValueStoreClientOptions());
+  std::string value(32, 'v');
+  int64_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        client.SetValue("key" + std::to_string(i++), value));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_InProcessGetValue, Transport::kDirect);
+BENCHMARK_TEMPLATE(BM_InProcessGetValue, Transport::kInProcessGrpc);
+BENCHMARK_TEMPLATE(BM_InProcessGetValue, Transport::kTcp);
+BENCHMARK_TEMPLATE(BM_InProcessSetValue, Transport::kDirect);
+BENCHMARK_TEMPLATE(BM_InProcessSetValue, Transport::kInProcessGrpc);
+BENCHMARK_TEMPLATE(BM_InProcessSetValue, Transport::kTcp);
+
+}  // namespace
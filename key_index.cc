@@ -0,0 +1,146 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "key_index.h"
+
+#include <algorithm>
+
+KeyIndex::KeyIndex() : root_(new Leaf) {}
+
+KeyIndex::~KeyIndex() { Free(root_); }
+
+void KeyIndex::Free(Node* node) {
+  if (node->leaf) {
+    delete static_cast<Leaf*>(node);
+    return;
+  }
+  Inner* inner = static_cast<Inner*>(node);
+  for (int i = 0; i <= inner->size; ++i) {
+    Free(inner->children[i]);
+  }
+  delete inner;
+}
+
+int KeyIndex::LowerBound(const Node& node, std::string_view key) {
+  return std::lower_bound(node.keys, node.keys + node.size, key) - node.keys;
+}
+
+int KeyIndex::UpperBound(const Node& node, std::string_view key) {
+  return std::upper_bound(node.keys, node.keys + node.size, key) - node.keys;
+}
+
+const KeyIndex::Leaf* KeyIndex::FindLeaf(std::string_view key) const {
+  const Node* node = root_;
+  while (!node->leaf) {
+    const Inner* inner = static_cast<const Inner*>(node);
+    node = inner->children[UpperBound(*inner, key)];
+  }
+  return static_cast<const Leaf*>(node);
+}
+
+void KeyIndex::Insert(std::string_view key) {
+  std::string_view separator;
+  Node* right = Insert(root_, key, &separator);
+  if (right != nullptr) {
+    // The root split, so the tree grows a level.
+    Inner* root = new Inner;
+    memory_usage_ += sizeof(Inner);
+    root->size = 1;
+    root->keys[0] = separator;
+    root->children[0] = root_;
+    root->children[1] = right;
+    root_ = root;
+  }
+  ++size_;
+}
+
+KeyIndex::Node* KeyIndex::Insert(Node* node, std::string_view key,
+                                 std::string_view* separator) {
+  if (node->leaf) {
+    return InsertIntoLeaf(static_cast<Leaf*>(node), key, separator);
+  }
+  Inner* inner = static_cast<Inner*>(node);
+  int child = UpperBound(*inner, key);
+  std::string_view right_key;
+  Node* right = Insert(inner->children[child], key, &right_key);
+  if (right == nullptr) {
+    return nullptr;
+  }
+  return InsertIntoInner(inner, child, right, right_key, separator);
+}
+
+KeyIndex::Node* KeyIndex::InsertIntoLeaf(Leaf* leaf, std::string_view key,
+                                         std::string_view* separator) {
+  int pos = LowerBound(*leaf, key);
+  Leaf* target = leaf;
+  Leaf* right = nullptr;
+  if (leaf->size == kMaxKeys) {
+    right = new Leaf;
+    memory_usage_ += sizeof(Leaf);
+    // A key past the end of a full leaf starts a new one, so that keys
+    // inserted in ascending order leave full leaves behind.
+    int split = pos == kMaxKeys ? kMaxKeys : kMaxKeys / 2;
+    std::copy(leaf->keys + split, leaf->keys + kMaxKeys, right->keys);
+    right->size = kMaxKeys - split;
+    leaf->size = split;
+    right->next = leaf->next;
+    leaf->next = right;
+    if (pos >= split) {
+      target = right;
+      pos -= split;
+    }
+  }
+  std::copy_backward(target->keys + pos, target->keys + target->size,
+                     target->keys + target->size + 1);
+  target->keys[pos] = key;
+  ++target->size;
+  if (right != nullptr) {
+    *separator = right->keys[0];
+  }
+  return right;
+}
+
+KeyIndex::Node* KeyIndex::InsertIntoInner(Inner* inner, int child,
+                                          Node* right,
+                                          std::string_view right_key,
+                                          std::string_view* separator) {
+  if (inner->size < kMaxKeys) {
+    std::copy_backward(inner->keys + child, inner->keys + inner->size,
+                       inner->keys + inner->size + 1);
+    std::copy_backward(inner->children + child + 1,
+                       inner->children + inner->size + 1,
+                       inner->children + inner->size + 2);
+    inner->keys[child] = right_key;
+    inner->children[child + 1] = right;
+    ++inner->size;
+    return nullptr;
+  }
+
+  // Lay out the node as it would be with room for one more child, then move
+  // the upper part to a new node and the key between them up.
+  std::string_view keys[kMaxKeys + 1];
+  Node* children[kMaxKeys + 2];
+  std::copy(inner->keys, inner->keys + child, keys);
+  keys[child] = right_key;
+  std::copy(inner->keys + child, inner->keys + kMaxKeys, keys + child + 1);
+  std::copy(inner->children, inner->children + child + 1, children);
+  children[child + 1] = right;
+  std::copy(inner->children + child + 1, inner->children + kMaxKeys + 1,
+            children + child + 2);
+
+  // As with leaves, a child past the end leaves this node full.
+  int mid = child == kMaxKeys ? kMaxKeys : kMaxKeys / 2;
+  Inner* sibling = new Inner;
+  memory_usage_ += sizeof(Inner);
+  std::copy(keys, keys + mid, inner->keys);
+  std::copy(children, children + mid + 1, inner->children);
+  inner->size = mid;
+  *separator = keys[mid];
+  std::copy(keys + mid + 1, keys + kMaxKeys + 1, sibling->keys);
+  std::copy(children + mid + 1, children + kMaxKeys + 2, sibling->children);
+  sibling->size = kMaxKeys - mid;
+  return sibling;
+}
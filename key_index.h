@@ -0,0 +1,100 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_KEY_INDEX_H
+#define KVS_KEY_INDEX_H
+
+#include <cstddef>
+#include <string_view>
+
+// An ordered set of keys that are stored elsewhere, such as in the arenas of
+// an ArenaHashMap, for listing them in order. The keys must outlive the index,
+// and are never removed.
+//
+// A B+ tree: the keys are in leaves of up to kMaxKeys keys, linked in order,
+// under inner nodes of up to kMaxKeys + 1 children. An insert allocates only
+// when a node splits, about once every kMaxKeys / 2 inserts, and only once
+// every kMaxKeys inserts when keys come in ascending order, as numbered keys
+// often do.
+//
+// Not thread-safe; ShardedKeyValueMap locks each shard's index.
+class KeyIndex {
+ public:
+  KeyIndex();
+  ~KeyIndex();
+  KeyIndex(const KeyIndex&) = delete;
+  KeyIndex(KeyIndex&&) = delete;
+  KeyIndex& operator=(const KeyIndex&) = delete;
+  KeyIndex&& operator=(KeyIndex&&) = delete;
+
+  // Adds the key, which must not be in the index yet.
+  void Insert(std::string_view key);
+
+  // Calls `callback(key)` for every key that is not less than `start`, in
+  // ascending order, until it returns false.
+  template <typename Callback>
+  void ScanFrom(std::string_view start, const Callback& callback) const {
+    const Leaf* leaf = FindLeaf(start);
+    for (int i = LowerBound(*leaf, start); leaf != nullptr;
+         leaf = leaf->next, i = 0) {
+      for (; i < leaf->size; ++i) {
+        if (!callback(leaf->keys[i])) {
+          return;
+        }
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  // Returns the bytes held by the nodes.
+  size_t memory_usage() const { return memory_usage_; }
+
+ private:
+  static constexpr int kMaxKeys = 32;
+
+  struct Node {
+    bool leaf;
+    int size = 0;
+    std::string_view keys[kMaxKeys];
+  };
+
+  struct Leaf : Node {
+    Leaf() { leaf = true; }
+    Leaf* next = nullptr;
+  };
+
+  // Child i holds the keys from keys[i - 1] up to keys[i].
+  struct Inner : Node {
+    Inner() { leaf = false; }
+    Node* children[kMaxKeys + 1];
+  };
+
+  // Returns the index of the first key of `node` not less than `key`.
+  static int LowerBound(const Node& node, std::string_view key);
+  // Returns the index of the first key of `node` greater than `key`.
+  static int UpperBound(const Node& node, std::string_view key);
+
+  // Returns the leaf where `key` belongs.
+  const Leaf* FindLeaf(std::string_view key) const;
+
+  // Inserts `key` under `node`. If `node` splits, returns the new node to
+  // its right and stores the lowest key under it to `separator`.
+  Node* Insert(Node* node, std::string_view key, std::string_view* separator);
+  Node* InsertIntoLeaf(Leaf* leaf, std::string_view key,
+                       std::string_view* separator);
+  Node* InsertIntoInner(Inner* inner, int child, Node* right,
+                        std::string_view right_key,
+                        std::string_view* separator);
+
+  void Free(Node* node);
+
+  Node* root_;
+  size_t size_ = 0;
+  size_t memory_usage_ = sizeof(Leaf);
+};
+
+#endif  // KVS_KEY_INDEX_H
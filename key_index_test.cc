@@ -0,0 +1,98 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "key_index.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+std::vector<std::string> Scan(const KeyIndex& index, std::string_view start,
+                              size_t limit) {
+  std::vector<std::string> keys;
+  index.ScanFrom(start, [&](std::string_view key) {
+    keys.emplace_back(key);
+    return keys.size() < limit;
+  });
+  return keys;
+}
+
+TEST(KeyIndexTest, Empty) {
+  KeyIndex index;
+  EXPECT_EQ(index.size(), 0);
+  EXPECT_TRUE(Scan(index, "", 10).empty());
+}
+
+TEST(KeyIndexTest, ScansInOrderFromAnyKey) {
+  std::vector<std::string> keys;
+  for (int i = 0; i < 20000; ++i) {
+    keys.push_back("job/" + std::to_string(i % 7) + "/rank" +
+                   std::to_string(i));
+  }
+  keys.push_back("");
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+  KeyIndex index;
+  std::set<std::string> expected;
+  for (const std::string& key : keys) {
+    index.Insert(key);
+    expected.insert(key);
+  }
+  EXPECT_EQ(index.size(), expected.size());
+  EXPECT_EQ(Scan(index, "", keys.size()),
+            std::vector<std::string>(expected.begin(), expected.end()));
+
+  // Every start, whether it is a key or falls between keys, finds the same
+  // keys as the set.
+  for (std::string start : {"", "job/3/", "job/3/rank17", "job/3/rank17 ",
+                            "job/6/rank9999", "job/7", "zzz"}) {
+    std::vector<std::string> from_set;
+    for (auto it = expected.lower_bound(start);
+         it != expected.end() && from_set.size() < 100; ++it) {
+      from_set.push_back(*it);
+    }
+    EXPECT_EQ(Scan(index, start, 100), from_set) << start;
+  }
+}
+
+TEST(KeyIndexTest, AscendingKeysFillTheNodes) {
+  std::vector<std::string> ascending, shuffled;
+  for (int i = 0; i < 100000; ++i) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%08d", i);
+    ascending.push_back(key);
+  }
+  shuffled = ascending;
+  std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+  KeyIndex in_order, random_order;
+  for (size_t i = 0; i < ascending.size(); ++i) {
+    in_order.Insert(ascending[i]);
+    random_order.Insert(shuffled[i]);
+  }
+  EXPECT_EQ(Scan(in_order, "", ascending.size()), ascending);
+  EXPECT_EQ(Scan(random_order, "", ascending.size()), ascending);
+  // Full leaves take 16 bytes per key, half-full ones twice as much.
+  EXPECT_LT(in_order.memory_usage(), ascending.size() * 18);
+  EXPECT_LT(random_order.memory_usage(), ascending.size() * 36);
+
+  // Descending keys split every leaf in the middle.
+  KeyIndex reversed;
+  for (auto it = ascending.rbegin(); it != ascending.rend(); ++it) {
+    reversed.Insert(*it);
+  }
+  EXPECT_EQ(Scan(reversed, "key00050000", 3),
+            std::vector<std::string>(ascending.begin() + 50000,
+                                     ascending.begin() + 50003));
+}
+
+}  // namespace
+}  // namespace kvs
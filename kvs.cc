@@ -6,20 +6,221 @@
 
 #include "kvs.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "client.h"
+#include "inproc.h"
+#include "log.h"
+#include "metrics.h"
 #include "server.h"
+#include "sharded_client.h"
+#include "shm.h"
 
-static KeyValueStoreClient* CastToKeyValueStoreClient(
+// Returns std::nullopt for KVS_LOG_LEVEL_DEFAULT and unknown levels.
+static std::optional<LogLevel> ToLogLevel(int level) {
+  switch (level) {
+    case KVS_LOG_LEVEL_DEBUG:
+      return LogLevel::kDebug;
+    case KVS_LOG_LEVEL_INFO:
+      return LogLevel::kInfo;
+    case KVS_LOG_LEVEL_WARNING:
+      return LogLevel::kWarning;
+    case KVS_LOG_LEVEL_ERROR:
+      return LogLevel::kError;
+    case KVS_LOG_LEVEL_OFF:
+      return LogLevel::kOff;
+  }
+  return std::nullopt;
+}
+
+static ShardedKeyValueStoreClient* CastToKeyValueStoreClient(
     kvs_client_t* kvs_client) {
-  return (KeyValueStoreClient*)(kvs_client);
+  return (ShardedKeyValueStoreClient*)(kvs_client);
 }
 
-static kvs_client_t* CastToKVSClient(KeyValueStoreClient* client) {
+static kvs_client_t* CastToKVSClient(ShardedKeyValueStoreClient* client) {
   return (kvs_client_t*)(client);
 }
 
+// Splits a list of addresses at `separator`, trimming the spaces around
+// them. Returns std::nullopt if an address is empty.
+static std::optional<std::vector<std::string>> SplitAddresses(
+    std::string_view list, char separator) {
+  std::vector<std::string> addresses;
+  while (true) {
+    size_t end = list.find(separator);
+    std::string_view address = list.substr(0, end);
+    size_t begin = address.find_first_not_of(' ');
+    if (begin == std::string_view::npos) {
+      return std::nullopt;
+    }
+    address = address.substr(begin, address.find_last_not_of(' ') + 1 - begin);
+    addresses.emplace_back(address);
+    if (end == std::string_view::npos) {
+      return addresses;
+    }
+    list.remove_prefix(end + 1);
+  }
+}
+
+// The scheme of kvs_client_create() addresses that name a shared memory
+// segment rather than servers.
+constexpr std::string_view kSharedMemoryScheme = "shm://";
+
+// Parses the servers of kvs_client_create(): a comma-separated list of
+// servers, each of which is a '|'-separated list of replicas. Returns
+// std::nullopt if an address is empty or repeated.
+static std::optional<std::vector<std::vector<std::string>>> ParseServers(
+    const char* addr) {
+  std::optional<std::vector<std::string>> servers = SplitAddresses(addr, ',');
+  if (!servers) {
+    return std::nullopt;
+  }
+  std::vector<std::vector<std::string>> shards;
+  std::vector<std::string> all_addresses;
+  for (const std::string& server : *servers) {
+    std::optional<std::vector<std::string>> replicas =
+        SplitAddresses(server, '|');
+    if (!replicas) {
+      return std::nullopt;
+    }
+    for (const std::string& address : *replicas) {
+      if (std::find(all_addresses.begin(), all_addresses.end(), address) !=
+          all_addresses.end()) {
+        return std::nullopt;
+      }
+      all_addresses.push_back(address);
+    }
+    shards.push_back(std::move(*replicas));
+  }
+  return shards;
+}
+
+// A request started by kvs_client_get_async() or kvs_client_set_async().
+struct kvs_request_t {
+  // Exactly one of the two futures is valid.
+  std::future<KeyValueStoreClient::GetValueResult> get_result;
+  std::future<grpc::Status> set_result;
+  // Where to copy the value of a get.
+  char* value = nullptr;
+  int value_len = 0;
+};
+
+// A value being read by kvs_reader_read(), which may ask for less than a chunk
+// at a time.
+struct kvs_reader_t {
+  std::unique_ptr<KeyValueStoreClient::ValueReader> reader;
+  // The chunk being read and how much of it has been returned.
+  std::string chunk;
+  size_t offset = 0;
+};
+
+static kvs_status_t ToKVSStatus(const grpc::Status& status) {
+  switch (status.error_code()) {
+    case grpc::StatusCode::OK:
+      return KVS_STATUS_OK;
+    case grpc::StatusCode::DEADLINE_EXCEEDED:
+      return KVS_STATUS_DEADLINE_EXCEEDED;
+    case grpc::StatusCode::INVALID_ARGUMENT:
+      return KVS_STATUS_INVALID_ARGUMENT;
+    case grpc::StatusCode::ALREADY_EXISTS:
+      return KVS_STATUS_INVALID_USAGE;
+    case grpc::StatusCode::FAILED_PRECONDITION:
+      // A write sent to a follower.
+      return KVS_STATUS_INVALID_USAGE;
+    case grpc::StatusCode::UNAVAILABLE:
+      return KVS_STATUS_CONNECTION_ERROR;
+    default:
+      // TODO(okkwon): handle error in a more detailed way.
+      return KVS_STATUS_INTERNAL_ERROR;
+  }
+}
+
+// Copies no more than `value_len` bytes of `v` to `value`, and terminates it
+// if there is room.
+static void CopyValue(const std::string& v, char* value, int value_len) {
+  size_t size = std::min(v.size(), static_cast<size_t>(value_len));
+  memcpy(value, v.data(), size);
+  if (size < static_cast<size_t>(value_len)) {
+    value[size] = '\0';
+  }
+}
+
+static_assert(KVS_RPC_COUNT == kNumRpcMethods,
+              "kvs_rpc_t must list the RPCs of RpcMethod");
+
+static void ToKVSLatencyStats(const keyvaluestore::LatencyStats& latency,
+                              kvs_latency_stats_t* stats) {
+  stats->count = latency.count();
+  stats->mean_us = latency.mean_us();
+  stats->p50_us = latency.p50_us();
+  stats->p99_us = latency.p99_us();
+  stats->p999_us = latency.p999_us();
+  stats->max_us = latency.max_us();
+}
+
+static void ToKVSServerStats(const keyvaluestore::GetStatsResponse& response,
+                             kvs_server_stats_t* stats) {
+  *stats = {};
+  for (int i = 0; i < std::min<int>(response.rpcs_size(), KVS_RPC_COUNT);
+       ++i) {
+    ToKVSLatencyStats(response.rpcs(i).latency(), &stats->rpcs[i]);
+  }
+  stats->blocked_waiters = response.blocked_waiters();
+  ToKVSLatencyStats(response.wait_time(), &stats->wait_time);
+  stats->timeouts = response.timeouts();
+  stats->already_exists = response.already_exists();
+  stats->num_keys = response.num_keys();
+  stats->bytes_stored = response.bytes_stored();
+  stats->leader = response.leader();
+  stats->cancelled = response.cancelled();
+  stats->num_namespaces = response.num_namespaces();
+  stats->expired_namespaces = response.expired_namespaces();
+}
+
+static KeyValueStoreClient::ValueView* CastToValueView(kvs_value_t* value) {
+  return (KeyValueStoreClient::ValueView*)(value);
+}
+
+static kvs_value_t* CastToKVSValue(KeyValueStoreClient::ValueView* view) {
+  return (kvs_value_t*)(view);
+}
+
+static KeyValueStoreClient::ValueWriter* CastToValueWriter(
+    kvs_writer_t* kvs_writer) {
+  return (KeyValueStoreClient::ValueWriter*)(kvs_writer);
+}
+
+static kvs_writer_t* CastToKVSWriter(KeyValueStoreClient::ValueWriter* writer) {
+  return (kvs_writer_t*)(writer);
+}
+
+static ShardedKeyValueStoreClient::PrefixWatch* CastToPrefixWatch(
+    kvs_watch_t* kvs_watch) {
+  return (ShardedKeyValueStoreClient::PrefixWatch*)(kvs_watch);
+}
+
+static kvs_watch_t* CastToKVSWatch(
+    ShardedKeyValueStoreClient::PrefixWatch* watch) {
+  return (kvs_watch_t*)(watch);
+}
+
+static ShardedKeyValueStoreClient::KeyList* CastToKeyList(
+    kvs_list_t* kvs_list) {
+  return (ShardedKeyValueStoreClient::KeyList*)(kvs_list);
+}
+
+static kvs_list_t* CastToKVSList(ShardedKeyValueStoreClient::KeyList* list) {
+  return (kvs_list_t*)(list);
+}
+
 static KeyValueStoreServer* CastToKeyValueStoreServer(
     kvs_server_t* kvs_server) {
   return (KeyValueStoreServer*)(kvs_server);
@@ -35,16 +236,96 @@ extern "C" {
 // Client C API
 //------------------------------------------------------------------------------
 
+kvs_status_t kvs_set_log_level(kvs_log_level_t level) {
+  std::optional<LogLevel> log_level = ToLogLevel(level);
+  if (!log_level) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  SetLogLevel(*log_level);
+  return KVS_STATUS_OK;
+}
+
 kvs_status_t kvs_client_create(kvs_client_t** kvs_client, const char* addr,
                                kvs_client_config_t* config) {
+  if (kvs_client == nullptr || addr == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
   *kvs_client = nullptr;
+  KeyValueStoreClientOptions options;
+  std::optional<std::vector<std::vector<std::string>>> shards;
+  std::string_view address(addr);
+  if (address.substr(0, kSharedMemoryScheme.size()) == kSharedMemoryScheme) {
+    std::string error;
+    options.shared_memory = SharedMemoryReader::Open(
+        std::string(address.substr(kSharedMemoryScheme.size())), &error);
+    if (!options.shared_memory) {
+      KVS_LOG(kError) << "Failed to open " << address << ": " << error;
+      return KVS_STATUS_CONNECTION_ERROR;
+    }
+    shards = {{options.shared_memory->server_address()}};
+  } else if (IsInProcessAddress(address)) {
+    options.in_process = FindInProcessServer(
+        std::string(address.substr(kInProcessScheme.size())));
+    if (!options.in_process) {
+      KVS_LOG(kError) << "No server in this process at " << address;
+      return KVS_STATUS_CONNECTION_ERROR;
+    }
+    shards = {{std::string(address)}};
+  } else {
+    shards = ParseServers(addr);
+  }
+  if (!shards) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
 
-  // Instantiate the client. It requires a channel, out of which the actual RPCs
-  // are created. This channel models a connection to an endpoint. We indicate
-  // that the channel isn't authenticated (use of InsecureChannelCredentials()).
-  auto channel = grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
-
-  KeyValueStoreClient* client = new KeyValueStoreClient(channel);
+  if (config != nullptr) {
+    if (config->cache_max_entries != 0) {
+      options.cache_max_entries = std::max(config->cache_max_entries, 0LL);
+    }
+    if (config->cache_max_bytes != 0) {
+      options.cache_max_bytes = std::max(config->cache_max_bytes, 0LL);
+    }
+    options.log_level = ToLogLevel(config->log_level);
+    if (config->connection_timeout_ms > 0) {
+      options.connection_timeout =
+          std::chrono::milliseconds(config->connection_timeout_ms);
+    }
+    if (config->channels_per_server > 0) {
+      options.channels_per_replica = config->channels_per_server;
+    }
+    if (config->keepalive_time_ms > 0) {
+      options.keepalive_time =
+          std::chrono::milliseconds(config->keepalive_time_ms);
+    }
+    if (config->keepalive_timeout_ms > 0) {
+      options.keepalive_timeout =
+          std::chrono::milliseconds(config->keepalive_timeout_ms);
+    }
+    if (config->max_message_size > 0) {
+      options.max_message_size = config->max_message_size;
+    }
+    switch (config->compression) {
+      case KVS_CODEC_NONE:
+        break;
+      case KVS_CODEC_ZLIB:
+        options.compression = Codec::kZlib;
+        break;
+      default:
+        return KVS_STATUS_INVALID_ARGUMENT;
+    }
+    if (config->compression_threshold > 0) {
+      options.compression_threshold = config->compression_threshold;
+    }
+    if (config->inproc_grpc) {
+      // Every call goes through the server's in-process channel.
+      options.direct_in_process = false;
+    }
+  }
+  // Instantiate the client. It creates a pool of channels per replica, out
+  // of which the actual RPCs are created, and connects them. The channels
+  // aren't authenticated.
+  ShardedKeyValueStoreClient* client =
+      new ShardedKeyValueStoreClient(*shards, options);
   if (!client) {
     return KVS_STATUS_INTERNAL_ERROR;
   }
@@ -55,7 +336,7 @@ kvs_status_t kvs_client_create(kvs_client_t** kvs_client, const char* addr,
 
 kvs_status_t kvs_client_destroy(kvs_client_t** kvs_client) {
   if (*kvs_client) {
-    KeyValueStoreClient* client = CastToKeyValueStoreClient(*kvs_client);
+    ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(*kvs_client);
     delete client;
     *kvs_client = nullptr;
   }
@@ -64,38 +345,499 @@ kvs_status_t kvs_client_destroy(kvs_client_t** kvs_client) {
 
 kvs_status_t kvs_client_get(kvs_client_t* kvs_client, const char* key,
                             int key_len, char* value, int value_len) {
+  return kvs_client_get_with_timeout(kvs_client, key, key_len, value,
+                                     value_len, /*timeout_ms=*/0);
+}
+
+kvs_status_t kvs_client_get_with_timeout(kvs_client_t* kvs_client,
+                                         const char* key, int key_len,
+                                         char* value, int value_len,
+                                         long long timeout_ms) {
+  if (kvs_client == nullptr || key == nullptr || key_len < 0 ||
+      value == nullptr || value_len < 0 || timeout_ms < 0) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
   std::string key_str(key, key_len), v;
-  KeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
-  grpc::Status status = client->GetValue(key_str, v);
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  grpc::Status status = client->ForKey(key_str)->GetValue(
+      key_str, v, std::chrono::milliseconds(timeout_ms));
   if (status.ok()) {
-    memcpy(value, v.data(), value_len);
+    CopyValue(v, value, value_len);
     return KVS_STATUS_OK;
-  } else {
-    printf("grpc::StatusCode = %d\n", status.error_code());
-    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
-      return KVS_STATUS_DEADLINE_EXCEEDED;
-    } else {
-      // TODO(okkwon): handle error in a more detailed way.
-      return KVS_STATUS_INTERNAL_ERROR;
-    }
   }
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_client_get_view(kvs_client_t* kvs_client, const char* key,
+                                 int key_len, kvs_value_t** value,
+                                 const char** data, long long* size) {
+  if (kvs_client == nullptr || key == nullptr || value == nullptr ||
+      data == nullptr || size == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  auto view = std::make_unique<KeyValueStoreClient::ValueView>();
+  std::string key_str(key, key_len);
+  grpc::Status status = client->ForKey(key_str)->GetValueView(key_str, *view);
+  if (!status.ok()) {
+    return ToKVSStatus(status);
+  }
+  *data = view->data();
+  *size = view->size();
+  *value = CastToKVSValue(view.release());
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_value_release(kvs_value_t** value) {
+  if (value == nullptr || *value == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  delete CastToValueView(*value);
+  *value = nullptr;
+  return KVS_STATUS_OK;
 }
 
 kvs_status_t kvs_client_set(kvs_client_t* kvs_client, const char* key,
                             int key_len, const char* value, int value_len) {
-  KeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  return kvs_client_set_with_timeout(kvs_client, key, key_len, value,
+                                     value_len, /*timeout_ms=*/0);
+}
+
+kvs_status_t kvs_client_set_with_timeout(kvs_client_t* kvs_client,
+                                         const char* key, int key_len,
+                                         const char* value, int value_len,
+                                         long long timeout_ms) {
+  if (kvs_client == nullptr || key == nullptr || key_len < 0 ||
+      value == nullptr || value_len < 0 || timeout_ms < 0) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
   std::string key_str(key, key_len), value_str(value, value_len);
-  grpc::Status status = client->SetValue(key_str, value_str);
+  grpc::Status status = client->ForKey(key_str)->SetValue(
+      key_str, value_str, std::chrono::milliseconds(timeout_ms));
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_client_multi_get(kvs_client_t* kvs_client, int num_keys,
+                                  const char* const* keys, const int* key_lens,
+                                  char* const* values, const int* value_lens,
+                                  int* found, long long* value_sizes,
+                                  kvs_wait_mode_t wait_mode) {
+  return kvs_client_multi_get_with_timeout(kvs_client, num_keys, keys,
+                                           key_lens, values, value_lens, found,
+                                           value_sizes, wait_mode,
+                                           /*timeout_ms=*/0);
+}
+
+kvs_status_t kvs_client_multi_get_with_timeout(
+    kvs_client_t* kvs_client, int num_keys, const char* const* keys,
+    const int* key_lens, char* const* values, const int* value_lens,
+    int* found, long long* value_sizes, kvs_wait_mode_t wait_mode,
+    long long timeout_ms) {
+  if (kvs_client == nullptr || num_keys < 0 || timeout_ms < 0 ||
+      (num_keys > 0 && (keys == nullptr || key_lens == nullptr ||
+                        values == nullptr || value_lens == nullptr ||
+                        found == nullptr))) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  for (int i = 0; i < num_keys; ++i) {
+    if (keys[i] == nullptr || key_lens[i] < 0 || values[i] == nullptr ||
+        value_lens[i] < 0) {
+      return KVS_STATUS_INVALID_ARGUMENT;
+    }
+  }
+
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::vector<std::string> key_strs;
+  key_strs.reserve(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    key_strs.emplace_back(keys[i], key_lens[i]);
+  }
+  std::vector<std::optional<std::string>> vs;
+  grpc::Status status =
+      client->MultiGetValue(key_strs, vs, wait_mode == KVS_WAIT_ANY,
+                            std::chrono::milliseconds(timeout_ms));
+  if (!status.ok()) {
+    return ToKVSStatus(status);
+  }
+  for (int i = 0; i < num_keys; ++i) {
+    found[i] = vs[i].has_value();
+    if (vs[i]) {
+      CopyValue(*vs[i], values[i], value_lens[i]);
+    }
+    if (value_sizes != nullptr) {
+      value_sizes[i] = vs[i] ? vs[i]->size() : 0;
+    }
+  }
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_multi_set(kvs_client_t* kvs_client, int num_keys,
+                                  const char* const* keys, const int* key_lens,
+                                  const char* const* values,
+                                  const int* value_lens) {
+  if (kvs_client == nullptr || num_keys < 0 ||
+      (num_keys > 0 && (keys == nullptr || key_lens == nullptr ||
+                        values == nullptr || value_lens == nullptr))) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::vector<std::pair<std::string, std::string>> key_values;
+  key_values.reserve(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    key_values.emplace_back(std::string(keys[i], key_lens[i]),
+                            std::string(values[i], value_lens[i]));
+  }
+  return ToKVSStatus(client->MultiSetValue(key_values));
+}
+
+kvs_status_t kvs_client_barrier(kvs_client_t* kvs_client, const char* name,
+                                int name_len, long long world_size,
+                                long long timeout_ms) {
+  if (kvs_client == nullptr || name == nullptr || world_size <= 0 ||
+      timeout_ms < 0) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::string name_str(name, name_len);
+  return ToKVSStatus(client->ForKey(name_str)->Barrier(
+      name_str, world_size, std::chrono::milliseconds(timeout_ms)));
+}
+
+kvs_status_t kvs_client_add(kvs_client_t* kvs_client, const char* key,
+                            int key_len, long long delta, long long* value) {
+  if (kvs_client == nullptr || key == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  int64_t new_value = 0;
+  std::string key_str(key, key_len);
+  grpc::Status status = client->ForKey(key_str)->Add(key_str, delta, new_value);
+  if (status.ok() && value != nullptr) {
+    *value = new_value;
+  }
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_client_open_namespace(kvs_client_t* kvs_client,
+                                       const char* name, int name_len,
+                                       long long ttl_ms) {
+  if (kvs_client == nullptr || name == nullptr || ttl_ms < 0) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  bool opened = false;
+  return ToKVSStatus(client->OpenNamespace(
+      std::string(name, name_len), std::chrono::milliseconds(ttl_ms), opened));
+}
+
+kvs_status_t kvs_client_drop_namespace(kvs_client_t* kvs_client,
+                                       const char* name, int name_len) {
+  if (kvs_client == nullptr || name == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  bool dropped = false;
+  return ToKVSStatus(
+      client->DropNamespace(std::string(name, name_len), dropped));
+}
+
+kvs_status_t kvs_client_get_cache_stats(kvs_client_t* kvs_client,
+                                        kvs_cache_stats_t* stats) {
+  if (kvs_client == nullptr || stats == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  ValueCache::Stats cache_stats = client->cache_stats();
+  stats->hits = cache_stats.hits;
+  stats->misses = cache_stats.misses;
+  stats->evictions = cache_stats.evictions;
+  stats->entries = cache_stats.entries;
+  stats->bytes = cache_stats.bytes;
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_get_server_stats(kvs_client_t* kvs_client,
+                                         kvs_server_stats_t* stats) {
+  if (kvs_client == nullptr || stats == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  keyvaluestore::GetStatsResponse response;
+  grpc::Status status = client->GetStats(response);
   if (status.ok()) {
-    return KVS_STATUS_OK;
+    ToKVSServerStats(response, stats);
+  }
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_client_cache_erase(kvs_client_t* kvs_client, const char* key,
+                                    int key_len) {
+  if (kvs_client == nullptr || key == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::string key_str(key, key_len);
+  client->ForKey(key_str)->cache()->Erase(key_str);
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_cache_invalidate(kvs_client_t* kvs_client) {
+  if (kvs_client == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  CastToKeyValueStoreClient(kvs_client)->InvalidateCaches();
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_get_async(kvs_client_t* kvs_client, const char* key,
+                                  int key_len, char* value, int value_len,
+                                  kvs_request_t** request) {
+  if (kvs_client == nullptr || key == nullptr || key_len < 0 ||
+      value == nullptr || value_len < 0 || request == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  *request = new kvs_request_t;
+  std::string key_str(key, key_len);
+  (*request)->get_result = client->ForKey(key_str)->GetValueAsync(key_str);
+  (*request)->value = value;
+  (*request)->value_len = value_len;
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_set_async(kvs_client_t* kvs_client, const char* key,
+                                  int key_len, const char* value,
+                                  int value_len, kvs_request_t** request) {
+  if (kvs_client == nullptr || key == nullptr || request == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  *request = new kvs_request_t;
+  std::string key_str(key, key_len);
+  (*request)->set_result = client->ForKey(key_str)->SetValueAsync(
+      key_str, std::string(value, value_len));
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_request_wait(kvs_request_t** request) {
+  if (request == nullptr || *request == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  kvs_request_t* req = *request;
+  grpc::Status status;
+  if (req->get_result.valid()) {
+    KeyValueStoreClient::GetValueResult result = req->get_result.get();
+    status = result.status;
+    if (status.ok()) {
+      CopyValue(result.value, req->value, req->value_len);
+    }
   } else {
-    if (status.error_code() == grpc::StatusCode::ALREADY_EXISTS) {
-      return KVS_STATUS_INVALID_USAGE;
-    } else {
-      // TODO(okkwon): add more error types to give more useful info.
-      return KVS_STATUS_INTERNAL_ERROR;
+    status = req->set_result.get();
+  }
+  delete req;
+  *request = nullptr;
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_request_test(kvs_request_t** request) {
+  if (request == nullptr || *request == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  kvs_request_t* req = *request;
+  std::future_status ready =
+      req->get_result.valid()
+          ? req->get_result.wait_for(std::chrono::seconds(0))
+          : req->set_result.wait_for(std::chrono::seconds(0));
+  if (ready != std::future_status::ready) {
+    return KVS_STATUS_IN_PROGRESS;
+  }
+  return kvs_request_wait(request);
+}
+
+kvs_status_t kvs_client_watch_prefix(kvs_client_t* kvs_client,
+                                     const char* prefix, int prefix_len,
+                                     long long max_keys, kvs_watch_t** watch) {
+  if (kvs_client == nullptr || prefix == nullptr || watch == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  *watch = CastToKVSWatch(
+      client->WatchPrefix(std::string(prefix, prefix_len), max_keys)
+          .release());
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_watch_next(kvs_watch_t* watch, char* key, int* key_len,
+                            char* value, int* value_len) {
+  if (watch == nullptr || key_len == nullptr || value_len == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient::PrefixWatch* prefix_watch =
+      CastToPrefixWatch(watch);
+  std::string k, v;
+  if (!prefix_watch->Next(k, v)) {
+    grpc::Status status = prefix_watch->Finish();
+    return status.ok() ? KVS_STATUS_END_OF_STREAM : ToKVSStatus(status);
+  }
+  memcpy(key, k.data(), std::min<size_t>(*key_len, k.size()));
+  memcpy(value, v.data(), std::min<size_t>(*value_len, v.size()));
+  *key_len = k.size();
+  *value_len = v.size();
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_watch_destroy(kvs_watch_t** watch) {
+  if (watch == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  if (*watch) {
+    delete CastToPrefixWatch(*watch);
+    *watch = nullptr;
+  }
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_list_keys(kvs_client_t* kvs_client,
+                                  const char* prefix, int prefix_len,
+                                  const char* start_after, int start_after_len,
+                                  long long limit, int with_values,
+                                  kvs_list_t** list) {
+  if (kvs_client == nullptr || prefix == nullptr || list == nullptr ||
+      (start_after == nullptr && start_after_len > 0)) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::string after;
+  if (start_after != nullptr) {
+    after.assign(start_after, start_after_len);
+  }
+  *list = CastToKVSList(client
+                            ->ListKeys(std::string(prefix, prefix_len),
+                                       std::move(after), limit,
+                                       with_values != 0)
+                            .release());
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_list_next(kvs_list_t* list, char* key, int* key_len,
+                           char* value, int* value_len) {
+  if (list == nullptr || key_len == nullptr || value_len == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient::KeyList* key_list = CastToKeyList(list);
+  std::string k, v;
+  if (!key_list->Next(k, v)) {
+    grpc::Status status = key_list->Finish();
+    return status.ok() ? KVS_STATUS_END_OF_STREAM : ToKVSStatus(status);
+  }
+  memcpy(key, k.data(), std::min<size_t>(*key_len, k.size()));
+  memcpy(value, v.data(), std::min<size_t>(*value_len, v.size()));
+  *key_len = k.size();
+  *value_len = v.size();
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_list_destroy(kvs_list_t** list) {
+  if (list == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  if (*list) {
+    delete CastToKeyList(*list);
+    *list = nullptr;
+  }
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_set_stream(kvs_client_t* kvs_client, const char* key,
+                                   int key_len, kvs_writer_t** writer) {
+  if (kvs_client == nullptr || key == nullptr || writer == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  std::string key_str(key, key_len);
+  *writer = CastToKVSWriter(
+      client->ForKey(key_str)->SetValueStream(key_str).release());
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_writer_write(kvs_writer_t* writer, const char* data,
+                              long long size) {
+  if (writer == nullptr || size < 0 || (size > 0 && data == nullptr)) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  KeyValueStoreClient::ValueWriter* value_writer = CastToValueWriter(writer);
+  if (!value_writer->Write(data, size)) {
+    grpc::Status status = value_writer->Finish();
+    return status.ok() ? KVS_STATUS_INTERNAL_ERROR : ToKVSStatus(status);
+  }
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_writer_close(kvs_writer_t** writer) {
+  if (writer == nullptr || *writer == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  KeyValueStoreClient::ValueWriter* value_writer = CastToValueWriter(*writer);
+  grpc::Status status = value_writer->Finish();
+  delete value_writer;
+  *writer = nullptr;
+  return ToKVSStatus(status);
+}
+
+kvs_status_t kvs_writer_abort(kvs_writer_t** writer) {
+  if (writer == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  if (*writer) {
+    delete CastToValueWriter(*writer);
+    *writer = nullptr;
+  }
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_client_get_stream(kvs_client_t* kvs_client, const char* key,
+                                   int key_len, kvs_reader_t** reader) {
+  if (kvs_client == nullptr || key == nullptr || reader == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  ShardedKeyValueStoreClient* client = CastToKeyValueStoreClient(kvs_client);
+  *reader = new kvs_reader_t;
+  std::string key_str(key, key_len);
+  (*reader)->reader = client->ForKey(key_str)->GetValueStream(key_str);
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_reader_read(kvs_reader_t* reader, char* buffer,
+                             long long* size) {
+  if (reader == nullptr || size == nullptr || *size < 0 ||
+      (*size > 0 && buffer == nullptr)) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  // Skip empty chunks so that a read returns no bytes only at the end.
+  while (reader->offset == reader->chunk.size()) {
+    reader->offset = 0;
+    if (!reader->reader->Read(reader->chunk)) {
+      reader->chunk.clear();
+      *size = 0;
+      grpc::Status status = reader->reader->Finish();
+      return status.ok() ? KVS_STATUS_END_OF_STREAM : ToKVSStatus(status);
     }
   }
+  size_t n = std::min<size_t>(*size, reader->chunk.size() - reader->offset);
+  memcpy(buffer, reader->chunk.data() + reader->offset, n);
+  reader->offset += n;
+  *size = n;
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_reader_destroy(kvs_reader_t** reader) {
+  if (reader == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  delete *reader;
+  *reader = nullptr;
   return KVS_STATUS_OK;
 }
 
@@ -110,12 +852,64 @@ kvs_status_t kvs_server_create(kvs_server_t** kvs_server, const char* addr,
   }
 
   *kvs_server = nullptr;
-  KeyValueStoreServerOptions options = {
-      .timeout_in_ms = std::chrono::milliseconds(config->timeout_ms)};
+  KeyValueStoreServerOptions options;
+  options.timeout_in_ms = std::chrono::milliseconds(config->timeout_ms);
+  if (config->num_shards > 0) {
+    options.num_shards = config->num_shards;
+  }
+  options.async_mode = config->async_mode != 0;
+  if (config->num_polling_threads > 0) {
+    options.num_polling_threads = config->num_polling_threads;
+  }
+  if (config->wal_dir != nullptr) {
+    options.wal_dir = config->wal_dir;
+  }
+  if (config->snapshot_interval_ms != 0) {
+    options.snapshot_interval =
+        std::chrono::milliseconds(std::max(config->snapshot_interval_ms, 0LL));
+  }
+  options.log_level = ToLogLevel(config->log_level);
+  if (config->replicas != nullptr) {
+    std::optional<std::vector<std::string>> replicas =
+        SplitAddresses(config->replicas, '|');
+    if (!replicas) {
+      return KVS_STATUS_INVALID_ARGUMENT;
+    }
+    options.replicas = std::move(*replicas);
+  }
+  if (config->upstream != nullptr) {
+    std::optional<std::vector<std::vector<std::string>>> upstream =
+        ParseServers(config->upstream);
+    if (!upstream) {
+      return KVS_STATUS_INVALID_ARGUMENT;
+    }
+    options.upstream = std::move(*upstream);
+  }
+  if (config->proxy_cache_max_entries != 0) {
+    options.proxy_cache_max_entries =
+        std::max(config->proxy_cache_max_entries, 0LL);
+  }
+  if (config->proxy_cache_max_bytes != 0) {
+    options.proxy_cache_max_bytes =
+        std::max(config->proxy_cache_max_bytes, 0LL);
+  }
+  if (config->shm_name != nullptr) {
+    options.shm_name = config->shm_name;
+  }
+  if (config->shm_size > 0) {
+    options.shm_size = config->shm_size;
+  }
+  if (config->max_message_size > 0) {
+    options.max_message_size = config->max_message_size;
+  }
   KeyValueStoreServer* server = new KeyValueStoreServer(addr, options);
   if (!server) {
     return KVS_STATUS_INTERNAL_ERROR;
   }
+  if (!server->ok()) {
+    delete server;
+    return KVS_STATUS_SYSTEM_ERROR;
+  }
   *kvs_server = CastToKVSServer(server);
   return KVS_STATUS_OK;
 }
@@ -126,6 +920,26 @@ kvs_status_t kvs_server_wait(kvs_server_t* kvs_server) {
   return KVS_STATUS_OK;
 }
 
+kvs_status_t kvs_server_promote(kvs_server_t* kvs_server) {
+  if (kvs_server == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  CastToKeyValueStoreServer(kvs_server)->Promote();
+  return KVS_STATUS_OK;
+}
+
+kvs_status_t kvs_server_get_stats(kvs_server_t* kvs_server,
+                                  kvs_server_stats_t* stats) {
+  if (kvs_server == nullptr || stats == nullptr) {
+    return KVS_STATUS_INVALID_ARGUMENT;
+  }
+  KeyValueStoreServer* server = CastToKeyValueStoreServer(kvs_server);
+  keyvaluestore::GetStatsResponse response;
+  server->GetStats(&response);
+  ToKVSServerStats(response, stats);
+  return KVS_STATUS_OK;
+}
+
 kvs_status_t kvs_server_destroy(kvs_server_t** kvs_server) {
   if (kvs_server == nullptr) {
     return KVS_STATUS_INVALID_ARGUMENT;
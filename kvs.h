@@ -21,38 +21,443 @@ typedef enum {
   KVS_STATUS_SYSTEM_ERROR = 6,
   KVS_STATUS_SERVER_ERROR = 7,
   KVS_STATUS_CONNECTION_ERROR = 8,
-  KVS_STATUS_NUM = 9,
+  KVS_STATUS_END_OF_STREAM = 9,
+  KVS_STATUS_NUM = 10,
 } kvs_status_t;
 
+/* Levels of the records that the client and server log to stderr. The level
+ * is shared by every client and server of the process. */
+typedef enum {
+  KVS_LOG_LEVEL_DEFAULT = 0, /* leaves the level as it is, initially WARNING */
+  KVS_LOG_LEVEL_DEBUG = 1,   /* every get and set */
+  KVS_LOG_LEVEL_INFO = 2,    /* failed calls and server events */
+  KVS_LOG_LEVEL_WARNING = 3,
+  KVS_LOG_LEVEL_ERROR = 4,
+  KVS_LOG_LEVEL_OFF = 5,
+} kvs_log_level_t;
+
+/* Sets the level below which records are not logged. */
+kvs_status_t kvs_set_log_level(kvs_log_level_t level);
+
+/* How a client compresses the values it sets. Values are decompressed by the
+ * clients that get them whatever their own codec is. */
+typedef enum {
+  KVS_CODEC_NONE = 0,
+  KVS_CODEC_ZLIB = 1, /* deflate at its fastest level */
+} kvs_codec_t;
+
 typedef struct {
-  long long connection_timeout_ms; /* timeout for connection */
+  /* how much longer than their timeout calls wait for the server, to connect
+   * and get the response, 0 for default */
+  long long connection_timeout_ms;
+  long long cache_max_entries;     /* 0 for default, < 0 to disable cache */
+  long long cache_max_bytes;       /* 0 for default, < 0 to disable cache */
+  int log_level;                   /* a kvs_log_level_t */
+  /* connections to each server, which calls are spread over, 0 for 1 */
+  int channels_per_server;
+  /* how often idle connections are pinged, 0 for never and 1000 at least,
+   * and how long a ping may go unanswered, 0 for 20 s */
+  long long keepalive_time_ms;
+  long long keepalive_timeout_ms;
+  /* largest message sent or received, 0 for gRPC's default; a server only
+   * receives messages of up to its own max_message_size */
+  int max_message_size;
+  /* a kvs_codec_t to compress values of at least `compression_threshold`
+   * bytes with, 0 for 4 KiB, if they shrink; the server stores them
+   * compressed. Values set with kvs_client_set_stream are not compressed. */
+  int compression;
+  long long compression_threshold;
+  /* with "inproc://name", send every call through gRPC's in-process
+   * transport instead of calling into the server directly if != 0 */
+  int inproc_grpc;
 } kvs_client_config_t;
 
 /* These are a C wrapper for the KVS client and server. */
 typedef struct kvs_client_t kvs_client_t;
 
+/* `addr` is a server address, or a comma-separated list of addresses of
+ * servers that the keys are spread across by consistent hashing. Calls on one
+ * key or barrier go to a single server, and multi-key calls go to the servers
+ * of their keys in parallel. Every client must list the same addresses, in
+ * any order, and the cache budget is split across them. Returns
+ * KVS_STATUS_INVALID_ARGUMENT if an address is empty or repeated.
+ *
+ * A server may be given as a '|'-separated list of replicas, such as
+ * "host1:50051|host2:50051", listed in the same order by every client. Reads
+ * are spread across the replicas, and calls fail over to the next replica
+ * while one is down or is a follower, for up to 10 seconds. A set that is
+ * retried succeeds if the key holds the same value already. kvs_client_add
+ * and kvs_client_barrier are not retried once a replica may have counted
+ * them, and return KVS_STATUS_CONNECTION_ERROR instead; the next call then
+ * starts at the next replica.
+ *
+ * "shm://name" connects to the server on the same host that publishes its
+ * values to the shared memory segment `name`, see kvs_server_config_t.
+ * kvs_client_get and kvs_client_get_view read the published values straight
+ * from the segment and wait there for the missing ones, and every other call
+ * goes to the server. Returns KVS_STATUS_CONNECTION_ERROR if there is no such
+ * segment.
+ *
+ * "inproc://name" connects to the server created in the same process with
+ * that address. kvs_client_get, kvs_client_set, kvs_client_multi_get,
+ * kvs_client_multi_set, kvs_client_barrier and kvs_client_add then call into
+ * the server on the calling thread, without serializing or sending anything,
+ * and every other call goes through gRPC's in-process transport. Returns
+ * KVS_STATUS_CONNECTION_ERROR if there is no such server.
+ *
+ * The client connects to every server before it returns, or gives up on the
+ * ones it could not connect to within `connection_timeout_ms`, which the
+ * first calls then connect to. */
 kvs_status_t kvs_client_create(kvs_client_t** kvs_client, const char* addr,
                                kvs_client_config_t* config);
 
 kvs_status_t kvs_client_destroy(kvs_client_t** kvs_client);
 
+/* Copies at most `value_len` bytes of the value to `value`, followed by a
+ * terminating NUL if there is room. */
 kvs_status_t kvs_client_get(kvs_client_t* kvs_client, const char* key,
                             int key_len, char* value, int value_len);
 
+/* Like kvs_client_get, but the server waits up to `timeout_ms` for the key to
+ * be set rather than for its own timeout, which is used if it is 0. Returns
+ * KVS_STATUS_DEADLINE_EXCEEDED once it runs out, and stops the server's wait
+ * if the server has not answered `connection_timeout_ms` after that. */
+kvs_status_t kvs_client_get_with_timeout(kvs_client_t* kvs_client,
+                                         const char* key, int key_len,
+                                         char* value, int value_len,
+                                         long long timeout_ms);
+
+/* A value borrowed from the buffer it was received into. */
+typedef struct kvs_value_t kvs_value_t;
+
+/* Gets the value of a key without copying it to a caller buffer. `*data` and
+ * `*size` point to the value, which stays valid until `*value` is released
+ * with kvs_value_release(). Unlike kvs_client_get, it bypasses the cache. */
+kvs_status_t kvs_client_get_view(kvs_client_t* kvs_client, const char* key,
+                                 int key_len, kvs_value_t** value,
+                                 const char** data, long long* size);
+
+/* Frees a value returned by kvs_client_get_view(). */
+kvs_status_t kvs_value_release(kvs_value_t** value);
+
 kvs_status_t kvs_client_set(kvs_client_t* kvs_client, const char* key,
                             int key_len, const char* value, int value_len);
 
+/* Like kvs_client_set, but returns KVS_STATUS_DEADLINE_EXCEEDED if the server
+ * has not taken the value `timeout_ms` plus `connection_timeout_ms` after the
+ * call. There is no limit if it is 0. */
+kvs_status_t kvs_client_set_with_timeout(kvs_client_t* kvs_client,
+                                         const char* key, int key_len,
+                                         const char* value, int value_len,
+                                         long long timeout_ms);
+
+/* Blocks until `world_size` clients have called this with the same name, or
+ * returns KVS_STATUS_DEADLINE_EXCEEDED after `timeout_ms`; the server's timeout
+ * is used if it is 0. A name can be reused once a round has been released. */
+kvs_status_t kvs_client_barrier(kvs_client_t* kvs_client, const char* name,
+                                int name_len, long long world_size,
+                                long long timeout_ms);
+
+/* Atomically adds `delta` to the counter `key`, which starts at 0, and returns
+ * the new value in `*value` if it is not NULL. Counters are separate from the
+ * keys set with kvs_client_set. */
+kvs_status_t kvs_client_add(kvs_client_t* kvs_client, const char* key,
+                            int key_len, long long delta, long long* value);
+
+/* Opens the namespace `name` on every server, so that the keys, counters and
+ * barriers named "<name>/..." from now on can be dropped together once a job
+ * is done with them. Calling it again renews the namespace's lease: the
+ * servers drop the namespace `ttl_ms` after the last call, or only with
+ * kvs_client_drop_namespace if it is 0. Keys outside of the namespaces are
+ * never dropped, including those set under the name before it was opened,
+ * which can still be read but not set again. Returns
+ * KVS_STATUS_INVALID_ARGUMENT if the name is empty or contains '/'.
+ *
+ * A name should not be reused once dropped, since other clients may still
+ * have the old values cached. */
+kvs_status_t kvs_client_open_namespace(kvs_client_t* kvs_client,
+                                       const char* name, int name_len,
+                                       long long ttl_ms);
+
+/* Drops the keys of a namespace from every server, and the values of the
+ * client's cache. Calls waiting for keys of the namespace keep waiting. Does
+ * nothing if the namespace is not open. */
+kvs_status_t kvs_client_drop_namespace(kvs_client_t* kvs_client,
+                                       const char* name, int name_len);
+
 typedef struct {
-  long long timeout_ms; /* timeout for kvs_get and kvs_set */
+  long long hits;      /* kvs_client_get calls served from the cache */
+  long long misses;    /* kvs_client_get calls that went to the server */
+  long long evictions; /* values dropped to stay within budget */
+  long long entries;   /* values in the cache */
+  long long bytes;     /* size of the keys and values in the cache */
+} kvs_cache_stats_t;
+
+/* Reports how well the client's cache of values works. Values are cached
+ * when kvs_client_get or kvs_client_multi_get finds them and when
+ * kvs_client_set succeeds. */
+kvs_status_t kvs_client_get_cache_stats(kvs_client_t* kvs_client,
+                                        kvs_cache_stats_t* stats);
+
+/* Drops the cached value of a key. Keys are write-once, so this is only
+ * needed if a key may have been set again, e.g. after a server restart
+ * without a write-ahead log. */
+kvs_status_t kvs_client_cache_erase(kvs_client_t* kvs_client, const char* key,
+                                    int key_len);
+
+/* Drops every cached value, including the ones of gets in flight. */
+kvs_status_t kvs_client_cache_invalidate(kvs_client_t* kvs_client);
+
+/* The RPCs of the server, which index kvs_server_stats_t.rpcs. */
+typedef enum {
+  KVS_RPC_GET_VALUE = 0,
+  KVS_RPC_SET_VALUE,
+  KVS_RPC_MULTI_GET_VALUE,
+  KVS_RPC_MULTI_SET_VALUE,
+  KVS_RPC_WATCH_PREFIX,
+  KVS_RPC_BARRIER,
+  KVS_RPC_ADD,
+  KVS_RPC_SET_VALUE_STREAM,
+  KVS_RPC_GET_VALUE_STREAM,
+  KVS_RPC_GET_STATS,
+  KVS_RPC_REPLICATE,
+  KVS_RPC_OPEN_NAMESPACE,
+  KVS_RPC_DROP_NAMESPACE,
+  KVS_RPC_LIST_KEYS,
+  KVS_RPC_COUNT
+} kvs_rpc_t;
+
+/* A summary of a latency histogram. Percentiles are accurate to within 25%. */
+typedef struct {
+  long long count;
+  double mean_us;
+  double p50_us;
+  double p99_us;
+  double p999_us;
+  double max_us;
+} kvs_latency_stats_t;
+
+typedef struct {
+  kvs_latency_stats_t rpcs[KVS_RPC_COUNT]; /* calls and their latency */
+  long long blocked_waiters;     /* calls waiting for keys not set yet */
+  kvs_latency_stats_t wait_time; /* how long calls waited for their keys */
+  long long timeouts;            /* calls that exceeded their time limit */
+  long long already_exists;      /* sets rejected for existing keys */
+  long long num_keys;            /* keys set */
+  long long bytes_stored;        /* size of the keys and values */
+  int leader;                    /* != 0 unless the server is a follower */
+  long long cancelled;           /* waiting calls cancelled by clients */
+  long long num_namespaces;      /* namespaces open */
+  long long expired_namespaces;  /* namespaces dropped as their lease expired */
+} kvs_server_stats_t;
+
+/* Fetches the counters and latency histograms of the server. */
+kvs_status_t kvs_client_get_server_stats(kvs_client_t* kvs_client,
+                                         kvs_server_stats_t* stats);
+
+/* A get or set started without blocking. Any number of requests can be in
+ * flight on a client at the same time. Every request must be completed with
+ * kvs_request_wait() or kvs_request_test() before the client is destroyed.
+ * Requests fail over to another replica like blocking calls. With an
+ * in-process server, gets go through its transport rather than calling into
+ * it directly, which would block. */
+typedef struct kvs_request_t kvs_request_t;
+
+/* Starts getting the value of a key. The value is copied to `value` like
+ * kvs_client_get does, so `value` has to stay valid until the request is
+ * completed. */
+kvs_status_t kvs_client_get_async(kvs_client_t* kvs_client, const char* key,
+                                  int key_len, char* value, int value_len,
+                                  kvs_request_t** request);
+
+/* Starts setting the value of a key. The key and value are copied before the
+ * function returns. */
+kvs_status_t kvs_client_set_async(kvs_client_t* kvs_client, const char* key,
+                                  int key_len, const char* value,
+                                  int value_len, kvs_request_t** request);
+
+/* Blocks until the request completes, frees it and returns its status. */
+kvs_status_t kvs_request_wait(kvs_request_t** request);
+
+/* Returns KVS_STATUS_IN_PROGRESS if the request is still in flight. Otherwise
+ * frees the request and returns its status. */
+kvs_status_t kvs_request_test(kvs_request_t** request);
+
+/* An iterator over the key/value pairs under a prefix. The keys that are
+ * already set come first, then each key as it is set. */
+typedef struct kvs_watch_t kvs_watch_t;
+
+/* Starts watching the keys under a prefix over a single stream, which ends
+ * after `max_keys` keys if it is positive. */
+kvs_status_t kvs_client_watch_prefix(kvs_client_t* kvs_client,
+                                     const char* prefix, int prefix_len,
+                                     long long max_keys, kvs_watch_t** watch);
+
+/* Blocks until the next key/value pair arrives. `*key_len` and `*value_len`
+ * hold the sizes of the buffers and receive the actual lengths; longer keys and
+ * values are truncated. Returns KVS_STATUS_END_OF_STREAM once `max_keys` keys
+ * have been returned, and KVS_STATUS_INTERNAL_ERROR if the server ended the
+ * watch because the keys set meanwhile piled up faster than they were read. */
+kvs_status_t kvs_watch_next(kvs_watch_t* watch, char* key, int* key_len,
+                            char* value, int* value_len);
+
+/* Cancels the watch if it has not ended yet and frees it. */
+kvs_status_t kvs_watch_destroy(kvs_watch_t** watch);
+
+/* An iterator over the keys under a prefix in ascending order, which the
+ * servers stream in pages so that any number of keys can be listed. Only the
+ * keys set with kvs_client_set or kvs_client_multi_set are listed. */
+typedef struct kvs_list_t kvs_list_t;
+
+/* Starts listing the keys under a prefix that sort after `start_after`, so
+ * that a listing can go on from the last key it got. The list ends after
+ * `limit` keys if it is positive. The values come with the keys if
+ * `with_values` != 0. */
+kvs_status_t kvs_client_list_keys(kvs_client_t* kvs_client,
+                                  const char* prefix, int prefix_len,
+                                  const char* start_after, int start_after_len,
+                                  long long limit, int with_values,
+                                  kvs_list_t** list);
+
+/* Blocks until the next key arrives. `*key_len` and `*value_len` hold the
+ * sizes of the buffers and receive the actual lengths, with a value length of
+ * 0 if the list has no values; longer keys and values are truncated. Returns
+ * KVS_STATUS_END_OF_STREAM once the keys run out. */
+kvs_status_t kvs_list_next(kvs_list_t* list, char* key, int* key_len,
+                           char* value, int* value_len);
+
+/* Cancels the list if it has not ended yet and frees it. */
+kvs_status_t kvs_list_destroy(kvs_list_t** list);
+
+/* A value being set in chunks, which can exceed the message size limit. Values
+ * set this way are kept apart from the ones set with kvs_client_set and are
+ * read with kvs_client_get_stream. */
+typedef struct kvs_writer_t kvs_writer_t;
+
+kvs_status_t kvs_client_set_stream(kvs_client_t* kvs_client, const char* key,
+                                   int key_len, kvs_writer_t** writer);
+
+/* Sends the next `size` bytes of the value. Blocks while the server is behind,
+ * so only a bounded amount of the value is buffered. */
+kvs_status_t kvs_writer_write(kvs_writer_t* writer, const char* data,
+                              long long size);
+
+/* Sets the value written so far and frees the writer. */
+kvs_status_t kvs_writer_close(kvs_writer_t** writer);
+
+/* Frees the writer without setting the value. */
+kvs_status_t kvs_writer_abort(kvs_writer_t** writer);
+
+/* A value set by kvs_client_set_stream being read in chunks. */
+typedef struct kvs_reader_t kvs_reader_t;
+
+kvs_status_t kvs_client_get_stream(kvs_client_t* kvs_client, const char* key,
+                                   int key_len, kvs_reader_t** reader);
+
+/* Reads the next bytes of the value into `buffer`. `*size` holds the size of
+ * the buffer and receives the number of bytes read. The first read blocks
+ * until the value is set. Returns KVS_STATUS_END_OF_STREAM after the last
+ * byte. */
+kvs_status_t kvs_reader_read(kvs_reader_t* reader, char* buffer,
+                             long long* size);
+
+/* Cancels the read if it has not ended yet and frees the reader. */
+kvs_status_t kvs_reader_destroy(kvs_reader_t** reader);
+
+typedef enum {
+  KVS_WAIT_ALL = 0, /* wait until all of the keys are set */
+  KVS_WAIT_ANY = 1, /* wait until at least one of the keys is set */
+} kvs_wait_mode_t;
+
+/* Gets the values of `num_keys` keys in one round trip. At most value_lens[i]
+ * bytes of the value of keys[i] are copied to the buffer values[i], followed
+ * by a terminating NUL if there is room, and found[i] is set to 1 if the key
+ * is set or 0 otherwise. Unless `value_sizes` is NULL, value_sizes[i] receives
+ * the size of the value, which may be more than was copied. */
+kvs_status_t kvs_client_multi_get(kvs_client_t* kvs_client, int num_keys,
+                                  const char* const* keys, const int* key_lens,
+                                  char* const* values, const int* value_lens,
+                                  int* found, long long* value_sizes,
+                                  kvs_wait_mode_t wait_mode);
+
+/* Like kvs_client_multi_get, but the servers wait up to `timeout_ms` for the
+ * keys, like kvs_client_get_with_timeout. */
+kvs_status_t kvs_client_multi_get_with_timeout(
+    kvs_client_t* kvs_client, int num_keys, const char* const* keys,
+    const int* key_lens, char* const* values, const int* value_lens,
+    int* found, long long* value_sizes, kvs_wait_mode_t wait_mode,
+    long long timeout_ms);
+
+/* Sets the values of `num_keys` keys in one round trip. */
+kvs_status_t kvs_client_multi_set(kvs_client_t* kvs_client, int num_keys,
+                                  const char* const* keys, const int* key_lens,
+                                  const char* const* values,
+                                  const int* value_lens);
+
+typedef struct {
+  long long timeout_ms;    /* timeout for kvs_get and kvs_set */
+  int num_shards;          /* number of key/value map shards, 0 for default */
+  int async_mode;          /* serve kvs_get from completion queues if != 0 */
+  int num_polling_threads; /* completion queue threads, 0 for default */
+  const char* wal_dir;     /* log directory for durable values, or NULL */
+  /* how often the log is compacted, 0 for default and < 0 for never */
+  long long snapshot_interval_ms;
+  int log_level; /* a kvs_log_level_t */
+  /* '|'-separated addresses of the replicas of this server, which may include
+   * itself. If set, the server starts as a follower, see kvs_server_promote.
+   */
+  const char* replicas;
+  /* The servers to proxy for, in the format of kvs_client_create. If set,
+   * the server runs as a proxy for the clients on its host: it forwards sets,
+   * counters and barriers to those servers, and fetches each value that its
+   * clients get only once, however many of them wait for it, and caches it.
+   * The upstream servers then see a connection per proxy instead of one per
+   * client. Streams are not supported by a proxy. */
+  const char* upstream;
+  /* budget of a proxy's cache, 0 for default, < 0 to disable the cache */
+  long long proxy_cache_max_entries;
+  long long proxy_cache_max_bytes;
+  /* Name of a shared memory segment that the server publishes its values to,
+   * for clients on the same host to read with "shm://name", or NULL. Values
+   * set once the segment is full are only served over RPC, and so are the
+   * keys of a dropped namespace until they are set again. */
+  const char* shm_name;
+  long long shm_size; /* size of the segment in bytes, 0 for 64 MiB */
+  /* largest message received, 0 for gRPC's default of 4 MiB */
+  int max_message_size;
 } kvs_server_config_t;
 
 typedef struct kvs_server_t kvs_server_t;
 
+/* `addr` is the address to listen on, or "inproc://name" for a server that
+ * listens on no port and only serves the clients created in the same process
+ * with that address. Such a server can't be a proxy. */
 kvs_status_t kvs_server_create(kvs_server_t** kvs_server, const char* addr,
                                kvs_server_config_t* config);
 
 kvs_status_t kvs_server_wait(kvs_server_t* kvs_server);
 
+/* A follower copies the values set with kvs_client_set and
+ * kvs_client_multi_set on whichever of its replicas is the leader, and serves
+ * kvs_client_get and kvs_client_multi_get calls, which wait for the values
+ * to be copied if they are not yet. It rejects other calls with
+ * KVS_STATUS_INVALID_USAGE. Values are copied after the leader acknowledges
+ * them, so the last ones may be lost if the leader fails. Namespaces are
+ * opened and dropped along with the leader, in order with the values.
+ * Counters, barriers and values set with kvs_client_set_stream are not
+ * replicated.
+ *
+ * kvs_server_promote makes a follower the leader, for when the leader has
+ * failed. The other followers then copy from it. The leases of the
+ * namespaces start over on the new leader, which drops each of them `ttl_ms`
+ * after the promotion unless it is opened again. */
+kvs_status_t kvs_server_promote(kvs_server_t* kvs_server);
+
+/* Reports the same stats as kvs_client_get_server_stats, without a round
+ * trip. */
+kvs_status_t kvs_server_get_stats(kvs_server_t* kvs_server,
+                                  kvs_server_stats_t* stats);
+
 kvs_status_t kvs_server_destroy(kvs_server_t** kvs_server);
 
 #ifdef __cplusplus
@@ -0,0 +1,30 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Usage:
+//   kvs_bench [--benchmark_filter=...]  runs the store and client
+//                                       microbenchmarks
+//   kvs_bench load [flags]              runs the load generator against a
+//                                       running server_app, see load_bench.h
+
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+
+#include "load_bench.h"
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "load") == 0) {
+    return RunLoadBench(argc - 2, argv + 2);
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
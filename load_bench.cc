@@ -0,0 +1,316 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "load_bench.h"
+
+#include <google/protobuf/struct.pb.h>
+#include <google/protobuf/util/json_util.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kvs.h"
+
+namespace {
+
+struct Flags {
+  std::string server = "localhost:50051";
+  int clients = 4;
+  int threads = 4;
+  int ops = 1000;
+  int value_size = 32;
+  std::string trace;
+};
+
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      return false;
+    }
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "server") {
+      flags->server = value;
+    } else if (name == "clients") {
+      flags->clients = std::max(atoi(value.c_str()), 1);
+    } else if (name == "threads") {
+      flags->threads = std::max(atoi(value.c_str()), 1);
+    } else if (name == "ops") {
+      flags->ops = std::max(atoi(value.c_str()), 1);
+    } else if (name == "value_size") {
+      flags->value_size = std::max(atoi(value.c_str()), 0);
+    } else if (name == "trace") {
+      flags->trace = value;
+    } else {
+      fprintf(stderr, "unknown flag: --%s\n", name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+struct TraceOp {
+  bool is_get;
+  std::string key;
+  std::string value;
+};
+
+bool ReadTrace(const std::string& path, std::vector<TraceOp>* ops) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "can't open %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  for (int line_number = 1; std::getline(file, line); ++line_number) {
+    if (line.empty()) {
+      continue;
+    }
+    google::protobuf::Struct object;
+    if (!google::protobuf::util::JsonStringToMessage(line, &object).ok()) {
+      fprintf(stderr, "%s:%d: not a JSON object\n", path.c_str(),
+              line_number);
+      return false;
+    }
+    const auto& fields = object.fields();
+    auto string_field = [&](const char* name) {
+      auto it = fields.find(name);
+      return it == fields.end() ? std::string() : it->second.string_value();
+    };
+    TraceOp op;
+    op.key = string_field("key");
+    if (op.key.empty()) {
+      op.is_get = false;
+      op.key = "line" + std::to_string(line_number);
+      op.value = line;
+    } else {
+      op.is_get = string_field("op") == "get";
+      op.value = string_field("value");
+    }
+    ops->push_back(std::move(op));
+  }
+  return true;
+}
+
+// The latencies of one request pattern, from every thread.
+class Recorder {
+ public:
+  explicit Recorder(int num_threads) : latencies_us_(num_threads) {}
+
+  // Times `op` on behalf of `thread`.
+  bool Time(int thread, const std::function<bool()>& op) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = op();
+    latencies_us_[thread].push_back(std::chrono::duration<double, std::micro>(
+                                        std::chrono::steady_clock::now() -
+                                        start)
+                                        .count());
+    if (!ok) {
+      ++num_errors_;
+    }
+    return ok;
+  }
+
+  void Report(const char* pattern, std::chrono::duration<double> elapsed) {
+    std::vector<double> all;
+    for (const auto& thread_latencies_us : latencies_us_) {
+      all.insert(all.end(), thread_latencies_us.begin(),
+                 thread_latencies_us.end());
+    }
+    if (all.empty()) {
+      return;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+      size_t index = static_cast<size_t>(all.size() * p);
+      return all[std::min(all.size() - 1, index)];
+    };
+    printf("%-12s %9zu ops %11.0f ops/s  p50 %9.1f us  p99 %9.1f us  "
+           "p999 %9.1f us  errors %d\n",
+           pattern, all.size(), all.size() / elapsed.count(), percentile(0.5),
+           percentile(0.99), percentile(0.999), num_errors_.load());
+  }
+
+ private:
+  std::vector<std::vector<double>> latencies_us_;
+  std::atomic<int> num_errors_{0};
+};
+
+class LoadBench {
+ public:
+  explicit LoadBench(const Flags& flags) : flags_(flags) {
+    // Keys are write-once, so every run needs its own.
+    run_prefix_ = "bench/" + std::to_string(getpid()) + "/" +
+                  std::to_string(std::chrono::steady_clock::now()
+                                     .time_since_epoch()
+                                     .count()) +
+                  "/";
+  }
+
+  ~LoadBench() {
+    for (kvs_client_t*& client : clients_) {
+      kvs_client_destroy(&client);
+    }
+  }
+
+  bool Connect() {
+    // Cache nothing, so that every get reaches the server.
+    kvs_client_config_t config = {.connection_timeout_ms = 3000,
+                                  .cache_max_entries = -1};
+    clients_.assign(flags_.clients, nullptr);
+    for (kvs_client_t*& client : clients_) {
+      if (kvs_client_create(&client, flags_.server.c_str(), &config) !=
+          KVS_STATUS_OK) {
+        fprintf(stderr, "can't connect to %s\n", flags_.server.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int num_threads() const { return flags_.clients * flags_.threads; }
+
+  // Runs `body(thread, client)` on every thread and reports the latencies it
+  // records.
+  void Run(const char* pattern,
+           const std::function<void(int, kvs_client_t*, Recorder*)>& body) {
+    Recorder recorder(num_threads());
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_threads(); ++i) {
+      threads.emplace_back(body, i, clients_[i % flags_.clients], &recorder);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    recorder.Report(pattern, std::chrono::steady_clock::now() - start);
+  }
+
+  std::string Key(const char* pattern, int thread, int op) const {
+    return run_prefix_ + pattern + "/" + std::to_string(thread) + "/" +
+           std::to_string(op);
+  }
+
+  void RunPatterns() {
+    std::string value(flags_.value_size, 'v');
+
+    Run("set", [&](int thread, kvs_client_t* client, Recorder* recorder) {
+      for (int i = 0; i < flags_.ops; ++i) {
+        std::string key = Key("kv", thread, i);
+        recorder->Time(thread, [&]() {
+          return kvs_client_set(client, key.data(), key.size(), value.data(),
+                                value.size()) == KVS_STATUS_OK;
+        });
+      }
+    });
+
+    // Reads the keys set by another thread, which are already there.
+    Run("get", [&](int thread, kvs_client_t* client, Recorder* recorder) {
+      std::vector<char> buffer(flags_.value_size + 1);
+      int peer = (thread + 1) % num_threads();
+      for (int i = 0; i < flags_.ops; ++i) {
+        std::string key = Key("kv", peer, i);
+        recorder->Time(thread, [&]() {
+          return kvs_client_get(client, key.data(), key.size(), buffer.data(),
+                                buffer.size()) == KVS_STATUS_OK;
+        });
+      }
+    });
+
+    // Pairs of threads ping-pong: one sets a key the other is blocked on,
+    // which answers with a key of its own. Each sample is a round trip of two
+    // blocked-get-then-set rendezvous.
+    Run("rendezvous", [&](int thread, kvs_client_t* client,
+                          Recorder* recorder) {
+      std::vector<char> buffer(flags_.value_size + 1);
+      int pair = thread / 2;
+      bool pinger = thread % 2 == 0;
+      if (pinger && thread + 1 == num_threads()) {
+        return;  // No partner.
+      }
+      auto set = [&](const std::string& key) {
+        return kvs_client_set(client, key.data(), key.size(), value.data(),
+                              value.size()) == KVS_STATUS_OK;
+      };
+      auto get = [&](const std::string& key) {
+        return kvs_client_get(client, key.data(), key.size(), buffer.data(),
+                              buffer.size()) == KVS_STATUS_OK;
+      };
+      for (int i = 0; i < flags_.ops; ++i) {
+        std::string ping = Key("ping", pair, i);
+        std::string pong = Key("pong", pair, i);
+        if (pinger) {
+          recorder->Time(thread, [&]() { return set(ping) && get(pong); });
+        } else if (!get(ping) || !set(pong)) {
+          break;
+        }
+      }
+    });
+  }
+
+  void RunTrace(const std::vector<TraceOp>& ops) {
+    Run("trace", [&](int thread, kvs_client_t* client, Recorder* recorder) {
+      std::vector<char> buffer(1 << 20);
+      for (size_t i = thread; i < ops.size(); i += num_threads()) {
+        const TraceOp& op = ops[i];
+        std::string key = run_prefix_ + op.key;
+        recorder->Time(thread, [&]() {
+          if (op.is_get) {
+            return kvs_client_get(client, key.data(), key.size(),
+                                  buffer.data(),
+                                  buffer.size()) == KVS_STATUS_OK;
+          }
+          return kvs_client_set(client, key.data(), key.size(),
+                                op.value.data(),
+                                op.value.size()) == KVS_STATUS_OK;
+        });
+      }
+    });
+  }
+
+ private:
+  Flags flags_;
+  std::string run_prefix_;
+  std::vector<kvs_client_t*> clients_;
+};
+
+}  // namespace
+
+int RunLoadBench(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    return 1;
+  }
+  std::vector<TraceOp> trace;
+  if (!flags.trace.empty() && !ReadTrace(flags.trace, &trace)) {
+    return 1;
+  }
+
+  LoadBench bench(flags);
+  if (!bench.Connect()) {
+    return 1;
+  }
+  printf("%d clients x %d threads against %s\n", flags.clients, flags.threads,
+         flags.server.c_str());
+  if (flags.trace.empty()) {
+    bench.RunPatterns();
+  } else {
+    bench.RunTrace(trace);
+  }
+  return 0;
+}
@@ -0,0 +1,27 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_LOAD_BENCH_H
+#define KVS_LOAD_BENCH_H
+
+// Runs M clients x K threads against a running server and reports ops/s and
+// latency percentiles per request pattern. `argv` holds the flags that follow
+// `kvs_bench load`:
+//
+//   --server=ADDR   server to connect to (localhost:50051)
+//   --clients=M     number of clients, each with its own channel (4)
+//   --threads=K     threads per client (4)
+//   --ops=N         operations per thread and pattern (1000)
+//   --value_size=B  bytes per value (32)
+//   --trace=FILE    replay the JSON lines of FILE instead of the patterns
+//
+// A trace line is an object with an "op" of "set" or "get", a "key" and, for
+// sets, a "value". Lines without a key, such as those of any other JSON lines
+// file, are replayed as a set of the whole line. Threads take the lines in
+// turn, and a get of a key set by another thread waits for it.
+int RunLoadBench(int argc, char** argv);
+
+#endif  // KVS_LOAD_BENCH_H
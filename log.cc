@@ -0,0 +1,217 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace log_internal {
+std::atomic<int> log_level{static_cast<int>(LogLevel::kWarning)};
+}  // namespace log_internal
+
+void SetLogLevel(LogLevel level) {
+  log_internal::log_level.store(static_cast<int>(level),
+                                std::memory_order_relaxed);
+}
+
+LogLevel GetLogLevel() {
+  return static_cast<LogLevel>(
+      log_internal::log_level.load(std::memory_order_relaxed));
+}
+
+std::string LogString(std::string_view data, size_t max_size) {
+  std::string result = "\"";
+  for (char c : data.substr(0, max_size)) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c >= 0x20 && c < 0x7f) {
+      result += c;
+    } else {
+      char escaped[5];
+      snprintf(escaped, sizeof(escaped), "\\x%02x",
+               static_cast<unsigned char>(c));
+      result += escaped;
+    }
+  }
+  result += '"';
+  if (data.size() > max_size) {
+    result += "... (" + std::to_string(data.size()) + " bytes)";
+  }
+  return result;
+}
+
+namespace {
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t power = 1;
+  while (power < n) {
+    power *= 2;
+  }
+  return power;
+}
+
+char LevelLetter(LogLevel level) {
+  switch (level) {
+    case LogLevel::kDebug:
+      return 'D';
+    case LogLevel::kInfo:
+      return 'I';
+    case LogLevel::kWarning:
+      return 'W';
+    case LogLevel::kError:
+      return 'E';
+    case LogLevel::kOff:
+      break;
+  }
+  return '?';
+}
+
+// How long the logging thread sleeps when the buffer is empty. Producers
+// never wake it up, since that could block them.
+constexpr auto kMinIdleSleep = std::chrono::microseconds(500);
+constexpr auto kMaxIdleSleep = std::chrono::milliseconds(50);
+
+}  // namespace
+
+Logger::Logger(size_t capacity, Sink sink)
+    : mask_(RoundUpToPowerOfTwo(std::max<size_t>(capacity, 2)) - 1),
+      slots_(new Slot[mask_ + 1]),
+      sink_(std::move(sink)) {
+  for (size_t i = 0; i <= mask_; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  thread_ = std::thread([this]() { Run(); });
+}
+
+Logger::~Logger() {
+  stop_.store(true, std::memory_order_release);
+  thread_.join();
+}
+
+Logger& Logger::Default() {
+  // Never destroyed, so that objects destroyed at exit can still log. The
+  // records logged before exit() are flushed.
+  static Logger* logger = []() {
+    auto* logger = new Logger(/*capacity=*/4096, [](std::string_view lines) {
+      fwrite(lines.data(), 1, lines.size(), stderr);
+      fflush(stderr);
+    });
+    std::atexit([]() { Default().Flush(); });
+    return logger;
+  }();
+  return *logger;
+}
+
+bool Logger::Log(LogLevel level, const char* file, int line,
+                 std::string_view message) {
+  // Claim a position whose slot has been drained.
+  uint64_t position = tail_.load(std::memory_order_relaxed);
+  Slot* slot;
+  while (true) {
+    slot = &slots_[position & mask_];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int64_t lag = static_cast<int64_t>(sequence - position);
+    if (lag == 0) {
+      if (tail_.compare_exchange_weak(position, position + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (lag < 0) {
+      // The slot still holds the record from one lap ago: the buffer is full.
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = tail_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->level = level;
+  slot->file = file;
+  slot->line = line;
+  slot->time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+  slot->size = std::min(message.size(), kMaxMessageSize);
+  memcpy(slot->message, message.data(), slot->size);
+  if (message.size() > kMaxMessageSize) {
+    memcpy(slot->message + kMaxMessageSize - 3, "...", 3);
+  }
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+void Logger::Flush() {
+  uint64_t tail = tail_.load(std::memory_order_acquire);
+  while (head_.load(std::memory_order_acquire) < tail) {
+    std::this_thread::sleep_for(kMinIdleSleep);
+  }
+}
+
+bool Logger::Drain(uint64_t* head, std::string* lines) {
+  bool drained = false;
+  while (true) {
+    Slot& slot = slots_[*head & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != *head + 1) {
+      break;
+    }
+    const char* base_name = strrchr(slot.file, '/');
+    base_name = base_name != nullptr ? base_name + 1 : slot.file;
+    time_t seconds = slot.time_us / 1000000;
+    struct tm time;
+    localtime_r(&seconds, &time);
+    char prefix[128];
+    snprintf(prefix, sizeof(prefix),
+             "%c%04d%02d%02d %02d:%02d:%02d.%06lld %s:%d] ",
+             LevelLetter(slot.level), time.tm_year + 1900, time.tm_mon + 1,
+             time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec,
+             static_cast<long long>(slot.time_us % 1000000), base_name,
+             slot.line);
+    *lines += prefix;
+    lines->append(slot.message, slot.size);
+    *lines += '\n';
+    // Hand the slot to the producers of the next lap.
+    slot.sequence.store(*head + mask_ + 1, std::memory_order_release);
+    ++*head;
+    drained = true;
+  }
+
+  int64_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped != reported_dropped_) {
+    *lines += "W " + std::to_string(dropped - reported_dropped_) +
+              " log records dropped\n";
+    reported_dropped_ = dropped;
+    drained = true;
+  }
+  return drained;
+}
+
+void Logger::Run() {
+  auto idle_sleep = kMinIdleSleep;
+  uint64_t head = 0;
+  std::string lines;
+  while (true) {
+    bool stopping = stop_.load(std::memory_order_acquire);
+    lines.clear();
+    if (Drain(&head, &lines)) {
+      sink_(lines);
+      // Flush() returns once the sink has the records.
+      head_.store(head, std::memory_order_release);
+      idle_sleep = kMinIdleSleep;
+      continue;
+    }
+    if (stopping) {
+      return;
+    }
+    std::this_thread::sleep_for(idle_sleep);
+    idle_sleep = std::min<std::chrono::microseconds>(idle_sleep * 2,
+                                                     kMaxIdleSleep);
+  }
+}
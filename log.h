@@ -0,0 +1,146 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_LOG_H
+#define KVS_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+enum class LogLevel {
+  kDebug,
+  kInfo,
+  kWarning,
+  kError,
+  kOff,
+};
+
+// The process-wide level below which records are discarded. It starts at
+// kWarning.
+void SetLogLevel(LogLevel level);
+LogLevel GetLogLevel();
+
+namespace log_internal {
+extern std::atomic<int> log_level;
+}  // namespace log_internal
+
+// Costs a load and a branch, so disabled records are free to leave in the
+// hot path.
+inline bool LogEnabled(LogLevel level) {
+  return static_cast<int>(level) >=
+         log_internal::log_level.load(std::memory_order_relaxed);
+}
+
+// Quotes at most `max_size` bytes of a key or value that may be binary, with
+// the size of the rest.
+std::string LogString(std::string_view data, size_t max_size = 32);
+
+// Formats records on the logging thread and hands them to a sink in batches.
+// Log() copies the record into a fixed-size lock-free ring buffer and never
+// blocks. When the buffer is full, the record is dropped and counted, and the
+// count is reported with the next batch.
+class Logger {
+ public:
+  // Receives one or more formatted lines at a time.
+  using Sink = std::function<void(std::string_view lines)>;
+
+  // Records longer than this are truncated.
+  static constexpr size_t kMaxMessageSize = 200;
+
+  // `capacity` is rounded up to a power of two.
+  Logger(size_t capacity, Sink sink);
+  Logger(const Logger&) = delete;
+  Logger(Logger&&) = delete;
+  Logger& operator=(const Logger&) = delete;
+  Logger&& operator=(Logger&&) = delete;
+
+  // Writes out the records that are still buffered.
+  ~Logger();
+
+  // The logger of KVS_LOG(), which writes to stderr.
+  static Logger& Default();
+
+  // Returns false if the record was dropped. `file` must be a string literal.
+  bool Log(LogLevel level, const char* file, int line,
+           std::string_view message);
+
+  // Blocks until every record logged so far has reached the sink.
+  void Flush();
+
+  int64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  struct alignas(64) Slot {
+    // The position the slot is free for, or that position + 1 once a record
+    // for it is written.
+    std::atomic<uint64_t> sequence;
+    LogLevel level;
+    const char* file;
+    int line;
+    int64_t time_us;
+    uint32_t size;
+    char message[kMaxMessageSize];
+  };
+
+  // Formats the records in the buffer from position `head` on into `lines`,
+  // and advances `head` past them. Returns false if there were none.
+  bool Drain(uint64_t* head, std::string* lines);
+  void Run();
+
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  Sink sink_;
+  // The next position to write, shared by the producers.
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  // The position up to which the sink has the records, advanced by the
+  // logging thread only.
+  alignas(64) std::atomic<uint64_t> head_{0};
+  std::atomic<int64_t> dropped_{0};
+  int64_t reported_dropped_ = 0;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+// Collects a record with operator<< and logs it when it goes out of scope.
+class LogMessage {
+ public:
+  LogMessage(LogLevel level, const char* file, int line)
+      : level_(level), file_(file), line_(line) {}
+  ~LogMessage() { Logger::Default().Log(level_, file_, line_, stream_.str()); }
+
+  std::ostream& stream() { return stream_; }
+
+ private:
+  LogLevel level_;
+  const char* file_;
+  int line_;
+  std::ostringstream stream_;
+};
+
+namespace log_internal {
+// Turns the stream expression into void, so that it fits in a conditional.
+struct Voidify {
+  void operator&(std::ostream&) {}
+};
+}  // namespace log_internal
+
+// Usage: KVS_LOG(kInfo) << "Server listening on " << addr;
+// The stream expression is not evaluated if the level is disabled.
+#define KVS_LOG(level)                                             \
+  !LogEnabled(LogLevel::level)                                     \
+      ? (void)0                                                    \
+      : log_internal::Voidify() &                                  \
+            LogMessage(LogLevel::level, __FILE__, __LINE__).stream()
+
+#endif  // KVS_LOG_H
@@ -0,0 +1,144 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "log.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+// Collects what a Logger writes.
+class TestSink {
+ public:
+  Logger::Sink sink() {
+    return [this](std::string_view lines) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      output_ += lines;
+    };
+  }
+
+  std::string output() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return output_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::string output_;
+};
+
+TEST(LogTest, FormatsRecordsInOrder) {
+  TestSink sink;
+  Logger logger(/*capacity=*/16, sink.sink());
+  EXPECT_TRUE(logger.Log(LogLevel::kInfo, "dir/file.cc", 12, "first"));
+  EXPECT_TRUE(logger.Log(LogLevel::kError, "other.cc", 34, "second"));
+  logger.Flush();
+  std::string output = sink.output();
+  size_t first = output.find("file.cc:12] first\n");
+  size_t second = output.find("other.cc:34] second\n");
+  ASSERT_NE(first, std::string::npos) << output;
+  ASSERT_NE(second, std::string::npos) << output;
+  EXPECT_LT(first, second);
+  EXPECT_EQ(output[0], 'I');
+  EXPECT_EQ(output.find("dir/"), std::string::npos);
+}
+
+TEST(LogTest, TruncatesLongRecords) {
+  TestSink sink;
+  Logger logger(/*capacity=*/16, sink.sink());
+  logger.Log(LogLevel::kInfo, "file.cc", 1, std::string(1000, 'x'));
+  logger.Flush();
+  std::string output = sink.output();
+  EXPECT_NE(output.find(std::string(Logger::kMaxMessageSize - 3, 'x') +
+                        "...\n"),
+            std::string::npos);
+  EXPECT_LT(output.size(), Logger::kMaxMessageSize + 100);
+}
+
+TEST(LogTest, DropsRecordsWhenFullInsteadOfBlocking) {
+  std::promise<void> sink_entered;
+  std::promise<void> release_sink;
+  std::shared_future<void> released = release_sink.get_future().share();
+  std::string output;
+  bool first_batch = true;
+  Logger logger(/*capacity=*/4, [&](std::string_view lines) {
+    if (first_batch) {
+      first_batch = false;
+      sink_entered.set_value();
+      released.wait();
+    }
+    output += lines;
+  });
+
+  // Hold the logging thread in the sink, so that the buffer fills up.
+  EXPECT_TRUE(logger.Log(LogLevel::kInfo, "file.cc", 1, "blocked"));
+  sink_entered.get_future().wait();
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(logger.Log(LogLevel::kInfo, "file.cc", 2, "buffered"));
+  }
+  EXPECT_FALSE(logger.Log(LogLevel::kInfo, "file.cc", 3, "lost"));
+  EXPECT_EQ(logger.dropped(), 1);
+
+  // The drop count is reported in the same batch as the buffered records.
+  release_sink.set_value();
+  logger.Flush();
+  EXPECT_EQ(output.find("lost"), std::string::npos);
+  EXPECT_NE(output.find("buffered"), std::string::npos);
+  EXPECT_NE(output.find("1 log records dropped"), std::string::npos);
+}
+
+TEST(LogTest, ConcurrentProducers) {
+  TestSink sink;
+  Logger logger(/*capacity=*/1 << 14, sink.sink());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < 1000; ++j) {
+        logger.Log(LogLevel::kInfo, "file.cc", i, "record");
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  logger.Flush();
+  std::string output = sink.output();
+  size_t num_lines = std::count(output.begin(), output.end(), '\n');
+  EXPECT_EQ(num_lines + logger.dropped(), 8000);
+  EXPECT_EQ(logger.dropped(), 0);
+}
+
+TEST(LogTest, DisabledLevelsAreNotEvaluated) {
+  LogLevel old_level = GetLogLevel();
+  SetLogLevel(LogLevel::kWarning);
+  int evaluations = 0;
+  auto count = [&]() { return ++evaluations; };
+  KVS_LOG(kDebug) << count();
+  KVS_LOG(kInfo) << count();
+  EXPECT_EQ(evaluations, 0);
+  EXPECT_FALSE(LogEnabled(LogLevel::kInfo));
+  EXPECT_TRUE(LogEnabled(LogLevel::kError));
+  SetLogLevel(LogLevel::kOff);
+  EXPECT_FALSE(LogEnabled(LogLevel::kError));
+  SetLogLevel(old_level);
+}
+
+TEST(LogTest, LogStringEscapesBinaryData) {
+  EXPECT_EQ(LogString("key"), "\"key\"");
+  EXPECT_EQ(LogString(std::string("a\0\"b", 4)), "\"a\\x00\\\"b\"");
+  EXPECT_EQ(LogString(std::string(100, 'v'), 4), "\"vvvv\"... (100 bytes)");
+}
+
+}  // namespace
+}  // namespace kvs
@@ -0,0 +1,135 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "metrics.h"
+
+#include <algorithm>
+
+namespace {
+
+// Buckets 0-3 hold 0-3 ns. Above that, bucket 4 * (msb - 1) + i holds the
+// values whose highest bit is `msb` and whose next two bits are `i`.
+size_t BucketIndex(uint64_t ns) {
+  if (ns < 4) {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  return 4 * (msb - 1) + ((ns >> (msb - 2)) & 3);
+}
+
+// Returns the midpoint of the values in a bucket.
+double BucketMidpointNs(size_t index) {
+  if (index < 4) {
+    return index;
+  }
+  int msb = index / 4 + 1;
+  uint64_t lower = (uint64_t{4} | (index % 4)) << (msb - 2);
+  uint64_t width = uint64_t{1} << (msb - 2);
+  return lower + width / 2.0;
+}
+
+}  // namespace
+
+size_t NextMetricStripe() {
+  static std::atomic<size_t> next_stripe{0};
+  return next_stripe.fetch_add(1, std::memory_order_relaxed) % kMetricStripes;
+}
+
+int64_t Counter::Value() const {
+  int64_t value = 0;
+  for (const Stripe& stripe : stripes_) {
+    value += stripe.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+void Histogram::Record(std::chrono::nanoseconds duration) {
+  int64_t ns = std::max<int64_t>(duration.count(), 0);
+  Stripe& stripe = stripes_[MetricStripe()];
+  stripe.buckets[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  stripe.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  // Only this stripe's threads race on its maximum.
+  int64_t max_ns = stripe.max_ns.load(std::memory_order_relaxed);
+  while (ns > max_ns && !stripe.max_ns.compare_exchange_weak(
+                            max_ns, ns, std::memory_order_relaxed)) {
+  }
+}
+
+Histogram::Summary Histogram::Summarize() const {
+  std::array<int64_t, kNumBuckets> buckets{};
+  int64_t sum_ns = 0;
+  int64_t max_ns = 0;
+  Summary summary;
+  for (const Stripe& stripe : stripes_) {
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      int64_t count = stripe.buckets[i].load(std::memory_order_relaxed);
+      buckets[i] += count;
+      summary.count += count;
+    }
+    sum_ns += stripe.sum_ns.load(std::memory_order_relaxed);
+    max_ns = std::max(max_ns, stripe.max_ns.load(std::memory_order_relaxed));
+  }
+  if (summary.count == 0) {
+    return summary;
+  }
+  summary.mean_us = sum_ns / 1000.0 / summary.count;
+  summary.max_us = max_ns / 1000.0;
+
+  auto percentile_us = [&](double p) {
+    // The rank of the sample at the percentile, counting from 1.
+    int64_t rank = std::max<int64_t>(1, static_cast<int64_t>(
+                                            p * summary.count + 0.5));
+    int64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(BucketMidpointNs(i), static_cast<double>(max_ns)) /
+               1000.0;
+      }
+    }
+    return summary.max_us;
+  };
+  summary.p50_us = percentile_us(0.5);
+  summary.p99_us = percentile_us(0.99);
+  summary.p999_us = percentile_us(0.999);
+  return summary;
+}
+
+const char* RpcMethodName(RpcMethod method) {
+  switch (method) {
+    case RpcMethod::kGetValue:
+      return "GetValue";
+    case RpcMethod::kSetValue:
+      return "SetValue";
+    case RpcMethod::kMultiGetValue:
+      return "MultiGetValue";
+    case RpcMethod::kMultiSetValue:
+      return "MultiSetValue";
+    case RpcMethod::kWatchPrefix:
+      return "WatchPrefix";
+    case RpcMethod::kBarrier:
+      return "Barrier";
+    case RpcMethod::kAdd:
+      return "Add";
+    case RpcMethod::kSetValueStream:
+      return "SetValueStream";
+    case RpcMethod::kGetValueStream:
+      return "GetValueStream";
+    case RpcMethod::kGetStats:
+      return "GetStats";
+    case RpcMethod::kReplicate:
+      return "Replicate";
+    case RpcMethod::kOpenNamespace:
+      return "OpenNamespace";
+    case RpcMethod::kDropNamespace:
+      return "DropNamespace";
+    case RpcMethod::kListKeys:
+      return "ListKeys";
+    case RpcMethod::kNumMethods:
+      break;
+  }
+  return "unknown";
+}
@@ -0,0 +1,134 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_METRICS_H
+#define KVS_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Metrics are updated by every RPC, so each one is split into stripes on
+// their own cache lines. A thread always updates the same stripe with relaxed
+// atomics, and readers add the stripes up.
+constexpr size_t kMetricStripes = 8;
+
+// Assigns stripes to threads in turn.
+size_t NextMetricStripe();
+
+// Returns the stripe of the calling thread.
+inline size_t MetricStripe() {
+  // Constant-initialized, so that reading it needs no initialization guard.
+  thread_local size_t stripe = kMetricStripes;
+  if (stripe == kMetricStripes) {
+    stripe = NextMetricStripe();
+  }
+  return stripe;
+}
+
+// A monotonic counter.
+class Counter {
+ public:
+  void Add(int64_t delta = 1) {
+    stripes_[MetricStripe()].value.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  int64_t Value() const;
+
+ private:
+  struct alignas(64) Stripe {
+    std::atomic<int64_t> value{0};
+  };
+  std::array<Stripe, kMetricStripes> stripes_;
+};
+
+// A histogram of durations with four buckets per power of two of
+// nanoseconds, so percentiles are accurate to within 25%.
+class Histogram {
+ public:
+  static constexpr size_t kNumBuckets = 4 * 64;
+
+  struct Summary {
+    int64_t count = 0;
+    double mean_us = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double max_us = 0;
+  };
+
+  void Record(std::chrono::nanoseconds duration);
+
+  Summary Summarize() const;
+
+ private:
+  struct alignas(64) Stripe {
+    std::array<std::atomic<int64_t>, kNumBuckets> buckets{};
+    std::atomic<int64_t> sum_ns{0};
+    std::atomic<int64_t> max_ns{0};
+  };
+  std::array<Stripe, kMetricStripes> stripes_;
+};
+
+// The RPCs of KeyValueStore, in the order GetStatsResponse reports them.
+enum class RpcMethod {
+  kGetValue,
+  kSetValue,
+  kMultiGetValue,
+  kMultiSetValue,
+  kWatchPrefix,
+  kBarrier,
+  kAdd,
+  kSetValueStream,
+  kGetValueStream,
+  kGetStats,
+  kReplicate,
+  kOpenNamespace,
+  kDropNamespace,
+  kListKeys,
+  kNumMethods,
+};
+
+constexpr size_t kNumRpcMethods = static_cast<size_t>(RpcMethod::kNumMethods);
+
+const char* RpcMethodName(RpcMethod method);
+
+// Everything KeyValueStoreServiceImpl measures, apart from what its maps
+// already know such as the number of keys.
+struct ServerMetrics {
+  std::array<Histogram, kNumRpcMethods> rpc_latency;
+  // How long calls that found their keys missing waited for them.
+  Histogram wait_time;
+  Counter timeouts;
+  // Waits given up because the client cancelled its call or went away.
+  Counter cancelled;
+  Counter already_exists;
+  // Namespaces dropped by the reaper.
+  Counter expired_namespaces;
+
+  Histogram& latency(RpcMethod method) {
+    return rpc_latency[static_cast<size_t>(method)];
+  }
+};
+
+// Records the latency of an RPC when it goes out of scope.
+class ScopedRpcTimer {
+ public:
+  ScopedRpcTimer(ServerMetrics* metrics, RpcMethod method)
+      : histogram_(&metrics->latency(method)),
+        start_(std::chrono::steady_clock::now()) {}
+  ~ScopedRpcTimer() {
+    histogram_->Record(std::chrono::steady_clock::now() - start_);
+  }
+
+ private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // KVS_METRICS_H
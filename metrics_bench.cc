@@ -0,0 +1,84 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Microbenchmarks of the server's metrics, run in-process by kvs_bench. Every
+// RPC updates a histogram, so updates from many threads must stay cheap next
+// to the store lookup that GetValue() does.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+#include "store.h"
+
+namespace {
+
+void BM_CounterAdd(benchmark::State& state) {
+  static Counter counter;
+  for (auto _ : state) {
+    counter.Add();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_HistogramRecord(benchmark::State& state) {
+  static Histogram histogram;
+  int64_t ns = 1000 + state.thread_index();
+  for (auto _ : state) {
+    histogram.Record(std::chrono::nanoseconds(ns));
+    ns = ns * 7 % 1000003;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// A lookup of a key that is set, with and without the timer that every
+// GetValue() call starts, to show what the timer adds to the hot path.
+template <bool kTimed>
+void BM_FindWithMetrics(benchmark::State& state) {
+  constexpr int kNumKeys = 1 << 16;
+  static ShardedKeyValueMap* kv_map = nullptr;
+  static std::vector<std::string>* keys = nullptr;
+  static ServerMetrics* metrics = nullptr;
+  if (state.thread_index() == 0) {
+    kv_map = new ShardedKeyValueMap(/*num_shards=*/64);
+    keys = new std::vector<std::string>();
+    for (int i = 0; i < kNumKeys; ++i) {
+      keys->push_back("key/" + std::to_string(i));
+      kv_map->Insert(keys->back(), keys->back());
+    }
+    metrics = new ServerMetrics();
+  }
+  int i = state.thread_index() * 7919 % kNumKeys;
+  std::string value;
+  for (auto _ : state) {
+    if (kTimed) {
+      ScopedRpcTimer timer(metrics, RpcMethod::kGetValue);
+      benchmark::DoNotOptimize(kv_map->Find((*keys)[i], &value));
+    } else {
+      benchmark::DoNotOptimize(kv_map->Find((*keys)[i], &value));
+    }
+    i = (i + 7919) % kNumKeys;
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    delete kv_map;
+    delete keys;
+    delete metrics;
+  }
+}
+
+BENCHMARK(BM_CounterAdd)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_HistogramRecord)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FindWithMetrics, false)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FindWithMetrics, true)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,95 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "metrics.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+using std::chrono::microseconds;
+
+TEST(MetricsTest, CounterSumsConcurrentAdds) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 16; ++i) {
+    threads.emplace_back([&]() {
+      for (int j = 0; j < 1000; ++j) {
+        counter.Add();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  counter.Add(-10);
+  EXPECT_EQ(counter.Value(), 16 * 1000 - 10);
+}
+
+TEST(MetricsTest, EmptyHistogram) {
+  Histogram histogram;
+  Histogram::Summary summary = histogram.Summarize();
+  EXPECT_EQ(summary.count, 0);
+  EXPECT_EQ(summary.p99_us, 0);
+  EXPECT_EQ(summary.max_us, 0);
+}
+
+TEST(MetricsTest, HistogramPercentilesAreWithinABucket) {
+  Histogram histogram;
+  // 1..1000 us, so the nth percentile is about n * 10 us.
+  for (int i = 1; i <= 1000; ++i) {
+    histogram.Record(microseconds(i));
+  }
+  Histogram::Summary summary = histogram.Summarize();
+  EXPECT_EQ(summary.count, 1000);
+  EXPECT_NEAR(summary.mean_us, 500.5, 0.01);
+  EXPECT_NEAR(summary.p50_us, 500, 500 * 0.25);
+  EXPECT_NEAR(summary.p99_us, 990, 990 * 0.25);
+  EXPECT_NEAR(summary.p999_us, 999, 999 * 0.25);
+  EXPECT_LE(summary.p999_us, summary.max_us);
+  EXPECT_EQ(summary.max_us, 1000);
+}
+
+TEST(MetricsTest, HistogramMergesThreads) {
+  Histogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 16; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < 100; ++j) {
+        histogram.Record(microseconds(i == 0 ? 5000 : 10));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  Histogram::Summary summary = histogram.Summarize();
+  EXPECT_EQ(summary.count, 1600);
+  EXPECT_NEAR(summary.p50_us, 10, 10 * 0.25);
+  EXPECT_EQ(summary.max_us, 5000);
+}
+
+TEST(MetricsTest, ScopedRpcTimerRecordsOnce) {
+  ServerMetrics metrics;
+  {
+    ScopedRpcTimer timer(&metrics, RpcMethod::kSetValue);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  Histogram::Summary summary =
+      metrics.latency(RpcMethod::kSetValue).Summarize();
+  EXPECT_EQ(summary.count, 1);
+  EXPECT_GE(summary.max_us, 2000);
+  EXPECT_EQ(metrics.latency(RpcMethod::kGetValue).Summarize().count, 0);
+  EXPECT_STREQ(RpcMethodName(RpcMethod::kSetValue), "SetValue");
+}
+
+}  // namespace
+}  // namespace kvs
@@ -0,0 +1,87 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "reaper.h"
+
+#include <vector>
+
+NamespaceReaper::NamespaceReaper(DropCallback drop)
+    : drop_(std::move(drop)), thread_(&NamespaceReaper::Run, this) {}
+
+NamespaceReaper::~NamespaceReaper() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void NamespaceReaper::Renew(const std::string& name,
+                            std::chrono::milliseconds ttl) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expired_.erase(name);
+    auto it = leases_.find(name);
+    if (it != leases_.end()) {
+      expiries_.erase({it->second, name});
+      leases_.erase(it);
+    }
+    if (ttl.count() <= 0) {
+      return;
+    }
+    Deadline deadline = std::chrono::steady_clock::now() + ttl;
+    leases_.emplace(name, deadline);
+    expiries_.emplace(deadline, name);
+  }
+  // The thread may be sleeping until a later deadline.
+  cv_.notify_all();
+}
+
+void NamespaceReaper::Cancel(const std::string& name) {
+  Renew(name, std::chrono::milliseconds(0));
+}
+
+bool NamespaceReaper::IsExpired(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return expired_.count(name) > 0;
+}
+
+size_t NamespaceReaper::num_leases() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return leases_.size();
+}
+
+void NamespaceReaper::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    if (expiries_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+    Deadline next = expiries_.begin()->first;
+    if (std::chrono::steady_clock::now() < next) {
+      cv_.wait_until(lock, next);
+      continue;
+    }
+    std::vector<std::string> expired;
+    auto now = std::chrono::steady_clock::now();
+    while (!expiries_.empty() && expiries_.begin()->first <= now) {
+      expired.push_back(expiries_.begin()->second);
+      expired_.insert(expiries_.begin()->second);
+      leases_.erase(expiries_.begin()->second);
+      expiries_.erase(expiries_.begin());
+    }
+    lock.unlock();
+    for (const std::string& name : expired) {
+      drop_(name);
+    }
+    lock.lock();
+    for (const std::string& name : expired) {
+      expired_.erase(name);
+    }
+  }
+}
@@ -0,0 +1,76 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_REAPER_H
+#define KVS_REAPER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Expires namespaces whose lease runs out. A thread of its own sleeps until
+// the earliest lease expires and drops the namespace with `drop`, outside of
+// any lock of the reaper, so expiring a large namespace holds up neither the
+// callers renewing leases nor the store beyond what the drop itself takes.
+//
+// A lease may be renewed after it expired but before `drop` gets to it, so
+// `drop` checks IsExpired() under the lock that its caller also holds to
+// call Renew(), and keeps the namespace if it was renewed.
+class NamespaceReaper {
+ public:
+  // Called with the name of every namespace whose lease expired.
+  using DropCallback = std::function<void(const std::string& name)>;
+
+  explicit NamespaceReaper(DropCallback drop);
+  NamespaceReaper(const NamespaceReaper&) = delete;
+  NamespaceReaper(NamespaceReaper&&) = delete;
+  NamespaceReaper& operator=(const NamespaceReaper&) = delete;
+  NamespaceReaper&& operator=(NamespaceReaper&&) = delete;
+
+  // Stops the thread. Leases that have not expired yet are forgotten.
+  ~NamespaceReaper();
+
+  // Starts or renews the lease of the namespace, which then expires `ttl`
+  // from now. A namespace with a zero TTL never expires.
+  void Renew(const std::string& name, std::chrono::milliseconds ttl);
+
+  // Forgets the lease of the namespace, such as when it has been dropped
+  // before it expired.
+  void Cancel(const std::string& name);
+
+  // Returns whether the lease of the namespace expired and has been neither
+  // renewed nor cancelled since.
+  bool IsExpired(const std::string& name) const;
+
+  // Returns the number of leases that have not expired yet.
+  size_t num_leases() const;
+
+ private:
+  using Deadline = std::chrono::steady_clock::time_point;
+
+  void Run();
+
+  DropCallback drop_;
+  // Guards everything below.
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::string, Deadline> leases_;
+  // The leases ordered by when they expire.
+  std::set<std::pair<Deadline, std::string>> expiries_;
+  // The expired leases that `drop_` has not been called with yet.
+  std::set<std::string> expired_;
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+#endif  // KVS_REAPER_H
@@ -0,0 +1,111 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "reaper.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+class NamespaceReaperTest : public ::testing::Test {
+ protected:
+  std::vector<std::string> dropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+  // Polls until `count` namespaces have been dropped or a second passes.
+  bool WaitForDropped(size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (dropped().size() >= count) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+  std::mutex mutex_;
+  std::vector<std::string> dropped_;
+  NamespaceReaper reaper_{[this](const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropped_.push_back(name);
+  }};
+};
+
+TEST_F(NamespaceReaperTest, ExpiresInOrder) {
+  reaper_.Renew("late", std::chrono::milliseconds(60));
+  reaper_.Renew("early", std::chrono::milliseconds(20));
+  EXPECT_EQ(reaper_.num_leases(), 2);
+  ASSERT_TRUE(WaitForDropped(2));
+  EXPECT_EQ(dropped(), (std::vector<std::string>{"early", "late"}));
+  EXPECT_EQ(reaper_.num_leases(), 0);
+}
+
+TEST_F(NamespaceReaperTest, RenewPostponesExpiry) {
+  auto start = std::chrono::steady_clock::now();
+  reaper_.Renew("job", std::chrono::milliseconds(50));
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  reaper_.Renew("job", std::chrono::milliseconds(100));
+  EXPECT_EQ(reaper_.num_leases(), 1);
+  ASSERT_TRUE(WaitForDropped(1));
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(125));
+  EXPECT_EQ(dropped(), std::vector<std::string>{"job"});
+}
+
+TEST_F(NamespaceReaperTest, CancelAndZeroTtlNeverExpire) {
+  reaper_.Renew("cancelled", std::chrono::milliseconds(20));
+  reaper_.Cancel("cancelled");
+  reaper_.Renew("forever", std::chrono::milliseconds(20));
+  reaper_.Renew("forever", std::chrono::milliseconds(0));
+  EXPECT_EQ(reaper_.num_leases(), 0);
+  reaper_.Renew("marker", std::chrono::milliseconds(40));
+  ASSERT_TRUE(WaitForDropped(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(dropped(), std::vector<std::string>{"marker"});
+}
+
+// A lease renewed after it expired, but before the drop callback got to it,
+// keeps its namespace.
+TEST(NamespaceReaperRaceTest, RenewalAfterExpiryKeepsNamespace) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool expired = false;
+  bool renewed = false;
+  std::vector<bool> still_expired;
+  NamespaceReaper reaper([&](const std::string& name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    expired = true;
+    cv.notify_all();
+    cv.wait(lock, [&]() { return renewed; });
+    still_expired.push_back(reaper.IsExpired(name));
+    cv.notify_all();
+  });
+  reaper.Renew("job", std::chrono::milliseconds(10));
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return expired; });
+  EXPECT_TRUE(reaper.IsExpired("job"));
+  EXPECT_EQ(reaper.num_leases(), 0);
+  reaper.Renew("job", std::chrono::hours(1));
+  renewed = true;
+  cv.notify_all();
+  cv.wait(lock, [&]() { return !still_expired.empty(); });
+  EXPECT_EQ(still_expired, std::vector<bool>{false});
+  EXPECT_EQ(reaper.num_leases(), 1);
+}
+
+}  // namespace
+}  // namespace kvs
@@ -6,84 +6,2677 @@
 
 #include "server.h"
 
+#include <grpcpp/alarm.h>
+
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
-#include <iostream>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "cache.h"
+#include "inproc.h"
+#include "keyvaluestore.grpc.pb.h"
+#include "log.h"
+#include "metrics.h"
+#include "reaper.h"
+#include "sharded_client.h"
+#include "shm.h"
+#include "store.h"
+#include "wal.h"
+
+namespace {
+
+// WatchPrefix() and Replicate() streams may stay open for the whole lifetime
+// of a job, and GetValueStream() calls may wait for their value as long, so
+// they are served by the callback API in both modes and never hold a thread.
+using BaseService =
+    keyvaluestore::KeyValueStore::WithCallbackMethod_WatchPrefix<
+        keyvaluestore::KeyValueStore::WithCallbackMethod_Replicate<
+            keyvaluestore::KeyValueStore::WithCallbackMethod_GetValueStream<
+                keyvaluestore::KeyValueStore::Service>>>;
+// GetValue(), MultiGetValue() and Barrier() may block until other clients
+// catch up, so sync mode serves them by the callback API as well, and every
+// other RPC runs on a thread of the sync server.
+using SyncService = keyvaluestore::KeyValueStore::WithCallbackMethod_GetValue<
+    keyvaluestore::KeyValueStore::WithCallbackMethod_MultiGetValue<
+        keyvaluestore::KeyValueStore::WithCallbackMethod_Barrier<
+            BaseService>>>;
+// Async mode serves them from completion queues instead, polled by threads
+// of the server's own.
+using AsyncService = keyvaluestore::KeyValueStore::WithAsyncMethod_GetValue<
+    keyvaluestore::KeyValueStore::WithAsyncMethod_MultiGetValue<
+        keyvaluestore::KeyValueStore::WithAsyncMethod_Barrier<BaseService>>>;
+
+// A proxy serves the calls it forwards upstream by the callback API, so that
+// they don't hold a thread while they wait for the upstream servers.
+using ProxyService = keyvaluestore::KeyValueStore::WithCallbackMethod_GetValue<
+    keyvaluestore::KeyValueStore::WithCallbackMethod_MultiGetValue<
+        keyvaluestore::KeyValueStore::WithCallbackMethod_SetValue<
+            keyvaluestore::KeyValueStore::WithCallbackMethod_MultiSetValue<
+                keyvaluestore::KeyValueStore::WithCallbackMethod_Barrier<
+                    keyvaluestore::KeyValueStore::WithCallbackMethod_Add<
+                        keyvaluestore::KeyValueStore::Service>>>>>>;
+
+// Bytes of snapshot keys and values a watch stream reads at a time.
+constexpr size_t kWatchPageBytes = 256 << 10;
+// Bytes of newly set keys and values a watch stream holds for a reader that
+// falls behind, before it gives up on the reader.
+constexpr size_t kMaxWatchBacklogBytes = 64 << 20;
+
+// Fills the message that a WatchPrefix() or Replicate() stream writes for a
+// key/value pair.
+void SetKeyValue(std::string key, std::string value,
+                 keyvaluestore::KeyValue* message) {
+  message->set_key(std::move(key));
+  message->set_value(std::move(value));
+}
+
+void SetKeyValue(std::string key, std::string value,
+                 keyvaluestore::ReplicateResponse* message) {
+  SetKeyValue(std::move(key), std::move(value), message->mutable_key_value());
+}
+
+// Streams the key/value pairs under a prefix, first the ones already set and
+// then the others as they are set, for WatchPrefix() and Replicate(). The
+// messages of Replicate() also carry the namespaces opened and dropped: the
+// ones open when the stream starts come first, and the ones changed since in
+// order with the keys.
+template <typename Message>
+class WatchPrefixReactor final : public grpc::ServerWriteReactor<Message> {
+ public:
+  // `on_done` is called before the reactor is freed, if set.
+  WatchPrefixReactor(ShardedKeyValueMap* kv_map, ServerMetrics* metrics,
+                     RpcMethod method, const std::string& prefix,
+                     int64_t max_keys, std::deque<Message> first = {},
+                     std::function<void(WatchPrefixReactor*)> on_done = {})
+      : kv_map_(kv_map),
+        timer_(metrics, method),
+        max_keys_(max_keys),
+        first_(std::move(first)),
+        on_done_(std::move(on_done)) {
+    watcher_id_ = kv_map_->AddPrefixWatcher(
+        prefix,
+        [this](const std::string& key, const std::string& value) {
+          OnKeySet(key, value);
+        },
+        &snapshot_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    writing_ = true;
+    WriteNext(lock);
+  }
+
+  void OnWriteDone(bool ok) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!ok) {
+      // The stream is broken, and OnCancel() or OnDone() follows. `writing_`
+      // stays set so that no other write starts.
+      return;
+    }
+    WriteNext(lock);
+  }
+
+  void OnCancel() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!finished_) {
+      finished_ = true;
+      this->Finish(grpc::Status::CANCELLED);
+    }
+  }
+
+  void OnDone() override {
+    kv_map_->RemovePrefixWatcher(watcher_id_);
+    if (on_done_) {
+      on_done_(this);
+    }
+    delete this;
+  }
+
+  // Writes a change other than a key being set, in order with the keys set
+  // before and after it.
+  void OnChange(Message change) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Enqueue(std::move(change), lock);
+  }
+
+ private:
+  void OnKeySet(const std::string& key, const std::string& value) {
+    Message message;
+    SetKeyValue(key, value, &message);
+    std::unique_lock<std::mutex> lock(mutex_);
+    Enqueue(std::move(message), lock);
+  }
+
+  void Enqueue(Message message, std::unique_lock<std::mutex>& lock) {
+    if (finished_ || overflowed_) {
+      return;
+    }
+    // Keys that don't fit within `max_keys_` after the ones already pending
+    // would never be written.
+    if (max_keys_ > 0 &&
+        static_cast<int64_t>(pending_.size()) >= max_keys_ - num_keys_) {
+      return;
+    }
+    size_t bytes = PendingBytes(message);
+    if (pending_bytes_ + bytes > kMaxWatchBacklogBytes) {
+      // Rather than buffering without bound for a reader that doesn't keep
+      // up, end the stream, for the reader to watch again from a snapshot.
+      overflowed_ = true;
+      pending_.clear();
+      pending_bytes_ = 0;
+      if (!writing_) {
+        finished_ = true;
+        this->Finish(Overflowed());
+      }
+      return;
+    }
+    pending_bytes_ += bytes;
+    pending_.push_back(std::move(message));
+    if (!writing_) {
+      writing_ = true;
+      WriteNext(lock);
+    }
+  }
+
+  // Starts writing the next message: the first ones, those of the snapshot,
+  // then the ones set or changed since. Ends the stream once the last
+  // requested key has been written or the reader fell too far behind. Only
+  // one write may be in flight at a time, so it must be called with
+  // `writing_` set, which it clears if there is nothing to write.
+  void WriteNext(std::unique_lock<std::mutex>& lock) {
+    while (true) {
+      if (finished_) {
+        writing_ = false;
+        return;
+      }
+      if (overflowed_ || (max_keys_ > 0 && num_keys_ >= max_keys_)) {
+        writing_ = false;
+        finished_ = true;
+        this->Finish(overflowed_ ? Overflowed() : grpc::Status::OK);
+        return;
+      }
+      if (!first_.empty()) {
+        current_ = std::move(first_.front());
+        first_.pop_front();
+        break;
+      }
+      if (page_next_ < page_.size()) {
+        auto& [key, value] = page_[page_next_++];
+        current_.Clear();
+        SetKeyValue(std::move(key), std::move(value), &current_);
+        break;
+      }
+      if (!snapshot_done_) {
+        // Only the caller that set `writing_` reads the snapshot, so it can
+        // do so without holding up the inserts that report keys.
+        page_.clear();
+        page_next_ = 0;
+        lock.unlock();
+        bool read = kv_map_->ReadWatchSnapshot(&snapshot_, kWatchPageBytes,
+                                               &page_);
+        lock.lock();
+        snapshot_done_ = !read;
+        continue;
+      }
+      if (pending_.empty()) {
+        writing_ = false;
+        return;
+      }
+      current_ = std::move(pending_.front());
+      pending_.pop_front();
+      pending_bytes_ -= PendingBytes(current_);
+      break;
+    }
+    ++num_keys_;
+    this->StartWrite(&current_);
+  }
+
+  static size_t PendingBytes(const Message& message) {
+    return sizeof(Message) + message.ByteSizeLong();
+  }
+
+  static grpc::Status Overflowed() {
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "the watch fell too far behind the keys being set");
+  }
+
+  ShardedKeyValueMap* kv_map_;
+  // Records how long the stream was open.
+  ScopedRpcTimer timer_;
+  ShardedKeyValueMap::WaiterId watcher_id_;
+  const int64_t max_keys_;
+  std::mutex mutex_;
+  int64_t num_keys_ = 0;
+  // Written before the snapshot.
+  std::deque<Message> first_;
+  std::function<void(WatchPrefixReactor*)> on_done_;
+  // The keys that were set when the stream started, read a page at a time.
+  ShardedKeyValueMap::WatchSnapshot snapshot_;
+  std::vector<std::pair<std::string, std::string>> page_;
+  size_t page_next_ = 0;
+  bool snapshot_done_ = false;
+  // Pairs set and changes made since the stream started that are yet to be
+  // written, in order, and the bytes they take.
+  std::deque<Message> pending_;
+  size_t pending_bytes_ = 0;
+  // The message being written.
+  Message current_;
+  bool writing_ = false;
+  bool overflowed_ = false;
+  bool finished_ = false;
+};
+
+using ReplicateReactor = WatchPrefixReactor<keyvaluestore::ReplicateResponse>;
+
+// Ends a stream right away, such as a Replicate() call to a follower.
+template <typename Message>
+class FailedWriteReactor final : public grpc::ServerWriteReactor<Message> {
+ public:
+  explicit FailedWriteReactor(const grpc::Status& status) {
+    this->Finish(status);
+  }
+
+  void OnDone() override { delete this; }
+};
+
+// Returns when a call waiting for keys gives up: after `timeout`, and no
+// later than the client's deadline, past which nobody is waiting for the
+// response anymore.
+std::chrono::steady_clock::time_point CallDeadline(
+    const grpc::ServerContextBase& context, std::chrono::milliseconds timeout) {
+  auto now = std::chrono::steady_clock::now();
+  auto system_now = std::chrono::system_clock::now();
+  // The deadline is far in the future if the client has none.
+  if (context.deadline() < system_now + timeout) {
+    return now + std::chrono::duration_cast<std::chrono::milliseconds>(
+                     context.deadline() - system_now);
+  }
+  return now + timeout;
+}
+
+// Returns the point of the system clock that `deadline` stands for, to set
+// an alarm to it.
+std::chrono::system_clock::time_point ToSystemTime(
+    std::chrono::steady_clock::time_point deadline) {
+  return std::chrono::system_clock::now() +
+         (deadline - std::chrono::steady_clock::now());
+}
+
+// Serves a GetValue(), MultiGetValue() or Barrier() call by the callback API.
+// It registers a waiter for each missing key, and finishes once enough keys
+// are set, once its deadline passes, or as soon as the client cancels it. It
+// holds a reference per waiter or alarm whose callback may still run and one
+// until OnDone(), and frees itself once they are all dropped.
+class WaitingReactor final : public grpc::ServerUnaryReactor {
+ public:
+  // Fills the response with one entry per key, which is std::nullopt if the
+  // key is not set.
+  using Respond = std::function<void(std::vector<std::optional<std::string>>)>;
+
+  // `give_up`, if set, is called instead of `respond` when the call times out
+  // or is cancelled.
+  WaitingReactor(ShardedKeyValueMap* kv_map, ServerMetrics* metrics,
+                 RpcMethod method, std::vector<std::string> keys,
+                 size_t min_found,
+                 std::chrono::steady_clock::time_point deadline,
+                 Respond respond, std::function<void()> give_up = {})
+      : kv_map_(kv_map),
+        metrics_(metrics),
+        method_(method),
+        timer_(metrics, method),
+        keys_(std::move(keys)),
+        values_(keys_.size()),
+        min_found_(min_found),
+        respond_(std::move(respond)),
+        give_up_(std::move(give_up)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < keys_.size(); ++i) {
+      std::string value;
+      if (kv_map_->Find(keys_[i], &value)) {
+        values_[i] = std::move(value);
+        ++num_found_;
+      }
+    }
+    for (size_t i = 0; i < keys_.size() && num_found_ < min_found_; ++i) {
+      if (values_[i]) {
+        continue;
+      }
+      ++refs_;
+      std::string value;
+      ShardedKeyValueMap::WaiterId waiter_id;
+      auto callback = [this, i](const std::string& value) {
+        OnKeySet(i, value);
+      };
+      if (kv_map_->FindOrAddWaiter(keys_[i], &value, callback, &waiter_id)) {
+        --refs_;
+        values_[i] = std::move(value);
+        ++num_found_;
+      } else {
+        waiters_.emplace_back(i, waiter_id);
+      }
+    }
+    if (num_found_ >= min_found_) {
+      Complete(grpc::Status::OK);
+      return;
+    }
+    // Waiter callbacks block on `mutex_`, so none of them can complete the
+    // call before the alarm is armed.
+    ++refs_;
+    alarm_armed_ = true;
+    alarm_.Set(ToSystemTime(deadline), [this](bool ok) { OnAlarm(ok); });
+  }
+
+  void OnCancel() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!finished_) {
+      metrics_->cancelled.Add();
+      Complete(grpc::Status(
+          grpc::StatusCode::CANCELLED,
+          std::string(RpcMethodName(method_)) + "() was cancelled"));
+    }
+  }
+
+  void OnDone() override { Unref(); }
+
+ private:
+  void OnKeySet(size_t i, const std::string& value) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!finished_) {
+        values_[i] = value;
+        if (++num_found_ >= min_found_) {
+          Complete(grpc::Status::OK);
+        }
+      }
+    }
+    Unref();
+  }
+
+  void OnAlarm(bool ok) {
+    {
+      // The alarm is cancelled only after the call is finished.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ok && !finished_) {
+        metrics_->timeouts.Add();
+        Complete(grpc::Status(
+            grpc::StatusCode::DEADLINE_EXCEEDED,
+            std::string(RpcMethodName(method_)) + "() exceeded time limit."));
+      }
+    }
+    Unref();
+  }
+
+  // Finishes the call. Must be called with `mutex_` held, at most once.
+  void Complete(const grpc::Status& status) {
+    finished_ = true;
+    if (alarm_armed_) {
+      alarm_.Cancel();
+    }
+    // Unregister the waiters that have not been called. The others drop their
+    // reference when their callback returns.
+    for (const auto& [i, waiter_id] : waiters_) {
+      if (kv_map_->RemoveWaiter(keys_[i], waiter_id)) {
+        --refs_;
+      }
+    }
+    waiters_.clear();
+    if (status.ok()) {
+      respond_(std::move(values_));
+    } else if (give_up_) {
+      give_up_();
+    }
+    Finish(status);
+  }
+
+  void Unref() {
+    if (refs_.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+  ShardedKeyValueMap* kv_map_;
+  ServerMetrics* metrics_;
+  const RpcMethod method_;
+  // Records how long the call took.
+  ScopedRpcTimer timer_;
+  const std::vector<std::string> keys_;
+  std::mutex mutex_;
+  std::vector<std::optional<std::string>> values_;
+  const size_t min_found_;
+  size_t num_found_ = 0;
+  Respond respond_;
+  std::function<void()> give_up_;
+  // The keys waited for, by index, and their waiters.
+  std::vector<std::pair<size_t, ShardedKeyValueMap::WaiterId>> waiters_;
+  grpc::Alarm alarm_;
+  bool alarm_armed_ = false;
+  bool finished_ = false;
+  std::atomic<int> refs_{1};
+};
+
+// Streams a value set in chunks for GetValueStream(), once it is set, one
+// chunk per message. Like WaitingReactor, it holds a reference per callback
+// that may still run and one until OnDone().
+class ChunkedValueReactor final
+    : public grpc::ServerWriteReactor<keyvaluestore::ValueChunk> {
+ public:
+  ChunkedValueReactor(ShardedKeyValueMap* kv_map, ServerMetrics* metrics,
+                      const std::string& key,
+                      std::chrono::steady_clock::time_point deadline)
+      : kv_map_(kv_map),
+        metrics_(metrics),
+        timer_(metrics, RpcMethod::kGetValueStream),
+        key_(key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++refs_;
+    value_ = kv_map_->FindOrAddChunkedWaiter(
+        key_,
+        [this](const ShardedKeyValueMap::ChunkedValue& value) {
+          OnValueSet(value);
+        },
+        &waiter_id_);
+    if (value_ != nullptr) {
+      --refs_;
+      WriteNext();
+      return;
+    }
+    // The waiter callback blocks on `mutex_` until the alarm is armed.
+    waiting_ = true;
+    ++refs_;
+    alarm_.Set(ToSystemTime(deadline), [this](bool ok) { OnAlarm(ok); });
+  }
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Otherwise the stream is broken, and OnCancel() or OnDone() follows.
+    if (ok && !finished_) {
+      WriteNext();
+    }
+  }
+
+  void OnCancel() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    if (waiting_) {
+      metrics_->cancelled.Add();
+      StopWaiting();
+    }
+    finished_ = true;
+    Finish(grpc::Status(grpc::StatusCode::CANCELLED,
+                        "GetValueStream() was cancelled"));
+  }
+
+  void OnDone() override { Unref(); }
+
+ private:
+  void OnValueSet(const ShardedKeyValueMap::ChunkedValue& value) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (waiting_) {
+        StopWaiting();
+        value_ = value;
+        WriteNext();
+      }
+    }
+    Unref();
+  }
+
+  void OnAlarm(bool ok) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ok && waiting_) {
+        StopWaiting();
+        metrics_->timeouts.Add();
+        finished_ = true;
+        Finish(grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            "GetValueStream() exceeded time limit."));
+      }
+    }
+    Unref();
+  }
+
+  // Cancels the alarm and unregisters the waiter if it has not been called.
+  // Must be called with `mutex_` held.
+  void StopWaiting() {
+    waiting_ = false;
+    alarm_.Cancel();
+    if (kv_map_->RemoveChunkedWaiter(key_, waiter_id_)) {
+      --refs_;
+    }
+  }
+
+  // Writes the next chunk, or ends the stream after the last one. Only one
+  // chunk at a time is copied into a message. Must be called with `mutex_`
+  // held.
+  void WriteNext() {
+    if (next_chunk_ < value_->size()) {
+      chunk_.set_data((*value_)[next_chunk_++]);
+      StartWrite(&chunk_);
+      return;
+    }
+    finished_ = true;
+    Finish(grpc::Status::OK);
+  }
+
+  void Unref() {
+    if (refs_.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+  ShardedKeyValueMap* kv_map_;
+  ServerMetrics* metrics_;
+  // Records how long the stream was open.
+  ScopedRpcTimer timer_;
+  const std::string key_;
+  std::mutex mutex_;
+  ShardedKeyValueMap::WaiterId waiter_id_;
+  ShardedKeyValueMap::ChunkedValue value_;
+  size_t next_chunk_ = 0;
+  keyvaluestore::ValueChunk chunk_;
+  grpc::Alarm alarm_;
+  bool waiting_ = false;
+  bool finished_ = false;
+  std::atomic<int> refs_{1};
+};
+
+// How long a follower waits before it tries every replica again, when none
+// of them was the leader.
+constexpr auto kMinFollowBackoff = std::chrono::milliseconds(10);
+constexpr auto kMaxFollowBackoff = std::chrono::seconds(1);
+
+// The most keys a ListKeys() response holds. A response also ends after the
+// key that takes it past kMaxListPageBytes, so that pages of large values
+// stay well below the message size limit.
+constexpr size_t kMaxListPageKeys = 1000;
+constexpr size_t kMaxListPageBytes = 1 << 20;
+
+size_t ListPageSize(const keyvaluestore::ListKeysRequest& request) {
+  return request.page_size() > 0
+             ? std::min<size_t>(request.page_size(), kMaxListPageKeys)
+             : kMaxListPageKeys;
+}
+
+// Returns how many of the requested keys a MultiGetValue() call waits for.
+size_t MinKeysToFind(const keyvaluestore::MultiGetValueRequest& request) {
+  if (request.wait_mode() == keyvaluestore::MultiGetValueRequest::WAIT_ANY) {
+    return std::min(request.keys_size(), 1);
+  }
+  return request.keys_size();
+}
+
+void SummarizeLatency(const Histogram& histogram,
+                      keyvaluestore::LatencyStats* stats) {
+  Histogram::Summary summary = histogram.Summarize();
+  stats->set_count(summary.count);
+  stats->set_mean_us(summary.mean_us);
+  stats->set_p50_us(summary.p50_us);
+  stats->set_p99_us(summary.p99_us);
+  stats->set_p999_us(summary.p999_us);
+  stats->set_max_us(summary.max_us);
+}
+
+}  // namespace
+
+// Logic and data behind the server's behavior.
+template <typename Service>
+class KeyValueStoreServiceImpl : public Service {
+ public:
+  explicit KeyValueStoreServiceImpl(const KeyValueStoreServerOptions& options)
+      : options_(options),
+        kv_map_(options.num_shards, &metrics_.wait_time),
+        barriers_(options.num_shards, &metrics_.wait_time),
+        leader_(options.replicas.empty()) {}
+  KeyValueStoreServiceImpl(const KeyValueStoreServiceImpl&) = delete;
+  KeyValueStoreServiceImpl(KeyValueStoreServiceImpl&&) = delete;
+  KeyValueStoreServiceImpl& operator=(const KeyValueStoreServiceImpl&) = delete;
+  KeyValueStoreServiceImpl&& operator=(KeyValueStoreServiceImpl&&) = delete;
+
+  ~KeyValueStoreServiceImpl() {
+    if (shm_) {
+      kv_map_.RemovePrefixWatcher(shm_watcher_id_);
+    }
+    StopFollowing();
+    if (follow_thread_.joinable()) {
+      follow_thread_.join();
+    }
+  }
+
+  // Serves a GetValue() call for a caller that is not a gRPC call, such as a
+  // client in the same process, on the caller's thread. It waits until
+  // `deadline` or until `canceller` is cancelled.
+  grpc::Status GetValue(const keyvaluestore::GetValueRequest& request,
+                        std::chrono::steady_clock::time_point deadline,
+                        ShardedKeyValueMap::Canceller* canceller,
+                        keyvaluestore::GetValueResponse* response) {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kGetValue);
+    if (!kv_map_.WaitFor(request.key(), deadline, response->mutable_value(),
+                         canceller)) {
+      return WaitFailed(canceller->cancelled(), "GetValue()");
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status SetValue(grpc::ServerContext* context,
+                        const keyvaluestore::SetValueRequest* request,
+                        keyvaluestore::SetValueResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kSetValue);
+    if (!leader()) {
+      return NotLeader();
+    }
+    int num_existing;
+    grpc::Status status = InsertLogged({{&request->key(), &request->value()}},
+                                       request->retried(), &num_existing);
+    if (status.ok() && num_existing) {
+      // We expect only one client sets a value with a key only once.
+      return AlreadyExists(1, "Updating an existing value is not supported");
+    }
+    return status;
+  }
+
+  // Like GetValue() above.
+  grpc::Status MultiGetValue(
+      const keyvaluestore::MultiGetValueRequest& request,
+      std::chrono::steady_clock::time_point deadline,
+      ShardedKeyValueMap::Canceller* canceller,
+      keyvaluestore::MultiGetValueResponse* response) {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kMultiGetValue);
+    std::vector<std::string> keys(request.keys().begin(),
+                                  request.keys().end());
+    std::vector<std::optional<std::string>> values;
+    if (!kv_map_.WaitForKeys(keys, MinKeysToFind(request), deadline, &values,
+                             canceller)) {
+      return WaitFailed(canceller->cancelled(), "MultiGetValue()");
+    }
+    for (std::optional<std::string>& value : values) {
+      auto* response_value = response->add_values();
+      if (value) {
+        response_value->set_found(true);
+        response_value->set_value(std::move(*value));
+      }
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status MultiSetValue(
+      grpc::ServerContext* context,
+      const keyvaluestore::MultiSetValueRequest* request,
+      keyvaluestore::MultiSetValueResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kMultiSetValue);
+    if (!leader()) {
+      return NotLeader();
+    }
+    std::vector<KeyValueRef> key_values;
+    key_values.reserve(request->key_values_size());
+    for (const keyvaluestore::KeyValue& key_value : request->key_values()) {
+      key_values.emplace_back(&key_value.key(), &key_value.value());
+    }
+    int num_existing;
+    grpc::Status status =
+        InsertLogged(key_values, request->retried(), &num_existing);
+    if (!status.ok()) {
+      return status;
+    }
+    if (num_existing) {
+      // The other keys are still set, as with individual SetValue() calls.
+      return AlreadyExists(num_existing,
+                           std::to_string(num_existing) +
+                               " keys already exist. Updating an existing "
+                               "value is not supported");
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::ServerWriteReactor<keyvaluestore::KeyValue>* WatchPrefix(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::WatchPrefixRequest* request) override {
+    return new WatchPrefixReactor<keyvaluestore::KeyValue>(
+        &kv_map_, &metrics_, RpcMethod::kWatchPrefix, request->prefix(),
+        request->max_keys());
+  }
+
+  grpc::ServerWriteReactor<keyvaluestore::ReplicateResponse>* Replicate(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::ReplicateRequest* request) override {
+    if (!leader()) {
+      return new FailedWriteReactor<keyvaluestore::ReplicateResponse>(
+          NotLeader());
+    }
+    // The namespaces open now come first, and no other opens or drops until
+    // the stream is registered for them.
+    std::lock_guard<std::mutex> lock(namespaces_mutex_);
+    std::deque<keyvaluestore::ReplicateResponse> first;
+    for (const auto& [name, ttl] : kv_map_.namespaces()) {
+      keyvaluestore::OpenNamespaceRequest* open =
+          first.emplace_back().mutable_open_namespace();
+      open->set_name(name);
+      open->set_ttl_ms(ttl.count());
+    }
+    // Counters and values set in chunks are not replicated.
+    auto* reactor = new ReplicateReactor(
+        &kv_map_, &metrics_, RpcMethod::kReplicate, /*prefix=*/"",
+        /*max_keys=*/0, std::move(first), [this](ReplicateReactor* reactor) {
+          std::lock_guard<std::mutex> lock(namespaces_mutex_);
+          replicate_reactors_.erase(reactor);
+        });
+    replicate_reactors_.insert(reactor);
+    return reactor;
+  }
+
+  grpc::Status SetValueStream(
+      grpc::ServerContext* context,
+      grpc::ServerReader<keyvaluestore::ValueChunk>* reader,
+      keyvaluestore::SetValueResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kSetValueStream);
+    if (!leader()) {
+      return NotLeader();
+    }
+    keyvaluestore::ValueChunk chunk;
+    if (!reader->Read(&chunk)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "SetValueStream() needs at least one chunk");
+    }
+    std::string key = std::move(*chunk.mutable_key());
+    // Keep the chunks as they arrive instead of joining them into one buffer.
+    auto chunks = std::make_shared<std::vector<std::string>>();
+    do {
+      if (!chunk.data().empty()) {
+        chunks->push_back(std::move(*chunk.mutable_data()));
+      }
+    } while (reader->Read(&chunk));
+    if (context->IsCancelled()) {
+      return grpc::Status(grpc::StatusCode::CANCELLED,
+                          "SetValueStream() was cancelled");
+    }
+    return InsertChunkedLogged(key, std::move(chunks));
+  }
+
+  grpc::ServerWriteReactor<keyvaluestore::ValueChunk>* GetValueStream(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::GetValueRequest* request) override {
+    if (!leader()) {
+      return new FailedWriteReactor<keyvaluestore::ValueChunk>(NotLeader());
+    }
+    return new ChunkedValueReactor(
+        &kv_map_, &metrics_, request->key(),
+        WaitDeadline(*context, request->timeout_ms()));
+  }
+
+  // Like GetValue() above.
+  grpc::Status Barrier(const keyvaluestore::BarrierRequest& request,
+                       std::chrono::steady_clock::time_point deadline,
+                       ShardedKeyValueMap::Canceller* canceller,
+                       keyvaluestore::BarrierResponse* response) {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kBarrier);
+    std::string release_key;
+    int64_t generation;
+    grpc::Status status = ArriveAtBarrier(request, &release_key, &generation);
+    if (!status.ok()) {
+      return status;
+    }
+    std::string unused_value;
+    if (!barriers_.WaitFor(release_key, deadline, &unused_value, canceller)) {
+      LeaveBarrier(request, generation);
+      return WaitFailed(canceller->cancelled(), "Barrier()");
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status Add(grpc::ServerContext* context,
+                   const keyvaluestore::AddRequest* request,
+                   keyvaluestore::AddResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kAdd);
+    if (!leader()) {
+      return NotLeader();
+    }
+    response->set_value(kv_map_.Add(request->key(), request->delta()));
+    return grpc::Status::OK;
+  }
+
+  grpc::Status OpenNamespace(
+      grpc::ServerContext* context,
+      const keyvaluestore::OpenNamespaceRequest* request,
+      keyvaluestore::OpenNamespaceResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kOpenNamespace);
+    if (!leader()) {
+      return NotLeader();
+    }
+    const std::string& name = request->name();
+    if (!IsValidNamespace(name)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Invalid namespace name");
+    }
+    auto ttl =
+        std::chrono::milliseconds(std::max<int64_t>(request->ttl_ms(), 0));
+    bool opened = false;
+    grpc::Status status = Open(name, ttl, &opened);
+    response->set_opened(opened);
+    return status;
+  }
+
+  grpc::Status DropNamespace(
+      grpc::ServerContext* context,
+      const keyvaluestore::DropNamespaceRequest* request,
+      keyvaluestore::DropNamespaceResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kDropNamespace);
+    if (!leader()) {
+      return NotLeader();
+    }
+    reaper_.Cancel(request->name());
+    bool dropped = false;
+    grpc::Status status = Drop(request->name(), &dropped);
+    response->set_dropped(dropped);
+    return status;
+  }
+
+  grpc::Status ListKeys(
+      grpc::ServerContext* context,
+      const keyvaluestore::ListKeysRequest* request,
+      grpc::ServerWriter<keyvaluestore::ListKeysResponse>* writer) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kListKeys);
+    size_t page_size = ListPageSize(*request);
+    int64_t left = request->limit() > 0 ? request->limit() : INT64_MAX;
+    std::string start_after = request->start_after();
+    // Only one page is held at a time, and the next one is read from the map
+    // once this one has been written.
+    keyvaluestore::ListKeysResponse page;
+    bool more = true;
+    while (more && left > 0) {
+      size_t wanted = std::min<int64_t>(page_size, left);
+      std::vector<std::string> keys =
+          kv_map_.ListKeys(request->prefix(), start_after, wanted);
+      more = keys.size() == wanted;
+      page.Clear();
+      size_t page_bytes = 0;
+      for (std::string& key : keys) {
+        start_after = key;
+        std::string value;
+        // The key is gone if its namespace was dropped meanwhile.
+        if (request->with_values() && !kv_map_.Find(key, &value)) {
+          continue;
+        }
+        page_bytes += key.size() + value.size();
+        page.add_keys(std::move(key));
+        if (request->with_values()) {
+          page.add_values(std::move(value));
+        }
+        --left;
+        if (page_bytes >= kMaxListPageBytes) {
+          // The rest of the keys go in the next page.
+          more = true;
+          break;
+        }
+      }
+      if (page.keys_size() > 0 && !writer->Write(page)) {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "ListKeys() was cancelled");
+      }
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status GetStats(grpc::ServerContext* context,
+                        const keyvaluestore::GetStatsRequest* request,
+                        keyvaluestore::GetStatsResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kGetStats);
+    CollectStats(response);
+    return grpc::Status::OK;
+  }
+
+  // Reads the metrics without stopping the RPCs that update them, so they
+  // may be slightly out of step with each other.
+  void CollectStats(keyvaluestore::GetStatsResponse* stats) const {
+    for (size_t i = 0; i < kNumRpcMethods; ++i) {
+      keyvaluestore::RpcStats* rpc = stats->add_rpcs();
+      rpc->set_method(RpcMethodName(static_cast<RpcMethod>(i)));
+      SummarizeLatency(metrics_.rpc_latency[i], rpc->mutable_latency());
+    }
+    stats->set_blocked_waiters(kv_map_.num_waiters() +
+                               barriers_.num_waiters());
+    SummarizeLatency(metrics_.wait_time, stats->mutable_wait_time());
+    stats->set_timeouts(metrics_.timeouts.Value());
+    stats->set_already_exists(metrics_.already_exists.Value());
+    stats->set_cancelled(metrics_.cancelled.Value());
+    stats->set_num_namespaces(kv_map_.namespaces().size());
+    stats->set_expired_namespaces(metrics_.expired_namespaces.Value());
+    stats->set_num_keys(kv_map_.size());
+    stats->set_bytes_stored(kv_map_.data_bytes());
+    stats->set_leader(leader());
+  }
+
+  grpc::Status TimedOut(const std::string& message) {
+    metrics_.timeouts.Add();
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, message);
+  }
+
+  grpc::Status AlreadyExists(int num_keys, const std::string& message) {
+    metrics_.already_exists.Add(num_keys);
+    return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, message);
+  }
+
+  // Counts the caller in at the barrier, and stores the key in `barriers_`
+  // that is set once all callers of its `generation` have arrived. Release
+  // keys are only freed with the namespace the barrier is named after.
+  grpc::Status ArriveAtBarrier(const keyvaluestore::BarrierRequest& request,
+                               std::string* release_key, int64_t* generation) {
+    if (!leader()) {
+      return NotLeader();
+    }
+    if (request.world_size() <= 0) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "world_size must be positive");
+    }
+    // The counter is kept apart from the release keys, so the name can't
+    // collide with them.
+    int64_t arrivals;
+    {
+      std::lock_guard<std::mutex> lock(barrier_mutex_);
+      arrivals = barriers_.Add(request.name(), 1);
+    }
+    *generation = (arrivals - 1) / request.world_size();
+    *release_key = request.name() + '/' + std::to_string(*generation);
+    if (arrivals % request.world_size() == 0) {
+      // The last caller of the generation releases everyone at once.
+      barriers_.Insert(*release_key, "");
+    }
+    return grpc::Status::OK;
+  }
+
+  // Counts out a caller that gave up waiting at the barrier, unless its
+  // generation is complete already, so that a retry or a restarted caller is
+  // not counted twice.
+  void LeaveBarrier(const keyvaluestore::BarrierRequest& request,
+                    int64_t generation) {
+    std::lock_guard<std::mutex> lock(barrier_mutex_);
+    int64_t arrivals = barriers_.Add(request.name(), 0);
+    // The counter starts over if its namespace was dropped meanwhile.
+    if (arrivals > generation * request.world_size() &&
+        arrivals < (generation + 1) * request.world_size()) {
+      barriers_.Add(request.name(), -1);
+    }
+  }
+
+  // When a wait for keys gives up: after `timeout_ms` if it is positive or
+  // the server's timeout otherwise, and no later than the client's deadline.
+  std::chrono::steady_clock::time_point WaitDeadline(
+      const grpc::ServerContextBase& context, int64_t timeout_ms) const {
+    return CallDeadline(context, Timeout(timeout_ms));
+  }
+
+  // Like above, for a caller without a deadline of its own.
+  std::chrono::steady_clock::time_point WaitDeadline(
+      int64_t timeout_ms) const {
+    return std::chrono::steady_clock::now() + Timeout(timeout_ms);
+  }
+
+  std::chrono::milliseconds Timeout(int64_t timeout_ms) const {
+    return timeout_ms > 0 ? std::chrono::milliseconds(timeout_ms)
+                          : options_.timeout_in_ms;
+  }
+
+  // The status of a call whose wait gave up, because it timed out or because
+  // the client cancelled it.
+  grpc::Status WaitFailed(bool cancelled, const std::string& method) {
+    if (cancelled) {
+      metrics_.cancelled.Add();
+      return grpc::Status(grpc::StatusCode::CANCELLED,
+                          method + " was cancelled");
+    }
+    return TimedOut(method + " exceeded time limit.");
+  }
+
+  // Restores the values from the write-ahead log if the server has one, and
+  // starts logging the new ones.
+  bool OpenLog(std::string* error) {
+    if (options_.wal_dir.empty()) {
+      return true;
+    }
+    wal_ = std::make_unique<WriteAheadLog>(options_.wal_dir, &kv_map_,
+                                           options_.snapshot_interval);
+    if (!wal_->Open(error)) {
+      return false;
+    }
+    // The leases of the restored namespaces start over, on a follower once
+    // it is promoted.
+    for (const auto& [name, ttl] : kv_map_.namespaces()) {
+      barriers_.OpenNamespace(name, ttl);
+      if (leader()) {
+        reaper_.Renew(name, ttl);
+      }
+    }
+    return true;
+  }
+
+  // Creates the shared memory segment of the same-host clients if the server
+  // has one, and publishes every value to it, starting with the restored
+  // ones.
+  bool OpenSharedMemory(const std::string& addr, std::string* error) {
+    if (options_.shm_name.empty()) {
+      return true;
+    }
+    shm_ = SharedMemoryWriter::Create(options_.shm_name, options_.shm_size,
+                                      addr, options_.timeout_in_ms, error);
+    if (!shm_) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(namespaces_mutex_);
+    for (const auto& [name, ttl] : kv_map_.namespaces()) {
+      shm_->OpenNamespace(name);
+    }
+    shm_watcher_id_ = kv_map_.AddPrefixWatcher(
+        /*prefix=*/"",
+        [this](const std::string& key, const std::string& value) {
+          shm_->Publish(key, value);
+        });
+    return true;
+  }
+
+  bool leader() const { return leader_.load(std::memory_order_acquire); }
+
+  static grpc::Status NotLeader() {
+    // Clients take this as a cue to try another replica.
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                        "this replica is a follower");
+  }
+
+  // Starts copying the values set on the leader if the server is a follower.
+  // `self` is skipped among the replicas.
+  void StartFollowing(const std::string& self) {
+    if (leader()) {
+      return;
+    }
+    std::vector<std::string> replicas;
+    for (const std::string& replica : options_.replicas) {
+      if (replica != self) {
+        replicas.push_back(replica);
+      }
+    }
+    if (replicas.empty()) {
+      KVS_LOG(kWarning) << "A follower needs other replicas to follow";
+      return;
+    }
+    follow_thread_ = std::thread([this, replicas]() { Follow(replicas); });
+  }
+
+  // Makes the server the leader, which stops copying values from the old one.
+  void Promote() {
+    if (!leader_.exchange(true, std::memory_order_acq_rel)) {
+      KVS_LOG(kInfo) << "Promoted to leader";
+      StopFollowing();
+      // The leases of the namespaces copied from the old leader start over.
+      std::lock_guard<std::mutex> lock(namespaces_mutex_);
+      for (const auto& [name, ttl] : kv_map_.namespaces()) {
+        reaper_.Renew(name, ttl);
+      }
+    }
+  }
+
+  static grpc::Status LogFailedStatus() {
+    // The value is not set, and no other will be since the log can't be
+    // written anymore.
+    return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                        "failed to write the value to the log");
+  }
+
+  using KeyValueRef = std::pair<const std::string*, const std::string*>;
+
+  // Inserts the pairs that are not set yet, after logging them if the server
+  // has a log, so that no reader, watcher or follower sees a value that a
+  // restart could lose. Counts the keys that are set already, or that another
+  // call is setting, in `num_existing`. For a `retried` request, keys that
+  // hold the same value already are not counted, as the first attempt may
+  // have set them before its replica went down.
+  grpc::Status InsertLogged(const std::vector<KeyValueRef>& key_values,
+                            bool retried, int* num_existing) {
+    *num_existing = 0;
+    auto count_existing = [&](const KeyValueRef& key_value) {
+      std::string value;
+      if (!retried || !kv_map_.Find(*key_value.first, &value) ||
+          value != *key_value.second) {
+        ++*num_existing;
+      }
+    };
+    if (!wal_) {
+      for (const KeyValueRef& key_value : key_values) {
+        if (!kv_map_.Insert(*key_value.first, *key_value.second)) {
+          count_existing(key_value);
+        }
+      }
+      return grpc::Status::OK;
+    }
+    std::vector<KeyValueRef> logged;
+    {
+      std::lock_guard<std::mutex> lock(logging_mutex_);
+      for (const KeyValueRef& key_value : key_values) {
+        if (kv_map_.Contains(*key_value.first) ||
+            !logging_keys_.insert(*key_value.first).second) {
+          count_existing(key_value);
+        } else {
+          logged.push_back(key_value);
+        }
+      }
+    }
+    std::vector<uint64_t> sequences;
+    sequences.reserve(logged.size());
+    for (const auto& [key, value] : logged) {
+      sequences.push_back(wal_->Append(*key, *value));
+    }
+    // All of the keys are committed together.
+    bool synced = sequences.empty() || wal_->Sync(sequences.back());
+    for (size_t i = 0; i < logged.size(); ++i) {
+      if (synced) {
+        kv_map_.Insert(*logged[i].first, *logged[i].second);
+      }
+      wal_->Applied(sequences[i]);
+    }
+    std::lock_guard<std::mutex> lock(logging_mutex_);
+    for (const auto& [key, value] : logged) {
+      logging_keys_.erase(*key);
+    }
+    return synced ? grpc::Status::OK : LogFailedStatus();
+  }
+
+  // Like InsertLogged(), for a value set in chunks.
+  grpc::Status InsertChunkedLogged(const std::string& key,
+                                   ShardedKeyValueMap::ChunkedValue chunks) {
+    bool exists;
+    if (!wal_) {
+      exists = !kv_map_.InsertChunked(key, std::move(chunks));
+    } else {
+      std::lock_guard<std::mutex> lock(logging_mutex_);
+      exists = kv_map_.FindChunked(key) != nullptr ||
+               !logging_chunked_keys_.insert(key).second;
+    }
+    if (exists) {
+      return AlreadyExists(1, "Updating an existing value is not supported.");
+    }
+    if (!wal_) {
+      return grpc::Status::OK;
+    }
+    uint64_t sequence = wal_->AppendChunked(key, *chunks);
+    bool synced = wal_->Sync(sequence);
+    if (synced) {
+      kv_map_.InsertChunked(key, std::move(chunks));
+    }
+    wal_->Applied(sequence);
+    std::lock_guard<std::mutex> lock(logging_mutex_);
+    logging_chunked_keys_.erase(key);
+    return synced ? grpc::Status::OK : LogFailedStatus();
+  }
+
+  const KeyValueStoreServerOptions& options() const { return options_; }
+  ShardedKeyValueMap* kv_map() { return &kv_map_; }
+  ShardedKeyValueMap* barriers() { return &barriers_; }
+  ServerMetrics* metrics() { return &metrics_; }
+
+ private:
+  KeyValueStoreServerOptions options_;
+  // Declared before the maps, which record wait times into it.
+  ServerMetrics metrics_;
+  ShardedKeyValueMap kv_map_;
+  // Barrier arrival counters, and the keys that release each generation of a
+  // barrier.
+  ShardedKeyValueMap barriers_;
+  // Serializes arrivals with the callers that give up, so that a caller is
+  // only counted out of a generation that is not complete.
+  std::mutex barrier_mutex_;
+  // Set if values must survive a restart.
+  std::unique_ptr<WriteAheadLog> wal_;
+  // The keys that are being logged before they are inserted, which point into
+  // the requests that set them. Chunked values have their own key space.
+  std::mutex logging_mutex_;
+  std::unordered_set<std::string_view> logging_keys_;
+  std::unordered_set<std::string_view> logging_chunked_keys_;
+  // Serializes opening and dropping namespaces, so that whether a namespace
+  // is open does not change while its record is logged, and guards
+  // `replicate_reactors_`.
+  std::mutex namespaces_mutex_;
+  // The Replicate() streams, which are sent the namespace changes.
+  std::unordered_set<ReplicateReactor*> replicate_reactors_;
+  // Set if same-host clients read the values from shared memory.
+  std::unique_ptr<SharedMemoryWriter> shm_;
+  ShardedKeyValueMap::WaiterId shm_watcher_id_;
+  // Declared after the maps and the log, so that it stops before they go.
+  NamespaceReaper reaper_{[this](const std::string& name) {
+    bool dropped = false;
+    Drop(name, &dropped, /*if_expired=*/true);
+    if (dropped) {
+      KVS_LOG(kInfo) << "Namespace " << name << " expired";
+      metrics_.expired_namespaces.Add();
+    }
+  }};
+
+  static bool IsValidNamespace(const std::string& name) {
+    return !name.empty() &&
+           name.find(ShardedKeyValueMap::kNamespaceSeparator) ==
+               std::string::npos;
+  }
+
+  // Opens a namespace after logging it, or renews its lease if it is open.
+  // Followers are sent the open before any key of the namespace, and only
+  // start its lease once they are promoted.
+  grpc::Status Open(const std::string& name, std::chrono::milliseconds ttl,
+                    bool* opened) {
+    std::lock_guard<std::mutex> lock(namespaces_mutex_);
+    *opened = kv_map_.namespaces().count(name) == 0;
+    if (*opened) {
+      // Like a value, a namespace is only opened once it is logged, so that
+      // a failed call leaves nothing behind.
+      uint64_t sequence = 0;
+      if (wal_) {
+        sequence = wal_->AppendOpenNamespace(name, ttl);
+        if (!wal_->Sync(sequence)) {
+          wal_->Applied(sequence);
+          return LogFailedStatus();
+        }
+      }
+      keyvaluestore::ReplicateResponse change;
+      change.mutable_open_namespace()->set_name(name);
+      change.mutable_open_namespace()->set_ttl_ms(ttl.count());
+      SendToFollowers(change);
+      if (shm_) {
+        shm_->OpenNamespace(name);
+      }
+      kv_map_.OpenNamespace(name, ttl);
+      if (wal_) {
+        wal_->Applied(sequence);
+      }
+    }
+    // Barriers named after the namespace go with it.
+    barriers_.OpenNamespace(name, ttl);
+    if (leader()) {
+      reaper_.Renew(name, ttl);
+    }
+    return grpc::Status::OK;
+  }
+
+  // Drops a namespace from the maps and logs it, if it is open. With
+  // `if_expired`, only if its lease has not been renewed since it expired.
+  grpc::Status Drop(const std::string& name, bool* dropped,
+                    bool if_expired = false) {
+    std::lock_guard<std::mutex> lock(namespaces_mutex_);
+    if (if_expired && !reaper_.IsExpired(name)) {
+      *dropped = false;
+      return grpc::Status::OK;
+    }
+    barriers_.DropNamespace(name);
+    *dropped = kv_map_.DropNamespace(name);
+    if (!*dropped) {
+      return grpc::Status::OK;
+    }
+    if (shm_) {
+      shm_->DropNamespace(name);
+    }
+    // After every key of the namespace.
+    keyvaluestore::ReplicateResponse change;
+    change.mutable_drop_namespace()->set_name(name);
+    SendToFollowers(change);
+    if (wal_ && !wal_->Sync(wal_->AppendDropNamespace(name))) {
+      return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                          "failed to write the drop to the log");
+    }
+    return grpc::Status::OK;
+  }
+
+  // Writes a namespace change to the Replicate() streams. Must be called
+  // under `namespaces_mutex_`.
+  void SendToFollowers(const keyvaluestore::ReplicateResponse& change) {
+    for (ReplicateReactor* reactor : replicate_reactors_) {
+      reactor->OnChange(change);
+    }
+  }
+
+  // Copies the values of the first replica that accepts a Replicate() call,
+  // and moves on to the next one once the stream ends, until promoted.
+  void Follow(const std::vector<std::string>& replicas) {
+    std::vector<std::unique_ptr<keyvaluestore::KeyValueStore::Stub>> stubs;
+    for (const std::string& replica : replicas) {
+      stubs.push_back(keyvaluestore::KeyValueStore::NewStub(
+          grpc::CreateChannel(replica, grpc::InsecureChannelCredentials())));
+    }
+    auto backoff = kMinFollowBackoff;
+    for (size_t i = 0;; i = (i + 1) % stubs.size()) {
+      grpc::ClientContext context;
+      {
+        std::lock_guard<std::mutex> lock(follow_mutex_);
+        if (stop_following_) {
+          return;
+        }
+        follow_context_ = &context;
+      }
+      auto reader =
+          stubs[i]->Replicate(&context, keyvaluestore::ReplicateRequest());
+      keyvaluestore::ReplicateResponse change;
+      bool followed = false;
+      while (reader->Read(&change)) {
+        if (!followed) {
+          KVS_LOG(kInfo) << "Following " << replicas[i];
+          followed = true;
+        }
+        if (change.has_open_namespace()) {
+          bool opened;
+          Open(change.open_namespace().name(),
+               std::chrono::milliseconds(change.open_namespace().ttl_ms()),
+               &opened);
+        } else if (change.has_drop_namespace()) {
+          bool dropped;
+          Drop(change.drop_namespace().name(), &dropped);
+        } else {
+          // Values are write-once, so the ones copied already are skipped.
+          const keyvaluestore::KeyValue& key_value = change.key_value();
+          int num_existing;
+          InsertLogged({{&key_value.key(), &key_value.value()}},
+                       /*retried=*/false, &num_existing);
+        }
+      }
+      grpc::Status status = reader->Finish();
+
+      std::unique_lock<std::mutex> lock(follow_mutex_);
+      follow_context_ = nullptr;
+      if (followed) {
+        KVS_LOG(kWarning) << "Stopped following " << replicas[i] << ": "
+                          << status.error_message();
+        backoff = kMinFollowBackoff;
+      } else if (i + 1 == stubs.size()) {
+        // None of the replicas is the leader, such as while one is being
+        // promoted.
+        follow_cv_.wait_for(lock, backoff, [this]() {
+          return stop_following_;
+        });
+        backoff = std::min<std::chrono::milliseconds>(backoff * 2,
+                                                      kMaxFollowBackoff);
+      }
+    }
+  }
+
+  void StopFollowing() {
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    stop_following_ = true;
+    if (follow_context_ != nullptr) {
+      follow_context_->TryCancel();
+    }
+    follow_cv_.notify_all();
+  }
+
+  // Whether the server takes writes, rather than following another replica.
+  std::atomic<bool> leader_;
+  std::thread follow_thread_;
+  std::mutex follow_mutex_;
+  std::condition_variable follow_cv_;
+  // The Replicate() call in flight, to cancel it when following stops.
+  grpc::ClientContext* follow_context_ = nullptr;
+  bool stop_following_ = false;
+};
+
+namespace {
+
+// The service in sync mode, which serves the calls that wait for keys by the
+// callback API.
+class KeyValueStoreSyncServiceImpl final
+    : public KeyValueStoreServiceImpl<SyncService> {
+ public:
+  using KeyValueStoreServiceImpl::KeyValueStoreServiceImpl;
+
+  grpc::ServerUnaryReactor* GetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::GetValueRequest* request,
+      keyvaluestore::GetValueResponse* response) override {
+    return new WaitingReactor(
+        kv_map(), metrics(), RpcMethod::kGetValue, {request->key()},
+        /*min_found=*/1, WaitDeadline(*context, request->timeout_ms()),
+        [response](std::vector<std::optional<std::string>> values) {
+          response->set_value(std::move(*values[0]));
+        });
+  }
+
+  grpc::ServerUnaryReactor* MultiGetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::MultiGetValueRequest* request,
+      keyvaluestore::MultiGetValueResponse* response) override {
+    return new WaitingReactor(
+        kv_map(), metrics(), RpcMethod::kMultiGetValue,
+        std::vector<std::string>(request->keys().begin(),
+                                 request->keys().end()),
+        MinKeysToFind(*request),
+        WaitDeadline(*context, request->timeout_ms()),
+        [response](std::vector<std::optional<std::string>> values) {
+          for (std::optional<std::string>& value : values) {
+            auto* response_value = response->add_values();
+            if (value) {
+              response_value->set_found(true);
+              response_value->set_value(std::move(*value));
+            }
+          }
+        });
+  }
+
+  grpc::ServerUnaryReactor* Barrier(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::BarrierRequest* request,
+      keyvaluestore::BarrierResponse* response) override {
+    std::string release_key;
+    int64_t generation;
+    grpc::Status status = ArriveAtBarrier(*request, &release_key, &generation);
+    if (!status.ok()) {
+      grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+      reactor->Finish(status);
+      return reactor;
+    }
+    return new WaitingReactor(
+        barriers(), metrics(), RpcMethod::kBarrier, {release_key},
+        /*min_found=*/1, WaitDeadline(*context, request->timeout_ms()),
+        [](std::vector<std::optional<std::string>>) {},
+        [this, request, generation]() { LeaveBarrier(*request, generation); });
+  }
+};
+
+// A tag handed to a completion queue in async mode. The polling thread calls
+// OnComplete() when the operation the tag was passed to completes.
+class CompletionTag {
+ public:
+  explicit CompletionTag(std::function<void(bool)> on_complete)
+      : on_complete_(std::move(on_complete)) {}
 
-#include "keyvaluestore.grpc.pb.h"
+  void OnComplete(bool ok) { on_complete_(ok); }
 
-// Logic and data behind the server's behavior.
-class KeyValueStoreServiceImpl final
-    : public keyvaluestore::KeyValueStore::Service {
+ private:
+  std::function<void(bool)> on_complete_;
+};
+
+// Base of the calls that async mode parks until keys are set. Start()
+// registers waiters for the keys the request needs, and the call is completed
+// by Finish() from a waiter callback, by an alarm at its deadline, or as soon
+// as the client cancels it, whichever comes first. No thread is blocked in the
+// meantime.
+template <typename Request, typename Response>
+class AsyncWaitingCall {
  public:
-  explicit KeyValueStoreServiceImpl(const KeyValueStoreServerOptions& options)
-      : options_(options) {}
-  KeyValueStoreServiceImpl(const KeyValueStoreServiceImpl&) = delete;
-  KeyValueStoreServiceImpl(KeyValueStoreServiceImpl&&) = delete;
-  KeyValueStoreServiceImpl& operator=(const KeyValueStoreServiceImpl&) = delete;
-  KeyValueStoreServiceImpl&& operator=(KeyValueStoreServiceImpl&&) = delete;
+  virtual ~AsyncWaitingCall() = default;
 
-  grpc::Status GetValue(grpc::ServerContext* context,
-                        const keyvaluestore::GetValueRequest* request,
-                        keyvaluestore::GetValueResponse* response) override {
-    std::unique_lock<std::mutex> lock(mutex_);
-    auto now = std::chrono::system_clock::now();
-    // Wake up every 1ms to check a value is set by a client.
-    // TODO(okkwon): make it an option.
-    auto wakeup_resolution = std::chrono::milliseconds(1);
-    auto deadline = now + options_.timeout_in_ms;
-    while (1) {
-      if (cv_.wait_for(lock, wakeup_resolution,
-                       [&]() { return kv_map_.count(request->key()); })) {
-        response->set_value(kv_map_[request->key()]);
-        return grpc::Status::OK;
-      } else {
-        if (std::chrono::system_clock::now() >= deadline) {
-          return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-                              "GetValue() exceeded time limit.");
+ protected:
+  AsyncWaitingCall(KeyValueStoreServiceImpl<AsyncService>* service,
+                   grpc::ServerCompletionQueue* cq, RpcMethod method)
+      : service_(service),
+        cq_(cq),
+        latency_(&service->metrics()->latency(method)),
+        responder_(&context_),
+        request_tag_([this](bool ok) { OnRequest(ok); }),
+        alarm_tag_([this](bool ok) { OnAlarm(ok); }),
+        finish_tag_([this](bool ok) { Unref(); }),
+        done_tag_([this](bool ok) { OnDone(); }) {
+    context_.AsyncNotifyWhenDone(&done_tag_);
+  }
+
+  // Starts accepting the next call of the same method.
+  virtual void ListenForNext() = 0;
+  // Handles the request. Called with `mutex_` held.
+  virtual void Start() = 0;
+  // The status the call finishes with when its deadline passes.
+  virtual grpc::Status TimeoutStatus() const = 0;
+
+  // How long the request asks the call to wait before it finishes with
+  // TimeoutStatus(), or zero for the server's timeout.
+  virtual int64_t RequestTimeoutMs() const { return 0; }
+
+  // Called with `mutex_` held when the call times out or is cancelled, right
+  // before it is completed.
+  virtual void OnGiveUp() {}
+
+  // Copies the value of `key` in `kv_map` and returns true if the key is set.
+  // Otherwise registers `on_set` to be called with the value when the key is
+  // set, and returns false. `key` must live as long as the call. `on_set` runs
+  // with `mutex_` held, and only if the call has not been completed yet.
+  bool FindOrWait(ShardedKeyValueMap* kv_map, const std::string& key,
+                  std::string* value,
+                  std::function<void(const std::string&)> on_set) {
+    ++refs_;
+    ShardedKeyValueMap::WaiterId waiter_id;
+    auto callback = [this, on_set](const std::string& value) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!completed_) {
+          on_set(value);
         }
       }
+      Unref();
+    };
+    if (kv_map->FindOrAddWaiter(key, value, callback, &waiter_id)) {
+      // The waiter was not registered. The reference held for the finish tag
+      // keeps this from dropping to zero.
+      --refs_;
+      return true;
     }
+    waiters_.push_back({kv_map, &key, waiter_id});
+    return false;
   }
 
-  grpc::Status SetValue(grpc::ServerContext* context,
-                        const keyvaluestore::SetValueRequest* request,
-                        keyvaluestore::SetValueResponse* response) override {
-    if (kv_map_.count(request->key())) {
-      // We expect only one client sets a value with a key only once.
-      return grpc::Status(grpc::StatusCode::ALREADY_EXISTS,
-                          "Updating an existing value is not supported");
+  // Completes the call. Must be called with `mutex_` held, at most once.
+  void Finish(const grpc::Status& status) {
+    completed_ = true;
+    if (alarm_armed_) {
+      alarm_.Cancel();
+    }
+    // Unregister the waiters that have not been called. The others drop their
+    // reference when their callback returns.
+    for (const Waiter& waiter : waiters_) {
+      if (waiter.kv_map->RemoveWaiter(*waiter.key, waiter.id)) {
+        --refs_;
+      }
+    }
+    waiters_.clear();
+    latency_->Record(std::chrono::steady_clock::now() - start_);
+    if (status.ok()) {
+      responder_.Finish(response_, status, &finish_tag_);
+    } else {
+      responder_.FinishWithError(status, &finish_tag_);
+    }
+  }
+
+  KeyValueStoreServiceImpl<AsyncService>* service_;
+  grpc::ServerCompletionQueue* cq_;
+  Histogram* latency_;
+  std::chrono::steady_clock::time_point start_;
+  grpc::ServerContext context_;
+  Request request_;
+  Response response_;
+  grpc::ServerAsyncResponseWriter<Response> responder_;
+  CompletionTag request_tag_;
+  // Guards `response_` and the completion state below once the request has
+  // arrived.
+  std::mutex mutex_;
+  bool completed_ = false;
+
+ private:
+  void OnRequest(bool ok) {
+    if (!ok) {
+      // The server is shutting down. The done tag is not delivered for a
+      // call that never started.
+      Unref();
+      Unref();
+      return;
+    }
+    start_ = std::chrono::steady_clock::now();
+    ListenForNext();
+
+    // From here on, the reference taken for the request tag is held for the
+    // finish tag.
+    std::lock_guard<std::mutex> lock(mutex_);
+    Start();
+    if (!completed_) {
+      // Waiter callbacks block on `mutex_`, so none of them can complete the
+      // call before the alarm is armed.
+      ++refs_;
+      alarm_armed_ = true;
+      auto deadline = service_->WaitDeadline(context_, RequestTimeoutMs());
+      alarm_.Set(cq_,
+                 std::chrono::system_clock::now() +
+                     (deadline - std::chrono::steady_clock::now()),
+                 &alarm_tag_);
+    }
+  }
+
+  void OnAlarm(bool ok) {
+    {
+      // The alarm is cancelled only after the call is completed.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ok && !completed_) {
+        service_->metrics()->timeouts.Add();
+        OnGiveUp();
+        Finish(TimeoutStatus());
+      }
+    }
+    Unref();
+  }
+
+  // Called once the call is over, and right away if the client cancels it.
+  void OnDone() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!completed_ && context_.IsCancelled()) {
+        service_->metrics()->cancelled.Add();
+        OnGiveUp();
+        Finish(grpc::Status::CANCELLED);
+      }
+    }
+    Unref();
+  }
+
+  void Unref() {
+    if (refs_.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+  struct Waiter {
+    ShardedKeyValueMap* kv_map;
+    const std::string* key;
+    ShardedKeyValueMap::WaiterId id;
+  };
+
+  grpc::Alarm alarm_;
+  bool alarm_armed_ = false;
+  std::vector<Waiter> waiters_;
+  CompletionTag alarm_tag_;
+  CompletionTag finish_tag_;
+  CompletionTag done_tag_;
+  // One reference per tag or waiter callback that may still be invoked: the
+  // request tag and then the finish tag, the done tag, and the alarm and
+  // waiters once they are set.
+  std::atomic<int> refs_{2};
+};
+
+class AsyncGetValueCall final
+    : public AsyncWaitingCall<keyvaluestore::GetValueRequest,
+                              keyvaluestore::GetValueResponse> {
+ public:
+  // Starts accepting the next GetValue() call on `cq`.
+  static void Listen(KeyValueStoreServiceImpl<AsyncService>* service,
+                     grpc::ServerCompletionQueue* cq) {
+    new AsyncGetValueCall(service, cq);
+  }
+
+ private:
+  AsyncGetValueCall(KeyValueStoreServiceImpl<AsyncService>* service,
+                    grpc::ServerCompletionQueue* cq)
+      : AsyncWaitingCall(service, cq, RpcMethod::kGetValue) {
+    service_->RequestGetValue(&context_, &request_, &responder_, cq_, cq_,
+                              &request_tag_);
+  }
+
+  void ListenForNext() override { Listen(service_, cq_); }
+
+  void Start() override {
+    auto on_set = [this](const std::string& value) {
+      response_.set_value(value);
+      Finish(grpc::Status::OK);
+    };
+    if (FindOrWait(service_->kv_map(), request_.key(),
+                   response_.mutable_value(), on_set)) {
+      Finish(grpc::Status::OK);
+    }
+  }
+
+  int64_t RequestTimeoutMs() const override { return request_.timeout_ms(); }
+
+  grpc::Status TimeoutStatus() const override {
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                        "GetValue() exceeded time limit.");
+  }
+};
+
+class AsyncMultiGetValueCall final
+    : public AsyncWaitingCall<keyvaluestore::MultiGetValueRequest,
+                              keyvaluestore::MultiGetValueResponse> {
+ public:
+  // Starts accepting the next MultiGetValue() call on `cq`.
+  static void Listen(KeyValueStoreServiceImpl<AsyncService>* service,
+                     grpc::ServerCompletionQueue* cq) {
+    new AsyncMultiGetValueCall(service, cq);
+  }
+
+ private:
+  AsyncMultiGetValueCall(KeyValueStoreServiceImpl<AsyncService>* service,
+                         grpc::ServerCompletionQueue* cq)
+      : AsyncWaitingCall(service, cq, RpcMethod::kMultiGetValue) {
+    service_->RequestMultiGetValue(&context_, &request_, &responder_, cq_,
+                                   cq_, &request_tag_);
+  }
+
+  void ListenForNext() override { Listen(service_, cq_); }
+
+  void Start() override {
+    const auto& keys = request_.keys();
+    min_found_ = MinKeysToFind(request_);
+    for (int i = 0; i < keys.size(); ++i) {
+      auto* value = response_.add_values();
+      if (service_->kv_map()->Find(keys[i], value->mutable_value())) {
+        value->set_found(true);
+        ++num_found_;
+      }
+    }
+    for (int i = 0; i < keys.size() && num_found_ < min_found_; ++i) {
+      auto* value = response_.mutable_values(i);
+      if (value->found()) {
+        continue;
+      }
+      auto on_set = [this, i](const std::string& set_value) {
+        auto* value = response_.mutable_values(i);
+        value->set_found(true);
+        value->set_value(set_value);
+        if (++num_found_ >= min_found_) {
+          Finish(grpc::Status::OK);
+        }
+      };
+      if (FindOrWait(service_->kv_map(), keys[i], value->mutable_value(),
+                     on_set)) {
+        value->set_found(true);
+        ++num_found_;
+      }
+    }
+    if (num_found_ >= min_found_) {
+      Finish(grpc::Status::OK);
+    }
+  }
+
+  int64_t RequestTimeoutMs() const override { return request_.timeout_ms(); }
+
+  grpc::Status TimeoutStatus() const override {
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                        "MultiGetValue() exceeded time limit.");
+  }
+
+  size_t min_found_ = 0;
+  size_t num_found_ = 0;
+};
+
+class AsyncBarrierCall final
+    : public AsyncWaitingCall<keyvaluestore::BarrierRequest,
+                              keyvaluestore::BarrierResponse> {
+ public:
+  // Starts accepting the next Barrier() call on `cq`.
+  static void Listen(KeyValueStoreServiceImpl<AsyncService>* service,
+                     grpc::ServerCompletionQueue* cq) {
+    new AsyncBarrierCall(service, cq);
+  }
+
+ private:
+  AsyncBarrierCall(KeyValueStoreServiceImpl<AsyncService>* service,
+                   grpc::ServerCompletionQueue* cq)
+      : AsyncWaitingCall(service, cq, RpcMethod::kBarrier) {
+    service_->RequestBarrier(&context_, &request_, &responder_, cq_, cq_,
+                             &request_tag_);
+  }
+
+  void ListenForNext() override { Listen(service_, cq_); }
+
+  void Start() override {
+    grpc::Status status =
+        service_->ArriveAtBarrier(request_, &release_key_, &generation_);
+    if (!status.ok()) {
+      Finish(status);
+      return;
+    }
+    arrived_ = true;
+    std::string unused_value;
+    auto on_set = [this](const std::string&) { Finish(grpc::Status::OK); };
+    if (FindOrWait(service_->barriers(), release_key_, &unused_value,
+                   on_set)) {
+      Finish(grpc::Status::OK);
+    }
+  }
+
+  int64_t RequestTimeoutMs() const override { return request_.timeout_ms(); }
+
+  void OnGiveUp() override {
+    if (arrived_) {
+      service_->LeaveBarrier(request_, generation_);
+    }
+  }
+
+  grpc::Status TimeoutStatus() const override {
+    return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                        "Barrier() exceeded time limit.");
+  }
+
+  std::string release_key_;
+  int64_t generation_ = 0;
+  bool arrived_ = false;
+};
+
+// Serves the clients of one host on behalf of the upstream servers, so that
+// the upstream servers see one connection per host instead of one per
+// client. Values are write-once, so the ones fetched or set through the proxy
+// are cached until they are evicted to stay within the cache budget, or until
+// a namespace is dropped. Streams are not supported.
+class KeyValueStoreProxyImpl final : public ProxyService {
+ public:
+  explicit KeyValueStoreProxyImpl(const KeyValueStoreServerOptions& options)
+      : options_(options),
+        cache_(options.proxy_cache_max_entries, options.proxy_cache_max_bytes),
+        upstream_(options.upstream, UpstreamOptions(options)) {}
+  KeyValueStoreProxyImpl(const KeyValueStoreProxyImpl&) = delete;
+  KeyValueStoreProxyImpl(KeyValueStoreProxyImpl&&) = delete;
+  KeyValueStoreProxyImpl& operator=(const KeyValueStoreProxyImpl&) = delete;
+  KeyValueStoreProxyImpl&& operator=(KeyValueStoreProxyImpl&&) = delete;
+
+  // Must run after the server has shut down, once no calls wait anymore.
+  ~KeyValueStoreProxyImpl() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto& [key, fetch] : fetches_) {
+      fetch->context.TryCancel();
+    }
+    fetches_cv_.wait(lock, [this]() { return num_fetching_ == 0; });
+  }
+
+  grpc::ServerUnaryReactor* GetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::GetValueRequest* request,
+      keyvaluestore::GetValueResponse* response) override {
+    return new WaitingCall(
+        this, RpcMethod::kGetValue, {request->key()}, /*min_found=*/1,
+        WaitDeadline(*context, request->timeout_ms()),
+        [response](std::vector<std::optional<std::string>> values) {
+          response->set_value(std::move(*values[0]));
+        });
+  }
+
+  grpc::ServerUnaryReactor* MultiGetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::MultiGetValueRequest* request,
+      keyvaluestore::MultiGetValueResponse* response) override {
+    return new WaitingCall(
+        this, RpcMethod::kMultiGetValue,
+        std::vector<std::string>(request->keys().begin(),
+                                 request->keys().end()),
+        MinKeysToFind(*request),
+        WaitDeadline(*context, request->timeout_ms()),
+        [response](std::vector<std::optional<std::string>> values) {
+          for (std::optional<std::string>& value : values) {
+            auto* response_value = response->add_values();
+            if (value) {
+              response_value->set_found(true);
+              response_value->set_value(std::move(*value));
+            }
+          }
+        });
+  }
+
+  grpc::ServerUnaryReactor* SetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::SetValueRequest* request,
+      keyvaluestore::SetValueResponse* response) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t cache_epoch = cache_.epoch();
+    upstream_.ForKey(request->key())
+        ->SetValueAsync(request->key(), request->value(),
+                        [this, reactor, request, start,
+                         cache_epoch](grpc::Status status) {
+                          if (status.ok()) {
+                            cache_.Put(request->key(), request->value(),
+                                       cache_epoch);
+                          }
+                          CountFailure(status);
+                          metrics_.latency(RpcMethod::kSetValue)
+                              .Record(std::chrono::steady_clock::now() -
+                                      start);
+                          reactor->Finish(status);
+                        });
+    return reactor;
+  }
+
+  grpc::ServerUnaryReactor* MultiSetValue(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::MultiSetValueRequest* request,
+      keyvaluestore::MultiSetValueResponse* response) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<std::string, std::string>> key_values;
+    for (const keyvaluestore::KeyValue& key_value : request->key_values()) {
+      key_values.emplace_back(key_value.key(), key_value.value());
+    }
+    uint64_t cache_epoch = cache_.epoch();
+    upstream_.MultiSetValueAsync(
+        key_values, [this, reactor, request, start,
+                     cache_epoch](grpc::Status status) {
+          // Which keys existed already is not known otherwise.
+          if (status.ok()) {
+            for (const keyvaluestore::KeyValue& key_value :
+                 request->key_values()) {
+              cache_.Put(key_value.key(), key_value.value(), cache_epoch);
+            }
+          }
+          CountFailure(status);
+          metrics_.latency(RpcMethod::kMultiSetValue)
+              .Record(std::chrono::steady_clock::now() - start);
+          reactor->Finish(status);
+        });
+    return reactor;
+  }
+
+  // Waits upstream without holding a thread, however many local callers wait
+  // at the barrier.
+  grpc::ServerUnaryReactor* Barrier(
+      grpc::CallbackServerContext* context,
+      const keyvaluestore::BarrierRequest* request,
+      keyvaluestore::BarrierResponse* response) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto start = std::chrono::steady_clock::now();
+    // Passed on as a timeout, of which zero would mean the upstream default.
+    auto timeout = std::max(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            WaitDeadline(*context, request->timeout_ms()) - start),
+        std::chrono::milliseconds(1));
+    upstream_.ForKey(request->name())
+        ->BarrierAsync(request->name(), request->world_size(), timeout,
+                       [this, reactor, start](grpc::Status status) {
+                         CountFailure(status);
+                         metrics_.latency(RpcMethod::kBarrier)
+                             .Record(std::chrono::steady_clock::now() - start);
+                         reactor->Finish(status);
+                       });
+    return reactor;
+  }
+
+  grpc::ServerUnaryReactor* Add(grpc::CallbackServerContext* context,
+                                const keyvaluestore::AddRequest* request,
+                                keyvaluestore::AddResponse* response) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto start = std::chrono::steady_clock::now();
+    upstream_.ForKey(request->key())
+        ->AddAsync(request->key(), request->delta(),
+                   [this, reactor, response, start](grpc::Status status,
+                                                    int64_t value) {
+                     response->set_value(value);
+                     metrics_.latency(RpcMethod::kAdd)
+                         .Record(std::chrono::steady_clock::now() - start);
+                     reactor->Finish(status);
+                   });
+    return reactor;
+  }
+
+  // The cache doesn't know which keys are in a namespace, so all of it is
+  // dropped when a namespace is dropped upstream or expires, which it does
+  // with the same TTL.
+  grpc::Status OpenNamespace(
+      grpc::ServerContext* context,
+      const keyvaluestore::OpenNamespaceRequest* request,
+      keyvaluestore::OpenNamespaceResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kOpenNamespace);
+    auto ttl =
+        std::chrono::milliseconds(std::max<int64_t>(request->ttl_ms(), 0));
+    bool opened = false;
+    grpc::Status status = upstream_.OpenNamespace(request->name(), ttl, opened);
+    if (status.ok()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      namespaces_.insert(request->name());
+      reaper_.Renew(request->name(), ttl);
     }
-    kv_map_[request->key()] = request->value();
+    response->set_opened(opened);
+    CountFailure(status);
+    return status;
+  }
+
+  grpc::Status DropNamespace(
+      grpc::ServerContext* context,
+      const keyvaluestore::DropNamespaceRequest* request,
+      keyvaluestore::DropNamespaceResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kDropNamespace);
+    reaper_.Cancel(request->name());
+    bool dropped = false;
+    grpc::Status status = upstream_.DropNamespace(request->name(), dropped);
+    // Values fetched before the drop are not cached after it.
+    ForgetNamespace(request->name());
+    response->set_dropped(dropped);
+    CountFailure(status);
+    return status;
+  }
+
+  grpc::Status GetStats(grpc::ServerContext* context,
+                        const keyvaluestore::GetStatsRequest* request,
+                        keyvaluestore::GetStatsResponse* response) override {
+    ScopedRpcTimer timer(&metrics_, RpcMethod::kGetStats);
+    CollectStats(response);
     return grpc::Status::OK;
   }
 
+  // Reports the proxy's own calls and cache, not those of the upstream
+  // servers.
+  void CollectStats(keyvaluestore::GetStatsResponse* stats) {
+    for (size_t i = 0; i < kNumRpcMethods; ++i) {
+      keyvaluestore::RpcStats* rpc = stats->add_rpcs();
+      rpc->set_method(RpcMethodName(static_cast<RpcMethod>(i)));
+      SummarizeLatency(metrics_.rpc_latency[i], rpc->mutable_latency());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      int64_t num_waiters = 0;
+      for (const auto& [key, fetch] : fetches_) {
+        num_waiters += fetch->waiters.size();
+      }
+      stats->set_blocked_waiters(num_waiters);
+      stats->set_num_namespaces(namespaces_.size());
+    }
+    SummarizeLatency(metrics_.wait_time, stats->mutable_wait_time());
+    stats->set_timeouts(metrics_.timeouts.Value());
+    stats->set_already_exists(metrics_.already_exists.Value());
+    stats->set_cancelled(metrics_.cancelled.Value());
+    stats->set_expired_namespaces(metrics_.expired_namespaces.Value());
+    ValueCache::Stats cache_stats = cache_.stats();
+    stats->set_num_keys(cache_stats.entries);
+    stats->set_bytes_stored(cache_stats.bytes);
+    // The proxy takes writes.
+    stats->set_leader(true);
+  }
+
  private:
-  std::unordered_map<std::string, std::string> kv_map_;
+  // Called once with the value of a key fetched from upstream, or with the
+  // error the fetch failed with.
+  using FetchDone =
+      std::function<void(const grpc::Status& status, const std::string& value)>;
+
+  // A GetValue() or MultiGetValue() call waiting for the keys it missed in
+  // the cache, until `deadline`. It holds a reference per fetch it waits for,
+  // one for its alarm and one until OnDone(), and frees itself once they are
+  // all dropped.
+  class WaitingCall final : public grpc::ServerUnaryReactor {
+   public:
+    // Fills the response with one entry per key, which is std::nullopt if
+    // the key is not set yet.
+    using Respond =
+        std::function<void(std::vector<std::optional<std::string>>)>;
+
+    WaitingCall(KeyValueStoreProxyImpl* proxy, RpcMethod method,
+                std::vector<std::string> keys, size_t min_found,
+                std::chrono::steady_clock::time_point deadline,
+                Respond respond)
+        : proxy_(proxy),
+          method_(method),
+          latency_(&proxy->metrics_.latency(method)),
+          start_(std::chrono::steady_clock::now()),
+          deadline_(deadline),
+          keys_(std::move(keys)),
+          values_(keys_.size()),
+          min_found_(min_found),
+          respond_(std::move(respond)) {
+      std::vector<size_t> missing;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < keys_.size(); ++i) {
+          std::string value;
+          if (proxy_->cache_.Get(keys_[i], &value)) {
+            values_[i] = std::move(value);
+            ++num_found_;
+          } else {
+            missing.push_back(i);
+          }
+        }
+        if (num_found_ >= min_found_) {
+          Complete(grpc::Status::OK);
+          return;
+        }
+        waited_ = true;
+        // Fetches may complete the call before they have all started.
+        refs_ += missing.size() + 1;
+        alarm_.Set(ToSystemTime(deadline_), [this](bool ok) { OnAlarm(ok); });
+        alarm_armed_ = true;
+      }
+      for (size_t i : missing) {
+        Fetch(i);
+      }
+    }
+
+    void OnCancel() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!finished_) {
+        proxy_->metrics_.cancelled.Add();
+        Complete(grpc::Status::CANCELLED);
+      }
+    }
+
+    void OnDone() override { Unref(); }
+
+   private:
+    void Fetch(size_t i) {
+      proxy_->Fetch(keys_[i], deadline_,
+                    [this, i](const grpc::Status& status,
+                              const std::string& value) {
+                      OnFetched(i, status, value);
+                    });
+    }
+
+    void OnFetched(size_t i, const grpc::Status& status,
+                   const std::string& value) {
+      bool fetch_again = false;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!finished_) {
+          if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED &&
+              std::chrono::steady_clock::now() < deadline_) {
+            // The fetch was shared with a call that gives up sooner.
+            fetch_again = true;
+          } else if (!status.ok()) {
+            Complete(status);
+          } else {
+            values_[i] = value;
+            if (++num_found_ >= min_found_) {
+              Complete(grpc::Status::OK);
+            }
+          }
+        }
+      }
+      if (fetch_again) {
+        // The new fetch takes over the reference.
+        Fetch(i);
+        return;
+      }
+      Unref();
+    }
+
+    void OnAlarm(bool ok) {
+      {
+        // The alarm is cancelled only after the call is finished.
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ok && !finished_) {
+          Complete(grpc::Status(
+              grpc::StatusCode::DEADLINE_EXCEEDED,
+              std::string(RpcMethodName(method_)) + "() exceeded time limit."));
+        }
+      }
+      Unref();
+    }
+
+    // Finishes the call. Must be called with `mutex_` held, at most once.
+    void Complete(const grpc::Status& status) {
+      finished_ = true;
+      if (alarm_armed_) {
+        alarm_.Cancel();
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (status.ok()) {
+        respond_(std::move(values_));
+      } else if (status.error_code() ==
+                 grpc::StatusCode::DEADLINE_EXCEEDED) {
+        proxy_->metrics_.timeouts.Add();
+      }
+      if (waited_) {
+        proxy_->metrics_.wait_time.Record(now - start_);
+      }
+      latency_->Record(now - start_);
+      Finish(status);
+    }
+
+    void Unref() {
+      if (refs_.fetch_sub(1) == 1) {
+        delete this;
+      }
+    }
+
+    KeyValueStoreProxyImpl* proxy_;
+    const RpcMethod method_;
+    Histogram* latency_;
+    const std::chrono::steady_clock::time_point start_;
+    const std::chrono::steady_clock::time_point deadline_;
+    const std::vector<std::string> keys_;
+    std::mutex mutex_;
+    std::vector<std::optional<std::string>> values_;
+    const size_t min_found_;
+    size_t num_found_ = 0;
+    Respond respond_;
+    grpc::Alarm alarm_;
+    bool alarm_armed_ = false;
+    bool waited_ = false;
+    bool finished_ = false;
+    std::atomic<int> refs_{1};
+  };
+
+  // An upstream call for a key, and the local calls waiting for it.
+  struct PendingFetch {
+    grpc::ClientContext context;
+    std::vector<FetchDone> waiters;
+  };
+
+  static KeyValueStoreClientOptions UpstreamOptions(
+      const KeyValueStoreServerOptions& server_options) {
+    KeyValueStoreClientOptions options;
+    // The proxy caches the values itself.
+    options.cache_max_entries = 0;
+    // Whatever the proxy takes from its clients is passed on, and so are
+    // their values, compressed or not.
+    options.max_message_size = server_options.max_message_size;
+    options.raw_values = true;
+    return options;
+  }
+
+  // Same as the server's, see KeyValueStoreServiceImpl::WaitDeadline().
+  std::chrono::steady_clock::time_point WaitDeadline(
+      const grpc::ServerContextBase& context, int64_t timeout_ms) const {
+    return CallDeadline(context, timeout_ms > 0
+                                     ? std::chrono::milliseconds(timeout_ms)
+                                     : options_.timeout_in_ms);
+  }
+
+  // Calls `done` with the value of `key` once it is set upstream, or with
+  // the error the upstream call failed with. Callers that ask for the same
+  // key at the same time share a single upstream call, which waits until
+  // the `deadline` of the caller that started it. A caller that joins it and
+  // waits longer fetches again if it times out.
+  void Fetch(const std::string& key,
+             std::chrono::steady_clock::time_point deadline, FetchDone done) {
+    grpc::ClientContext* context = nullptr;
+    std::string value;
+    uint64_t cache_epoch = cache_.epoch();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto [it, inserted] = fetches_.try_emplace(key);
+      if (!inserted) {
+        it->second->waiters.push_back(std::move(done));
+        return;
+      }
+      // A fetch may have set the key since the caller missed it. Fetches
+      // cache their value before they are removed, so it is found here
+      // unless it has been evicted already.
+      if (cache_.Get(key, &value)) {
+        fetches_.erase(it);
+      } else {
+        it->second = std::make_unique<PendingFetch>();
+        it->second->waiters.push_back(std::move(done));
+        context = &it->second->context;
+        context->set_deadline(ToSystemTime(deadline));
+        ++num_fetching_;
+      }
+    }
+    if (context == nullptr) {
+      done(grpc::Status::OK, value);
+      return;
+    }
+    KeyValueStoreClient* client = upstream_.ForKey(key);
+    KeyValueStoreClient::Failover failover(
+        client, KeyValueStoreClient::Failover::kRead);
+    // The upstream server waits as long as the proxy does, rather than for
+    // its own timeout.
+    auto timeout = std::max(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()),
+        std::chrono::milliseconds(1));
+    client->MultiGetValueAsync(
+        context, failover.replica(), {key}, /*wait_for_any=*/false, timeout,
+        [this, key, cache_epoch](
+            grpc::Status status,
+            std::vector<std::optional<std::string>> values) {
+          OnFetched(key, cache_epoch, std::move(status), std::move(values));
+        });
+  }
+
+  void OnFetched(const std::string& key, uint64_t cache_epoch,
+                 grpc::Status status,
+                 std::vector<std::optional<std::string>> values) {
+    std::string value;
+    if (status.ok() && (values.size() != 1 || !values[0])) {
+      status = grpc::Status(grpc::StatusCode::INTERNAL,
+                            "upstream server did not return the key");
+    } else if (status.ok()) {
+      value = std::move(*values[0]);
+      cache_.Put(key, value, cache_epoch);
+    }
+    std::vector<FetchDone> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = fetches_.find(key);
+      waiters = std::move(it->second->waiters);
+      fetches_.erase(it);
+    }
+    for (FetchDone& done : waiters) {
+      done(status, value);
+    }
+    // The waiters are done with the proxy's metrics by now.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--num_fetching_ == 0) {
+      fetches_cv_.notify_all();
+    }
+  }
+
+  // Forgets a namespace that was dropped or expired, and the cached values,
+  // which may have been in it. Returns whether it was open.
+  bool ForgetNamespace(const std::string& name) {
+    bool erased;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      erased = namespaces_.erase(name) > 0;
+    }
+    cache_.Invalidate();
+    return erased;
+  }
+
+  void CountFailure(const grpc::Status& status) {
+    if (status.error_code() == grpc::StatusCode::ALREADY_EXISTS) {
+      metrics_.already_exists.Add();
+    } else if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+      metrics_.timeouts.Add();
+    }
+  }
+
   KeyValueStoreServerOptions options_;
-  std::condition_variable cv_;
+  ServerMetrics metrics_;
+  // The values fetched from or set upstream through the proxy.
+  ValueCache cache_;
+  ShardedKeyValueStoreClient upstream_;
+  std::mutex mutex_;
+  // The namespaces opened through the proxy.
+  std::unordered_set<std::string> namespaces_;
+  std::condition_variable fetches_cv_;
+  // The keys being fetched from upstream.
+  std::unordered_map<std::string, std::unique_ptr<PendingFetch>> fetches_;
+  // Fetches whose waiters have not all been called yet.
+  int num_fetching_ = 0;
+  // Declared last, so that it stops before the members it uses go away.
+  NamespaceReaper reaper_{[this](const std::string& name) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Renewed since it expired.
+      if (!reaper_.IsExpired(name)) {
+        return;
+      }
+      if (namespaces_.erase(name) > 0) {
+        metrics_.expired_namespaces.Add();
+      }
+    }
+    cache_.Invalidate();
+  }};
+};
+
+void PollCompletionQueue(grpc::ServerCompletionQueue* cq) {
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<CompletionTag*>(tag)->OnComplete(ok);
+  }
+}
+
+}  // namespace
+
+// The part of an in-process endpoint that does not depend on the service,
+// which the server closes when it shuts down.
+class InProcessEndpoint : public InProcessServer {
+ public:
+  explicit InProcessEndpoint(std::shared_ptr<grpc::Channel> channel)
+      : channel_(std::move(channel)) {}
+
+  std::shared_ptr<grpc::Channel> channel() override { return channel_; }
+  bool closed() const override { return closed_.load(); }
+
+  // Fails the calls from now on, and waits for the ones in flight, whose
+  // waits give up.
+  void Close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    closed_.store(true);
+    canceller_.Cancel();
+    // The last call to return wakes this up.
+    no_calls_in_flight_.wait(lock, [this]() { return in_flight_ == 0; });
+  }
+
+ protected:
+  template <typename Handler>
+  grpc::Status Call(const Handler& handler) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server shut down");
+      }
+      ++in_flight_;
+    }
+    grpc::Status status = handler();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--in_flight_ == 0) {
+      no_calls_in_flight_.notify_all();
+    }
+    return status;
+  }
+
+  // Cancels the waits of every call when the server shuts down.
+  ShardedKeyValueMap::Canceller* canceller() { return &canceller_; }
+
+ private:
+  std::shared_ptr<grpc::Channel> channel_;
+  // Guards `in_flight_` and the closing of the endpoint, so that Close()
+  // either sees a call in flight or the call sees that the server is closed.
   std::mutex mutex_;
+  std::condition_variable no_calls_in_flight_;
+  int in_flight_ = 0;
+  // Also read without `mutex_` by closed().
+  std::atomic<bool> closed_{false};
+  ShardedKeyValueMap::Canceller canceller_;
+};
+
+namespace {
+
+// Serves a client in the same process, see InProcessServer.
+template <typename Service>
+class InProcessEndpointImpl final : public InProcessEndpoint {
+ public:
+  InProcessEndpointImpl(KeyValueStoreServiceImpl<Service>* service,
+                        std::shared_ptr<grpc::Channel> channel)
+      : InProcessEndpoint(std::move(channel)), service_(service) {}
+
+  grpc::Status GetValue(const keyvaluestore::GetValueRequest& request,
+                        keyvaluestore::GetValueResponse* response) override {
+    return Call([&]() {
+      return service_->GetValue(request,
+                                service_->WaitDeadline(request.timeout_ms()),
+                                canceller(), response);
+    });
+  }
+
+  grpc::Status SetValue(const keyvaluestore::SetValueRequest& request,
+                        keyvaluestore::SetValueResponse* response) override {
+    // The handlers that don't wait have no use for a context.
+    return Call([&]() {
+      return service_->SetValue(/*context=*/nullptr, &request, response);
+    });
+  }
+
+  grpc::Status MultiGetValue(
+      const keyvaluestore::MultiGetValueRequest& request,
+      keyvaluestore::MultiGetValueResponse* response) override {
+    return Call([&]() {
+      return service_->MultiGetValue(
+          request, service_->WaitDeadline(request.timeout_ms()), canceller(),
+          response);
+    });
+  }
+
+  grpc::Status MultiSetValue(
+      const keyvaluestore::MultiSetValueRequest& request,
+      keyvaluestore::MultiSetValueResponse* response) override {
+    return Call([&]() {
+      return service_->MultiSetValue(/*context=*/nullptr, &request, response);
+    });
+  }
+
+  grpc::Status Barrier(const keyvaluestore::BarrierRequest& request,
+                       keyvaluestore::BarrierResponse* response) override {
+    return Call([&]() {
+      return service_->Barrier(request,
+                               service_->WaitDeadline(request.timeout_ms()),
+                               canceller(), response);
+    });
+  }
+
+  grpc::Status Add(const keyvaluestore::AddRequest& request,
+                   keyvaluestore::AddResponse* response) override {
+    return Call([&]() {
+      return service_->Add(/*context=*/nullptr, &request, response);
+    });
+  }
+
+ private:
+  KeyValueStoreServiceImpl<Service>* service_;
 };
 
+}  // namespace
+
 KeyValueStoreServer::KeyValueStoreServer(
     const std::string& addr, const KeyValueStoreServerOptions& options) {
+  if (options.log_level) {
+    SetLogLevel(*options.log_level);
+  }
   grpc::ServerBuilder builder;
-  // Listen on the given address without any authentication mechanism.
-  builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
+  bool in_process = IsInProcessAddress(addr);
+  if (in_process) {
+    in_process_name_ = addr.substr(kInProcessScheme.size());
+  } else {
+    // Listen on the given address without any authentication mechanism.
+    builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
+  }
+  // Let clients keep their idle connections alive, see
+  // KeyValueStoreClientOptions::keepalive_time.
+  builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  builder.AddChannelArgument(
+      GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+      static_cast<int>(
+          std::chrono::milliseconds(kMinKeepaliveTime).count()));
+  if (options.max_message_size > 0) {
+    builder.SetMaxReceiveMessageSize(options.max_message_size);
+  }
   // Register "service" as the instance through which we'll communicate with
-  // clients. In this case, it corresponds to an *synchronous* service.
-  service_impl_ = std::make_unique<KeyValueStoreServiceImpl>(options);
+  // clients. In sync mode, it corresponds to an *synchronous* service. In async
+  // mode, the RPCs waiting for keys are served from completion queues.
+  KeyValueStoreServiceImpl<AsyncService>* async_service = nullptr;
+  // Whether the write-ahead log and the shared memory segment were opened.
+  bool opened = false;
+  std::string error;
+  std::function<void(const std::string&)> start_following;
+  // Creates the endpoint of the in-process clients, which call into the
+  // service directly.
+  std::function<std::shared_ptr<InProcessEndpoint>(
+      std::shared_ptr<grpc::Channel>)>
+      make_endpoint;
+  if (!options.upstream.empty()) {
+    auto service = std::make_unique<KeyValueStoreProxyImpl>(options);
+    opened = true;
+    collect_stats_ = [impl = service.get()](
+                         keyvaluestore::GetStatsResponse* stats) {
+      impl->CollectStats(stats);
+    };
+    // A proxy has no replicas.
+    promote_ = []() {};
+    start_following = [](const std::string&) {};
+    service_impl_ = std::move(service);
+    if (in_process) {
+      error = "a proxy can't be in-process";
+      opened = false;
+    }
+  } else if (options.async_mode) {
+    auto service = std::make_unique<KeyValueStoreServiceImpl<AsyncService>>(
+        options);
+    async_service = service.get();
+    opened = service->OpenLog(&error) &&
+             service->OpenSharedMemory(addr, &error);
+    collect_stats_ = [impl = service.get()](
+                         keyvaluestore::GetStatsResponse* stats) {
+      impl->CollectStats(stats);
+    };
+    promote_ = [impl = service.get()]() { impl->Promote(); };
+    start_following = [impl = service.get()](const std::string& self) {
+      impl->StartFollowing(self);
+    };
+    make_endpoint = [impl = service.get()](
+                        std::shared_ptr<grpc::Channel> channel) {
+      return std::make_shared<InProcessEndpointImpl<AsyncService>>(
+          impl, std::move(channel));
+    };
+    service_impl_ = std::move(service);
+  } else {
+    auto service =
+        std::make_unique<KeyValueStoreSyncServiceImpl>(options);
+    opened = service->OpenLog(&error) &&
+             service->OpenSharedMemory(addr, &error);
+    collect_stats_ = [impl = service.get()](
+                         keyvaluestore::GetStatsResponse* stats) {
+      impl->CollectStats(stats);
+    };
+    promote_ = [impl = service.get()]() { impl->Promote(); };
+    start_following = [impl = service.get()](const std::string& self) {
+      impl->StartFollowing(self);
+    };
+    make_endpoint = [impl = service.get()](
+                        std::shared_ptr<grpc::Channel> channel) {
+      return std::make_shared<InProcessEndpointImpl<SyncService>>(
+          impl, std::move(channel));
+    };
+    service_impl_ = std::move(service);
+  }
+  if (!opened) {
+    KVS_LOG(kError) << "Failed to start the server: " << error;
+    return;
+  }
+  if (async_service) {
+    for (int i = 0; i < std::max(options.num_polling_threads, 1); ++i) {
+      cqs_.push_back(builder.AddCompletionQueue());
+    }
+  }
   builder.RegisterService(service_impl_.get());
   // Finally assemble the server.
   server_ = builder.BuildAndStart();
-  std::cout << "Server listening on " << addr << std::endl;
+  if (in_process) {
+    grpc::ChannelArguments args;
+    if (options.max_message_size > 0) {
+      args.SetMaxReceiveMessageSize(options.max_message_size);
+      args.SetMaxSendMessageSize(options.max_message_size);
+    }
+    in_process_ = make_endpoint(server_->InProcessChannel(args));
+    if (!RegisterInProcessServer(in_process_name_, in_process_)) {
+      KVS_LOG(kError) << "Failed to start the server: " << addr
+                      << " is taken";
+      in_process_ = nullptr;
+      server_->Shutdown();
+      for (auto& cq : cqs_) {
+        cq->Shutdown();
+        void* tag;
+        bool ok;
+        while (cq->Next(&tag, &ok)) {
+        }
+      }
+      service_impl_ = nullptr;
+      server_ = nullptr;
+      return;
+    }
+  }
+  for (auto& cq : cqs_) {
+    AsyncGetValueCall::Listen(async_service, cq.get());
+    AsyncMultiGetValueCall::Listen(async_service, cq.get());
+    AsyncBarrierCall::Listen(async_service, cq.get());
+    polling_threads_.emplace_back(PollCompletionQueue, cq.get());
+  }
+  KVS_LOG(kInfo) << "Server listening on " << addr;
+  start_following(addr);
 }
 
 KeyValueStoreServer::~KeyValueStoreServer() {
-  server_->Shutdown();
+  if (!ok()) {
+    return;
+  }
+  if (in_process_) {
+    UnregisterInProcessServer(in_process_name_);
+    in_process_->Close();
+  }
+  // Cancel the calls that are still in flight, such as WatchPrefix() streams
+  // that would otherwise never end.
+  server_->Shutdown(std::chrono::system_clock::now());
   server_->Wait();
+  // Completion queues must be shut down after the server, and drained before
+  // the calls they own can go away.
+  for (auto& cq : cqs_) {
+    cq->Shutdown();
+  }
+  for (std::thread& thread : polling_threads_) {
+    thread.join();
+  }
   // The service impl must be freed up first before the server.
   service_impl_ = nullptr;
   server_ = nullptr;
 }
 
-void KeyValueStoreServer::Wait() { server_->Wait(); }
+void KeyValueStoreServer::Wait() {
+  if (ok()) {
+    server_->Wait();
+  }
+}
+
+void KeyValueStoreServer::GetStats(keyvaluestore::GetStatsResponse* stats) {
+  collect_stats_(stats);
+}
+
+void KeyValueStoreServer::Promote() { promote_(); }
@@ -7,17 +7,71 @@
 #include <grpcpp/grpcpp.h>
 
 #include <chrono>
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
-class KeyValueStoreServiceImpl;
+#include "log.h"
+
+namespace keyvaluestore {
+class GetStatsResponse;
+}  // namespace keyvaluestore
+
+class InProcessEndpoint;
 
 struct KeyValueStoreServerOptions {
   std::chrono::milliseconds timeout_in_ms = std::chrono::milliseconds(3000);
+  // Number of independently locked shards of the key/value map.
+  size_t num_shards = 64;
+  // Serve waiting calls such as GetValue() from completion queues polled by
+  // `num_polling_threads` threads instead of gRPC's callback threads. Either
+  // way, calls waiting for a key don't occupy a thread each.
+  bool async_mode = false;
+  // Number of threads polling the completion queues in async mode.
+  int num_polling_threads = 2;
+  // Directory of the write-ahead log that makes the values survive a restart.
+  // SetValue() calls are acknowledged only once their value is on disk. No
+  // log is kept if it is empty.
+  std::string wal_dir;
+  // How often the log is compacted into a snapshot, or never if it is zero.
+  std::chrono::milliseconds snapshot_interval = std::chrono::minutes(1);
+  // Sets the process-wide log level if present.
+  std::optional<LogLevel> log_level;
+  // Addresses of the replicas of this server, which may include its own. If
+  // set, the server starts as a follower: it copies the values set on
+  // whichever replica is the leader, serves reads, and rejects writes with
+  // FAILED_PRECONDITION until it is promoted.
+  std::vector<std::string> replicas;
+  // Replica addresses of each server this one is a proxy for, as in
+  // ShardedKeyValueStoreClient. If set, the server keeps no values of its
+  // own: it forwards writes upstream, fetches the values its clients wait
+  // for once per key however many clients wait, and caches them. The
+  // write-ahead log, async mode and replicas are not used then.
+  std::vector<std::vector<std::string>> upstream;
+  // Budget of a proxy's cache of the values it fetched or set, see
+  // ValueCache. Zero disables the cache.
+  size_t proxy_cache_max_entries = 1 << 16;
+  size_t proxy_cache_max_bytes = 256 << 20;
+  // Name of a shared memory segment to publish the values to, for clients
+  // on the same host to read them without a round trip. No segment is
+  // created if it is empty.
+  std::string shm_name;
+  // Size of the segment. Values set once it is full are only served over
+  // RPC, and values stay in it after their namespace is dropped.
+  size_t shm_size = 64 << 20;
+  // Largest message the server receives, or gRPC's default if zero.
+  int max_message_size = 0;
 };
 
 class KeyValueStoreServer {
  public:
+  // With an address of the form "inproc://name", the server listens on no
+  // port and only serves the clients in the same process that are created
+  // with that address, see InProcessServer. A proxy can't be in-process.
   explicit KeyValueStoreServer(const std::string& addr,
                                const KeyValueStoreServerOptions& options);
   KeyValueStoreServer(const KeyValueStoreServer&) = delete;
@@ -27,10 +81,29 @@ class KeyValueStoreServer {
 
   ~KeyValueStoreServer();
 
+  // Returns false if the server failed to start because its write-ahead log
+  // could not be restored, its shared memory segment could not be created or
+  // its in-process name is taken.
+  bool ok() const { return server_ != nullptr; }
+
   void Wait();
 
+  // Reports the same stats as the GetStats() RPC, without a round trip.
+  void GetStats(keyvaluestore::GetStatsResponse* stats);
+
+  // Makes a follower the leader. Does nothing if it is the leader already.
+  void Promote();
+
  private:
   // Need to keep this service during the server's lifetime.
-  std::unique_ptr<KeyValueStoreServiceImpl> service_impl_;
+  std::unique_ptr<::grpc::Service> service_impl_;
+  std::function<void(keyvaluestore::GetStatsResponse*)> collect_stats_;
+  std::function<void()> promote_;
   std::unique_ptr<::grpc::Server> server_;
+  // Completion queues and their polling threads, used in async mode only.
+  std::vector<std::unique_ptr<::grpc::ServerCompletionQueue>> cqs_;
+  std::vector<std::thread> polling_threads_;
+  // Set if the server is in-process, under `in_process_name_`.
+  std::shared_ptr<InProcessEndpoint> in_process_;
+  std::string in_process_name_;
 };
@@ -4,17 +4,33 @@
 // See https://llvm.org/LICENSE.txt for license information.
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 
+#include <cstring>
+
 #include "kvs.h"
 
-void RunServer() {
+// Usage: server_app [address [replicas]]
+//        server_app --proxy upstream [address]
+// `replicas` is a '|'-separated list of the replica addresses, which makes
+// the server start as a follower. With --proxy, the server is a proxy for
+// the clients on its host, and `upstream` lists the servers it proxies for
+// as kvs_client_create() takes them.
+void RunServer(const char* addr, const char* replicas, const char* upstream) {
   kvs_server_t* kvs_server = nullptr;
-  kvs_server_config_t config = {.timeout_ms = 3000};
-  kvs_server_create(&kvs_server, "localhost:50051", &config);
+  kvs_server_config_t config = {.timeout_ms = 3000,
+                                .log_level = KVS_LOG_LEVEL_INFO,
+                                .replicas = replicas,
+                                .upstream = upstream};
+  kvs_server_create(&kvs_server, addr, &config);
   kvs_server_wait(kvs_server);
 }
 
 int main(int argc, char** argv) {
-  RunServer();
+  if (argc > 2 && strcmp(argv[1], "--proxy") == 0) {
+    RunServer(argc > 3 ? argv[3] : "localhost:50051", nullptr, argv[2]);
+  } else {
+    RunServer(argc > 1 ? argv[1] : "localhost:50051",
+              argc > 2 ? argv[2] : nullptr, nullptr);
+  }
 
   return 0;
 }
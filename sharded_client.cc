@@ -0,0 +1,561 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "sharded_client.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "log.h"
+
+namespace {
+
+// Starts the part of a multi-key call that goes to `shard`, on `replica` of
+// it, and calls `done` when it completes. `retried` is set if the part was
+// sent to another replica before.
+using StartShardCall = std::function<void(
+    size_t shard, grpc::ClientContext* context, size_t replica, bool retried,
+    std::function<void(grpc::Status)> done)>;
+
+// Sends a multi-key call to each of `shards` in parallel, and waits for every
+// part of it to complete. Parts that find a replica down or no longer the
+// leader are sent again to another replica. Returns the first error of a
+// part. With `stop_on_success` the first part to succeed, and with
+// `stop_on_error` the first error, ends the call and cancels the other parts.
+grpc::Status FanOut(
+    const std::vector<std::unique_ptr<KeyValueStoreClient>>& clients,
+    std::vector<size_t> shards, KeyValueStoreClient::Failover::Kind kind,
+    bool stop_on_success,
+    bool stop_on_error, const StartShardCall& start) {
+  std::vector<std::optional<KeyValueStoreClient::Failover>> failovers(
+      clients.size());
+  for (size_t shard : shards) {
+    failovers[shard].emplace(clients[shard].get(), kind);
+  }
+  // Created before a round starts, so that parts can cancel the ones started
+  // after them.
+  std::vector<std::unique_ptr<grpc::ClientContext>> contexts(clients.size());
+  std::vector<grpc::Status> statuses(clients.size());
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t pending = 0;
+  // Set once the outcome is known, after which the remaining parts are
+  // cancelled and their errors ignored.
+  bool stopped = false;
+  grpc::Status result;
+
+  auto cancel_others = [&](size_t shard) {
+    for (size_t i = 0; i < contexts.size(); ++i) {
+      if (i != shard && contexts[i]) {
+        contexts[i]->TryCancel();
+      }
+    }
+  };
+  // Must be called with `mutex` held.
+  auto fail = [&](const grpc::Status& status) {
+    if (result.ok()) {
+      result = status;
+    }
+    stopped |= stop_on_error;
+  };
+
+  while (!shards.empty()) {
+    for (size_t shard : shards) {
+      contexts[shard] = std::make_unique<grpc::ClientContext>();
+    }
+    pending = shards.size();
+    for (size_t shard : shards) {
+      start(shard, contexts[shard].get(), failovers[shard]->replica(),
+            failovers[shard]->retried(), [&, shard](grpc::Status status) {
+              bool cancel = false;
+              {
+                std::lock_guard<std::mutex> lock(mutex);
+                bool was_stopped = stopped;
+                if (status.ok()) {
+                  stopped |= stop_on_success;
+                } else if (!stopped &&
+                           !failovers[shard]->CanRetry(status)) {
+                  fail(status);
+                }
+                cancel = stopped && !was_stopped;
+                statuses[shard] = std::move(status);
+              }
+              // Outside of the lock, in case a cancelled part completes
+              // inline.
+              if (cancel) {
+                cancel_others(shard);
+              }
+              std::lock_guard<std::mutex> lock(mutex);
+              if (--pending == 0) {
+                cv.notify_all();
+              }
+            });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return pending == 0; });
+
+    std::vector<size_t> retries;
+    for (size_t shard : shards) {
+      const grpc::Status& status = statuses[shard];
+      if (stopped || status.ok() || !failovers[shard]->CanRetry(status)) {
+        continue;
+      }
+      // Retry() may back off, which the callbacks are done with by now.
+      if (failovers[shard]->Retry(status)) {
+        retries.push_back(shard);
+      } else {
+        fail(status);
+      }
+    }
+    if (stopped) {
+      break;
+    }
+    shards = std::move(retries);
+  }
+  return result;
+}
+
+void MergeLatency(const keyvaluestore::LatencyStats& from,
+                  keyvaluestore::LatencyStats* to) {
+  int64_t count = to->count() + from.count();
+  if (count == 0) {
+    return;
+  }
+  to->set_mean_us((to->mean_us() * to->count() +
+                   from.mean_us() * from.count()) /
+                  count);
+  to->set_count(count);
+  to->set_p50_us(std::max(to->p50_us(), from.p50_us()));
+  to->set_p99_us(std::max(to->p99_us(), from.p99_us()));
+  to->set_p999_us(std::max(to->p999_us(), from.p999_us()));
+  to->set_max_us(std::max(to->max_us(), from.max_us()));
+}
+
+}  // namespace
+
+ShardedKeyValueStoreClient::ShardedKeyValueStoreClient(
+    const std::vector<std::vector<std::string>>& shards,
+    const KeyValueStoreClientOptions& options) {
+  KeyValueStoreClientOptions shard_options = options;
+  size_t num_shards = std::max<size_t>(shards.size(), 1);
+  shard_options.cache_max_entries =
+      (options.cache_max_entries + num_shards - 1) / num_shards;
+  shard_options.cache_max_bytes =
+      (options.cache_max_bytes + num_shards - 1) / num_shards;
+  std::vector<std::shared_ptr<grpc::Channel>> all_channels;
+  for (const std::vector<std::string>& replicas : shards) {
+    std::string name;
+    std::vector<std::vector<std::shared_ptr<grpc::Channel>>> pools;
+    for (const std::string& address : replicas) {
+      name += name.empty() ? address : '|' + address;
+      pools.push_back(CreateChannelPool(address, options));
+      // An in-process channel has no connection to warm up.
+      if (!IsInProcessAddress(address)) {
+        all_channels.insert(all_channels.end(), pools.back().begin(),
+                            pools.back().end());
+      }
+    }
+    ring_.AddNode(name);
+    shards_.push_back(
+        std::make_unique<KeyValueStoreClient>(pools, shard_options));
+  }
+  // Servers that are still starting up or down are connected to by the
+  // first calls instead.
+  size_t not_connected =
+      WarmUpChannels(all_channels, std::chrono::system_clock::now() +
+                                       options.connection_timeout);
+  if (not_connected > 0) {
+    KVS_LOG(kInfo) << not_connected << " of " << all_channels.size()
+                   << " channels did not connect within "
+                   << options.connection_timeout.count() << " ms";
+  }
+}
+
+grpc::Status ShardedKeyValueStoreClient::MultiGetValue(
+    const std::vector<std::string>& keys,
+    std::vector<std::optional<std::string>>& values, bool wait_for_any,
+    std::chrono::milliseconds timeout) {
+  if (shards_.size() == 1) {
+    return shards_[0]->MultiGetValue(keys, values, wait_for_any, timeout);
+  }
+
+  std::vector<std::vector<std::string>> shard_keys(shards_.size());
+  std::vector<std::vector<size_t>> indices(shards_.size());
+  std::vector<size_t> shards;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    size_t shard = ring_.NodeFor(keys[i]);
+    if (indices[shard].empty()) {
+      shards.push_back(shard);
+    }
+    shard_keys[shard].push_back(keys[i]);
+    indices[shard].push_back(i);
+  }
+  values.assign(keys.size(), std::nullopt);
+  // Every part and its failover attempts share the deadline.
+  auto deadline = shards_[0]->CallDeadline(timeout);
+  // Each part fills in the values of its own keys.
+  auto start = [&](size_t shard, grpc::ClientContext* context, size_t replica,
+                   bool retried, std::function<void(grpc::Status)> done) {
+    if (deadline) {
+      context->set_deadline(*deadline);
+    }
+    shards_[shard]->MultiGetValueAsync(
+        context, replica, shard_keys[shard], wait_for_any, timeout,
+        [&, shard, done = std::move(done)](
+            grpc::Status status,
+            std::vector<std::optional<std::string>> shard_values) {
+          if (status.ok()) {
+            for (size_t j = 0; j < shard_values.size(); ++j) {
+              values[indices[shard][j]] = std::move(shard_values[j]);
+            }
+          }
+          done(std::move(status));
+        });
+  };
+  return FanOut(shards_, std::move(shards),
+                KeyValueStoreClient::Failover::kRead,
+                /*stop_on_success=*/wait_for_any, /*stop_on_error=*/true,
+                start);
+}
+
+grpc::Status ShardedKeyValueStoreClient::MultiSetValue(
+    const std::vector<std::pair<std::string, std::string>>& key_values) {
+  if (shards_.size() == 1) {
+    return shards_[0]->MultiSetValue(key_values);
+  }
+
+  std::vector<std::vector<std::pair<std::string, std::string>>> shard_values(
+      shards_.size());
+  std::vector<size_t> shards;
+  for (const auto& key_value : key_values) {
+    size_t shard = ring_.NodeFor(key_value.first);
+    if (shard_values[shard].empty()) {
+      shards.push_back(shard);
+    }
+    shard_values[shard].push_back(key_value);
+  }
+  auto start = [&](size_t shard, grpc::ClientContext* context, size_t replica,
+                   bool retried, std::function<void(grpc::Status)> done) {
+    shards_[shard]->MultiSetValueAsync(context, replica, retried,
+                                       shard_values[shard], std::move(done));
+  };
+  // Every part sets what it can, even if another one failed.
+  return FanOut(shards_, std::move(shards),
+                KeyValueStoreClient::Failover::kWrite,
+                /*stop_on_success=*/false, /*stop_on_error=*/false, start);
+}
+
+void ShardedKeyValueStoreClient::MultiSetValueAsync(
+    const std::vector<std::pair<std::string, std::string>>& key_values,
+    std::function<void(grpc::Status)> done) {
+  std::vector<std::vector<std::pair<std::string, std::string>>> shard_values(
+      shards_.size());
+  std::vector<size_t> shards;
+  for (const auto& key_value : key_values) {
+    size_t shard = ring_.NodeFor(key_value.first);
+    if (shard_values[shard].empty()) {
+      shards.push_back(shard);
+    }
+    shard_values[shard].push_back(key_value);
+  }
+  if (shards.empty()) {
+    done(grpc::Status::OK);
+    return;
+  }
+  struct State {
+    std::mutex mutex;
+    size_t pending;
+    grpc::Status result;
+    std::function<void(grpc::Status)> done;
+  };
+  auto state = std::make_shared<State>();
+  state->pending = shards.size();
+  state->done = std::move(done);
+  // Every part sets what it can, even if another one failed.
+  for (size_t shard : shards) {
+    shards_[shard]->MultiSetValueAsync(
+        std::move(shard_values[shard]), [state](grpc::Status status) {
+          {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!status.ok() && state->result.ok()) {
+              state->result = std::move(status);
+            }
+            if (--state->pending > 0) {
+              return;
+            }
+          }
+          state->done(std::move(state->result));
+        });
+  }
+}
+
+grpc::Status ShardedKeyValueStoreClient::OpenNamespace(
+    const std::string& name, std::chrono::milliseconds ttl, bool& opened) {
+  grpc::Status first_error;
+  opened = false;
+  for (const auto& shard : shards_) {
+    bool shard_opened = false;
+    grpc::Status status = shard->OpenNamespace(name, ttl, shard_opened);
+    opened = opened || shard_opened;
+    if (!status.ok() && first_error.ok()) {
+      first_error = status;
+    }
+  }
+  return first_error;
+}
+
+grpc::Status ShardedKeyValueStoreClient::DropNamespace(const std::string& name,
+                                                       bool& dropped) {
+  grpc::Status first_error;
+  dropped = false;
+  for (const auto& shard : shards_) {
+    bool shard_dropped = false;
+    grpc::Status status = shard->DropNamespace(name, shard_dropped);
+    dropped = dropped || shard_dropped;
+    if (!status.ok() && first_error.ok()) {
+      first_error = status;
+    }
+  }
+  return first_error;
+}
+
+grpc::Status ShardedKeyValueStoreClient::GetStats(
+    keyvaluestore::GetStatsResponse& stats) {
+  stats.Clear();
+  stats.set_leader(true);
+  for (const auto& shard : shards_) {
+    keyvaluestore::GetStatsResponse shard_stats;
+    grpc::Status status = shard->GetStats(shard_stats);
+    if (!status.ok()) {
+      return status;
+    }
+    for (int i = 0; i < shard_stats.rpcs_size(); ++i) {
+      if (i == stats.rpcs_size()) {
+        stats.add_rpcs()->set_method(shard_stats.rpcs(i).method());
+      }
+      MergeLatency(shard_stats.rpcs(i).latency(),
+                   stats.mutable_rpcs(i)->mutable_latency());
+    }
+    stats.set_blocked_waiters(stats.blocked_waiters() +
+                              shard_stats.blocked_waiters());
+    MergeLatency(shard_stats.wait_time(), stats.mutable_wait_time());
+    stats.set_timeouts(stats.timeouts() + shard_stats.timeouts());
+    stats.set_already_exists(stats.already_exists() +
+                             shard_stats.already_exists());
+    stats.set_num_keys(stats.num_keys() + shard_stats.num_keys());
+    stats.set_bytes_stored(stats.bytes_stored() + shard_stats.bytes_stored());
+    stats.set_leader(stats.leader() && shard_stats.leader());
+    stats.set_cancelled(stats.cancelled() + shard_stats.cancelled());
+    // Every server has every namespace.
+    stats.set_num_namespaces(
+        std::max(stats.num_namespaces(), shard_stats.num_namespaces()));
+    stats.set_expired_namespaces(
+        std::max(stats.expired_namespaces(), shard_stats.expired_namespaces()));
+  }
+  return grpc::Status::OK;
+}
+
+ValueCache::Stats ShardedKeyValueStoreClient::cache_stats() const {
+  ValueCache::Stats stats;
+  for (const auto& shard : shards_) {
+    ValueCache::Stats shard_stats = shard->cache()->stats();
+    stats.hits += shard_stats.hits;
+    stats.misses += shard_stats.misses;
+    stats.evictions += shard_stats.evictions;
+    stats.entries += shard_stats.entries;
+    stats.bytes += shard_stats.bytes;
+  }
+  return stats;
+}
+
+void ShardedKeyValueStoreClient::InvalidateCaches() {
+  for (const auto& shard : shards_) {
+    shard->cache()->Invalidate();
+  }
+}
+
+std::unique_ptr<ShardedKeyValueStoreClient::PrefixWatch>
+ShardedKeyValueStoreClient::WatchPrefix(std::string prefix,
+                                        int64_t max_keys) {
+  std::vector<std::unique_ptr<KeyValueStoreClient::PrefixWatch>> watches;
+  for (const auto& shard : shards_) {
+    watches.push_back(shard->WatchPrefix(prefix, max_keys));
+  }
+  return std::make_unique<PrefixWatch>(std::move(watches), max_keys);
+}
+
+ShardedKeyValueStoreClient::PrefixWatch::PrefixWatch(
+    std::vector<std::unique_ptr<KeyValueStoreClient::PrefixWatch>> watches,
+    int64_t max_keys)
+    : watches_(std::move(watches)), max_keys_(max_keys) {
+  // A single stream is read directly, and ends after `max_keys` by itself.
+  if (watches_.size() == 1) {
+    return;
+  }
+  num_running_ = watches_.size();
+  for (size_t shard = 0; shard < watches_.size(); ++shard) {
+    readers_.emplace_back([this, shard]() { Read(shard); });
+  }
+}
+
+ShardedKeyValueStoreClient::PrefixWatch::~PrefixWatch() {
+  Stop();
+  for (std::thread& reader : readers_) {
+    reader.join();
+  }
+}
+
+bool ShardedKeyValueStoreClient::PrefixWatch::Next(std::string& key,
+                                                   std::string& value) {
+  if (readers_.empty()) {
+    return watches_[0]->Next(key, value);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return !pending_.empty() || num_running_ == 0; });
+  if (pending_.empty()) {
+    return false;
+  }
+  key = std::move(pending_.front().first);
+  value = std::move(pending_.front().second);
+  pending_.pop_front();
+  cv_.notify_all();
+  if (max_keys_ > 0 && ++num_read_ == max_keys_) {
+    lock.unlock();
+    Stop();
+  }
+  return true;
+}
+
+grpc::Status ShardedKeyValueStoreClient::PrefixWatch::Finish() {
+  if (readers_.empty()) {
+    return watches_[0]->Finish();
+  }
+  std::string key, value;
+  while (Next(key, value)) {
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return status_;
+}
+
+void ShardedKeyValueStoreClient::PrefixWatch::Read(size_t shard) {
+  std::string key, value;
+  while (watches_[shard]->Next(key, value)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+      return stopped_ ||
+             pending_.size() < kMaxPendingPerShard * watches_.size();
+    });
+    if (stopped_) {
+      break;
+    }
+    pending_.emplace_back(std::move(key), std::move(value));
+    cv_.notify_all();
+  }
+  grpc::Status status = watches_[shard]->Finish();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!status.ok() && !stopped_ && status_.ok()) {
+    status_ = std::move(status);
+  }
+  --num_running_;
+  cv_.notify_all();
+}
+
+void ShardedKeyValueStoreClient::PrefixWatch::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    pending_.clear();
+    cv_.notify_all();
+  }
+  for (const auto& watch : watches_) {
+    watch->Cancel();
+  }
+}
+
+std::unique_ptr<ShardedKeyValueStoreClient::KeyList>
+ShardedKeyValueStoreClient::ListKeys(std::string prefix,
+                                     std::string start_after, int64_t limit,
+                                     bool with_values) {
+  std::vector<std::unique_ptr<KeyValueStoreClient::KeyList>> lists;
+  // Any server may hold all of the first `limit` keys.
+  for (const auto& shard : shards_) {
+    lists.push_back(
+        shard->ListKeys(prefix, start_after, limit, with_values));
+  }
+  return std::make_unique<KeyList>(std::move(lists), limit);
+}
+
+ShardedKeyValueStoreClient::KeyList::KeyList(
+    std::vector<std::unique_ptr<KeyValueStoreClient::KeyList>> lists,
+    int64_t limit)
+    : lists_(std::move(lists)), heads_(lists_.size()), limit_(limit) {}
+
+bool ShardedKeyValueStoreClient::KeyList::Next(std::string& key,
+                                               std::string& value) {
+  if (stopped_) {
+    return false;
+  }
+  if (!started_) {
+    started_ = true;
+    for (size_t shard = 0; shard < lists_.size(); ++shard) {
+      Advance(shard);
+    }
+  }
+  if (!status_.ok()) {
+    // The keys of the failed server would be missing from the rest.
+    Stop();
+    return false;
+  }
+  size_t next = heads_.size();
+  for (size_t shard = 0; shard < heads_.size(); ++shard) {
+    if (heads_[shard].valid &&
+        (next == heads_.size() || heads_[shard].key < heads_[next].key)) {
+      next = shard;
+    }
+  }
+  if (next == heads_.size()) {
+    return false;
+  }
+  key = std::move(heads_[next].key);
+  value = std::move(heads_[next].value);
+  if (limit_ > 0 && ++num_read_ == limit_) {
+    Stop();
+  } else {
+    Advance(next);
+  }
+  return true;
+}
+
+grpc::Status ShardedKeyValueStoreClient::KeyList::Finish() {
+  if (!stopped_) {
+    stopped_ = true;
+    for (const auto& list : lists_) {
+      grpc::Status status = list->Finish();
+      if (!status.ok() && status_.ok()) {
+        status_ = std::move(status);
+      }
+    }
+  }
+  return status_;
+}
+
+void ShardedKeyValueStoreClient::KeyList::Advance(size_t shard) {
+  Head& head = heads_[shard];
+  head.valid = lists_[shard]->Next(head.key, head.value);
+  if (!head.valid) {
+    grpc::Status status = lists_[shard]->Finish();
+    if (!status.ok() && status_.ok()) {
+      status_ = std::move(status);
+    }
+  }
+}
+
+void ShardedKeyValueStoreClient::KeyList::Stop() {
+  stopped_ = true;
+  for (const auto& list : lists_) {
+    list->Cancel();
+  }
+}
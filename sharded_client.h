@@ -0,0 +1,213 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_SHARDED_CLIENT_H
+#define KVS_SHARDED_CLIENT_H
+
+#include <grpcpp/grpcpp.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cache.h"
+#include "client.h"
+#include "hash_ring.h"
+#include "keyvaluestore.grpc.pb.h"
+
+// A client of several servers, each of which stores the keys that a
+// HashRing of the server addresses assigns to it. Calls on a single key go to
+// that key's server, and calls on several keys are split up by server and
+// sent to all of them in parallel. Each server may be a group of replicas,
+// which KeyValueStoreClient fails over between.
+//
+// Every client of the same keys must list the same servers, in any order,
+// with the replicas of each in the same order.
+// Adding a server moves about 1/n of the keys to it, which the servers do not
+// migrate, so the list is fixed while the keys are in use.
+class ShardedKeyValueStoreClient {
+ public:
+  // `shards` holds the replica addresses of each server. The cache budget of
+  // `options` is split evenly across the servers.
+  explicit ShardedKeyValueStoreClient(
+      const std::vector<std::vector<std::string>>& shards,
+      const KeyValueStoreClientOptions& options = KeyValueStoreClientOptions());
+  ShardedKeyValueStoreClient(const ShardedKeyValueStoreClient&) = delete;
+  ShardedKeyValueStoreClient(ShardedKeyValueStoreClient&&) = delete;
+  ShardedKeyValueStoreClient& operator=(const ShardedKeyValueStoreClient&) =
+      delete;
+  ShardedKeyValueStoreClient&& operator=(ShardedKeyValueStoreClient&&) =
+      delete;
+
+  size_t num_shards() const { return shards_.size(); }
+
+  // Returns the client of the server that stores `key`. Barriers are routed
+  // by name in the same way.
+  KeyValueStoreClient* ForKey(std::string_view key) {
+    return shards_[ring_.NodeFor(key)].get();
+  }
+
+  // Returns the client of the server with the given index, which is its
+  // position in the list of servers.
+  KeyValueStoreClient* shard(size_t index) { return shards_[index].get(); }
+
+  // Like KeyValueStoreClient::MultiGetValue. With `wait_for_any`, it returns
+  // as soon as one server has found a key, and cancels the calls to the
+  // others, whose keys are then reported as not set unless they were found
+  // in the meantime.
+  grpc::Status MultiGetValue(
+      const std::vector<std::string>& keys,
+      std::vector<std::optional<std::string>>& values,
+      bool wait_for_any = false,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+  // Like KeyValueStoreClient::MultiSetValue. Returns the first error of any
+  // server, after every server has set the keys it could.
+  grpc::Status MultiSetValue(
+      const std::vector<std::pair<std::string, std::string>>& key_values);
+  // Like above without blocking. `done` is called with the first error, or
+  // OK, once every server has answered.
+  void MultiSetValueAsync(
+      const std::vector<std::pair<std::string, std::string>>& key_values,
+      std::function<void(grpc::Status)> done);
+
+  // Like KeyValueStoreClient::OpenNamespace and DropNamespace, on every
+  // server since the keys of a namespace are spread across all of them.
+  // `opened` and `dropped` tell whether any server opened or dropped it.
+  // Returns the first error of any server, after trying every server.
+  grpc::Status OpenNamespace(const std::string& name,
+                             std::chrono::milliseconds ttl, bool& opened);
+  grpc::Status DropNamespace(const std::string& name, bool& dropped);
+
+  // GetStats adds up the stats of every server. Latency counts and means are
+  // combined exactly, while the percentiles and maximums are those of the
+  // slowest server.
+  grpc::Status GetStats(keyvaluestore::GetStatsResponse& stats);
+
+  // The sum of the stats of the caches of every server.
+  ValueCache::Stats cache_stats() const;
+
+  // Drops every cached value of every server.
+  void InvalidateCaches();
+
+  // The key/value pairs under a prefix across every server, see WatchPrefix.
+  class PrefixWatch {
+   public:
+    PrefixWatch(
+        std::vector<std::unique_ptr<KeyValueStoreClient::PrefixWatch>> watches,
+        int64_t max_keys);
+    PrefixWatch(const PrefixWatch&) = delete;
+    PrefixWatch& operator=(const PrefixWatch&) = delete;
+    // Cancels the streams that have not ended yet.
+    ~PrefixWatch();
+
+    // Next blocks until the next key/value pair arrives from any server. It
+    // returns false once every stream has ended, and Finish then tells why.
+    bool Next(std::string& key, std::string& value);
+
+    // Finish waits for every stream to end, dropping the pairs that have not
+    // been read, and returns the first error any of them ended with.
+    grpc::Status Finish();
+
+   private:
+    // How many pairs the readers buffer per server before they stop pulling
+    // from their streams.
+    static constexpr size_t kMaxPendingPerShard = 64;
+
+    // Forwards the pairs of a stream to `pending_` on a thread of its own.
+    void Read(size_t shard);
+    // Cancels every stream and drops the pairs that have not been read.
+    void Stop();
+
+    std::vector<std::unique_ptr<KeyValueStoreClient::PrefixWatch>> watches_;
+    const int64_t max_keys_;
+    int64_t num_read_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::string, std::string>> pending_;
+    size_t num_running_ = 0;
+    // Set once no more pairs are wanted, after which the streams' errors
+    // are expected and ignored.
+    bool stopped_ = false;
+    grpc::Status status_;
+    std::vector<std::thread> readers_;
+  };
+
+  // WatchPrefix watches `prefix` on every server, since the keys under it may
+  // be anywhere. Pairs from different servers arrive in no particular order.
+  // The watch ends after `max_keys` keys in total if it is positive.
+  std::unique_ptr<PrefixWatch> WatchPrefix(std::string prefix,
+                                           int64_t max_keys = 0);
+
+  // The keys under a prefix across every server, see ListKeys.
+  class KeyList {
+   public:
+    KeyList(std::vector<std::unique_ptr<KeyValueStoreClient::KeyList>> lists,
+            int64_t limit);
+    KeyList(const KeyList&) = delete;
+    KeyList& operator=(const KeyList&) = delete;
+
+    // Next blocks until the next key in ascending order across every server
+    // is known. It returns false once the keys run out, `limit` keys have
+    // been read or a stream fails, and Finish then tells why.
+    bool Next(std::string& key, std::string& value);
+
+    // Finish waits for every stream to end, dropping the keys that have not
+    // been read, and returns the first error any of them ended with.
+    grpc::Status Finish();
+
+   private:
+    // The smallest key of a server that has not been returned yet.
+    struct Head {
+      std::string key;
+      std::string value;
+      bool valid = false;
+    };
+
+    // Reads the next key of `shard` into its head, or finishes its stream.
+    void Advance(size_t shard);
+    // Cancels every stream once no more keys are wanted.
+    void Stop();
+
+    std::vector<std::unique_ptr<KeyValueStoreClient::KeyList>> lists_;
+    std::vector<Head> heads_;
+    const int64_t limit_;
+    int64_t num_read_ = 0;
+    // The heads are read by the first call to Next, so that starting the
+    // list does not block.
+    bool started_ = false;
+    // Set once no more keys are wanted, after which the streams' errors
+    // are expected and ignored.
+    bool stopped_ = false;
+    grpc::Status status_;
+  };
+
+  // ListKeys lists the keys under `prefix` after `start_after` on every
+  // server and merges them, so they come in ascending order. Each server
+  // streams its keys in pages, of which the list holds about one per server.
+  // The list ends after `limit` keys in total if it is positive.
+  std::unique_ptr<KeyList> ListKeys(std::string prefix,
+                                    std::string start_after = "",
+                                    int64_t limit = 0,
+                                    bool with_values = false);
+
+ private:
+  HashRing ring_;
+  std::vector<std::unique_ptr<KeyValueStoreClient>> shards_;
+};
+
+#endif  // KVS_SHARDED_CLIENT_H
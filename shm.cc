@@ -0,0 +1,391 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include "hash_ring.h"
+#include "log.h"
+#include "store.h"
+
+namespace shm_internal {
+
+// The start of the segment. Everything but the atomics is written once by
+// the server before `magic`, and only the server writes to the atomics other
+// than `num_waiters`.
+struct Header {
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  // A power of two.
+  uint32_t num_slots;
+  uint64_t slots_offset;
+  uint64_t heap_offset;
+  char server_address[256];
+  uint64_t timeout_ms;
+  // Used by the server only.
+  uint64_t heap_used;
+  uint64_t num_keys;
+  // Bumped whenever a key is published or the state changes. Readers sleep
+  // on it as a futex.
+  alignas(64) std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> num_waiters;
+  std::atomic<uint32_t> state;
+};
+
+// An entry of the table. A slot is free while `offset` is zero. Once it is
+// set, it only changes to have kDroppedBit set when the key's namespace is
+// dropped.
+struct Slot {
+  std::atomic<uint64_t> offset;
+  uint64_t hash;
+};
+
+// Followed by the key and the value.
+struct Record {
+  uint64_t key_size;
+  uint64_t value_size;
+};
+
+}  // namespace shm_internal
+
+namespace {
+
+using shm_internal::Header;
+using shm_internal::Record;
+using shm_internal::Slot;
+
+constexpr uint64_t kMagic = 0x4b56534d454d3031;  // "KVSMEM01"
+constexpr uint32_t kVersion = 3;
+
+// Set in the offset of a slot whose key was dropped with its namespace.
+// Records are aligned, so offsets have their low bit clear.
+constexpr uint64_t kDroppedBit = 1;
+static_assert(alignof(Record) > kDroppedBit);
+
+enum State : uint32_t {
+  kOpen = 0,
+  // Keys are no longer published.
+  kFull = 1,
+  // The server is gone.
+  kClosed = 2,
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "the atomics of the segment are shared across processes");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "the sequence is used as a futex");
+
+std::string SegmentPath(const std::string& name) { return "/" + name; }
+
+bool IsValidName(const std::string& name) {
+  return !name.empty() && name.size() < NAME_MAX &&
+         name.find('/') == std::string::npos;
+}
+
+std::string ErrnoMessage(const std::string& what) {
+  return what + ": " + strerror(errno);
+}
+
+uint64_t AlignUp(uint64_t n, uint64_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+Slot* Slots(char* base) {
+  return reinterpret_cast<Slot*>(
+      base + reinterpret_cast<Header*>(base)->slots_offset);
+}
+
+// Wakes up every reader sleeping on the sequence, if there are any.
+void BumpSequence(Header* header) {
+  header->sequence.fetch_add(1, std::memory_order_seq_cst);
+  if (header->num_waiters.load(std::memory_order_seq_cst) > 0) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->sequence),
+            FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<SharedMemoryWriter> SharedMemoryWriter::Create(
+    const std::string& name, size_t size, const std::string& server_address,
+    std::chrono::milliseconds timeout, std::string* error) {
+  if (!IsValidName(name)) {
+    *error = "invalid shared memory name \"" + name + "\"";
+    return nullptr;
+  }
+  if (server_address.size() >= sizeof(Header::server_address)) {
+    *error = "server address is too long for shared memory";
+    return nullptr;
+  }
+  // A quarter of the segment goes to the table, at most.
+  uint64_t slots_offset = AlignUp(sizeof(Header), 64);
+  uint32_t num_slots = 16;
+  while (num_slots * 2 * sizeof(Slot) * 4 <= size && num_slots < (1u << 30)) {
+    num_slots *= 2;
+  }
+  uint64_t heap_offset = slots_offset + num_slots * sizeof(Slot);
+  if (heap_offset >= size) {
+    *error = "shared memory size " + std::to_string(size) + " is too small";
+    return nullptr;
+  }
+
+  // Start over from an empty segment, so that readers never see one being
+  // filled in.
+  std::string path = SegmentPath(name);
+  shm_unlink(path.c_str());
+  int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    *error = ErrnoMessage("can't create shared memory " + name);
+    return nullptr;
+  }
+  if (ftruncate(fd, size) != 0) {
+    *error = ErrnoMessage("can't size shared memory " + name);
+    close(fd);
+    shm_unlink(path.c_str());
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    *error = ErrnoMessage("can't map shared memory " + name);
+    shm_unlink(path.c_str());
+    return nullptr;
+  }
+
+  // The segment starts zeroed, which leaves the slots free.
+  Header* header = new (base) Header();
+  header->version = kVersion;
+  header->num_slots = num_slots;
+  header->slots_offset = slots_offset;
+  header->heap_offset = heap_offset;
+  strcpy(header->server_address, server_address.c_str());
+  header->timeout_ms = timeout.count();
+  header->magic.store(kMagic, std::memory_order_release);
+  return std::unique_ptr<SharedMemoryWriter>(
+      new SharedMemoryWriter(name, static_cast<char*>(base), size));
+}
+
+SharedMemoryWriter::SharedMemoryWriter(std::string name, char* base,
+                                       size_t size)
+    : name_(std::move(name)), base_(base), size_(size) {}
+
+SharedMemoryWriter::~SharedMemoryWriter() {
+  Header* header = reinterpret_cast<Header*>(base_);
+  header->state.store(kClosed, std::memory_order_release);
+  BumpSequence(header);
+  munmap(base_, size_);
+  shm_unlink(SegmentPath(name_).c_str());
+}
+
+bool SharedMemoryWriter::Publish(std::string_view key,
+                                 std::string_view value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Header* header = reinterpret_cast<Header*>(base_);
+  if (header->state.load(std::memory_order_relaxed) != kOpen) {
+    return false;
+  }
+  uint64_t record_size =
+      AlignUp(sizeof(Record) + key.size() + value.size(), alignof(Record));
+  // The table is kept at most 3/4 full, so that probes stay short and
+  // always end at a free slot.
+  if ((header->num_keys + 1) * 4 > uint64_t{header->num_slots} * 3 ||
+      record_size > size_ - header->heap_offset - header->heap_used) {
+    KVS_LOG(kWarning) << "Shared memory " << name_
+                      << " is full, so clients will ask the server for the "
+                         "keys set from now on";
+    header->state.store(kFull, std::memory_order_release);
+    BumpSequence(header);
+    return false;
+  }
+
+  uint64_t offset = header->heap_offset + header->heap_used;
+  auto* record = reinterpret_cast<Record*>(base_ + offset);
+  record->key_size = key.size();
+  record->value_size = value.size();
+  char* data = reinterpret_cast<char*>(record + 1);
+  memcpy(data, key.data(), key.size());
+  memcpy(data + key.size(), value.data(), value.size());
+  header->heap_used += record_size;
+  ++header->num_keys;
+
+  uint64_t hash = HashRing::Hash(key);
+  uint64_t mask = header->num_slots - 1;
+  Slot* slots = Slots(base_);
+  uint64_t i = hash & mask;
+  while (slots[i].offset.load(std::memory_order_relaxed) != 0) {
+    i = (i + 1) & mask;
+  }
+  slots[i].hash = hash;
+  // Publishes the record and the hash along with it.
+  slots[i].offset.store(offset, std::memory_order_release);
+  size_t separator = key.find(ShardedKeyValueMap::kNamespaceSeparator);
+  if (separator != std::string_view::npos && !namespace_slots_.empty()) {
+    auto it = namespace_slots_.find(std::string(key.substr(0, separator)));
+    if (it != namespace_slots_.end()) {
+      it->second.push_back(i);
+    }
+  }
+  BumpSequence(header);
+  return true;
+}
+
+void SharedMemoryWriter::OpenNamespace(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  namespace_slots_.try_emplace(name);
+}
+
+void SharedMemoryWriter::DropNamespace(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = namespace_slots_.find(name);
+  if (it == namespace_slots_.end()) {
+    return;
+  }
+  Slot* slots = Slots(base_);
+  for (uint64_t i : it->second) {
+    // The slot stays taken, for the probes of the keys after it.
+    uint64_t offset = slots[i].offset.load(std::memory_order_relaxed);
+    slots[i].offset.store(offset | kDroppedBit, std::memory_order_release);
+  }
+  namespace_slots_.erase(it);
+  // Readers waiting for a dropped key ask the server instead.
+  BumpSequence(reinterpret_cast<Header*>(base_));
+}
+
+std::unique_ptr<SharedMemoryReader> SharedMemoryReader::Open(
+    const std::string& name, std::string* error) {
+  if (!IsValidName(name)) {
+    *error = "invalid shared memory name \"" + name + "\"";
+    return nullptr;
+  }
+  // Mapped writable, since readers count themselves in `num_waiters`.
+  int fd = shm_open(SegmentPath(name).c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    *error = ErrnoMessage("can't open shared memory " + name);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = ErrnoMessage("can't stat shared memory " + name);
+    close(fd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  if (size < sizeof(Header)) {
+    *error = "shared memory " + name + " is not a key/value segment";
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    *error = ErrnoMessage("can't map shared memory " + name);
+    return nullptr;
+  }
+  auto* header = static_cast<Header*>(base);
+  if (header->magic.load(std::memory_order_acquire) != kMagic ||
+      header->version != kVersion ||
+      header->heap_offset > size) {
+    *error = "shared memory " + name + " is not a key/value segment";
+    munmap(base, size);
+    return nullptr;
+  }
+  return std::unique_ptr<SharedMemoryReader>(
+      new SharedMemoryReader(static_cast<char*>(base), size));
+}
+
+SharedMemoryReader::SharedMemoryReader(char* base, size_t size)
+    : base_(base), size_(size) {}
+
+SharedMemoryReader::~SharedMemoryReader() { munmap(base_, size_); }
+
+Header* SharedMemoryReader::header() const {
+  return reinterpret_cast<Header*>(base_);
+}
+
+std::string SharedMemoryReader::server_address() const {
+  return header()->server_address;
+}
+
+std::chrono::milliseconds SharedMemoryReader::timeout() const {
+  return std::chrono::milliseconds(header()->timeout_ms);
+}
+
+bool SharedMemoryReader::Find(std::string_view key, std::string_view* value,
+                              bool* dropped) const {
+  *dropped = false;
+  uint64_t hash = HashRing::Hash(key);
+  uint64_t mask = header()->num_slots - 1;
+  const Slot* slots = Slots(base_);
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    uint64_t offset = slots[i].offset.load(std::memory_order_acquire);
+    if (offset == 0) {
+      return false;
+    }
+    if (slots[i].hash != hash) {
+      continue;
+    }
+    const auto* record =
+        reinterpret_cast<const Record*>(base_ + (offset & ~kDroppedBit));
+    const char* data = reinterpret_cast<const char*>(record + 1);
+    if (record->key_size == key.size() &&
+        memcmp(data, key.data(), key.size()) == 0) {
+      if (offset & kDroppedBit) {
+        // The key may have been published again further on.
+        *dropped = true;
+        continue;
+      }
+      *value = std::string_view(data + key.size(), record->value_size);
+      return true;
+    }
+  }
+}
+
+SharedMemoryReader::WaitResult SharedMemoryReader::WaitFor(
+    std::string_view key, std::chrono::steady_clock::time_point deadline,
+    std::string_view* value) const {
+  Header* header = this->header();
+  while (true) {
+    // Read before the lookup, so that a key published after the lookup
+    // changes it and the futex does not sleep.
+    uint32_t sequence = header->sequence.load(std::memory_order_seq_cst);
+    bool dropped;
+    if (Find(key, value, &dropped)) {
+      return WaitResult::kFound;
+    }
+    if (dropped || header->state.load(std::memory_order_acquire) != kOpen) {
+      return WaitResult::kUnpublished;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return WaitResult::kTimedOut;
+    }
+    auto timeout =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now);
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    // The server reads `num_waiters` after it bumps the sequence, so either
+    // it wakes this reader up or the futex sees the new sequence.
+    header->num_waiters.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->sequence),
+            FUTEX_WAIT, sequence, &ts, nullptr, 0);
+    header->num_waiters.fetch_sub(1, std::memory_order_seq_cst);
+  }
+}
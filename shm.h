@@ -0,0 +1,140 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_SHM_H
+#define KVS_SHM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace shm_internal {
+struct Header;
+}  // namespace shm_internal
+
+// A read-only copy of a server's values in a POSIX shared memory segment, so
+// that clients on the same host can look keys up without a round trip.
+//
+// The segment holds a fixed-size open-addressing table of keys and an
+// append-only heap of key/value records. Only the server writes to it, and
+// since values are write-once, records are never moved or freed: a key is
+// published by a release store of its record's offset into its slot, so
+// lookups take no lock and make no syscall. Readers that miss a key can wait
+// on a futex that the server bumps whenever it publishes one. When a
+// namespace is dropped, the slots of its keys are marked as dropped instead,
+// and readers ask the server for those keys.
+//
+// Once the table or the heap is full, the server stops publishing and marks
+// the segment as such, and readers have to ask the server for the keys they
+// miss. The segment is only readable by the user that runs the server.
+class SharedMemoryWriter {
+ public:
+  // Creates the segment `name`, replacing any left over from an earlier
+  // server, and records `server_address` and the server's `timeout` in it for
+  // the readers. `size` covers the table and the heap. Returns nullptr and
+  // describes the problem in `error` if the segment can't be created.
+  static std::unique_ptr<SharedMemoryWriter> Create(
+      const std::string& name, size_t size, const std::string& server_address,
+      std::chrono::milliseconds timeout, std::string* error);
+  SharedMemoryWriter(const SharedMemoryWriter&) = delete;
+  SharedMemoryWriter(SharedMemoryWriter&&) = delete;
+  SharedMemoryWriter& operator=(const SharedMemoryWriter&) = delete;
+  SharedMemoryWriter&& operator=(SharedMemoryWriter&&) = delete;
+
+  // Wakes up the waiting readers and removes the segment. Readers that still
+  // have it mapped keep the values published so far.
+  ~SharedMemoryWriter();
+
+  // Publishes a key/value pair and wakes up the readers waiting for a key.
+  // Each key must be published at most once, other than once more after its
+  // namespace is dropped. Returns false if the segment is full, after which
+  // nothing more is published.
+  bool Publish(std::string_view key, std::string_view value);
+
+  // Keys named "<name>/..." that are published from now on belong to the
+  // namespace `name`, until it is dropped.
+  void OpenNamespace(const std::string& name);
+
+  // Marks the keys published in the namespace as dropped, so that readers no
+  // longer find them, and wakes up the readers. Each of them may then be
+  // published once more.
+  void DropNamespace(const std::string& name);
+
+ private:
+  SharedMemoryWriter(std::string name, char* base, size_t size);
+
+  const std::string name_;
+  char* const base_;
+  const size_t size_;
+  // Guards everything below and the segment.
+  std::mutex mutex_;
+  // The slots of the keys published in each open namespace.
+  std::unordered_map<std::string, std::vector<uint64_t>> namespace_slots_;
+};
+
+class SharedMemoryReader {
+ public:
+  // Maps the segment `name` created by a server on this host. Returns nullptr
+  // and describes the problem in `error` if there is no such segment.
+  static std::unique_ptr<SharedMemoryReader> Open(const std::string& name,
+                                                  std::string* error);
+  SharedMemoryReader(const SharedMemoryReader&) = delete;
+  SharedMemoryReader(SharedMemoryReader&&) = delete;
+  SharedMemoryReader& operator=(const SharedMemoryReader&) = delete;
+  SharedMemoryReader&& operator=(SharedMemoryReader&&) = delete;
+
+  ~SharedMemoryReader();
+
+  // The address the server that created the segment listens on.
+  std::string server_address() const;
+  // How long the server waits for a key by default.
+  std::chrono::milliseconds timeout() const;
+
+  // Points `value` to the value of `key` in the segment and returns true if
+  // the key is published, and was not dropped with its namespace since. The
+  // value stays valid while the reader exists.
+  bool Find(std::string_view key, std::string_view* value) const {
+    bool dropped;
+    return Find(key, value, &dropped);
+  }
+
+  enum class WaitResult {
+    kFound,
+    kTimedOut,
+    // The key may be set without being published, because the segment is
+    // full, the server is gone or the key's namespace was dropped since it
+    // was published, so the server has to be asked.
+    kUnpublished,
+  };
+
+  // Like Find(), but sleeps on the futex until the key is published or
+  // `deadline` passes.
+  WaitResult WaitFor(std::string_view key,
+                     std::chrono::steady_clock::time_point deadline,
+                     std::string_view* value) const;
+
+ private:
+  SharedMemoryReader(char* base, size_t size);
+
+  shm_internal::Header* header() const;
+
+  // Like Find(), and sets `dropped` if the key is not found but was
+  // published before its namespace was dropped.
+  bool Find(std::string_view key, std::string_view* value,
+            bool* dropped) const;
+
+  char* const base_;
+  const size_t size_;
+};
+
+#endif  // KVS_SHM_H
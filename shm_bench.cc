@@ -0,0 +1,87 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Microbenchmarks of reads by a client on the server's host, run in-process
+// by kvs_bench. They compare KeyValueStoreClient::GetValue() of published
+// keys from shared memory with the same call over gRPC, and measure bare
+// lookups in the segment.
+
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "client.h"
+#include "server.h"
+#include "shm.h"
+
+namespace {
+
+constexpr int kNumKeys = 1 << 12;
+
+std::string SegmentName() {
+  return "kvs_bench." + std::to_string(getpid());
+}
+
+void BM_SharedMemoryFind(benchmark::State& state) {
+  std::string error;
+  auto writer =
+      SharedMemoryWriter::Create(SegmentName(), 64 << 20, "localhost:50051",
+                                 std::chrono::seconds(3), &error);
+  auto reader = SharedMemoryReader::Open(SegmentName(), &error);
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    writer->Publish(keys.back(), std::string(32, 'v'));
+  }
+  size_t i = 0;
+  std::string_view value;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(reader->Find(keys[i], &value));
+    i = (i + 7919) % kNumKeys;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Gets published keys through a client that reads them from shared memory
+// if `shared_memory` is set, or from the server otherwise. The client's
+// cache is disabled.
+template <bool shared_memory>
+void BM_ClientGetValue(benchmark::State& state) {
+  KeyValueStoreServerOptions server_options;
+  server_options.shm_name = SegmentName();
+  KeyValueStoreServer server("localhost:50061", server_options);
+  KeyValueStoreClientOptions options;
+  options.cache_max_entries = 0;
+  std::string error;
+  if (shared_memory) {
+    options.shared_memory = SharedMemoryReader::Open(SegmentName(), &error);
+  }
+  KeyValueStoreClient client(
+      grpc::CreateChannel("localhost:50061",
+                          grpc::InsecureChannelCredentials()),
+      options);
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    client.SetValue(keys.back(), std::string(32, 'v'));
+  }
+  size_t i = 0;
+  std::string value;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(client.GetValue(keys[i], value));
+    i = (i + 7919) % kNumKeys;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_SharedMemoryFind);
+BENCHMARK_TEMPLATE(BM_ClientGetValue, true);
+BENCHMARK_TEMPLATE(BM_ClientGetValue, false);
+
+}  // namespace
@@ -0,0 +1,169 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "shm.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace kvs {
+namespace {
+
+class SharedMemoryTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    name_ = "kvs_shm_test." + std::to_string(getpid());
+  }
+
+  std::unique_ptr<SharedMemoryWriter> CreateWriter(size_t size = 1 << 20) {
+    std::string error;
+    auto writer = SharedMemoryWriter::Create(
+        name_, size, "localhost:50051", std::chrono::seconds(3), &error);
+    EXPECT_NE(writer, nullptr) << error;
+    return writer;
+  }
+
+  std::unique_ptr<SharedMemoryReader> OpenReader() {
+    std::string error;
+    auto reader = SharedMemoryReader::Open(name_, &error);
+    EXPECT_NE(reader, nullptr) << error;
+    return reader;
+  }
+
+  static std::chrono::steady_clock::time_point After(int ms) {
+    return std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  }
+
+  std::string name_;
+};
+
+TEST_F(SharedMemoryTest, PublishAndFind) {
+  auto writer = CreateWriter();
+  auto reader = OpenReader();
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(reader->server_address(), "localhost:50051");
+  EXPECT_EQ(reader->timeout(), std::chrono::seconds(3));
+
+  std::string_view value;
+  EXPECT_FALSE(reader->Find("key", &value));
+  EXPECT_TRUE(writer->Publish("key", "value"));
+  EXPECT_TRUE(writer->Publish(std::string("bin\0key", 7), ""));
+  ASSERT_TRUE(reader->Find("key", &value));
+  EXPECT_EQ(value, "value");
+  ASSERT_TRUE(reader->Find(std::string("bin\0key", 7), &value));
+  EXPECT_EQ(value, "");
+  EXPECT_FALSE(reader->Find("bin", &value));
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(writer->Publish("k" + std::to_string(i), std::to_string(i)));
+  }
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(reader->Find("k" + std::to_string(i), &value));
+    EXPECT_EQ(value, std::to_string(i));
+  }
+}
+
+TEST_F(SharedMemoryTest, OpenMissingSegment) {
+  std::string error;
+  EXPECT_EQ(SharedMemoryReader::Open(name_, &error), nullptr);
+  EXPECT_FALSE(error.empty());
+  EXPECT_EQ(SharedMemoryReader::Open("a/b", &error), nullptr);
+  EXPECT_EQ(SharedMemoryWriter::Create("", 1 << 20, "addr",
+                                       std::chrono::seconds(3), &error),
+            nullptr);
+  EXPECT_EQ(SharedMemoryWriter::Create(name_, 64, "addr",
+                                       std::chrono::seconds(3), &error),
+            nullptr);
+}
+
+TEST_F(SharedMemoryTest, WaitForKey) {
+  auto writer = CreateWriter();
+  auto reader = OpenReader();
+  std::string_view value;
+  EXPECT_EQ(reader->WaitFor("key", After(10), &value),
+            SharedMemoryReader::WaitResult::kTimedOut);
+
+  std::thread publisher([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    writer->Publish("other", "value");
+    writer->Publish("key", "value");
+  });
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(reader->WaitFor("key", After(5000), &value),
+            SharedMemoryReader::WaitResult::kFound);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+  EXPECT_EQ(value, "value");
+  publisher.join();
+}
+
+TEST_F(SharedMemoryTest, FullSegmentStopsPublishing) {
+  auto writer = CreateWriter(/*size=*/4096);
+  auto reader = OpenReader();
+  std::string big(1024, 'x');
+  int num_published = 0;
+  while (writer->Publish("k" + std::to_string(num_published), big)) {
+    ++num_published;
+  }
+  EXPECT_GT(num_published, 0);
+  std::string_view value;
+  EXPECT_TRUE(reader->Find("k0", &value));
+  // Smaller values are not published either once the segment is full.
+  EXPECT_FALSE(writer->Publish("small", "v"));
+  EXPECT_EQ(reader->WaitFor("small", After(5000), &value),
+            SharedMemoryReader::WaitResult::kUnpublished);
+}
+
+TEST_F(SharedMemoryTest, DropAndReuseNamespace) {
+  auto writer = CreateWriter();
+  auto reader = OpenReader();
+  // Set before the namespace was opened, so not in it.
+  EXPECT_TRUE(writer->Publish("job/before", "value"));
+  writer->OpenNamespace("job");
+  EXPECT_TRUE(writer->Publish("job/key", "old"));
+  EXPECT_TRUE(writer->Publish("other/key", "value"));
+  std::string_view value;
+  ASSERT_TRUE(reader->Find("job/key", &value));
+  EXPECT_EQ(value, "old");
+
+  writer->DropNamespace("job");
+  EXPECT_FALSE(reader->Find("job/key", &value));
+  EXPECT_EQ(reader->WaitFor("job/key", After(5000), &value),
+            SharedMemoryReader::WaitResult::kUnpublished);
+  EXPECT_TRUE(reader->Find("job/before", &value));
+  EXPECT_TRUE(reader->Find("other/key", &value));
+
+  writer->OpenNamespace("job");
+  EXPECT_TRUE(writer->Publish("job/key", "new"));
+  ASSERT_EQ(reader->WaitFor("job/key", After(5000), &value),
+            SharedMemoryReader::WaitResult::kFound);
+  EXPECT_EQ(value, "new");
+}
+
+TEST_F(SharedMemoryTest, ReaderOutlivesWriter) {
+  auto writer = CreateWriter();
+  auto reader = OpenReader();
+  writer->Publish("key", "value");
+  std::thread closer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    writer = nullptr;
+  });
+  std::string_view value;
+  EXPECT_EQ(reader->WaitFor("missing", After(5000), &value),
+            SharedMemoryReader::WaitResult::kUnpublished);
+  closer.join();
+  ASSERT_TRUE(reader->Find("key", &value));
+  EXPECT_EQ(value, "value");
+  std::string error;
+  EXPECT_EQ(SharedMemoryReader::Open(name_, &error), nullptr);
+}
+
+}  // namespace
+}  // namespace kvs
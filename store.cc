@@ -0,0 +1,715 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "store.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string_view>
+
+namespace {
+
+// Bytes of keys and values read from a watch snapshot at a time.
+constexpr size_t kWatchPageBytes = 1 << 20;
+// Entries a watch snapshot reads under a shard lock at a time.
+constexpr size_t kWatchScanEntries = 4096;
+
+// Waits on `cv` until `ready` returns true, `deadline` passes or `canceller`
+// is cancelled, if it is set. The caller must be subscribed to the canceller
+// to be woken up by it. Returns the last result of `ready`.
+template <typename ConditionVariable, typename Lock, typename Predicate>
+bool WaitUntil(ConditionVariable& cv, Lock& lock,
+               std::chrono::steady_clock::time_point deadline,
+               const ShardedKeyValueMap::Canceller* canceller,
+               Predicate ready) {
+  return cv.wait_until(lock, deadline, [&]() {
+    return ready() || (canceller != nullptr && canceller->cancelled());
+  }) && ready();
+}
+
+}  // namespace
+
+void ShardedKeyValueMap::Canceller::Cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cancelled_.store(true);
+  for (const auto& [id, wake_up] : wake_ups_) {
+    wake_up();
+  }
+}
+
+ShardedKeyValueMap::Canceller::Subscription::Subscription(
+    Canceller* canceller, std::function<void()> wake_up)
+    : canceller_(canceller) {
+  if (canceller_ != nullptr) {
+    canceller_->OnWait();
+    std::lock_guard<std::mutex> lock(canceller_->mutex_);
+    id_ = canceller_->next_id_++;
+    canceller_->wake_ups_.emplace(id_, std::move(wake_up));
+  }
+}
+
+ShardedKeyValueMap::Canceller::Subscription::~Subscription() {
+  if (canceller_ != nullptr) {
+    std::lock_guard<std::mutex> lock(canceller_->mutex_);
+    canceller_->wake_ups_.erase(id_);
+  }
+}
+
+ShardedKeyValueMap::ShardedKeyValueMap(size_t num_shards,
+                                       Histogram* wait_time)
+    : num_shards_(std::max<size_t>(num_shards, 1)),
+      shards_(new Shard[num_shards_]),
+      wait_time_(wait_time) {}
+
+ShardedKeyValueMap::Shard& ShardedKeyValueMap::GetShard(
+    const std::string& key) const {
+  return shards_[std::hash<std::string>()(key) % num_shards_];
+}
+
+ShardedKeyValueMap::Space& ShardedKeyValueMap::GetSpace(
+    Shard& shard, const std::string& key) {
+  // Maps without namespaces don't pay for the lookup.
+  if (shard.namespaces.empty()) {
+    return shard.space;
+  }
+  size_t separator = key.find(kNamespaceSeparator);
+  if (separator == std::string::npos) {
+    return shard.space;
+  }
+  auto it = shard.namespaces.find(key.substr(0, separator));
+  if (it == shard.namespaces.end()) {
+    return shard.space;
+  }
+  // A key inserted before its namespace was opened stays where it is.
+  if (it->second->shadows && InSpace(shard.space, key)) {
+    return shard.space;
+  }
+  return *it->second;
+}
+
+bool ShardedKeyValueMap::InSpace(const Space& space, const std::string& key) {
+  std::string_view value;
+  return space.kv_map.Find(key, &value) || space.counters.count(key) ||
+         space.chunked_values.count(key);
+}
+
+bool ShardedKeyValueMap::Insert(const std::string& key,
+                                const std::string& value) {
+  Shard& shard = GetShard(key);
+  std::vector<Waiter> waiters;
+  std::vector<std::shared_ptr<PrefixWatcher>> prefix_watchers;
+  {
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    Space& space = GetSpace(shard, key);
+    std::string_view stored_key;
+    if (!space.kv_map.Insert(key, value, &stored_key)) {
+      return false;
+    }
+    space.key_index.Insert(stored_key);
+    auto waiters_it = shard.waiters.find(key);
+    if (waiters_it != shard.waiters.end()) {
+      waiters = std::move(waiters_it->second);
+      shard.waiters.erase(waiters_it);
+      num_waiters_.fetch_sub(waiters.size(), std::memory_order_relaxed);
+    }
+    for (const auto& watcher : shard.prefix_watchers) {
+      if (key.compare(0, watcher->prefix.size(), watcher->prefix) == 0) {
+        prefix_watchers.push_back(watcher);
+      }
+    }
+  }
+
+  // Wake up only the callers waiting for this key.
+  if (wait_time_ != nullptr && !waiters.empty()) {
+    auto now = std::chrono::steady_clock::now();
+    for (const Waiter& waiter : waiters) {
+      wait_time_->Record(now - waiter.since);
+    }
+  }
+  for (Waiter& waiter : waiters) {
+    waiter.callback(value);
+  }
+  for (const auto& watcher : prefix_watchers) {
+    std::lock_guard<std::mutex> lock(watcher->mutex);
+    if (!watcher->removed) {
+      watcher->callback(key, value);
+    }
+  }
+  return true;
+}
+
+int64_t ShardedKeyValueMap::Add(const std::string& key, int64_t delta) {
+  Shard& shard = GetShard(key);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  return GetSpace(shard, key).counters[key] += delta;
+}
+
+bool ShardedKeyValueMap::InsertChunked(const std::string& key,
+                                       ChunkedValue value) {
+  Shard& shard = GetShard(key);
+  size_t bytes = key.size();
+  for (const std::string& chunk : *value) {
+    bytes += chunk.size();
+  }
+  std::vector<ChunkedWaiter> waiters;
+  {
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    Space& space = GetSpace(shard, key);
+    if (!space.chunked_values.emplace(key, value).second) {
+      return false;
+    }
+    space.chunked_bytes += bytes;
+    auto waiters_it = shard.chunked_waiters.find(key);
+    if (waiters_it != shard.chunked_waiters.end()) {
+      waiters = std::move(waiters_it->second);
+      shard.chunked_waiters.erase(waiters_it);
+    }
+  }
+  for (ChunkedWaiter& waiter : waiters) {
+    waiter.callback(value);
+  }
+  return true;
+}
+
+ShardedKeyValueMap::ChunkedValue ShardedKeyValueMap::FindChunked(
+    const std::string& key) const {
+  Shard& shard = GetShard(key);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  const auto& chunked_values = GetSpace(shard, key).chunked_values;
+  auto it = chunked_values.find(key);
+  return it == chunked_values.end() ? nullptr : it->second;
+}
+
+ShardedKeyValueMap::ChunkedValue ShardedKeyValueMap::WaitForChunked(
+    const std::string& key, std::chrono::steady_clock::time_point deadline,
+    Canceller* canceller) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  ChunkedValue value;
+  WaiterId waiter_id;
+  auto callback = [&](const ChunkedValue& inserted_value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    value = inserted_value;
+    cv.notify_one();
+  };
+  value = FindOrAddChunkedWaiter(key, callback, &waiter_id);
+  if (value != nullptr) {
+    return value;
+  }
+
+  Canceller::Subscription subscription(canceller, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  if (WaitUntil(cv, lock, deadline, canceller,
+                [&]() { return value != nullptr; })) {
+    return value;
+  }
+  lock.unlock();
+  if (RemoveChunkedWaiter(key, waiter_id)) {
+    return nullptr;
+  }
+  // The value was inserted right at the deadline and the callback is
+  // running. Wait for it so that it doesn't outlive this frame.
+  lock.lock();
+  cv.wait(lock, [&]() { return value != nullptr; });
+  return value;
+}
+
+ShardedKeyValueMap::ChunkedValue ShardedKeyValueMap::FindOrAddChunkedWaiter(
+    const std::string& key, ChunkedWaitCallback callback,
+    WaiterId* waiter_id) {
+  Shard& shard = GetShard(key);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  const auto& chunked_values = GetSpace(shard, key).chunked_values;
+  auto it = chunked_values.find(key);
+  if (it != chunked_values.end()) {
+    return it->second;
+  }
+  *waiter_id = next_waiter_id_.fetch_add(1, std::memory_order_relaxed);
+  shard.chunked_waiters[key].push_back({*waiter_id, std::move(callback)});
+  return nullptr;
+}
+
+bool ShardedKeyValueMap::RemoveChunkedWaiter(const std::string& key,
+                                             WaiterId waiter_id) {
+  Shard& shard = GetShard(key);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  auto waiters_it = shard.chunked_waiters.find(key);
+  if (waiters_it == shard.chunked_waiters.end()) {
+    return false;
+  }
+  auto& waiters = waiters_it->second;
+  auto it = std::find_if(waiters.begin(), waiters.end(),
+                         [&](const ChunkedWaiter& waiter) {
+                           return waiter.id == waiter_id;
+                         });
+  if (it == waiters.end()) {
+    return false;
+  }
+  waiters.erase(it);
+  if (waiters.empty()) {
+    shard.chunked_waiters.erase(waiters_it);
+  }
+  return true;
+}
+
+bool ShardedKeyValueMap::Find(const std::string& key,
+                              std::string* value) const {
+  Shard& shard = GetShard(key);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  std::string_view found_value;
+  if (!GetSpace(shard, key).kv_map.Find(key, &found_value)) {
+    return false;
+  }
+  value->assign(found_value);
+  return true;
+}
+
+bool ShardedKeyValueMap::Contains(const std::string& key) const {
+  Shard& shard = GetShard(key);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  std::string_view found_value;
+  return GetSpace(shard, key).kv_map.Find(key, &found_value);
+}
+
+bool ShardedKeyValueMap::WaitFor(const std::string& key,
+                                 std::chrono::steady_clock::time_point deadline,
+                                 std::string* value,
+                                 Canceller* canceller) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool ready = false;
+  WaiterId waiter_id;
+  auto callback = [&](const std::string& inserted_value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    *value = inserted_value;
+    ready = true;
+    cv.notify_one();
+  };
+  if (FindOrAddWaiter(key, value, callback, &waiter_id)) {
+    return true;
+  }
+
+  Canceller::Subscription subscription(canceller, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  if (WaitUntil(cv, lock, deadline, canceller, [&]() { return ready; })) {
+    return true;
+  }
+  lock.unlock();
+  if (RemoveWaiter(key, waiter_id)) {
+    return false;
+  }
+  // The key was inserted right at the deadline and the callback is running.
+  // Wait for it so that it doesn't outlive this frame.
+  lock.lock();
+  cv.wait(lock, [&]() { return ready; });
+  return true;
+}
+
+bool ShardedKeyValueMap::WaitForKeys(
+    const std::vector<std::string>& keys, size_t min_found,
+    std::chrono::steady_clock::time_point deadline,
+    std::vector<std::optional<std::string>>* values,
+    Canceller* canceller) {
+  values->assign(keys.size(), std::nullopt);
+  size_t num_found = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    std::string value;
+    if (Find(keys[i], &value)) {
+      (*values)[i] = std::move(value);
+      ++num_found;
+    }
+  }
+  if (num_found >= min_found) {
+    return true;
+  }
+
+  // Register a waiter for every missing key. `mutex` guards `values`,
+  // `num_found` and `num_called` from here on.
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t num_called = 0;
+  std::vector<std::pair<size_t, WaiterId>> waiters;
+  Canceller::Subscription subscription(canceller, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  for (size_t i = 0; i < keys.size() && num_found < min_found; ++i) {
+    if ((*values)[i]) {
+      continue;
+    }
+    auto callback = [&, i](const std::string& inserted_value) {
+      std::lock_guard<std::mutex> lock(mutex);
+      (*values)[i] = inserted_value;
+      ++num_found;
+      ++num_called;
+      cv.notify_one();
+    };
+    std::string value;
+    WaiterId waiter_id;
+    if (FindOrAddWaiter(keys[i], &value, callback, &waiter_id)) {
+      (*values)[i] = std::move(value);
+      ++num_found;
+    } else {
+      waiters.emplace_back(i, waiter_id);
+    }
+  }
+  WaitUntil(cv, lock, deadline, canceller,
+            [&]() { return num_found >= min_found; });
+
+  // Unregister the remaining waiters, and wait for the callbacks that are
+  // already running so that none of them outlives this frame.
+  lock.unlock();
+  size_t num_removed = 0;
+  for (const auto& waiter : waiters) {
+    if (RemoveWaiter(keys[waiter.first], waiter.second)) {
+      ++num_removed;
+    }
+  }
+  lock.lock();
+  cv.wait(lock,
+          [&]() { return num_called + num_removed == waiters.size(); });
+  return num_found >= min_found;
+}
+
+bool ShardedKeyValueMap::FindOrAddWaiter(const std::string& key,
+                                         std::string* value,
+                                         WaitCallback callback,
+                                         WaiterId* waiter_id) {
+  // Most keys are already set by the time they are read, so try the shared
+  // lock first.
+  if (Find(key, value)) {
+    return true;
+  }
+
+  Shard& shard = GetShard(key);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  // The key may have been inserted after Find() released the lock.
+  std::string_view found_value;
+  if (GetSpace(shard, key).kv_map.Find(key, &found_value)) {
+    value->assign(found_value);
+    return true;
+  }
+  *waiter_id = next_waiter_id_.fetch_add(1, std::memory_order_relaxed);
+  // Waiters are the slow path, so only they pay for reading the clock.
+  auto since = wait_time_ != nullptr ? std::chrono::steady_clock::now()
+                                     : std::chrono::steady_clock::time_point();
+  shard.waiters[key].push_back({*waiter_id, std::move(callback), since});
+  num_waiters_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+bool ShardedKeyValueMap::RemoveWaiter(const std::string& key,
+                                      WaiterId waiter_id) {
+  Shard& shard = GetShard(key);
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  auto waiters_it = shard.waiters.find(key);
+  if (waiters_it == shard.waiters.end()) {
+    return false;
+  }
+  auto& waiters = waiters_it->second;
+  auto it = std::find_if(waiters.begin(), waiters.end(),
+                         [&](const Waiter& waiter) {
+                           return waiter.id == waiter_id;
+                         });
+  if (it == waiters.end()) {
+    return false;
+  }
+  waiters.erase(it);
+  num_waiters_.fetch_sub(1, std::memory_order_relaxed);
+  if (waiters.empty()) {
+    shard.waiters.erase(waiters_it);
+  }
+  return true;
+}
+
+std::shared_ptr<ShardedKeyValueMap::PrefixWatcher>
+ShardedKeyValueMap::NewPrefixWatcher(const std::string& prefix,
+                                     WatchCallback callback) {
+  auto watcher = std::make_shared<PrefixWatcher>();
+  watcher->id = next_waiter_id_.fetch_add(1, std::memory_order_relaxed);
+  watcher->prefix = prefix;
+  watcher->callback = std::move(callback);
+  return watcher;
+}
+
+void ShardedKeyValueMap::RegisterPrefixWatcher(
+    const std::shared_ptr<PrefixWatcher>& watcher, WatchSnapshot* snapshot) {
+  snapshot->prefix_ = watcher->prefix;
+  snapshot->shards_.assign(num_shards_, {});
+  // Recording the size of a shard's spaces and registering the watcher on it
+  // happen under the same lock, so every key is either in the snapshot or
+  // reported by Insert(), never both.
+  for (size_t i = 0; i < num_shards_; ++i) {
+    Shard& shard = shards_[i];
+    auto& ranges = snapshot->shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.space.kv_map.size() > 0) {
+      ranges.push_back({"", shard.space.id, shard.space.kv_map.size()});
+    }
+    for (const auto& [name, space] : shard.namespaces) {
+      if (space->kv_map.size() > 0) {
+        ranges.push_back({name, space->id, space->kv_map.size()});
+      }
+    }
+    shard.prefix_watchers.push_back(watcher);
+  }
+}
+
+ShardedKeyValueMap::WaiterId ShardedKeyValueMap::AddPrefixWatcher(
+    const std::string& prefix, WatchCallback callback) {
+  auto watcher = NewPrefixWatcher(prefix, std::move(callback));
+  // Insert() reports its keys once the ones in the snapshot are reported.
+  std::lock_guard<std::mutex> watcher_lock(watcher->mutex);
+  WatchSnapshot snapshot;
+  RegisterPrefixWatcher(watcher, &snapshot);
+  std::vector<std::pair<std::string, std::string>> key_values;
+  while (ReadWatchSnapshot(&snapshot, kWatchPageBytes, &key_values)) {
+    for (const auto& [key, value] : key_values) {
+      watcher->callback(key, value);
+    }
+    key_values.clear();
+  }
+  return watcher->id;
+}
+
+ShardedKeyValueMap::WaiterId ShardedKeyValueMap::AddPrefixWatcher(
+    const std::string& prefix, WatchCallback callback,
+    WatchSnapshot* snapshot) {
+  auto watcher = NewPrefixWatcher(prefix, std::move(callback));
+  RegisterPrefixWatcher(watcher, snapshot);
+  return watcher->id;
+}
+
+bool ShardedKeyValueMap::ReadWatchSnapshot(
+    WatchSnapshot* snapshot, size_t max_bytes,
+    std::vector<std::pair<std::string, std::string>>* key_values) const {
+  const std::string& prefix = snapshot->prefix_;
+  size_t num_read = key_values->size();
+  size_t bytes = 0;
+  // A page holds at least one key, however large.
+  auto full = [&]() {
+    return bytes >= max_bytes && key_values->size() > num_read;
+  };
+  while (!full() && snapshot->shard_ < snapshot->shards_.size()) {
+    const auto& ranges = snapshot->shards_[snapshot->shard_];
+    if (snapshot->range_ == ranges.size()) {
+      ++snapshot->shard_;
+      snapshot->range_ = 0;
+      continue;
+    }
+    const WatchSnapshot::SpaceRange& range = ranges[snapshot->range_];
+    const Shard& shard = shards_[snapshot->shard_];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const Space* space = &shard.space;
+    if (range.space_id != 0) {
+      auto it = shard.namespaces.find(range.name);
+      space = it != shard.namespaces.end() && it->second->id == range.space_id
+                  ? it->second.get()
+                  : nullptr;
+    }
+    size_t& position = snapshot->position_;
+    if (space != nullptr) {
+      // Hold the lock for a bounded number of entries, however few of them
+      // are under the prefix.
+      size_t end = std::min(range.end, position + kWatchScanEntries);
+      space->kv_map.ForEachInRange(
+          position, end, [&](std::string_view key, std::string_view value) {
+            if (full()) {
+              return;
+            }
+            ++position;
+            if (key.substr(0, prefix.size()) == prefix) {
+              key_values->emplace_back(key, value);
+              bytes += key.size() + value.size();
+            }
+          });
+    }
+    if (space == nullptr || position == range.end) {
+      ++snapshot->range_;
+      position = 0;
+    }
+  }
+  return key_values->size() > num_read;
+}
+
+void ShardedKeyValueMap::RemovePrefixWatcher(WaiterId watcher_id) {
+  std::shared_ptr<PrefixWatcher> watcher;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    Shard& shard = shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = std::find_if(
+        shard.prefix_watchers.begin(), shard.prefix_watchers.end(),
+        [&](const auto& watcher) { return watcher->id == watcher_id; });
+    if (it != shard.prefix_watchers.end()) {
+      watcher = std::move(*it);
+      shard.prefix_watchers.erase(it);
+    }
+  }
+  if (watcher) {
+    // Wait for a callback that Insert() may be running right now.
+    std::lock_guard<std::mutex> lock(watcher->mutex);
+    watcher->removed = true;
+  }
+}
+
+bool ShardedKeyValueMap::OpenNamespace(const std::string& name,
+                                       std::chrono::milliseconds ttl) {
+  std::lock_guard<std::mutex> namespaces_lock(namespaces_mutex_);
+  if (!namespaces_.emplace(name, ttl).second) {
+    return false;
+  }
+  uint64_t id = next_namespace_id_++;
+  std::string prefix = name + kNamespaceSeparator;
+  auto has_prefix = [&](std::string_view key) {
+    return key.compare(0, prefix.size(), prefix) == 0;
+  };
+  for (size_t i = 0; i < num_shards_; ++i) {
+    auto space = std::make_unique<Space>();
+    space->id = id;
+    Shard& shard = shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    // Values are found in order, while counters and chunked values, of
+    // which there are few, are scanned.
+    shard.space.key_index.ScanFrom(prefix, [&](std::string_view key) {
+      space->shadows = has_prefix(key);
+      return false;
+    });
+    for (const auto& [key, counter] : shard.space.counters) {
+      space->shadows = space->shadows || has_prefix(key);
+    }
+    for (const auto& [key, value] : shard.space.chunked_values) {
+      space->shadows = space->shadows || has_prefix(key);
+    }
+    shard.namespaces.emplace(name, std::move(space));
+  }
+  return true;
+}
+
+bool ShardedKeyValueMap::DropNamespace(const std::string& name) {
+  std::lock_guard<std::mutex> namespaces_lock(namespaces_mutex_);
+  if (namespaces_.erase(name) == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::unique_ptr<Space> space;
+    {
+      std::unique_lock<std::shared_mutex> lock(shards_[i].mutex);
+      auto it = shards_[i].namespaces.find(name);
+      space = std::move(it->second);
+      shards_[i].namespaces.erase(it);
+    }
+    // Freed here, outside of the shard lock.
+  }
+  return true;
+}
+
+std::map<std::string, std::chrono::milliseconds>
+ShardedKeyValueMap::namespaces() const {
+  std::lock_guard<std::mutex> lock(namespaces_mutex_);
+  return namespaces_;
+}
+
+void ShardedKeyValueMap::ForEach(const WatchCallback& callback) const {
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i], [&](const Space& space) {
+      space.kv_map.ForEach([&](std::string_view key, std::string_view value) {
+        callback(std::string(key), std::string(value));
+      });
+    });
+  }
+}
+
+void ShardedKeyValueMap::ForEachChunked(
+    const std::function<void(const std::string&, const ChunkedValue&)>&
+        callback) const {
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i], [&](const Space& space) {
+      for (const auto& [key, value] : space.chunked_values) {
+        callback(key, value);
+      }
+    });
+  }
+}
+
+std::vector<std::string> ShardedKeyValueMap::ListKeys(
+    const std::string& prefix, const std::string& start_after,
+    size_t limit) const {
+  std::vector<std::string> keys;
+  if (limit == 0) {
+    return keys;
+  }
+  // The lowest key after `start_after` is `start_after` followed by a zero.
+  std::string start = prefix;
+  if (start_after >= prefix) {
+    start = start_after;
+    start.push_back('\0');
+  }
+  // Every space yields its lowest keys in order, which are merged with the
+  // lowest keys of the spaces before it. Once `limit` keys are found, the
+  // other spaces only need to be scanned up to the highest of them.
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i], [&](const Space& space) {
+      size_t merged = keys.size();
+      space.key_index.ScanFrom(start, [&](std::string_view key) {
+        if (key.substr(0, prefix.size()) != prefix ||
+            (merged == limit && key >= keys[limit - 1])) {
+          return false;
+        }
+        keys.emplace_back(key);
+        return keys.size() - merged < limit;
+      });
+      std::inplace_merge(keys.begin(), keys.begin() + merged, keys.end());
+      if (keys.size() > limit) {
+        keys.resize(limit);
+      }
+    });
+  }
+  return keys;
+}
+
+size_t ShardedKeyValueMap::size() const {
+  size_t size = 0;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i],
+                 [&](const Space& space) { size += space.kv_map.size(); });
+  }
+  return size;
+}
+
+size_t ShardedKeyValueMap::memory_usage() const {
+  size_t bytes = 0;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i], [&](const Space& space) {
+      bytes += space.kv_map.memory_usage() + space.key_index.memory_usage();
+    });
+  }
+  return bytes;
+}
+
+size_t ShardedKeyValueMap::data_bytes() const {
+  size_t bytes = 0;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+    ForEachSpace(shards_[i], [&](const Space& space) {
+      bytes += space.kv_map.data_bytes() + space.chunked_bytes;
+    });
+  }
+  return bytes;
+}
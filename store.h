@@ -0,0 +1,363 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_STORE_H
+#define KVS_STORE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena_map.h"
+#include "key_index.h"
+#include "metrics.h"
+
+// A concurrent write-once hash map split into independently locked shards.
+// Operations on keys that hash to different shards never contend on the same
+// lock, and readers of the same shard share a reader lock. Each shard also
+// keeps its keys in order, so that the keys under a prefix can be listed
+// without visiting the others, while lookups only use the hash tables.
+//
+// Keys named "<namespace>/..." after an open namespace are stored apart from
+// the others, with the values, counters and chunked values of each namespace
+// in arenas and tables of their own in every shard. Dropping a namespace
+// unlinks them shard by shard and frees them once the shard is unlocked,
+// without visiting its keys, so a long-lived map can reclaim the keys of a
+// job when it is done with them. Keys outside of the namespaces stay for the
+// life of the map, including those inserted under the name of a namespace
+// before it was opened.
+class ShardedKeyValueMap {
+ public:
+  // Called once with the value of the key a waiter is registered for.
+  using WaitCallback = std::function<void(const std::string& value)>;
+  using WaiterId = uint64_t;
+  // Called with every key/value pair under the prefix a watcher is added for.
+  using WatchCallback =
+      std::function<void(const std::string& key, const std::string& value)>;
+  // A large value stored as a list of chunks, so that it is never held in one
+  // contiguous buffer.
+  using ChunkedValue = std::shared_ptr<const std::vector<std::string>>;
+
+  // If `wait_time` is not null, it records how long every waiter registered
+  // by FindOrAddWaiter() waits until its key is inserted.
+  explicit ShardedKeyValueMap(size_t num_shards,
+                              Histogram* wait_time = nullptr);
+  ShardedKeyValueMap(const ShardedKeyValueMap&) = delete;
+  ShardedKeyValueMap(ShardedKeyValueMap&&) = delete;
+  ShardedKeyValueMap& operator=(const ShardedKeyValueMap&) = delete;
+  ShardedKeyValueMap&& operator=(ShardedKeyValueMap&&) = delete;
+
+  // Inserts the key/value pair and wakes up the callers waiting for the key.
+  // Returns false without modifying the map if the key already exists.
+  bool Insert(const std::string& key, const std::string& value);
+
+  // Atomically adds `delta` to the counter `key` and returns the new value.
+  // Counters start at zero and live in their own key space, apart from the
+  // write-once values.
+  int64_t Add(const std::string& key, int64_t delta);
+
+  // Inserts a chunked value and wakes up the callers waiting for it. Chunked
+  // values live in their own key space, apart from the values set with
+  // Insert(). Returns false if the key already has a chunked value.
+  bool InsertChunked(const std::string& key, ChunkedValue value);
+
+  // Returns the chunked value for the key, or nullptr if it has none.
+  ChunkedValue FindChunked(const std::string& key) const;
+
+  // Tells the callers blocked in the calls below to give up, such as when
+  // their RPC is cancelled. Cancel() wakes them up right away.
+  class Canceller {
+   public:
+    Canceller() = default;
+    virtual ~Canceller() = default;
+    Canceller(const Canceller&) = delete;
+    Canceller& operator=(const Canceller&) = delete;
+
+    void Cancel();
+    bool cancelled() const { return cancelled_.load(); }
+
+    // Has Cancel() call `wake_up` as long as it lives, for a caller blocked
+    // on a condition variable of its own. `wake_up` must notify the caller
+    // under the caller's lock, which must not be held while the subscription
+    // is created or destroyed. Does nothing if `canceller` is null.
+    class Subscription {
+     public:
+      Subscription(Canceller* canceller, std::function<void()> wake_up);
+      ~Subscription();
+      Subscription(const Subscription&) = delete;
+      Subscription& operator=(const Subscription&) = delete;
+
+     private:
+      Canceller* canceller_;
+      uint64_t id_ = 0;
+    };
+
+   protected:
+    // Called whenever a caller is about to block with the canceller, with no
+    // lock held, such as to only hook it to an RPC when it is needed.
+    virtual void OnWait() {}
+
+   private:
+    std::atomic<bool> cancelled_{false};
+    // Guards `wake_ups_`, and keeps them from running once unsubscribed.
+    std::mutex mutex_;
+    std::map<uint64_t, std::function<void()>> wake_ups_;
+    uint64_t next_id_ = 0;
+  };
+
+  // Blocks until the key has a chunked value, `deadline` passes or the caller
+  // is cancelled. Returns the value, or nullptr otherwise.
+  ChunkedValue WaitForChunked(const std::string& key,
+                              std::chrono::steady_clock::time_point deadline,
+                              Canceller* canceller = nullptr);
+
+  // Like FindOrAddWaiter(), for a chunked value. Returns the value if the key
+  // has one. Otherwise registers `callback` to be called with the value when
+  // it is inserted, stores a handle for RemoveChunkedWaiter() in `waiter_id`
+  // and returns nullptr.
+  using ChunkedWaitCallback = std::function<void(const ChunkedValue& value)>;
+  ChunkedValue FindOrAddChunkedWaiter(const std::string& key,
+                                      ChunkedWaitCallback callback,
+                                      WaiterId* waiter_id);
+
+  // Like RemoveWaiter(), for a waiter added by FindOrAddChunkedWaiter().
+  bool RemoveChunkedWaiter(const std::string& key, WaiterId waiter_id);
+
+  // Copies the value for the key to `value` and returns true if the key
+  // exists.
+  bool Find(const std::string& key, std::string* value) const;
+
+  // Like Find(), without copying the value.
+  bool Contains(const std::string& key) const;
+
+  // Like Find(), but blocks until the key is inserted, `deadline` passes or
+  // the caller is cancelled.
+  bool WaitFor(const std::string& key,
+               std::chrono::steady_clock::time_point deadline,
+               std::string* value, Canceller* canceller = nullptr);
+
+  // Blocks until at least `min_found` of `keys` are inserted, `deadline`
+  // passes or the caller is cancelled. `values` receives one entry per key:
+  // its value, or std::nullopt if the key is not set. Returns true if at least
+  // `min_found` keys were found.
+  bool WaitForKeys(const std::vector<std::string>& keys, size_t min_found,
+                   std::chrono::steady_clock::time_point deadline,
+                   std::vector<std::optional<std::string>>* values,
+                   Canceller* canceller = nullptr);
+
+  // Copies the value for the key to `value` and returns true if the key
+  // exists. Otherwise registers `callback` to be called when the key is
+  // inserted, stores a handle for RemoveWaiter() in `waiter_id` and returns
+  // false. The callback runs on the inserting thread after the shard lock has
+  // been released.
+  bool FindOrAddWaiter(const std::string& key, std::string* value,
+                       WaitCallback callback, WaiterId* waiter_id);
+
+  // Unregisters a waiter added by FindOrAddWaiter(). Returns false if the key
+  // has been inserted and the waiter's callback has been or is being called.
+  bool RemoveWaiter(const std::string& key, WaiterId waiter_id);
+
+  // The keys under a prefix that were in the map when a watcher was added, to
+  // be read a page at a time with ReadWatchSnapshot().
+  class WatchSnapshot {
+   private:
+    friend class ShardedKeyValueMap;
+
+    // The entries of a space that were inserted before the watcher was added.
+    struct SpaceRange {
+      std::string name;
+      uint64_t space_id;
+      size_t end;
+    };
+
+    std::string prefix_;
+    std::vector<std::vector<SpaceRange>> shards_;
+    // The next entry to read.
+    size_t shard_ = 0;
+    size_t range_ = 0;
+    size_t position_ = 0;
+  };
+
+  // Calls `callback` for every key starting with `prefix` that is already in
+  // the map, then for every such key inserted until RemovePrefixWatcher(). Each
+  // key is reported exactly once. The callback must not call back into the
+  // map, and calls for keys of different shards may run concurrently.
+  WaiterId AddPrefixWatcher(const std::string& prefix, WatchCallback callback);
+
+  // Like AddPrefixWatcher(), but only calls `callback` for the keys inserted
+  // from now on, and leaves the keys already in the map in `snapshot` instead.
+  // Each shard is locked only to register the watcher, so adding a watcher
+  // takes the same time however many keys there are.
+  WaiterId AddPrefixWatcher(const std::string& prefix, WatchCallback callback,
+                            WatchSnapshot* snapshot);
+
+  // Appends the next keys of `snapshot` and their values to `key_values`:
+  // at least one, and more until they take `max_bytes`. Shards are read
+  // under their reader lock, a few entries at a time. Keys of a namespace
+  // that was dropped meanwhile are left out. Returns false once there are no
+  // keys left.
+  bool ReadWatchSnapshot(
+      WatchSnapshot* snapshot, size_t max_bytes,
+      std::vector<std::pair<std::string, std::string>>* key_values) const;
+
+  // Removes a watcher added by AddPrefixWatcher(). Its callback is not running
+  // and won't be called anymore once this returns.
+  void RemovePrefixWatcher(WaiterId watcher_id);
+
+  // Calls `callback` for every key/value pair, one shard at a time under its
+  // reader lock. Keys inserted meanwhile may or may not be visited.
+  void ForEach(const WatchCallback& callback) const;
+
+  // Like ForEach(), for the chunked values.
+  void ForEachChunked(
+      const std::function<void(const std::string&, const ChunkedValue&)>&
+          callback) const;
+
+  // Returns up to `limit` keys that start with `prefix` and sort after
+  // `start_after`, in ascending order, so that a listing can go on from the
+  // last key it got. Only the keys set with Insert() are listed. Shards are
+  // read one at a time, so keys inserted meanwhile may or may not be listed.
+  std::vector<std::string> ListKeys(const std::string& prefix,
+                                    const std::string& start_after,
+                                    size_t limit) const;
+
+  static constexpr char kNamespaceSeparator = '/';
+
+  // Opens the namespace `name`, under which keys inserted from now on can be
+  // dropped together, and records `ttl` with it for whoever expires it.
+  // Returns false if the namespace is already open. Keys that were inserted
+  // under the name before are not moved into it, and are not dropped with it,
+  // but they are still found and can't be inserted again.
+  bool OpenNamespace(const std::string& name, std::chrono::milliseconds ttl);
+
+  // Removes every key of the namespace and closes it. Shards are locked one
+  // at a time and only to unlink the namespace, so callers are not held up
+  // by the size of the namespace. Callers waiting for keys of the namespace
+  // keep waiting, until the keys are inserted again outside of it. Returns
+  // false if the namespace is not open.
+  bool DropNamespace(const std::string& name);
+
+  // Returns the open namespaces and their TTLs.
+  std::map<std::string, std::chrono::milliseconds> namespaces() const;
+
+  size_t num_shards() const { return num_shards_; }
+
+  // Returns the number of keys in the map.
+  size_t size() const;
+
+  // Returns the bytes held by the keys and values, and by their index.
+  size_t memory_usage() const;
+
+  // Returns the size of the keys and values, chunked values included.
+  size_t data_bytes() const;
+
+  // Returns the number of waiters registered by FindOrAddWaiter(), and so of
+  // the callers blocked in WaitFor() and WaitForKeys(), that are still
+  // waiting for their key.
+  int64_t num_waiters() const {
+    return num_waiters_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // A watcher shared by all of the shards. `mutex` serializes its callback
+  // with RemovePrefixWatcher().
+  struct PrefixWatcher {
+    WaiterId id;
+    std::string prefix;
+    WatchCallback callback;
+    std::mutex mutex;
+    bool removed = false;
+  };
+
+  struct Waiter {
+    WaiterId id;
+    WaitCallback callback;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  struct ChunkedWaiter {
+    WaiterId id;
+    ChunkedWaitCallback callback;
+  };
+
+  // The keys of a shard that are in one namespace, or in none.
+  struct Space {
+    // Tells apart the namespaces opened under the same name, and is zero
+    // outside of the namespaces.
+    uint64_t id = 0;
+    // Whether the shard had keys under the name of the namespace when it was
+    // opened, which lookups then find outside of it.
+    bool shadows = false;
+    ArenaHashMap kv_map;
+    // The keys of `kv_map` in order, for ListKeys().
+    KeyIndex key_index;
+    std::unordered_map<std::string, int64_t> counters;
+    std::unordered_map<std::string, ChunkedValue> chunked_values;
+    size_t chunked_bytes = 0;
+  };
+
+  // Keep every shard on its own cache line so that shards don't false-share.
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mutex;
+    // The keys outside of the namespaces.
+    Space space;
+    // The part of every open namespace that falls in this shard.
+    std::unordered_map<std::string, std::unique_ptr<Space>> namespaces;
+    // Waiters registered per key, woken up by Insert() for that key only.
+    std::unordered_map<std::string, std::vector<Waiter>> waiters;
+    // Likewise, woken up by InsertChunked().
+    std::unordered_map<std::string, std::vector<ChunkedWaiter>>
+        chunked_waiters;
+    // Prefix watchers, notified by Insert() for matching keys.
+    std::vector<std::shared_ptr<PrefixWatcher>> prefix_watchers;
+  };
+
+  Shard& GetShard(const std::string& key) const;
+
+  std::shared_ptr<PrefixWatcher> NewPrefixWatcher(const std::string& prefix,
+                                                  WatchCallback callback);
+  void RegisterPrefixWatcher(const std::shared_ptr<PrefixWatcher>& watcher,
+                             WatchSnapshot* snapshot);
+
+  // Returns the space of `key` in `shard`. The shard must be locked.
+  static Space& GetSpace(Shard& shard, const std::string& key);
+
+  // Returns whether `space` has a value, counter or chunked value for `key`.
+  static bool InSpace(const Space& space, const std::string& key);
+
+  // Calls `callback` for every space of `shard`. The shard must be locked.
+  template <typename Callback>
+  static void ForEachSpace(const Shard& shard, const Callback& callback) {
+    callback(shard.space);
+    for (const auto& [name, space] : shard.namespaces) {
+      callback(*space);
+    }
+  }
+
+  size_t num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<WaiterId> next_waiter_id_{1};
+  std::atomic<int64_t> num_waiters_{0};
+  Histogram* wait_time_;
+  // Serializes opening and dropping namespaces, and guards `namespaces_` and
+  // `next_namespace_id_`.
+  mutable std::mutex namespaces_mutex_;
+  std::map<std::string, std::chrono::milliseconds> namespaces_;
+  uint64_t next_namespace_id_ = 1;
+};
+
+#endif  // KVS_STORE_H
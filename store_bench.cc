@@ -0,0 +1,224 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Microbenchmarks of the server's store, run in-process by kvs_bench. They
+// compare the arena-backed map that stores the values with the
+// std::unordered_map it replaced, for many small keys and values, and measure
+// ShardedKeyValueMap under concurrent readers and writers and when listing the
+// keys under a prefix.
+
+#include <benchmark/benchmark.h>
+#include <malloc.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena_map.h"
+#include "store.h"
+
+namespace {
+
+// Keys and values of 20 to 60 bytes, like the addresses and ranks that jobs
+// publish.
+std::vector<std::string> MakeStrings(int n, const char* prefix) {
+  std::vector<std::string> strings;
+  strings.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    std::string s = std::string(prefix) + std::to_string(i);
+    s.resize(20 + i % 41, '.');
+    strings.push_back(std::move(s));
+  }
+  return strings;
+}
+
+size_t HeapBytesInUse() { return mallinfo2().uordblks; }
+
+class StdMap {
+ public:
+  bool Insert(const std::string& key, const std::string& value) {
+    return map_.emplace(key, value).second;
+  }
+  bool Find(const std::string& key, std::string_view* value) const {
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      return false;
+    }
+    *value = it->second;
+    return true;
+  }
+
+ private:
+  std::unordered_map<std::string, std::string> map_;
+};
+
+class ArenaMap {
+ public:
+  bool Insert(const std::string& key, const std::string& value) {
+    return map_.Insert(key, value);
+  }
+  bool Find(const std::string& key, std::string_view* value) const {
+    return map_.Find(key, value);
+  }
+
+ private:
+  ArenaHashMap map_;
+};
+
+template <typename Map>
+void BM_Insert(benchmark::State& state) {
+  const int n = state.range(0);
+  std::vector<std::string> keys = MakeStrings(n, "key/");
+  std::vector<std::string> values = MakeStrings(n, "value/");
+  size_t bytes_per_entry = 0;
+  for (auto _ : state) {
+    size_t heap_before = HeapBytesInUse();
+    auto map = std::make_unique<Map>();
+    for (int i = 0; i < n; ++i) {
+      map->Insert(keys[i], values[i]);
+    }
+    bytes_per_entry = (HeapBytesInUse() - heap_before) / n;
+    state.PauseTiming();
+    map.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_entry"] = bytes_per_entry;
+}
+
+template <typename Map>
+void BM_Find(benchmark::State& state) {
+  const int n = state.range(0);
+  std::vector<std::string> keys = MakeStrings(n, "key/");
+  std::vector<std::string> values = MakeStrings(n, "value/");
+  Map map;
+  for (int i = 0; i < n; ++i) {
+    map.Insert(keys[i], values[i]);
+  }
+  // Look the keys up in a scattered order, as independent clients would.
+  int i = 0;
+  for (auto _ : state) {
+    std::string_view value;
+    benchmark::DoNotOptimize(map.Find(keys[i], &value));
+    i = (i + 7919) % n;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_Insert, StdMap)
+    ->Arg(1 << 20)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Insert, ArenaMap)
+    ->Arg(1 << 20)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Find, StdMap)->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_Find, ArenaMap)->Arg(1 << 10)->Arg(1 << 20);
+
+// Concurrent inserts of distinct keys, which only contend when they hash to
+// the same shard.
+void BM_ShardedInsert(benchmark::State& state) {
+  static ShardedKeyValueMap* kv_map = nullptr;
+  if (state.thread_index() == 0) {
+    kv_map = new ShardedKeyValueMap(/*num_shards=*/64);
+  }
+  std::string prefix = std::to_string(state.thread_index()) + "/key/";
+  int i = 0;
+  for (auto _ : state) {
+    kv_map->Insert(prefix + std::to_string(i++), "value");
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    delete kv_map;
+  }
+}
+
+// Concurrent lookups of keys that are all set, the common case of GetValue().
+void BM_ShardedFind(benchmark::State& state) {
+  constexpr int kNumKeys = 1 << 16;
+  static ShardedKeyValueMap* kv_map = nullptr;
+  static std::vector<std::string>* keys = nullptr;
+  if (state.thread_index() == 0) {
+    kv_map = new ShardedKeyValueMap(/*num_shards=*/64);
+    keys = new std::vector<std::string>(MakeStrings(kNumKeys, "key/"));
+    for (const std::string& key : *keys) {
+      kv_map->Insert(key, key);
+    }
+  }
+  int i = state.thread_index() * 7919 % kNumKeys;
+  std::string value;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(kv_map->Find((*keys)[i], &value));
+    i = (i + 7919) % kNumKeys;
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    delete kv_map;
+    delete keys;
+  }
+}
+
+// A map of kNumListedJobs jobs that published the same number of keys each.
+constexpr int kNumListedJobs = 16;
+
+std::unique_ptr<ShardedKeyValueMap> MakeJobMap(int num_keys) {
+  auto kv_map = std::make_unique<ShardedKeyValueMap>(/*num_shards=*/64);
+  for (int job = 0; job < kNumListedJobs; ++job) {
+    std::string prefix = "job" + std::to_string(job) + "/";
+    for (const std::string& key :
+         MakeStrings(num_keys / kNumListedJobs, prefix.c_str())) {
+      kv_map->Insert(key, key);
+    }
+  }
+  return kv_map;
+}
+
+// Lists the keys of one job in the pages that ListKeys() streams.
+void BM_ShardedListKeys(benchmark::State& state) {
+  std::unique_ptr<ShardedKeyValueMap> kv_map = MakeJobMap(state.range(0));
+  const std::string prefix = "job7/";
+  int64_t num_listed = 0;
+  for (auto _ : state) {
+    std::string start_after;
+    for (;;) {
+      std::vector<std::string> keys =
+          kv_map->ListKeys(prefix, start_after, /*limit=*/1000);
+      num_listed += keys.size();
+      if (keys.size() < 1000) {
+        break;
+      }
+      start_after = std::move(keys.back());
+    }
+  }
+  state.SetItemsProcessed(num_listed);
+}
+
+// The same listing by visiting every key and sorting the matching ones, as
+// it would be done without the ordered index.
+void BM_ShardedForEachPrefix(benchmark::State& state) {
+  std::unique_ptr<ShardedKeyValueMap> kv_map = MakeJobMap(state.range(0));
+  const std::string prefix = "job7/";
+  int64_t num_listed = 0;
+  for (auto _ : state) {
+    std::vector<std::string> keys;
+    kv_map->ForEach([&](const std::string& key, const std::string& value) {
+      if (key.compare(0, prefix.size(), prefix) == 0) {
+        keys.push_back(key);
+      }
+    });
+    std::sort(keys.begin(), keys.end());
+    num_listed += keys.size();
+  }
+  state.SetItemsProcessed(num_listed);
+}
+
+BENCHMARK(BM_ShardedInsert)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_ShardedFind)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_ShardedListKeys)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(BM_ShardedForEachPrefix)->Arg(1 << 16)->Arg(1 << 20);
+
+}  // namespace
@@ -0,0 +1,465 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "store.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+TEST(ShardedKeyValueMapTest, InsertOnce) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  std::string value;
+
+  EXPECT_FALSE(kv_map.Find("key1", &value));
+  EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+  EXPECT_FALSE(kv_map.Insert("key1", "value2"));
+  EXPECT_TRUE(kv_map.Find("key1", &value));
+  EXPECT_EQ(value, "value1");
+  EXPECT_EQ(kv_map.size(), 1);
+}
+
+TEST(ShardedKeyValueMapTest, ZeroShardsFallsBackToOne) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/0);
+  EXPECT_EQ(kv_map.num_shards(), 1);
+  EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+}
+
+TEST(ShardedKeyValueMapTest, ConcurrentInsertsOfSameKeySucceedOnce) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/16);
+  constexpr int kNumThreads = 8;
+  constexpr int kNumKeys = 1000;
+  std::atomic<int> num_inserted(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kNumKeys; ++i) {
+        if (kv_map.Insert("key" + std::to_string(i), std::to_string(t))) {
+          ++num_inserted;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_inserted, kNumKeys);
+  EXPECT_EQ(kv_map.size(), kNumKeys);
+}
+
+TEST(ShardedKeyValueMapTest, WaitForWakesUpOnInsert) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  std::string value;
+  std::thread waiter([&]() {
+    EXPECT_TRUE(kv_map.WaitFor(
+        "key1", std::chrono::steady_clock::now() + std::chrono::seconds(10),
+        &value));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+  waiter.join();
+  EXPECT_EQ(value, "value1");
+}
+
+TEST(ShardedKeyValueMapTest, WaitForTimesOut) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  std::string value;
+  EXPECT_FALSE(kv_map.WaitFor(
+      "key1",
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(10),
+      &value));
+  // The timed out waiter must not be woken up by a later insert.
+  EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+}
+
+TEST(ShardedKeyValueMapTest, WaitForStopsWhenCancelled) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  ShardedKeyValueMap::Canceller canceller;
+  std::string value;
+  std::vector<std::optional<std::string>> values;
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::seconds(10);
+  std::thread waiter([&]() {
+    EXPECT_FALSE(kv_map.WaitFor("key1", deadline, &value, &canceller));
+  });
+  std::thread keys_waiter([&]() {
+    EXPECT_FALSE(kv_map.WaitForKeys({"key1", "key2"}, /*min_found=*/2,
+                                    deadline, &values, &canceller));
+  });
+  std::thread chunked_waiter([&]() {
+    EXPECT_EQ(kv_map.WaitForChunked("key1", deadline, &canceller), nullptr);
+  });
+  while (kv_map.num_waiters() < 3) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  canceller.Cancel();
+  waiter.join();
+  keys_waiter.join();
+  chunked_waiter.join();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  EXPECT_EQ(kv_map.num_waiters(), 0);
+  // A cancelled canceller doesn't let callers wait anymore.
+  EXPECT_FALSE(kv_map.WaitFor("key1", deadline, &value, &canceller));
+}
+
+TEST(ShardedKeyValueMapTest, WaitForKeys) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  std::vector<std::string> keys = {"key1", "key2", "key3"};
+  std::vector<std::optional<std::string>> values;
+  EXPECT_TRUE(kv_map.Insert("key2", "value2"));
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  EXPECT_TRUE(kv_map.WaitForKeys(keys, /*min_found=*/1, deadline, &values));
+  EXPECT_EQ(values[0], std::nullopt);
+  EXPECT_EQ(values[1], "value2");
+  EXPECT_EQ(values[2], std::nullopt);
+
+  std::thread setter([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_TRUE(kv_map.Insert("key3", "value3"));
+    EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+  });
+  EXPECT_TRUE(kv_map.WaitForKeys(keys, keys.size(), deadline, &values));
+  setter.join();
+  EXPECT_EQ(values[0], "value1");
+  EXPECT_EQ(values[1], "value2");
+  EXPECT_EQ(values[2], "value3");
+}
+
+TEST(ShardedKeyValueMapTest, WaitForKeysTimesOut) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  std::vector<std::string> keys = {"key1", "key2"};
+  std::vector<std::optional<std::string>> values;
+  EXPECT_TRUE(kv_map.Insert("key1", "value1"));
+  EXPECT_FALSE(kv_map.WaitForKeys(
+      keys, keys.size(),
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(10),
+      &values));
+  EXPECT_EQ(values[0], "value1");
+  EXPECT_EQ(values[1], std::nullopt);
+  EXPECT_TRUE(kv_map.Insert("key2", "value2"));
+}
+
+TEST(ShardedKeyValueMapTest, PrefixWatcherReportsEachKeyOnce) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/8);
+  constexpr int kNumKeys = 1000;
+  std::mutex mutex;
+  std::map<std::string, int> num_reports;
+  auto callback = [&](const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(key.compare(0, 4, "job/"), 0);
+    EXPECT_EQ(value, key);
+    ++num_reports[key];
+  };
+
+  // Half of the keys are set before the watcher is added, and the other half
+  // while it is being added.
+  for (int i = 0; i < kNumKeys / 2; ++i) {
+    std::string key = "job/" + std::to_string(i);
+    EXPECT_TRUE(kv_map.Insert(key, key));
+    EXPECT_TRUE(kv_map.Insert("other/" + std::to_string(i), "other"));
+  }
+  std::thread setter([&]() {
+    for (int i = kNumKeys / 2; i < kNumKeys; ++i) {
+      std::string key = "job/" + std::to_string(i);
+      EXPECT_TRUE(kv_map.Insert(key, key));
+    }
+  });
+  auto watcher_id = kv_map.AddPrefixWatcher("job/", callback);
+  setter.join();
+  kv_map.RemovePrefixWatcher(watcher_id);
+  EXPECT_TRUE(kv_map.Insert("job/late", "job/late"));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  EXPECT_EQ(num_reports.size(), kNumKeys);
+  for (const auto& num_report : num_reports) {
+    EXPECT_EQ(num_report.second, 1) << num_report.first;
+  }
+}
+
+TEST(ShardedKeyValueMapTest, WatchSnapshotPages) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  constexpr int kNumKeys = 2000;
+  std::mutex mutex;
+  std::map<std::string, int> num_reports;
+  auto report = [&](const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(key.compare(0, 4, "job/"), 0);
+    EXPECT_EQ(value, key);
+    ++num_reports[key];
+  };
+
+  for (int i = 0; i < kNumKeys / 2; ++i) {
+    std::string key = "job/" + std::to_string(i);
+    EXPECT_TRUE(kv_map.Insert(key, key));
+    EXPECT_TRUE(kv_map.Insert("other/" + std::to_string(i), "other"));
+  }
+  // The keys of a namespace dropped before they are read are left out.
+  ASSERT_TRUE(kv_map.OpenNamespace("job", std::chrono::milliseconds(0)));
+  EXPECT_TRUE(kv_map.Insert("job/dropped", "job/dropped"));
+
+  ShardedKeyValueMap::WatchSnapshot snapshot;
+  auto watcher_id = kv_map.AddPrefixWatcher("job/", report, &snapshot);
+  ASSERT_TRUE(kv_map.DropNamespace("job"));
+  // Keys inserted while the snapshot is read are reported by the watcher
+  // only.
+  std::thread setter([&]() {
+    for (int i = kNumKeys / 2; i < kNumKeys; ++i) {
+      std::string key = "job/" + std::to_string(i);
+      EXPECT_TRUE(kv_map.Insert(key, key));
+    }
+  });
+  std::vector<std::pair<std::string, std::string>> page;
+  int num_pages = 0;
+  while (kv_map.ReadWatchSnapshot(&snapshot, /*max_bytes=*/100, &page)) {
+    ++num_pages;
+    for (const auto& [key, value] : page) {
+      report(key, value);
+    }
+    page.clear();
+  }
+  setter.join();
+  kv_map.RemovePrefixWatcher(watcher_id);
+  EXPECT_GT(num_pages, 10);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  EXPECT_EQ(num_reports.size(), kNumKeys);
+  for (const auto& num_report : num_reports) {
+    EXPECT_EQ(num_report.second, 1) << num_report.first;
+  }
+}
+
+TEST(ShardedKeyValueMapTest, ConcurrentAdds) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  constexpr int kNumThreads = 8;
+  constexpr int kNumAdds = 1000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < kNumAdds; ++i) {
+        kv_map.Add("counter", 2);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(kv_map.Add("counter", -1), 2 * kNumThreads * kNumAdds - 1);
+  // Counters are not values.
+  std::string value;
+  EXPECT_FALSE(kv_map.Find("counter", &value));
+  EXPECT_EQ(kv_map.size(), 0);
+}
+
+TEST(ShardedKeyValueMapTest, WaitForChunkedWakesUpOnInsert) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/1);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::thread inserter([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // A value of another key on the same shard doesn't wake the waiter up.
+    kv_map.InsertChunked("other", std::make_shared<std::vector<std::string>>(
+                                      std::vector<std::string>{"x"}));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_TRUE(kv_map.InsertChunked(
+        "blob", std::make_shared<std::vector<std::string>>(
+                    std::vector<std::string>{"chunk1", "chunk2"})));
+  });
+  ShardedKeyValueMap::ChunkedValue value =
+      kv_map.WaitForChunked("blob", deadline);
+  inserter.join();
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(*value, (std::vector<std::string>{"chunk1", "chunk2"}));
+
+  EXPECT_FALSE(kv_map.InsertChunked(
+      "blob", std::make_shared<std::vector<std::string>>()));
+  EXPECT_EQ(kv_map.WaitForChunked("missing", std::chrono::steady_clock::now()),
+            nullptr);
+  // Chunked values are not values.
+  std::string unused_value;
+  EXPECT_FALSE(kv_map.Find("blob", &unused_value));
+}
+
+TEST(ShardedKeyValueMapTest, ListKeysPagesInOrder) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/8);
+  ASSERT_TRUE(kv_map.OpenNamespace("job2", std::chrono::milliseconds(0)));
+  std::vector<std::string> job1, all;
+  for (int i = 0; i < 300; ++i) {
+    job1.push_back("job1/worker/" + std::to_string(i));
+    ASSERT_TRUE(kv_map.Insert(job1.back(), "value"));
+    // Keys of a namespace are listed along with the others.
+    all.push_back("job2/worker/" + std::to_string(i));
+    ASSERT_TRUE(kv_map.Insert(all.back(), "value"));
+  }
+  all.insert(all.end(), job1.begin(), job1.end());
+  all.push_back("job10");
+  ASSERT_TRUE(kv_map.Insert(all.back(), "value"));
+  kv_map.Add("job1/counter", 1);
+  kv_map.InsertChunked("job1/blob",
+                       std::make_shared<std::vector<std::string>>());
+  std::sort(job1.begin(), job1.end());
+  std::sort(all.begin(), all.end());
+
+  // Pages go on from the last key of the previous one.
+  std::vector<std::string> listed;
+  while (true) {
+    std::vector<std::string> page = kv_map.ListKeys(
+        "job1/", listed.empty() ? "" : listed.back(), /*limit=*/64);
+    ASSERT_LE(page.size(), 64);
+    if (page.empty()) {
+      break;
+    }
+    listed.insert(listed.end(), page.begin(), page.end());
+  }
+  EXPECT_EQ(listed, job1);
+  EXPECT_EQ(kv_map.ListKeys("", "", all.size() + 1), all);
+  EXPECT_EQ(kv_map.ListKeys("job", "job1/worker/99", 3),
+            std::vector<std::string>(
+                {"job10", "job2/worker/0", "job2/worker/1"}));
+  // A start before the prefix lists from the prefix on.
+  EXPECT_EQ(kv_map.ListKeys("job2/", "a", 2),
+            std::vector<std::string>({"job2/worker/0", "job2/worker/1"}));
+  EXPECT_TRUE(kv_map.ListKeys("job1/", "job1/x", 10).empty());
+  EXPECT_TRUE(kv_map.ListKeys("job1/", "", 0).empty());
+
+  ASSERT_TRUE(kv_map.DropNamespace("job2"));
+  EXPECT_TRUE(kv_map.ListKeys("job2/", "", 10).empty());
+}
+
+TEST(ShardedKeyValueMapTest, DropNamespace) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  EXPECT_TRUE(kv_map.Insert("job1/early", "value"));
+  EXPECT_TRUE(kv_map.OpenNamespace("job1", std::chrono::seconds(10)));
+  EXPECT_FALSE(kv_map.OpenNamespace("job1", std::chrono::seconds(10)));
+  EXPECT_EQ(kv_map.namespaces(),
+            (std::map<std::string, std::chrono::milliseconds>{
+                {"job1", std::chrono::seconds(10)}}));
+  EXPECT_TRUE(kv_map.Insert("key", "value"));
+  EXPECT_TRUE(kv_map.Insert("job1/key1", "value1"));
+  EXPECT_TRUE(kv_map.Insert("job1/key2", "value2"));
+  EXPECT_FALSE(kv_map.Insert("job1/key1", "value3"));
+  EXPECT_TRUE(kv_map.Insert("job2/key1", "value1"));
+  EXPECT_EQ(kv_map.Add("job1/counter", 3), 3);
+  EXPECT_TRUE(kv_map.InsertChunked(
+      "job1/blob", std::make_shared<std::vector<std::string>>(
+                       std::vector<std::string>{"chunk"})));
+  EXPECT_EQ(kv_map.size(), 5);
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("job1/key1", &value));
+  EXPECT_EQ(value, "value1");
+
+  EXPECT_TRUE(kv_map.DropNamespace("job1"));
+  EXPECT_FALSE(kv_map.DropNamespace("job1"));
+  EXPECT_TRUE(kv_map.namespaces().empty());
+  // Only the keys inserted into the namespace are gone.
+  EXPECT_EQ(kv_map.size(), 3);
+  EXPECT_FALSE(kv_map.Find("job1/key1", &value));
+  EXPECT_TRUE(kv_map.Find("job1/early", &value));
+  EXPECT_TRUE(kv_map.Find("job2/key1", &value));
+  EXPECT_EQ(kv_map.Add("job1/counter", 1), 1);
+  EXPECT_EQ(
+      kv_map.WaitForChunked("job1/blob", std::chrono::steady_clock::now()),
+      nullptr);
+  // The names can be set again.
+  EXPECT_TRUE(kv_map.Insert("job1/key1", "value4"));
+  EXPECT_TRUE(kv_map.Find("job1/key1", &value));
+  EXPECT_EQ(value, "value4");
+}
+
+TEST(ShardedKeyValueMapTest, NamespaceDoesNotShadowEarlierKeys) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  ASSERT_TRUE(kv_map.Insert("a/x", "value"));
+  EXPECT_EQ(kv_map.Add("a/counter", 2), 2);
+  ASSERT_TRUE(kv_map.OpenNamespace("a", std::chrono::seconds(10)));
+
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("a/x", &value));
+  EXPECT_EQ(value, "value");
+  EXPECT_TRUE(kv_map.WaitFor("a/x", std::chrono::steady_clock::now(), &value));
+  EXPECT_FALSE(kv_map.Insert("a/x", "other"));
+  EXPECT_EQ(kv_map.Add("a/counter", 1), 3);
+  // Other keys under the name go to the namespace.
+  EXPECT_TRUE(kv_map.Insert("a/y", "value"));
+
+  // The earlier keys stay after the namespace is dropped.
+  ASSERT_TRUE(kv_map.DropNamespace("a"));
+  EXPECT_TRUE(kv_map.Find("a/x", &value));
+  EXPECT_EQ(value, "value");
+  EXPECT_FALSE(kv_map.Find("a/y", &value));
+}
+
+TEST(ShardedKeyValueMapTest, WaitersOutliveDroppedNamespace) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  ASSERT_TRUE(kv_map.OpenNamespace("job", std::chrono::milliseconds(0)));
+  std::string value;
+  std::thread waiter([&]() {
+    EXPECT_TRUE(kv_map.WaitFor(
+        "job/key", std::chrono::steady_clock::now() + std::chrono::seconds(10),
+        &value));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(kv_map.DropNamespace("job"));
+  EXPECT_EQ(kv_map.num_waiters(), 1);
+  EXPECT_TRUE(kv_map.Insert("job/key", "value"));
+  waiter.join();
+  EXPECT_EQ(value, "value");
+}
+
+// Runs many jobs through namespaces of their own, as a long-lived server
+// does, and checks that the memory of the map stays flat.
+TEST(ShardedKeyValueMapTest, NamespaceChurnKeepsMemoryFlat) {
+  ShardedKeyValueMap kv_map(/*num_shards=*/8);
+  EXPECT_TRUE(kv_map.Insert("config", "value"));
+  size_t base_memory = kv_map.memory_usage();
+  size_t base_bytes = kv_map.data_bytes();
+
+  constexpr int kNumJobs = 500;
+  constexpr int kKeysPerJob = 200;
+  const std::string value(1000, 'x');
+  size_t job_memory = 0;
+  size_t peak_memory = 0;
+  // Jobs overlap: each one is dropped once the next one has run.
+  for (int job = 0; job < kNumJobs; ++job) {
+    std::string name = "job" + std::to_string(job);
+    ASSERT_TRUE(kv_map.OpenNamespace(name, std::chrono::milliseconds(0)));
+    for (int i = 0; i < kKeysPerJob; ++i) {
+      std::string key = name + "/" + std::to_string(i);
+      ASSERT_TRUE(kv_map.Insert(key, value));
+      kv_map.Add(key, 1);
+    }
+    ASSERT_TRUE(kv_map.InsertChunked(
+        name + "/blob", std::make_shared<std::vector<std::string>>(
+                            std::vector<std::string>{value})));
+    if (job == 0) {
+      job_memory = kv_map.memory_usage() - base_memory;
+    }
+    peak_memory = std::max(peak_memory, kv_map.memory_usage());
+    if (job > 0) {
+      ASSERT_TRUE(kv_map.DropNamespace("job" + std::to_string(job - 1)));
+    }
+  }
+  ASSERT_TRUE(kv_map.DropNamespace("job" + std::to_string(kNumJobs - 1)));
+
+  EXPECT_EQ(kv_map.memory_usage(), base_memory);
+  EXPECT_EQ(kv_map.data_bytes(), base_bytes);
+  EXPECT_EQ(kv_map.size(), 1);
+  // No more than two jobs are ever held at once, give or take how their keys
+  // spread over the shards.
+  EXPECT_LT(peak_memory, base_memory + 3 * job_memory);
+}
+
+}  // namespace
+}  // namespace kvs
@@ -0,0 +1,486 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "wal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+constexpr char kSnapshotName[] = "snapshot";
+constexpr char kSnapshotTempName[] = "snapshot.tmp";
+constexpr char kSnapshotMagic[8] = {'K', 'V', 'S', 'S', 'N', 'A', 'P', '1'};
+
+// Every record is a header followed by the key and the value.
+struct RecordHeader {
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t checksum;
+};
+
+// Set in `key_size` for a record that opens or drops the namespace named by
+// its key rather than inserting a value. Its value is the TTL of the
+// namespace in milliseconds when it is opened, and empty when it is dropped.
+constexpr uint32_t kNamespaceRecord = 1u << 31;
+
+// Set in `key_size` for a chunk of a value that is set in chunks, named by
+// its key. The chunks of a value are written back to back and followed by a
+// record with both flags and no value, which sets it, so that a value whose
+// chunks are not all on disk is not restored.
+constexpr uint32_t kChunkRecord = 1u << 30;
+
+// A snapshot starts with a header, followed by records up to the end of the
+// file. It covers every segment up to and including `last_segment`.
+struct SnapshotHeader {
+  char magic[8];
+  uint64_t last_segment;
+};
+
+// FNV-1a, which is enough to tell a torn record at the end of a segment from
+// a complete one.
+uint32_t Checksum(std::string_view key, std::string_view value) {
+  uint32_t hash = 2166136261u;
+  for (std::string_view data : {key, value}) {
+    for (unsigned char c : data) {
+      hash = (hash ^ c) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+void AppendRecord(std::string_view key, std::string_view value,
+                  std::string* buffer, uint32_t flags = 0) {
+  RecordHeader header = {static_cast<uint32_t>(key.size()) | flags,
+                         static_cast<uint32_t>(value.size()),
+                         Checksum(key, value)};
+  buffer->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  buffer->append(key);
+  buffer->append(value);
+}
+
+// Inserts the records in `data` into `kv_map` and stops at the first record
+// that is incomplete or damaged, which can only be the tail of a segment that
+// was being written when the process died.
+void ReplayRecords(const char* data, size_t size, ShardedKeyValueMap* kv_map) {
+  size_t offset = 0;
+  auto chunks = std::make_shared<std::vector<std::string>>();
+  while (size - offset >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    memcpy(&header, data + offset, sizeof(header));
+    uint32_t flags = header.key_size & (kNamespaceRecord | kChunkRecord);
+    uint32_t key_size = header.key_size & ~flags;
+    size_t record_size =
+        sizeof(header) + static_cast<size_t>(key_size) + header.value_size;
+    if (record_size > size - offset) {
+      return;
+    }
+    std::string_view key(data + offset + sizeof(header), key_size);
+    std::string_view value(key.data() + key.size(), header.value_size);
+    if (Checksum(key, value) != header.checksum) {
+      return;
+    }
+    if (flags == 0) {
+      // A key may be in both a snapshot and a later segment.
+      kv_map->Insert(std::string(key), std::string(value));
+    } else if (flags == kChunkRecord) {
+      chunks->emplace_back(value);
+    } else if (flags != kNamespaceRecord) {
+      kv_map->InsertChunked(std::string(key), std::move(chunks));
+      chunks = std::make_shared<std::vector<std::string>>();
+    } else if (value.empty()) {
+      kv_map->DropNamespace(std::string(key));
+    } else {
+      kv_map->OpenNamespace(
+          std::string(key),
+          std::chrono::milliseconds(std::stoll(std::string(value))));
+    }
+    offset += record_size;
+  }
+}
+
+// Maps a whole file into memory so that it is parsed without being copied.
+class MappedFile {
+ public:
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+  }
+
+  bool Map(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    size_ = ok ? st.st_size : 0;
+    if (ok && size_ > 0) {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ok = false;
+      } else {
+        data_ = data;
+        madvise(data_, size_, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+    return ok;
+  }
+
+  const char* data() const { return static_cast<const char*>(data_); }
+  size_t size() const { return size_; }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+std::string SegmentName(uint64_t segment) {
+  char name[32];
+  snprintf(name, sizeof(name), "wal-%016llx.log",
+           static_cast<unsigned long long>(segment));
+  return name;
+}
+
+bool ParseSegmentName(const char* name, uint64_t* segment) {
+  unsigned long long value;
+  char suffix[8];
+  if (strlen(name) != SegmentName(0).size() ||
+      sscanf(name, "wal-%16llx.%3s", &value, suffix) != 2 ||
+      strcmp(suffix, "log") != 0) {
+    return false;
+  }
+  *segment = value;
+  return true;
+}
+
+std::string ErrnoMessage(const std::string& what) {
+  return what + ": " + strerror(errno);
+}
+
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(std::string dir, ShardedKeyValueMap* kv_map,
+                             std::chrono::milliseconds snapshot_interval)
+    : dir_(std::move(dir)),
+      kv_map_(kv_map),
+      snapshot_interval_(snapshot_interval) {}
+
+WriteAheadLog::~WriteAheadLog() {
+  uint64_t appended;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    appended = appended_;
+  }
+  cv_.notify_all();
+  if (snapshot_thread_.joinable()) {
+    snapshot_thread_.join();
+  }
+  // Records are only acknowledged once synced, so whatever is still buffered
+  // belongs to calls that never returned; write it out anyway.
+  Sync(appended);
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool WriteAheadLog::Open(std::string* error) {
+  if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    *error = ErrnoMessage("can't create " + dir_);
+    return false;
+  }
+
+  uint64_t last_snapshot_segment = 0;
+  MappedFile snapshot;
+  if (snapshot.Map(dir_ + "/" + kSnapshotName)) {
+    SnapshotHeader header;
+    if (snapshot.size() >= sizeof(header)) {
+      memcpy(&header, snapshot.data(), sizeof(header));
+    }
+    if (snapshot.size() < sizeof(header) ||
+        memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+      *error = dir_ + "/" + kSnapshotName + " is not a snapshot";
+      return false;
+    }
+    last_snapshot_segment = header.last_segment;
+    ReplayRecords(snapshot.data() + sizeof(header),
+                  snapshot.size() - sizeof(header), kv_map_);
+  } else if (errno != ENOENT) {
+    *error = ErrnoMessage("can't read the snapshot in " + dir_);
+    return false;
+  }
+
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    *error = ErrnoMessage("can't list " + dir_);
+    return false;
+  }
+  std::vector<uint64_t> segments;
+  while (struct dirent* entry = readdir(dir)) {
+    uint64_t segment;
+    if (ParseSegmentName(entry->d_name, &segment)) {
+      segments.push_back(segment);
+    }
+  }
+  closedir(dir);
+  std::sort(segments.begin(), segments.end());
+
+  uint64_t last_segment = last_snapshot_segment;
+  for (uint64_t segment : segments) {
+    last_segment = std::max(last_segment, segment);
+    if (segment <= last_snapshot_segment) {
+      continue;
+    }
+    MappedFile file;
+    if (!file.Map(dir_ + "/" + SegmentName(segment))) {
+      *error = ErrnoMessage("can't read " + SegmentName(segment));
+      return false;
+    }
+    ReplayRecords(file.data(), file.size(), kv_map_);
+  }
+
+  // Never append to a segment that may end with a torn record.
+  if (!OpenSegment(last_segment + 1)) {
+    *error = ErrnoMessage("can't create a segment in " + dir_);
+    return false;
+  }
+  if (snapshot_interval_.count() > 0) {
+    snapshot_thread_ = std::thread(&WriteAheadLog::RunSnapshots, this);
+  }
+  return true;
+}
+
+uint64_t WriteAheadLog::Append(const std::string& key,
+                               const std::string& value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AppendRecord(key, value, &buffer_);
+  unapplied_.insert(++appended_);
+  return appended_;
+}
+
+uint64_t WriteAheadLog::AppendChunked(const std::string& key,
+                                      const std::vector<std::string>& chunks) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const std::string& chunk : chunks) {
+    AppendRecord(key, chunk, &buffer_, kChunkRecord);
+  }
+  AppendRecord(key, "", &buffer_, kNamespaceRecord | kChunkRecord);
+  unapplied_.insert(++appended_);
+  return appended_;
+}
+
+void WriteAheadLog::Applied(uint64_t sequence) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  unapplied_.erase(sequence);
+  applied_cv_.notify_all();
+}
+
+uint64_t WriteAheadLog::AppendOpenNamespace(const std::string& name,
+                                            std::chrono::milliseconds ttl) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AppendRecord(name, std::to_string(ttl.count()), &buffer_, kNamespaceRecord);
+  unapplied_.insert(++appended_);
+  return appended_;
+}
+
+uint64_t WriteAheadLog::AppendDropNamespace(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AppendRecord(name, "", &buffer_, kNamespaceRecord);
+  return ++appended_;
+}
+
+bool WriteAheadLog::Sync(uint64_t sequence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (durable_ < sequence && !failed_) {
+    if (writing_) {
+      // Another caller is writing, and will pick up this record next time
+      // around if it isn't part of the current group.
+      cv_.wait(lock);
+      continue;
+    }
+    writing_ = true;
+    std::string group;
+    group.swap(buffer_);
+    uint64_t group_end = appended_;
+    int fd = fd_;
+    lock.unlock();
+    bool ok = WriteAll(fd, group.data(), group.size()) && fdatasync(fd) == 0;
+    lock.lock();
+    writing_ = false;
+    if (ok) {
+      durable_ = group_end;
+    } else {
+      failed_ = true;
+    }
+    cv_.notify_all();
+  }
+  return durable_ >= sequence;
+}
+
+bool WriteAheadLog::Rotate(uint64_t* last_segment, uint64_t* last_sequence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return !writing_; });
+  if (failed_) {
+    return false;
+  }
+  // Holding the lock keeps new records in the buffer until the next segment
+  // is ready; this is rare enough not to matter.
+  bool ok = WriteAll(fd_, buffer_.data(), buffer_.size()) && fsync(fd_) == 0;
+  close(fd_);
+  fd_ = -1;
+  buffer_.clear();
+  *last_segment = segment_;
+  *last_sequence = appended_;
+  if (!ok || !OpenSegment(segment_ + 1)) {
+    failed_ = true;
+    cv_.notify_all();
+    return false;
+  }
+  durable_ = appended_;
+  cv_.notify_all();
+  return true;
+}
+
+bool WriteAheadLog::OpenSegment(uint64_t segment) {
+  std::string path = dir_ + "/" + SegmentName(segment);
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+  segment_ = segment;
+  return SyncDirectory();
+}
+
+bool WriteAheadLog::SyncDirectory() {
+  int fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+bool WriteAheadLog::Snapshot() {
+  std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex_);
+  // Once every record up to `last_sequence` is applied, every key in the
+  // segments up to `last_segment` is in the map, so the snapshot covers them
+  // even though it also catches some later keys.
+  uint64_t last_segment;
+  uint64_t last_sequence;
+  if (!Rotate(&last_segment, &last_sequence)) {
+    return false;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    applied_cv_.wait(lock, [&]() {
+      return unapplied_.empty() || *unapplied_.begin() > last_sequence;
+    });
+  }
+
+  std::string temp_path = dir_ + "/" + kSnapshotTempName;
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::vector<char> file_buffer(1 << 20);
+  setvbuf(file, file_buffer.data(), _IOFBF, file_buffer.size());
+
+  SnapshotHeader header;
+  memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.last_segment = last_segment;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  std::string record;
+  auto write_record = [&](std::string_view key, std::string_view value,
+                          uint32_t flags) {
+    record.clear();
+    AppendRecord(key, value, &record, flags);
+    ok = ok && fwrite(record.data(), 1, record.size(), file) == record.size();
+  };
+  // The namespaces come first so that their keys are put back into them. A
+  // namespace opened from here on is in a later segment, and keys that the
+  // snapshot catches in it are restored outside of it.
+  for (const auto& [name, ttl] : kv_map_->namespaces()) {
+    write_record(name, std::to_string(ttl.count()), kNamespaceRecord);
+  }
+  kv_map_->ForEach([&](const std::string& key, const std::string& value) {
+    write_record(key, value, /*flags=*/0);
+  });
+  // Each chunk is a record of its own, so that a value is not copied whole.
+  kv_map_->ForEachChunked([&](const std::string& key,
+                              const ShardedKeyValueMap::ChunkedValue& value) {
+    for (const std::string& chunk : *value) {
+      write_record(key, chunk, kChunkRecord);
+    }
+    write_record(key, "", kNamespaceRecord | kChunkRecord);
+  });
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  std::string path = dir_ + "/" + kSnapshotName;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0 ||
+      !SyncDirectory()) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // The snapshot replaces these segments even if some of them are left
+  // behind, since its header says which ones it covers.
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    return true;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    uint64_t segment;
+    if (ParseSegmentName(entry->d_name, &segment) &&
+        segment <= last_segment) {
+      unlink((dir_ + "/" + entry->d_name).c_str());
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+void WriteAheadLog::RunSnapshots() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    cv_.wait_for(lock, snapshot_interval_, [this]() { return stopped_; });
+    if (stopped_) {
+      break;
+    }
+    lock.unlock();
+    Snapshot();
+    lock.lock();
+  }
+}
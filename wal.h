@@ -0,0 +1,119 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "store.h"
+
+// A write-ahead log that makes the values of a ShardedKeyValueMap survive a
+// restart. The log is a directory of segments, each a sequence of records,
+// plus a snapshot of the map that replaces the segments written before it.
+//
+// Values are logged before they are inserted, so that nobody sees a value
+// that a restart could lose. Since values are write-once, replaying a record
+// twice is harmless, which lets snapshots be taken while the map is being
+// written to. Namespaces are logged as they are opened and
+// dropped, so that the keys of a dropped namespace don't come back. Values set
+// in chunks are logged chunk by chunk. Counters are not logged.
+//
+// Records and snapshots are written in host byte order, so a log directory is
+// only read back on a machine of the same endianness.
+class WriteAheadLog {
+ public:
+  // Logs the values of `kv_map` to `dir`, which is created if it doesn't exist.
+  // A snapshot is taken every `snapshot_interval` if it is positive.
+  WriteAheadLog(std::string dir, ShardedKeyValueMap* kv_map,
+                std::chrono::milliseconds snapshot_interval);
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog(WriteAheadLog&&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+  WriteAheadLog&& operator=(WriteAheadLog&&) = delete;
+
+  ~WriteAheadLog();
+
+  // Restores the map from the latest snapshot and the segments written after
+  // it, then starts a new segment. Returns false and describes the problem in
+  // `error` if the directory can't be read or written.
+  bool Open(std::string* error);
+
+  // Buffers a record for a key/value pair that is about to be inserted into
+  // the map and returns its sequence number for Sync(). Applied() must be
+  // called with it once the pair is inserted, or once it won't be.
+  uint64_t Append(const std::string& key, const std::string& value);
+
+  // Like Append(), for a value that is about to be set in chunks. The chunks
+  // are written as they are kept in the map, without being joined.
+  uint64_t AppendChunked(const std::string& key,
+                         const std::vector<std::string>& chunks);
+
+  // Marks the record as inserted into the map, which a snapshot waits for
+  // before it replaces the segment that holds the record.
+  void Applied(uint64_t sequence);
+
+  // Like Append(), for a namespace that is about to be opened. Applied() must
+  // be called with it once the namespace is open, or once it won't be.
+  uint64_t AppendOpenNamespace(const std::string& name,
+                               std::chrono::milliseconds ttl);
+  // Buffers a record for a namespace that was just dropped, which a snapshot
+  // has no need to wait for.
+  uint64_t AppendDropNamespace(const std::string& name);
+
+  // Blocks until the records up to `sequence` are on disk. Concurrent callers
+  // are committed as a group: whichever of them finds no write in progress
+  // writes and syncs everything buffered so far on behalf of the others.
+  // Returns false if the log can't be written anymore.
+  bool Sync(uint64_t sequence);
+
+  // Writes a snapshot of the map and deletes the segments it makes obsolete.
+  bool Snapshot();
+
+ private:
+  // Writes out the buffered records and switches to a new segment. Returns
+  // the number of the last segment that is complete and the sequence number
+  // of its last record.
+  bool Rotate(uint64_t* last_segment, uint64_t* last_sequence);
+  bool OpenSegment(uint64_t segment);
+  bool SyncDirectory();
+  void RunSnapshots();
+
+  std::string dir_;
+  ShardedKeyValueMap* kv_map_;
+  std::chrono::milliseconds snapshot_interval_;
+
+  // Serializes Snapshot() calls.
+  std::mutex snapshot_mutex_;
+
+  // Guards everything below.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int fd_ = -1;
+  uint64_t segment_ = 0;
+  // Records appended but not yet handed to a writer.
+  std::string buffer_;
+  uint64_t appended_ = 0;
+  uint64_t durable_ = 0;
+  // Records appended but not yet applied to the map, and the snapshot that
+  // waits for them.
+  std::set<uint64_t> unapplied_;
+  std::condition_variable applied_cv_;
+  bool writing_ = false;
+  bool failed_ = false;
+  bool stopped_ = false;
+
+  std::thread snapshot_thread_;
+};
+
+#endif  // KVS_WAL_H
@@ -0,0 +1,299 @@
+// Copyright 2023 The IREE Authors
+//
+// Licensed under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#include "wal.h"
+
+#include <dirent.h>
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvs {
+namespace {
+
+class WriteAheadLogTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char dir[] = "/tmp/wal_test.XXXXXX";
+    ASSERT_NE(mkdtemp(dir), nullptr);
+    dir_ = dir;
+  }
+
+  void TearDown() override {
+    for (const std::string& name : ListDir()) {
+      unlink((dir_ + "/" + name).c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  std::vector<std::string> ListDir() const {
+    std::vector<std::string> names;
+    DIR* dir = opendir(dir_.c_str());
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        names.push_back(entry->d_name);
+      }
+    }
+    closedir(dir);
+    return names;
+  }
+
+  // Sets a key the way the server does.
+  static void Set(ShardedKeyValueMap* kv_map, WriteAheadLog* wal,
+                  const std::string& key, const std::string& value) {
+    uint64_t sequence = wal->Append(key, value);
+    ASSERT_TRUE(wal->Sync(sequence));
+    ASSERT_TRUE(kv_map->Insert(key, value));
+    wal->Applied(sequence);
+  }
+
+  std::string dir_;
+};
+
+TEST_F(WriteAheadLogTest, RestoresFromSegments) {
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    Set(&kv_map, &wal, "key1", "value1");
+    Set(&kv_map, &wal, "key2", std::string(1000, 'x'));
+    Set(&kv_map, &wal, "empty", "");
+  }
+
+  // Each restart replays the old segments and starts a new one.
+  for (int restart = 0; restart < 2; ++restart) {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    EXPECT_EQ(kv_map.size(), 3 + restart);
+    std::string value;
+    EXPECT_TRUE(kv_map.Find("key1", &value));
+    EXPECT_EQ(value, "value1");
+    EXPECT_TRUE(kv_map.Find("key2", &value));
+    EXPECT_EQ(value, std::string(1000, 'x'));
+    EXPECT_TRUE(kv_map.Find("empty", &value));
+    Set(&kv_map, &wal, "restart" + std::to_string(restart), "value");
+  }
+}
+
+TEST_F(WriteAheadLogTest, IgnoresTornRecord) {
+  std::string segment;
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/1);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    Set(&kv_map, &wal, "key1", "value1");
+    Set(&kv_map, &wal, "key2", "value2");
+    ASSERT_EQ(ListDir().size(), 1);
+    segment = dir_ + "/" + ListDir()[0];
+  }
+  // Cut the last record in half, as if the process died while writing it.
+  ASSERT_EQ(truncate(segment.c_str(), 12 + 4 + 6 + 12 + 2), 0);
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/1);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("key1", &value));
+  EXPECT_FALSE(kv_map.Find("key2", &value));
+  EXPECT_EQ(kv_map.size(), 1);
+}
+
+TEST_F(WriteAheadLogTest, SnapshotReplacesSegments) {
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    for (int i = 0; i < 100; ++i) {
+      Set(&kv_map, &wal, "key" + std::to_string(i), std::to_string(i));
+    }
+    ASSERT_TRUE(wal.Snapshot());
+    // The snapshot and the segment after it are left.
+    EXPECT_EQ(ListDir().size(), 2);
+    for (int i = 100; i < 150; ++i) {
+      Set(&kv_map, &wal, "key" + std::to_string(i), std::to_string(i));
+    }
+  }
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  EXPECT_EQ(kv_map.size(), 150);
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("key149", &value));
+  EXPECT_EQ(value, "149");
+}
+
+TEST_F(WriteAheadLogTest, RestoresChunkedValues) {
+  auto SetChunked = [](ShardedKeyValueMap* kv_map, WriteAheadLog* wal,
+                       const std::string& key,
+                       std::vector<std::string> chunks) {
+    uint64_t sequence = wal->AppendChunked(key, chunks);
+    ASSERT_TRUE(wal->Sync(sequence));
+    ASSERT_TRUE(kv_map->InsertChunked(
+        key, std::make_shared<std::vector<std::string>>(std::move(chunks))));
+    wal->Applied(sequence);
+  };
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    SetChunked(&kv_map, &wal, "blob1", {"a", std::string(1000, 'b'), "c"});
+    SetChunked(&kv_map, &wal, "empty", {});
+    ASSERT_TRUE(wal.Snapshot());
+    SetChunked(&kv_map, &wal, "blob2", {"d", "e"});
+    // A plain value with the same key is apart from the chunked one.
+    Set(&kv_map, &wal, "blob2", "value");
+  }
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  ShardedKeyValueMap::ChunkedValue value = kv_map.FindChunked("blob1");
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(*value,
+            std::vector<std::string>({"a", std::string(1000, 'b'), "c"}));
+  value = kv_map.FindChunked("empty");
+  ASSERT_NE(value, nullptr);
+  EXPECT_TRUE(value->empty());
+  value = kv_map.FindChunked("blob2");
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(*value, std::vector<std::string>({"d", "e"}));
+  std::string plain;
+  EXPECT_TRUE(kv_map.Find("blob2", &plain));
+  EXPECT_EQ(plain, "value");
+}
+
+TEST_F(WriteAheadLogTest, RestoresNamespaces) {
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    for (const char* name : {"job1", "job2", "job3"}) {
+      uint64_t sequence =
+          wal.AppendOpenNamespace(name, std::chrono::seconds(5));
+      ASSERT_TRUE(wal.Sync(sequence));
+      ASSERT_TRUE(kv_map.OpenNamespace(name, std::chrono::seconds(5)));
+      wal.Applied(sequence);
+      Set(&kv_map, &wal, std::string(name) + "/key", "value");
+    }
+    ASSERT_TRUE(kv_map.DropNamespace("job1"));
+    ASSERT_TRUE(wal.Sync(wal.AppendDropNamespace("job1")));
+    // The snapshot only has the namespaces that are still open.
+    ASSERT_TRUE(wal.Snapshot());
+    ASSERT_TRUE(kv_map.DropNamespace("job2"));
+    ASSERT_TRUE(wal.Sync(wal.AppendDropNamespace("job2")));
+    Set(&kv_map, &wal, "job1/key", "outside");
+  }
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  EXPECT_EQ(kv_map.namespaces(),
+            (std::map<std::string, std::chrono::milliseconds>{
+                {"job3", std::chrono::seconds(5)}}));
+  EXPECT_EQ(kv_map.size(), 2);
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("job1/key", &value));
+  EXPECT_EQ(value, "outside");
+  EXPECT_FALSE(kv_map.Find("job2/key", &value));
+  EXPECT_TRUE(kv_map.Find("job3/key", &value));
+  // The restored keys are still in their namespace.
+  EXPECT_TRUE(kv_map.DropNamespace("job3"));
+  EXPECT_FALSE(kv_map.Find("job3/key", &value));
+}
+
+TEST_F(WriteAheadLogTest, RejectsDamagedSnapshot) {
+  std::ofstream(dir_ + "/snapshot") << "garbage";
+  ShardedKeyValueMap kv_map(/*num_shards=*/1);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  EXPECT_FALSE(wal.Open(&error));
+  EXPECT_NE(error, "");
+}
+
+TEST_F(WriteAheadLogTest, SnapshotWaitsForLoggedValues) {
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/4);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    uint64_t sequence = wal.Append("key", "value");
+    ASSERT_TRUE(wal.Sync(sequence));
+
+    // The snapshot would drop the segment that holds the record while the
+    // value is not in the map yet.
+    std::atomic<bool> done(false);
+    std::thread snapshot([&]() {
+      EXPECT_TRUE(wal.Snapshot());
+      done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(done);
+    ASSERT_TRUE(kv_map.Insert("key", "value"));
+    wal.Applied(sequence);
+    snapshot.join();
+  }
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/4);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  std::string value;
+  EXPECT_TRUE(kv_map.Find("key", &value));
+  EXPECT_EQ(value, "value");
+}
+
+TEST_F(WriteAheadLogTest, ConcurrentWritersWithPeriodicSnapshots) {
+  constexpr int kNumThreads = 8;
+  constexpr int kNumKeys = 200;
+  {
+    ShardedKeyValueMap kv_map(/*num_shards=*/16);
+    WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(5));
+    std::string error;
+    ASSERT_TRUE(wal.Open(&error)) << error;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; ++t) {
+      threads.emplace_back([&, t]() {
+        for (int i = 0; i < kNumKeys; ++i) {
+          Set(&kv_map, &wal, std::to_string(t) + "/" + std::to_string(i),
+              std::to_string(i));
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  ShardedKeyValueMap kv_map(/*num_shards=*/16);
+  WriteAheadLog wal(dir_, &kv_map, std::chrono::milliseconds(0));
+  std::string error;
+  ASSERT_TRUE(wal.Open(&error)) << error;
+  EXPECT_EQ(kv_map.size(), kNumThreads * kNumKeys);
+}
+
+}  // namespace
+}  // namespace kvs